@@ -0,0 +1,319 @@
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/* Blocks start past the span header, 16 byte aligned. */
+#define NDL_ARENA_START ((sizeof(ndl_arena_span) + 15) & ~(uint64_t) 15)
+
+ndl_arena *ndl_arena_init(void) {
+
+    void *region = malloc(ndl_arena_msize());
+    if (region == NULL)
+        return NULL;
+
+    return ndl_arena_minit(region);
+}
+
+void ndl_arena_kill(ndl_arena *arena) {
+
+    if (arena == NULL)
+        return;
+
+    ndl_arena_mkill(arena);
+
+    free(arena);
+}
+
+ndl_arena *ndl_arena_minit(void *region) {
+
+    ndl_arena *arena = (ndl_arena *) region;
+    if (arena == NULL)
+        return NULL;
+
+    memset(arena, 0, sizeof(ndl_arena));
+
+    return arena;
+}
+
+void ndl_arena_mkill(ndl_arena *arena) {
+
+    ndl_arena_span *span = arena->spans;
+    while (span != NULL) {
+        ndl_arena_span *next = span->next;
+        munmap(span, span->size);
+        span = next;
+    }
+
+    int huge = arena->huge;
+    ndl_arena_minit(arena);
+    arena->huge = huge;
+}
+
+uint64_t ndl_arena_msize(void) {
+
+    return sizeof(ndl_arena);
+}
+
+/* Size class of a block of at most NDL_ARENA_MAX bytes. */
+static inline uint64_t ndl_arena_class(uint64_t size) {
+
+    if (size <= NDL_ARENA_MIN)
+        return 0;
+
+    return (uint64_t) (64 - __builtin_clzll(size - 1)) - NDL_ARENA_MIN_BITS;
+}
+
+/* Map a span of the given size. Huge spans are aligned to their size,
+ * so transparent huge pages can back them. NULL on error.
+ */
+static ndl_arena_span *ndl_arena_map(uint64_t size, int huge) {
+
+    void *mem = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+    if (huge)
+        mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+
+    if (mem != MAP_FAILED)
+        return (ndl_arena_span *) mem;
+
+    if (!huge) {
+        mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        return (mem != MAP_FAILED)? (ndl_arena_span *) mem : NULL;
+    }
+
+    /* Map twice over, and keep the aligned middle. */
+    uint8_t *raw = mmap(NULL, 2 * size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED)
+        return NULL;
+
+    uint64_t skip = (size - ((uintptr_t) raw & (size - 1))) & (size - 1);
+    if (skip > 0)
+        munmap(raw, skip);
+    munmap(raw + skip + size, size - skip);
+
+#ifdef MADV_HUGEPAGE
+    madvise(raw + skip, size, MADV_HUGEPAGE);
+#endif
+
+    return (ndl_arena_span *) (raw + skip);
+}
+
+/* Start a new span for a class. NULL on error. */
+static ndl_arena_span *ndl_arena_open(ndl_arena *arena, uint64_t cls) {
+
+    uint64_t size = arena->huge? NDL_ARENA_HUGE_SPAN : NDL_ARENA_SPAN;
+
+    ndl_arena_span *span = ndl_arena_map(size, arena->huge);
+    if (span == NULL)
+        return NULL;
+
+    span->next = arena->spans;
+    span->size = size;
+    span->used = NDL_ARENA_START;
+    span->freed = 0;
+
+    arena->spans = span;
+    arena->span_count++;
+    arena->mapped += size;
+
+    arena->open[cls] = span;
+
+    return span;
+}
+
+void *ndl_arena_alloc(ndl_arena *arena, uint64_t size) {
+
+    if (size > NDL_ARENA_MAX)
+        return malloc(size);
+
+    uint64_t cls = ndl_arena_class(size);
+
+    void *block = arena->local[cls];
+    if (block == NULL)
+        block = __atomic_exchange_n(&arena->remote[cls], NULL, __ATOMIC_ACQUIRE);
+
+    if (block != NULL) {
+        arena->local[cls] = *(void **) block;
+        return block;
+    }
+
+    uint64_t bsize = NDL_ARENA_MIN << cls;
+
+    ndl_arena_span *span = arena->open[cls];
+    if ((span == NULL) || (span->used + bsize > span->size)) {
+        span = ndl_arena_open(arena, cls);
+        if (span == NULL)
+            return NULL;
+    }
+
+    block = (uint8_t *) span + span->used;
+    span->used += bsize;
+
+    return block;
+}
+
+void ndl_arena_free(ndl_arena *arena, void *block, uint64_t size) {
+
+    if (block == NULL)
+        return;
+
+    if (size > NDL_ARENA_MAX) {
+        free(block);
+        return;
+    }
+
+    void **list = &arena->remote[ndl_arena_class(size)];
+
+    void *head = __atomic_load_n(list, __ATOMIC_RELAXED);
+    do {
+        *(void **) block = head;
+    } while (!__atomic_compare_exchange_n(list, &head, block, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+void *ndl_arena_realloc(ndl_arena *arena, void *block, uint64_t old, uint64_t size) {
+
+    if (block == NULL)
+        return ndl_arena_alloc(arena, size);
+
+    if ((old > NDL_ARENA_MAX) && (size > NDL_ARENA_MAX))
+        return realloc(block, size);
+
+    if ((old <= NDL_ARENA_MAX) && (size <= NDL_ARENA_MAX) &&
+        (ndl_arena_class(old) == ndl_arena_class(size)))
+        return block;
+
+    void *moved = ndl_arena_alloc(arena, size);
+    if (moved == NULL)
+        return NULL;
+
+    memcpy(moved, block, (old < size)? old : size);
+    ndl_arena_free(arena, block, old);
+
+    return moved;
+}
+
+static int ndl_arena_span_cmp(const void *a, const void *b) {
+
+    uintptr_t x = (uintptr_t) *(ndl_arena_span **) a;
+    uintptr_t y = (uintptr_t) *(ndl_arena_span **) b;
+
+    return (x > y) - (x < y);
+}
+
+/* The span holding a block, from spans sorted by address. */
+static ndl_arena_span *ndl_arena_find(ndl_arena_span **sorted, uint64_t count, void *block) {
+
+    uint64_t lo = 0, hi = count;
+    while (hi - lo > 1) {
+        uint64_t mid = (lo + hi) / 2;
+        if ((uintptr_t) sorted[mid] <= (uintptr_t) block)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    return sorted[lo];
+}
+
+/* Spans being unmapped are marked with freed = UINT64_MAX. */
+#define NDL_ARENA_DEAD UINT64_MAX
+
+uint64_t ndl_arena_trim(ndl_arena *arena) {
+
+    if (arena->span_count == 0)
+        return 0;
+
+    ndl_arena_span **sorted = malloc(arena->span_count * sizeof(ndl_arena_span *));
+    if (sorted == NULL)
+        return 0;
+
+    uint64_t i = 0;
+    ndl_arena_span *span;
+    for (span = arena->spans; span != NULL; span = span->next) {
+        span->freed = 0;
+        sorted[i++] = span;
+    }
+
+    qsort(sorted, arena->span_count, sizeof(ndl_arena_span *), &ndl_arena_span_cmp);
+
+    /* Take in the remote frees, and total each span's free bytes. */
+    uint64_t cls;
+    for (cls = 0; cls < NDL_ARENA_CLASSES; cls++) {
+
+        void *remote = __atomic_exchange_n(&arena->remote[cls], NULL, __ATOMIC_ACQUIRE);
+        if (remote != NULL) {
+            void *tail = remote;
+            while (*(void **) tail != NULL)
+                tail = *(void **) tail;
+            *(void **) tail = arena->local[cls];
+            arena->local[cls] = remote;
+        }
+
+        void *block;
+        for (block = arena->local[cls]; block != NULL; block = *(void **) block)
+            ndl_arena_find(sorted, arena->span_count, block)->freed += NDL_ARENA_MIN << cls;
+    }
+
+    for (i = 0; i < arena->span_count; i++)
+        if (sorted[i]->freed == sorted[i]->used - NDL_ARENA_START)
+            sorted[i]->freed = NDL_ARENA_DEAD;
+
+    /* Drop the dead spans' blocks from the free lists. */
+    for (cls = 0; cls < NDL_ARENA_CLASSES; cls++) {
+
+        void **prev = &arena->local[cls];
+        while (*prev != NULL) {
+            if (ndl_arena_find(sorted, arena->span_count, *prev)->freed == NDL_ARENA_DEAD)
+                *prev = *(void **) *prev;
+            else
+                prev = (void **) *prev;
+        }
+
+        if ((arena->open[cls] != NULL) && (arena->open[cls]->freed == NDL_ARENA_DEAD))
+            arena->open[cls] = NULL;
+    }
+
+    free(sorted);
+
+    uint64_t unmapped = 0;
+
+    ndl_arena_span **prev = &arena->spans;
+    while (*prev != NULL) {
+
+        span = *prev;
+        if (span->freed != NDL_ARENA_DEAD) {
+            prev = &span->next;
+            continue;
+        }
+
+        *prev = span->next;
+
+        arena->span_count--;
+        arena->mapped -= span->size;
+        unmapped += span->size;
+
+        munmap(span, span->size);
+    }
+
+    return unmapped;
+}
+
+void ndl_arena_hugepages(ndl_arena *arena, int enable) {
+
+    arena->huge = enable;
+}
+
+uint64_t ndl_arena_spans(ndl_arena *arena) {
+
+    return arena->span_count;
+}
+
+uint64_t ndl_arena_mapped(ndl_arena *arena) {
+
+    return arena->mapped;
+}
@@ -0,0 +1,103 @@
+#ifndef NODEL_ARENA_H
+#define NODEL_ARENA_H
+
+#include <stdint.h>
+
+/* Size class allocator for many small, short lived blocks.
+ * Blocks are rounded up to a power of two, from NDL_ARENA_MIN to
+ * NDL_ARENA_MAX bytes, and carved from spans mapped straight from the
+ * OS, one class per span. Freed blocks go on their class's free list,
+ * and are handed out again before a span is carved further, so alloc()
+ * and free() are a few pointer ops. Larger blocks go to malloc.
+ *
+ * One thread at a time may alloc() and trim(). free() may be called
+ * from any thread: it pushes onto an atomic per-class list, which alloc()
+ * takes over whole once its own list runs dry.
+ *
+ * trim() unmaps spans with no blocks in use, after, say, a collection.
+ * kill() unmaps every span at once, blocks in use or not; only blocks
+ * past NDL_ARENA_MAX need freeing one by one.
+ *
+ * Spans are NDL_ARENA_SPAN bytes, or NDL_ARENA_HUGE_SPAN with huge pages
+ * on: mapped as huge pages where the system has them reserved, and
+ * advised to be backed by transparent huge pages otherwise.
+ */
+#define NDL_ARENA_MIN_BITS 4
+#define NDL_ARENA_CLASSES  9
+
+#define NDL_ARENA_MIN ((uint64_t) 1 << NDL_ARENA_MIN_BITS)
+#define NDL_ARENA_MAX ((uint64_t) 1 << (NDL_ARENA_MIN_BITS + NDL_ARENA_CLASSES - 1))
+
+#define NDL_ARENA_SPAN      ((uint64_t) 1 << 16)
+#define NDL_ARENA_HUGE_SPAN ((uint64_t) 1 << 21)
+
+/* Spans start with their header. used is the bytes carved so far,
+ * header included. freed is scratch space for trim().
+ */
+typedef struct ndl_arena_span_s {
+
+    struct ndl_arena_span_s *next;
+    uint64_t size, used, freed;
+
+} ndl_arena_span;
+
+/* open holds the span each class is carving, local each class's free
+ * list, and remote the blocks freed through the atomic path.
+ */
+typedef struct ndl_arena_s {
+
+    int huge;
+
+    uint64_t span_count, mapped;
+    ndl_arena_span *spans;
+
+    ndl_arena_span *open[NDL_ARENA_CLASSES];
+    void *local[NDL_ARENA_CLASSES];
+    void *remote[NDL_ARENA_CLASSES];
+
+} ndl_arena;
+
+/* Create and destroy arenas.
+ *
+ * init() allocates and initializes an empty arena.
+ * kill() frees an arena, and every block in its spans.
+ *
+ * minit() initializes an empty arena in the given region. Maps nothing.
+ * mkill() unmaps an arena's spans, but doesn't free its region.
+ * msize() gets the size needed to store an arena.
+ */
+ndl_arena *ndl_arena_init(void);
+void       ndl_arena_kill(ndl_arena *arena);
+
+ndl_arena *ndl_arena_minit(void *region);
+void       ndl_arena_mkill(ndl_arena *arena);
+uint64_t   ndl_arena_msize(void);
+
+/* Allocate and free blocks. Callers keep track of block sizes.
+ *
+ * alloc() gets a block of at least size bytes, aligned to 16. NULL on error.
+ * free() releases a block of the given size. NULL is ignored.
+ * realloc() moves a block of old bytes into one of size bytes, keeping
+ *     what fits. Acts like alloc() for NULL. NULL on error, leaving the old block.
+ */
+void *ndl_arena_alloc  (ndl_arena *arena, uint64_t size);
+void  ndl_arena_free   (ndl_arena *arena, void *block, uint64_t size);
+void *ndl_arena_realloc(ndl_arena *arena, void *block, uint64_t old, uint64_t size);
+
+/* Return memory to the OS, and pick how it's mapped.
+ *
+ * trim() unmaps every span without blocks in use. Returns the bytes unmapped.
+ * hugepages() sets whether new spans use huge pages. Off by default.
+ */
+uint64_t ndl_arena_trim     (ndl_arena *arena);
+void     ndl_arena_hugepages(ndl_arena *arena, int enable);
+
+/* Arena metadata.
+ *
+ * spans() gets the number of spans mapped.
+ * mapped() gets the bytes mapped for them.
+ */
+uint64_t ndl_arena_spans (ndl_arena *arena);
+uint64_t ndl_arena_mapped(ndl_arena *arena);
+
+#endif /* NODEL_ARENA_H */
@@ -5,6 +5,15 @@
 
 #include <stdio.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Control byte values. Full slots hold the low 7 bits of their hash. */
+#define NDL_HASHTABLE_EMPTY ((uint8_t) 0x80)
+
+#define NDL_HASHTABLE_ISFULL(ctrl) (((ctrl) & 0x80) == 0)
+
 ndl_hashtable *ndl_hashtable_init(uint64_t key_size, uint64_t val_size, uint64_t capacity) {
 
     void *region = malloc(ndl_hashtable_msize(key_size, val_size, capacity));
@@ -24,6 +33,26 @@ void ndl_hashtable_kill(ndl_hashtable *table) {
     free(table);
 }
 
+ndl_hashtable *ndl_hashtable_ainit(uint64_t key_size, uint64_t val_size, uint64_t capacity, ndl_arena *arena) {
+
+    if (arena == NULL)
+        return ndl_hashtable_init(key_size, val_size, capacity);
+
+    void *region = ndl_arena_alloc(arena, ndl_hashtable_msize(key_size, val_size, capacity));
+    if (region == NULL)
+        return NULL;
+
+    return ndl_hashtable_minit(region, key_size, val_size, capacity);
+}
+
+void ndl_hashtable_akill(ndl_hashtable *table, ndl_arena *arena) {
+
+    if (arena == NULL)
+        ndl_hashtable_kill(table);
+    else if (table != NULL)
+        ndl_arena_free(arena, table, ndl_hashtable_msize(table->key_size, table->val_size, table->capacity));
+}
+
 int ndl_hashtable_copy(ndl_hashtable *to, ndl_hashtable *from) {
 
     if ((to == NULL) || (from == NULL))
@@ -34,7 +63,7 @@ int ndl_hashtable_copy(ndl_hashtable *to, ndl_hashtable *from) {
     while (next != NULL) {
 
         void *key = ndl_hashtable_pairs_key(from, next);
-        val = ndl_hashtable_put(to, key, ((uint8_t *) key) + from->key_size);
+        val = ndl_hashtable_put(to, key, ndl_hashtable_pairs_val(from, next));
         if (val == NULL)
             return -1;
 
@@ -44,173 +73,338 @@ int ndl_hashtable_copy(ndl_hashtable *to, ndl_hashtable *from) {
     return 0;
 }
 
+/* Round capacity up to the next power of two, so buckets can be
+ * indexed with a mask rather than a division.
+ */
+static inline uint64_t ndl_hashtable_roundcap(uint64_t capacity) {
+
+    uint64_t cap = 1;
+    while (cap < capacity)
+        cap <<= 1;
+
+    return cap;
+}
+
+static inline uint64_t ndl_hashtable_align(uint64_t size, uint64_t align) {
+
+    return (size + align - 1) & ~(align - 1);
+}
+
+/* Keys and values are aligned to 8 bytes when their sizes allow it,
+ * to 4 bytes otherwise (keys are always %sizeof(int32_t).)
+ */
+static inline uint64_t ndl_hashtable_alignof(uint64_t size) {
+
+    return ((size & 0x07) == 0)? 8 : 4;
+}
+
+static inline uint64_t ndl_hashtable_val_offset(uint64_t key_size, uint64_t val_size) {
+
+    return ndl_hashtable_align(key_size, ndl_hashtable_alignof(val_size));
+}
+
+static inline uint64_t ndl_hashtable_slot_size(uint64_t key_size, uint64_t val_size) {
+
+    uint64_t align = ndl_hashtable_alignof(key_size);
+    if (ndl_hashtable_alignof(val_size) > align)
+        align = ndl_hashtable_alignof(val_size);
+
+    return ndl_hashtable_align(ndl_hashtable_val_offset(key_size, val_size) + val_size, align);
+}
+
+/* Control bytes, plus a cloned tail so any group load stays in bounds. */
+static inline uint64_t ndl_hashtable_ctrl_size(uint64_t capacity) {
+
+    return ndl_hashtable_align(capacity + NDL_HASHTABLE_GROUP, 16);
+}
+
 ndl_hashtable *ndl_hashtable_minit(void *region, uint64_t key_size, uint64_t val_size, uint64_t capacity) {
 
     ndl_hashtable *table = region;
 
+    capacity = ndl_hashtable_roundcap(capacity);
+
     table->key_size = key_size;
     table->val_size = val_size;
 
     table->size = 0;
     table->capacity = capacity;
 
-    uint64_t bucketsize = sizeof(ndl_hashtable_bucket) + key_size + val_size;
+    table->val_offset = ndl_hashtable_val_offset(key_size, val_size);
+    table->slot_size = ndl_hashtable_slot_size(key_size, val_size);
 
-    memset(table->data, 0, (uint64_t) bucketsize * capacity);
+    memset(table->data, NDL_HASHTABLE_EMPTY, ndl_hashtable_ctrl_size(capacity));
 
     return table;
 }
 
 uint64_t ndl_hashtable_msize(uint64_t key_size, uint64_t val_size, uint64_t capacity) {
 
-    return sizeof(ndl_hashtable) + (sizeof(ndl_hashtable_bucket) + key_size + val_size) * capacity;
+    capacity = ndl_hashtable_roundcap(capacity);
+
+    return sizeof(ndl_hashtable) + ndl_hashtable_ctrl_size(capacity) +
+        ndl_hashtable_slot_size(key_size, val_size) * capacity;
 }
 
+/* 64 bit finalizer from MurmurHash3.
+ * Every input bit affects every output bit, so sequential refs and
+ * symbols differing in a single character spread over the whole table.
+ */
+static inline uint64_t ndl_hashtable_mix(uint64_t h) {
+
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+
+    return h;
+}
+
+/* Full hash. The low 7 bits go in the control byte, the rest pick the slot. */
 static inline uint64_t ndl_hashtable_hash(ndl_hashtable *table, void *key) {
 
     uint64_t size = table->key_size;
 
-    uint64_t sum = 0;
+    /* Fast path for ndl_sym / ndl_ref keys. */
+    if (size == sizeof(uint64_t))
+        return ndl_hashtable_mix(*((uint64_t *) key));
+
+    uint64_t hash = size;
     uint64_t size_64 = size >> 3;
     uint64_t size_32 = size >> 2;
     uint64_t extra_word = size & 0x04;
 
     uint64_t i;
-    for (i = 0; i < size_64; i++) {
-        sum += ((uint64_t *) key)[i];
-    }
+    for (i = 0; i < size_64; i++)
+        hash = ndl_hashtable_mix(hash ^ ((uint64_t *) key)[i]);
 
     if (extra_word)
-        sum += ((uint32_t *) key)[size_32 - 1];
+        hash = ndl_hashtable_mix(hash ^ ((uint32_t *) key)[size_32 - 1]);
 
-    return (sum + (sum << 1)) % table->capacity;
+    return hash;
 }
 
-static inline int ndl_hashtable_keycmp(ndl_hashtable *table, ndl_hashtable_bucket *bucket, void *key) {
+#define NDL_HASHTABLE_H1(hash) ((hash) >> 7)
+#define NDL_HASHTABLE_H2(hash) ((uint8_t) ((hash) & 0x7F))
+
+/* Group operations. Each returns a bitmask over the NDL_HASHTABLE_GROUP
+ * control bytes starting at ctrl, bit i set if byte i matches.
+ */
+#ifdef __SSE2__
 
-    void *bucketkey = ((uint8_t *) bucket) + sizeof(ndl_hashtable_bucket);
+static inline uint32_t ndl_hashtable_group_match(uint8_t *ctrl, uint8_t h2) {
 
-    return memcmp(bucketkey, key, table->key_size);
+    __m128i group = _mm_loadu_si128((__m128i *) ctrl);
+    return (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char) h2)));
 }
 
-void *ndl_hashtable_get(ndl_hashtable *table, void *key) {
+static inline uint32_t ndl_hashtable_group_empty(uint8_t *ctrl) {
 
-    uint64_t hash = ndl_hashtable_hash(table, key);
+    return ndl_hashtable_group_match(ctrl, NDL_HASHTABLE_EMPTY);
+}
 
-    uint64_t bucketsize = sizeof(ndl_hashtable_bucket) + table->key_size + table->val_size;
+#else
 
-    uint8_t *base = table->data;
-    ndl_hashtable_bucket *start = (ndl_hashtable_bucket *) (base + (bucketsize * hash));
-    ndl_hashtable_bucket *curr = start;
-    ndl_hashtable_bucket *end = (ndl_hashtable_bucket *) (base + (bucketsize * table->capacity));
+static inline uint32_t ndl_hashtable_group_match(uint8_t *ctrl, uint8_t h2) {
 
-    do {
+    uint32_t ret = 0;
 
-        if (curr->marker == 0)
-            return NULL;
+    uint32_t i;
+    for (i = 0; i < NDL_HASHTABLE_GROUP; i++)
+        if (ctrl[i] == h2)
+            ret |= (uint32_t) 1 << i;
 
-        if (curr->marker == 1)
-            if (!ndl_hashtable_keycmp(table, curr, key))
-                return ((uint8_t *) curr) + sizeof(ndl_hashtable_bucket) + table->key_size;
+    return ret;
+}
 
-        curr = (ndl_hashtable_bucket *) (((uint8_t *) curr) + bucketsize);
-        if (curr == end)
-            curr = (ndl_hashtable_bucket *) base;
+static inline uint32_t ndl_hashtable_group_empty(uint8_t *ctrl) {
 
-    } while (curr != start);
+    return ndl_hashtable_group_match(ctrl, NDL_HASHTABLE_EMPTY);
+}
 
-    return NULL;
+#endif
+
+/* Bits of a group that refer to distinct slots.
+ * Tables smaller than a group see every slot more than once per load.
+ */
+static inline uint32_t ndl_hashtable_group_width(ndl_hashtable *table) {
+
+    return (table->capacity < NDL_HASHTABLE_GROUP)?
+        (uint32_t) table->capacity : NDL_HASHTABLE_GROUP;
 }
 
-void *ndl_hashtable_put(ndl_hashtable *table, void *key, void *value) {
+static inline uint32_t ndl_hashtable_group_bits(uint32_t width) {
 
-    if (table->capacity == table->size)
-        return NULL;
+    return (width >= 32)? 0xFFFFFFFF : (((uint32_t) 1 << width) - 1);
+}
 
-    uint64_t hash = ndl_hashtable_hash(table, key);
+/* Set a control byte, and its clones past the end of the array. */
+static inline void ndl_hashtable_set_ctrl(ndl_hashtable *table, uint64_t index, uint8_t ctrl) {
+
+    uint64_t end = table->capacity + NDL_HASHTABLE_GROUP;
+
+    uint64_t i;
+    for (i = index; i < end; i += table->capacity)
+        table->data[i] = ctrl;
+}
+
+static inline uint8_t *ndl_hashtable_slots(ndl_hashtable *table) {
+
+    return table->data + ndl_hashtable_ctrl_size(table->capacity);
+}
+
+static inline uint8_t *ndl_hashtable_slot(ndl_hashtable *table, uint64_t index) {
+
+    return ndl_hashtable_slots(table) + (table->slot_size * index);
+}
+
+/* Linear probe from the key's home slot, a group of control bytes at a time.
+ * Returns the slot index holding key, or -1. If hole is non-NULL, it is set
+ * to the empty slot ending the probe run (or -1), for insertion.
+ */
+static inline int64_t ndl_hashtable_find(ndl_hashtable *table, void *key, uint64_t hash, int64_t *hole) {
+
+    uint64_t mask = table->capacity - 1;
+    uint64_t pos = NDL_HASHTABLE_H1(hash) & mask;
+    uint8_t h2 = NDL_HASHTABLE_H2(hash);
+
+    uint32_t width = ndl_hashtable_group_width(table);
+    uint32_t bits = ndl_hashtable_group_bits(width);
+
+    if (hole != NULL)
+        *hole = -1;
 
-    uint64_t bucketsize = sizeof(ndl_hashtable_bucket) + table->key_size + table->val_size;
+    uint64_t probed;
+    for (probed = 0; probed < table->capacity; probed += width) {
 
-    uint8_t *base = table->data;
-    ndl_hashtable_bucket *start = (ndl_hashtable_bucket *) (base + (bucketsize * hash));
-    ndl_hashtable_bucket *curr = start;
-    ndl_hashtable_bucket *end = (ndl_hashtable_bucket *) (base + (bucketsize * table->capacity));
+        uint8_t *ctrl = table->data + pos;
 
-    do {
+        uint32_t empty = ndl_hashtable_group_empty(ctrl) & bits;
 
-        uint8_t *currkey = ((uint8_t *) curr) + sizeof(ndl_hashtable_bucket);
-        uint8_t *currval = currkey + table->key_size;
+        /* Keys never sit past an empty slot on their probe sequence. */
+        uint32_t live = (empty != 0)? ((empty & (~empty + 1)) - 1) : bits;
 
-        if ((curr->marker == 0) || (curr->marker == -1)) {
-            curr->marker = 1;
-            table->size++;
-            memcpy(currkey, key, table->key_size);
-            if (value == NULL)
-                return currval;
-            else
-                return memcpy(currval, value, table->val_size);
+        uint32_t match = ndl_hashtable_group_match(ctrl, h2) & live;
+        while (match != 0) {
+
+            uint64_t index = (pos + (uint64_t) __builtin_ctz(match)) & mask;
+            if (!memcmp(ndl_hashtable_slot(table, index), key, table->key_size))
+                return (int64_t) index;
+
+            match &= match - 1;
         }
 
-        if (curr->marker == 1) {
-            if (!ndl_hashtable_keycmp(table, curr, key)) {
-                if (value == NULL)
-                    return currval;
-                else
-                    return memcpy(currval, value, table->val_size);
-            }
+        if (empty != 0) {
+            if (hole != NULL)
+                *hole = (int64_t) ((pos + (uint64_t) __builtin_ctz(empty)) & mask);
+            return -1;
         }
 
-        curr = (ndl_hashtable_bucket *) (((uint8_t *) curr) + bucketsize);
-        if (curr == end)
-            curr = (ndl_hashtable_bucket *) base;
+        pos = (pos + width) & mask;
+    }
 
-    } while (curr != start);
+    return -1;
+}
 
-    ndl_hashtable_print(table);
+void *ndl_hashtable_get(ndl_hashtable *table, void *key) {
 
-    return NULL;
+    uint64_t hash = ndl_hashtable_hash(table, key);
+
+    int64_t index = ndl_hashtable_find(table, key, hash, NULL);
+    if (index < 0)
+        return NULL;
+
+    return ndl_hashtable_slot(table, (uint64_t) index) + table->val_offset;
 }
 
-int ndl_hashtable_del(ndl_hashtable *table, void *key) {
+void *ndl_hashtable_put(ndl_hashtable *table, void *key, void *value) {
 
-    uint8_t *val = (uint8_t *) ndl_hashtable_get(table, key);
+    uint64_t hash = ndl_hashtable_hash(table, key);
 
-    if (val == NULL)
-        return -1;
+    int64_t hole;
+    int64_t index = ndl_hashtable_find(table, key, hash, &hole);
 
-    ndl_hashtable_bucket *bucket = (ndl_hashtable_bucket *) (val - sizeof(ndl_hashtable_bucket) - table->key_size);
+    if (index < 0) {
 
-    bucket->marker = -1;
-    table->size--;
+        if ((table->capacity == table->size) || (hole < 0)) {
+            ndl_hashtable_print(table);
+            return NULL;
+        }
 
-    return 0;
+        index = hole;
+        ndl_hashtable_set_ctrl(table, (uint64_t) index, NDL_HASHTABLE_H2(hash));
+        table->size++;
+
+        memcpy(ndl_hashtable_slot(table, (uint64_t) index), key, table->key_size);
+    }
+
+    uint8_t *currval = ndl_hashtable_slot(table, (uint64_t) index) + table->val_offset;
+
+    if (value == NULL)
+        return currval;
+    else
+        return memcpy(currval, value, table->val_size);
 }
 
-static inline ndl_hashtable_bucket *ndl_hashtable_bucketscan(ndl_hashtable *table, ndl_hashtable_bucket *bucket) {
+/* Backward-shift deletion: empty the slot, then walk the rest of its
+ * probe run, moving back any pair whose home doesn't lie between the
+ * hole and its current slot. Lookups stop at the first empty slot, so
+ * this keeps every remaining pair reachable without tombstones.
+ */
+static inline void ndl_hashtable_shift(ndl_hashtable *table, uint64_t hole) {
 
-    uint64_t bucketsize = sizeof(ndl_hashtable_bucket) + table->key_size + table->val_size;
-    ndl_hashtable_bucket *end = (ndl_hashtable_bucket *) (table->data + (bucketsize * table->capacity));
+    uint64_t mask = table->capacity - 1;
 
-    while (bucket < end) {
+    uint64_t next;
+    for (next = (hole + 1) & mask; next != hole; next = (next + 1) & mask) {
 
-        if (bucket->marker == 1)
-            return bucket;
+        uint8_t ctrl = table->data[next];
+        if (!NDL_HASHTABLE_ISFULL(ctrl))
+            break;
 
-        bucket = (ndl_hashtable_bucket *) (((uint8_t *) bucket) + bucketsize);
+        uint8_t *slot = ndl_hashtable_slot(table, next);
+        uint64_t home = NDL_HASHTABLE_H1(ndl_hashtable_hash(table, slot)) & mask;
+
+        /* Stays put if home is cyclically within (hole, next]. */
+        if (((next - home) & mask) < ((next - hole) & mask))
+            continue;
+
+        memcpy(ndl_hashtable_slot(table, hole), slot, table->slot_size);
+        ndl_hashtable_set_ctrl(table, hole, ctrl);
+
+        hole = next;
     }
 
-    return NULL;
+    ndl_hashtable_set_ctrl(table, hole, NDL_HASHTABLE_EMPTY);
 }
 
-void *ndl_hashtable_pairs_head(ndl_hashtable *table) {
+int ndl_hashtable_del(ndl_hashtable *table, void *key) {
 
-    ndl_hashtable_bucket *buckethead =
-        ndl_hashtable_bucketscan(table, (ndl_hashtable_bucket *) table->data);
+    uint64_t hash = ndl_hashtable_hash(table, key);
 
-    if (buckethead == NULL)
-        return NULL;
+    int64_t index = ndl_hashtable_find(table, key, hash, NULL);
+    if (index < 0)
+        return -1;
+
+    ndl_hashtable_shift(table, (uint64_t) index);
+    table->size--;
 
-    return buckethead;
+    return 0;
+}
+
+static inline void *ndl_hashtable_slotscan(ndl_hashtable *table, uint64_t index) {
+
+    for (; index < table->capacity; index++)
+        if (NDL_HASHTABLE_ISFULL(table->data[index]))
+            return ndl_hashtable_slot(table, index);
+
+    return NULL;
+}
+
+void *ndl_hashtable_pairs_head(ndl_hashtable *table) {
+
+    return ndl_hashtable_slotscan(table, 0);
 }
 
 void *ndl_hashtable_pairs_next(ndl_hashtable *table, void *prev) {
@@ -218,25 +412,66 @@ void *ndl_hashtable_pairs_next(ndl_hashtable *table, void *prev) {
     if (prev == NULL)
         return NULL;
 
-    ndl_hashtable_bucket *nextbucket = (ndl_hashtable_bucket *)
-        (((uint8_t *) prev) + sizeof(ndl_hashtable_bucket) + table->key_size + table->val_size);
+    uint64_t index = (uint64_t) ((uint8_t *) prev - ndl_hashtable_slots(table)) / table->slot_size;
 
-    nextbucket = ndl_hashtable_bucketscan(table, nextbucket);
+    return ndl_hashtable_slotscan(table, index + 1);
+}
+
+void *ndl_hashtable_pairs_at(ndl_hashtable *table, uint64_t index) {
+
+    if (index >= table->capacity)
+        return NULL;
 
-    if (nextbucket == NULL)
+    if (!NDL_HASHTABLE_ISFULL(table->data[index]))
         return NULL;
 
-    return nextbucket;
+    return ndl_hashtable_slot(table, index);
 }
 
 void *ndl_hashtable_pairs_key(ndl_hashtable *table, void *curr) {
 
-    return ((uint8_t *) curr) + sizeof(ndl_hashtable_bucket);
+    return curr;
 }
 
 void *ndl_hashtable_pairs_val(ndl_hashtable *table, void *curr) {
 
-    return ((uint8_t *) curr) + sizeof(ndl_hashtable_bucket) + table->key_size;
+    return ((uint8_t *) curr) + table->val_offset;
+}
+
+uint64_t ndl_hashtable_probes(ndl_hashtable *table, void *key) {
+
+    uint64_t hash = ndl_hashtable_hash(table, key);
+
+    int64_t index = ndl_hashtable_find(table, key, hash, NULL);
+    if (index < 0)
+        return 0;
+
+    uint64_t mask = table->capacity - 1;
+
+    return (((uint64_t) index - NDL_HASHTABLE_H1(hash)) & mask) + 1;
+}
+
+void ndl_hashtable_probe_stats(ndl_hashtable *table, ndl_hashtable_stats *stats) {
+
+    uint64_t mask = table->capacity - 1;
+
+    stats->size = table->size;
+    stats->probes = 0;
+    stats->max_probes = 0;
+
+    uint64_t i;
+    for (i = 0; i < table->capacity; i++) {
+
+        if (!NDL_HASHTABLE_ISFULL(table->data[i]))
+            continue;
+
+        uint64_t home = NDL_HASHTABLE_H1(ndl_hashtable_hash(table, ndl_hashtable_slot(table, i)));
+        uint64_t probes = ((i - home) & mask) + 1;
+
+        stats->probes += probes;
+        if (probes > stats->max_probes)
+            stats->max_probes = probes;
+    }
 }
 
 uint64_t ndl_hashtable_cap(ndl_hashtable *table) {
@@ -265,13 +500,12 @@ void ndl_hashtable_print(ndl_hashtable *table) {
     printf("Key, val, cap: %ld:%ld x %ld.\n", table->key_size, table->val_size, table->capacity);
     printf("Usage: %ld / %ld.\n", table->size, table->capacity);
 
-    uint8_t *base = (uint8_t *) table->data;
-    uint64_t bucketsize = sizeof(ndl_hashtable_bucket) + table->key_size + table->val_size;
+    ndl_hashtable_stats stats;
+    ndl_hashtable_probe_stats(table, &stats);
+    printf("Probes: mean %.2f, max %ld.\n",
+           (stats.size > 0)? (double) stats.probes / (double) stats.size : 0.0, stats.max_probes);
 
     uint64_t i;
-    for (i = 0; i < table->capacity; i++) {
-
-        ndl_hashtable_bucket *bucket = (ndl_hashtable_bucket *) (base + (bucketsize * i));
-        printf("[%3d]\n", bucket->marker);
-    }
+    for (i = 0; i < table->capacity; i++)
+        printf("[%3d]\n", NDL_HASHTABLE_ISFULL(table->data[i])? 1 : 0);
 }
@@ -3,6 +3,8 @@
 
 #include <stdint.h>
 
+#include "arena.h"
+
 /* Statically sized open addressing hashtable.
  * Used in construction of fancier things (resizable hashtable,
  * hashtable accelerated search tree, etc.)
@@ -10,27 +12,47 @@
 
 /* Simple hashtable datastructure.
  * Entire hashtable allocated as one block.
- * Tracks key and value size, bucket count and usage.
- * data is an array of buckets. Each bucket stores
- * a marker, a key, and a value. A marker is 1 for used,
- * 0 for unused, and -1 for deleted. When searching for
- * a key, you must search until either key is found, a
- * bucket with marker=0 is found, or you loop the entire
- * list.
+ * Tracks key and value size, slot count and usage.
+ *
+ * data holds an array of control bytes, followed by an array of slots.
+ * Each control byte describes one slot: 0x80 for empty, or the low
+ * 7 bits of the key's hash for used. The first
+ * NDL_HASHTABLE_GROUP control bytes are cloned past the end of the
+ * array, so a group of them can always be loaded at once.
+ *
+ * Lookups probe linearly from the key's home slot, comparing a whole group
+ * of control bytes against the hash fragment at once (SSE2 where available),
+ * and only compare keys on a fragment match. A search stops at the first
+ * empty slot, or after looping the entire table.
+ * Deletion shifts the rest of the probe run back into the freed slot
+ * (no tombstones), so probe lengths don't creep up under churn.
+ *
+ * Slots hold a key, then a value, each aligned to 8 bytes where their
+ * sizes allow it.
  * Keys must be %sizeof(int32_t).
+ * Capacities are rounded up to a power of two, and keys are
+ * hashed with a 64 bit mixing function (single round for 8 byte
+ * keys), so a slot is found with a mask rather than a division.
  */
-typedef struct ndl_hashtable_bucket_s {
+#define NDL_HASHTABLE_GROUP 16
 
-    int32_t marker;
-    uint8_t data[];
+/* Probe length statistics, from probe_stats(). The mean probe
+ * length is probes / size.
+ */
+typedef struct ndl_hashtable_stats_s {
+
+    uint64_t size;
+    uint64_t probes, max_probes;
 
-} ndl_hashtable_bucket;
+} ndl_hashtable_stats;
 
 typedef struct ndl_hashtable_s {
 
     uint64_t key_size, val_size;
     uint64_t size, capacity;
 
+    uint64_t val_offset, slot_size;
+
     uint8_t data[];
 
 } ndl_hashtable;
@@ -45,6 +67,10 @@ typedef struct ndl_hashtable_s {
  *     Used for growing or shrinking hashtables.
  *     Returns 0 on success, -1 on failure. Overrides existing keys.
  *
+ * Capacity is rounded up to the next power of two.
+ *
+ * ainit() and akill() are init() and kill(), from the given arena. NULL for malloc.
+ *
  * minit() initializes a hashtable from given memory region.
  *     Memory region must be at least msize() in bytes.
  *     No cleanup is required on deletion. (Except as needed by the element data.)
@@ -54,6 +80,9 @@ ndl_hashtable *ndl_hashtable_init(uint64_t key_size, uint64_t val_size, uint64_t
 void           ndl_hashtable_kill(ndl_hashtable *table);
 int            ndl_hashtable_copy(ndl_hashtable *to, ndl_hashtable *from);
 
+ndl_hashtable *ndl_hashtable_ainit(uint64_t key_size, uint64_t val_size, uint64_t capacity, ndl_arena *arena);
+void           ndl_hashtable_akill(ndl_hashtable *table, ndl_arena *arena);
+
 ndl_hashtable *ndl_hashtable_minit(void *region, uint64_t key_size, uint64_t val_size, uint64_t capacity);
 uint64_t       ndl_hashtable_msize(uint64_t key_size, uint64_t val_size, uint64_t capacity);
 
@@ -79,6 +108,9 @@ int   ndl_hashtable_del(ndl_hashtable *table, void *key);
  * pairs_next() gets the next key/value pair in the hashtable.
  *     Returns NULL on error, end of list.
  *
+ * pairs_at() gets the key/value pair in the given slot, for slot by slot scans.
+ *     Returns NULL if the slot is unused or out of range.
+ *
  * pairs_key() gets the key for the pair iterator.
  *     Returns NULL on error.
  * pairs_val() gets the value for the pair iterator.
@@ -86,6 +118,7 @@ int   ndl_hashtable_del(ndl_hashtable *table, void *key);
  */
 void *ndl_hashtable_pairs_head(ndl_hashtable *table);
 void *ndl_hashtable_pairs_next(ndl_hashtable *table, void *prev);
+void *ndl_hashtable_pairs_at  (ndl_hashtable *table, uint64_t index);
 
 void *ndl_hashtable_pairs_key(ndl_hashtable *table, void *curr);
 void *ndl_hashtable_pairs_val(ndl_hashtable *table, void *curr);
@@ -95,12 +128,19 @@ void *ndl_hashtable_pairs_val(ndl_hashtable *table, void *curr);
  * size() gets the number of used pairs in the hashtable.
  * cap()  gets the capacity (in pairs) of a hashtable.
  *
+ * probes() gets the number of buckets examined when looking up key.
+ *     Returns 0 if key is not present.
+ * probe_stats() gets the total and maximum probes() over every key.
+ *
  * key_size() gets the key_size for the hashtable.
  * val_size() gets the val_size for the hashtable.
  */
 uint64_t ndl_hashtable_size(ndl_hashtable *table);
 uint64_t ndl_hashtable_cap (ndl_hashtable *table);
 
+uint64_t ndl_hashtable_probes(ndl_hashtable *table, void *key);
+void     ndl_hashtable_probe_stats(ndl_hashtable *table, ndl_hashtable_stats *stats);
+
 uint64_t ndl_hashtable_key_size(ndl_hashtable *table);
 uint64_t ndl_hashtable_val_size(ndl_hashtable *table);
 
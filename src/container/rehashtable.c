@@ -2,30 +2,29 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "hashtable.h"
 
 #define NDL_REHASHTABLE_MIN_DEFAULT 8
 
-ndl_rhashtable *ndl_rhashtable_init(uint64_t key_size, uint64_t val_size, uint64_t min_size) {
-
-    ndl_rhashtable *rtable = malloc(sizeof(ndl_rhashtable));
-    if (rtable == NULL)
-        return NULL;
+/* Slots of the old table examined per put/del while migrating.
+ * Draining takes at most (cap + size)/STEP operations, which keeps
+ * the new table well under its own resize thresholds until done.
+ */
+#define NDL_REHASHTABLE_MIGRATE_STEP 32
 
-    if (min_size == 0)
-        min_size = NDL_REHASHTABLE_MIN_DEFAULT;
+ndl_rhashtable *ndl_rhashtable_init(uint64_t key_size, uint64_t val_size, uint64_t min_size) {
 
-    ndl_hashtable *table = ndl_hashtable_init(key_size, val_size, min_size);
-    if (table == NULL) {
-        free(rtable);
+    void *region = malloc(ndl_rhashtable_msize(key_size, val_size, min_size));
+    if (region == NULL)
         return NULL;
-    }
 
-    rtable->min_size = min_size;
-    rtable->table = table;
+    ndl_rhashtable *ret = ndl_rhashtable_minit(region, key_size, val_size, min_size);
+    if (ret == NULL)
+        free(region);
 
-    return rtable;
+    return ret;
 }
 
 void ndl_rhashtable_kill(ndl_rhashtable *table) {
@@ -38,6 +37,12 @@ void ndl_rhashtable_kill(ndl_rhashtable *table) {
 
 ndl_rhashtable *ndl_rhashtable_minit(void *region, uint64_t key_size, uint64_t val_size, uint64_t min_size) {
 
+    return ndl_rhashtable_aminit(region, key_size, val_size, min_size, NULL);
+}
+
+ndl_rhashtable *ndl_rhashtable_aminit(void *region, uint64_t key_size, uint64_t val_size, uint64_t min_size,
+                                      ndl_arena *arena) {
+
     ndl_rhashtable *rtable = (ndl_rhashtable *) region;
     if (rtable == NULL)
         return NULL;
@@ -45,15 +50,18 @@ ndl_rhashtable *ndl_rhashtable_minit(void *region, uint64_t key_size, uint64_t v
     if (min_size == 0)
         min_size = NDL_REHASHTABLE_MIN_DEFAULT;
 
-    ndl_hashtable *table = ndl_hashtable_init(key_size, val_size, min_size);
-    if (table == NULL) {
-        free(rtable);
+    ndl_hashtable *table = ndl_hashtable_ainit(key_size, val_size, min_size, arena);
+    if (table == NULL)
         return NULL;
-    }
 
+    rtable->arena = arena;
     rtable->min_size = min_size;
     rtable->table = table;
 
+    rtable->incremental = 0;
+    rtable->old = NULL;
+    rtable->migrated = 0;
+
     return rtable;
 }
 
@@ -63,7 +71,10 @@ void ndl_rhashtable_mkill(ndl_rhashtable *table) {
         return;
 
     if (table->table != NULL)
-        ndl_hashtable_kill(table->table);
+        ndl_hashtable_akill(table->table, table->arena);
+
+    if (table->old != NULL)
+        ndl_hashtable_akill(table->old, table->arena);
 
     return;
 }
@@ -73,39 +84,97 @@ uint64_t ndl_rhashtable_msize(uint64_t key_size, uint64_t val_size, uint64_t min
     return sizeof(ndl_rhashtable);
 }
 
-void *ndl_rhashtable_get(ndl_rhashtable *table, void *key) {
+/* Move up to count slots worth of pairs from the old table to the new one.
+ * Pairs are deleted from old as they move, so slots before migrated are
+ * always empty; a deletion may pull a later pair back into the current
+ * slot, so a slot is only passed once it is seen empty.
+ */
+static void ndl_rhashtable_migrate(ndl_rhashtable *table, uint64_t count) {
 
-    return ndl_hashtable_get(table->table, key);
-}
+    if (table->old == NULL)
+        return;
 
-/* If ((size/cap) >= 3/4), realloc.
- * Computed as as (size*4 >= cap*3).
- */
-static inline void ndl_rhashtable_grow(ndl_rhashtable *table) {
+    ndl_hashtable *old = table->old;
+    uint64_t cap = ndl_hashtable_cap(old);
 
-    uint64_t size = ndl_hashtable_size(table->table);
-    uint64_t cap = ndl_hashtable_cap(table->table);
+    uint64_t i;
+    for (i = 0; (i < count) && (table->migrated < cap); i++) {
 
-    if ((size * 4) < (cap * 3))
+        void *curr = ndl_hashtable_pairs_at(old, table->migrated);
+        if (curr == NULL) {
+            table->migrated++;
+            continue;
+        }
+
+        void *key = ndl_hashtable_pairs_key(old, curr);
+        void *val = ndl_hashtable_pairs_val(old, curr);
+
+        /* The new table never fills while migrating; see MIGRATE_STEP. */
+        if (ndl_hashtable_put(table->table, key, val) == NULL)
+            return;
+
+        ndl_hashtable_del(old, key);
+    }
+
+    if (table->migrated < cap && ndl_hashtable_size(old) > 0)
         return;
 
+    ndl_hashtable_akill(old, table->arena);
+    table->old = NULL;
+    table->migrated = 0;
+}
+
+/* Swap in a table of the given capacity, and start migrating to it.
+ * Outside of incremental mode, the migration finishes immediately.
+ */
+static inline void ndl_rhashtable_resize(ndl_rhashtable *table, uint64_t cap) {
+
     uint64_t key_size = ndl_hashtable_key_size(table->table);
     uint64_t val_size = ndl_hashtable_val_size(table->table);
 
-    ndl_hashtable *ntable = ndl_hashtable_init(key_size, val_size, cap * 2);
+    ndl_hashtable *ntable = ndl_hashtable_ainit(key_size, val_size, cap, table->arena);
     if (ntable == NULL)
         return;
 
-    int err = ndl_hashtable_copy(ntable, table->table);
-    if (err != 0) {
-        ndl_hashtable_kill(ntable);
+    if (!table->incremental) {
+
+        int err = ndl_hashtable_copy(ntable, table->table);
+        if (err != 0) {
+            ndl_hashtable_akill(ntable, table->arena);
+            return;
+        }
+
+        ndl_hashtable_akill(table->table, table->arena);
+        table->table = ntable;
+
         return;
     }
 
-    ndl_hashtable_kill(table->table);
+    table->old = table->table;
     table->table = ntable;
+    table->migrated = 0;
+}
 
-    return;
+/* If ((size/cap) >= 3/4), realloc.
+ * Computed as as (size*4 >= cap*3).
+ */
+static inline void ndl_rhashtable_grow(ndl_rhashtable *table) {
+
+    uint64_t size = ndl_hashtable_size(table->table);
+    uint64_t cap = ndl_hashtable_cap(table->table);
+
+    if ((size * 4) < (cap * 3))
+        return;
+
+    /* Shouldn't happen, but never stack migrations. */
+    if (table->old != NULL)
+        ndl_rhashtable_migrate(table, UINT64_MAX);
+
+    size = ndl_hashtable_size(table->table);
+    if ((size * 4) < (cap * 3))
+        return;
+
+    ndl_rhashtable_resize(table, cap * 2);
 }
 
 /* If ((size/cap) <= 3/16), realloc.
@@ -113,6 +182,9 @@ static inline void ndl_rhashtable_grow(ndl_rhashtable *table) {
  */
 static inline void ndl_rhashtable_shrink(ndl_rhashtable *table) {
 
+    if (table->old != NULL)
+        return;
+
     uint64_t size = ndl_hashtable_size(table->table);
     uint64_t cap = ndl_hashtable_cap(table->table);
 
@@ -122,27 +194,34 @@ static inline void ndl_rhashtable_shrink(ndl_rhashtable *table) {
     if ((size * 16) > (cap * 3))
         return;
 
-    uint64_t key_size = ndl_hashtable_key_size(table->table);
-    uint64_t val_size = ndl_hashtable_val_size(table->table);
+    ndl_rhashtable_resize(table, cap / 2);
+}
 
-    ndl_hashtable *ntable = ndl_hashtable_init(key_size, val_size, cap / 2);
-    if (ntable == NULL)
-        return;
+void *ndl_rhashtable_get(ndl_rhashtable *table, void *key) {
 
-    int err = ndl_hashtable_copy(ntable, table->table);
-    if (err != 0) {
-        ndl_hashtable_kill(ntable);
-        return;
-    }
+    void *ret = ndl_hashtable_get(table->table, key);
 
-    ndl_hashtable_kill(table->table);
-    table->table = ntable;
+    if ((ret == NULL) && (table->old != NULL))
+        ret = ndl_hashtable_get(table->old, key);
 
-    return;
+    return ret;
 }
 
 void *ndl_rhashtable_put(ndl_rhashtable *table, void *key, void *value) {
 
+    ndl_rhashtable_migrate(table, NDL_REHASHTABLE_MIGRATE_STEP);
+
+    /* Overwrite in place if not yet migrated. */
+    if (table->old != NULL) {
+
+        void *ret = ndl_hashtable_get(table->old, key);
+        if (ret != NULL) {
+            if (value != NULL)
+                memcpy(ret, value, ndl_hashtable_val_size(table->old));
+            return ret;
+        }
+    }
+
     ndl_rhashtable_grow(table);
 
     return ndl_hashtable_put(table->table, key, value);
@@ -150,25 +229,54 @@ void *ndl_rhashtable_put(ndl_rhashtable *table, void *key, void *value) {
 
 int ndl_rhashtable_del(ndl_rhashtable *table, void *key) {
 
+    ndl_rhashtable_migrate(table, NDL_REHASHTABLE_MIGRATE_STEP);
+
     int ret = ndl_hashtable_del(table->table, key);
 
+    if ((ret != 0) && (table->old != NULL))
+        ret = ndl_hashtable_del(table->old, key);
+
     if (ret == 0)
         ndl_rhashtable_shrink(table);
 
     return ret;
 }
 
+/* Checks whether an iterator points into the given table's memory. */
+static inline int ndl_rhashtable_owns(ndl_hashtable *table, void *curr) {
+
+    uint8_t *base = (uint8_t *) table;
+    uint64_t size = ndl_hashtable_msize(ndl_hashtable_key_size(table),
+                                        ndl_hashtable_val_size(table),
+                                        ndl_hashtable_cap(table));
+
+    return ((uint8_t *) curr >= base) && ((uint8_t *) curr < base + size);
+}
+
 void *ndl_rhashtable_pairs_head(ndl_rhashtable *table) {
 
-    return ndl_hashtable_pairs_head(table->table);
+    void *ret = ndl_hashtable_pairs_head(table->table);
+
+    if ((ret == NULL) && (table->old != NULL))
+        ret = ndl_hashtable_pairs_head(table->old);
+
+    return ret;
 }
 
 void *ndl_rhashtable_pairs_next(ndl_rhashtable *table, void *prev) {
 
-    return ndl_hashtable_pairs_next(table->table, prev);
-}
+    if ((table->old != NULL) && ndl_rhashtable_owns(table->old, prev))
+        return ndl_hashtable_pairs_next(table->old, prev);
 
+    void *ret = ndl_hashtable_pairs_next(table->table, prev);
+
+    if ((ret == NULL) && (table->old != NULL))
+        ret = ndl_hashtable_pairs_head(table->old);
+
+    return ret;
+}
 
+/* Both tables share key/value sizes, and so pair layouts. */
 void *ndl_rhashtable_pairs_key(ndl_rhashtable *table, void *curr) {
 
     return ndl_hashtable_pairs_key(table->table, curr);
@@ -191,7 +299,28 @@ uint64_t ndl_rhashtable_cap(ndl_rhashtable *table) {
 
 uint64_t ndl_rhashtable_size(ndl_rhashtable *table) {
 
-    return ndl_hashtable_size(table->table);
+    uint64_t size = ndl_hashtable_size(table->table);
+
+    if (table->old != NULL)
+        size += ndl_hashtable_size(table->old);
+
+    return size;
+}
+
+void ndl_rhashtable_probe_stats(ndl_rhashtable *table, ndl_hashtable_stats *stats) {
+
+    ndl_hashtable_probe_stats(table->table, stats);
+
+    if (table->old == NULL)
+        return;
+
+    ndl_hashtable_stats old;
+    ndl_hashtable_probe_stats(table->old, &old);
+
+    stats->size += old.size;
+    stats->probes += old.probes;
+    if (old.max_probes > stats->max_probes)
+        stats->max_probes = old.max_probes;
 }
 
 uint64_t ndl_rhashtable_key_size(ndl_rhashtable *table) {
@@ -204,9 +333,27 @@ uint64_t ndl_rhashtable_val_size(ndl_rhashtable *table) {
     return ndl_hashtable_val_size(table->table);
 }
 
+void ndl_rhashtable_incremental(ndl_rhashtable *table, int enable) {
+
+    table->incremental = (enable != 0);
+
+    if (!enable)
+        ndl_rhashtable_migrate(table, UINT64_MAX);
+}
+
+int ndl_rhashtable_migrating(ndl_rhashtable *table) {
+
+    return table->old != NULL;
+}
+
 void ndl_rhashtable_print(ndl_rhashtable *table) {
 
     printf("Printing resizable hashtable:\n");
     printf("Minimum size: %ld. Current hashtable:\n", table->min_size);
     ndl_hashtable_print(table->table);
+
+    if (table->old != NULL) {
+        printf("Migrating from slot %ld of old hashtable:\n", table->migrated);
+        ndl_hashtable_print(table->old);
+    }
 }
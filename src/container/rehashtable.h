@@ -7,16 +7,20 @@
 
 /* Malloc based resizable open addressing hashtable.
  * Automatically grows or shrinks the hashtable to meet capacity.
- * Amortized O(1) get, put, del, and more. Possible latency issues
- * when growing the hashtable.
- * (Consider iterative dual table migration? Meh.)
+ * Amortized O(1) get, put, del, and more. By default, a resize copies
+ * the whole table in one call; in incremental mode, the old and new
+ * tables are both kept live, and each put/del migrates a bounded
+ * number of slots, giving worst-case O(1) operations (plus malloc.)
  * Automatically grows and shrinks to larger or smaller hashtables
- * based on usage.
+ * based on usage. Rhashtables made with aminit() take their tables
+ * from the given arena instead of malloc.
  *
  * Keys must be %sizeof(int32_t).
  */
 
 /* Stores the minimum hashtable size, pointer to current hashtable.
+ * While migrating, old is the table being drained, and migrated
+ * is the next slot of old to move. Lookups check both tables.
  *
  * Currently doubles capacity when (load > 3/4), halves capacity
  * when (load <= 3/16).
@@ -26,6 +30,12 @@ typedef struct ndl_rhashtable_s {
     uint64_t min_size;
     ndl_hashtable *table;
 
+    uint64_t incremental;
+    ndl_hashtable *old;
+    uint64_t migrated;
+
+    ndl_arena *arena;
+
 } ndl_rhashtable;
 
 
@@ -38,13 +48,16 @@ typedef struct ndl_rhashtable_s {
  *
  * minit() initializes an rhashtable from the given memory region.
  *     Memory region must be at least msize() in bytes.
+ * aminit() is minit(), keeping the tables in the given arena. NULL for malloc.
  * mkill() cleans up an rhashtable, without free()ing the memory.
  * msize() gets the size of an rhashtable with the given parameters.
  */
 ndl_rhashtable *ndl_rhashtable_init(uint64_t key_size, uint64_t val_size, uint64_t min_size);
 void            ndl_rhashtable_kill(ndl_rhashtable *table);
 
-ndl_rhashtable *ndl_rhashtable_minit(void *region, uint64_t key_size, uint64_t val_size, uint64_t min_size);
+ndl_rhashtable *ndl_rhashtable_minit (void *region, uint64_t key_size, uint64_t val_size, uint64_t min_size);
+ndl_rhashtable *ndl_rhashtable_aminit(void *region, uint64_t key_size, uint64_t val_size, uint64_t min_size,
+                                      ndl_arena *arena);
 void            ndl_rhashtable_mkill(ndl_rhashtable *table);
 uint64_t        ndl_rhashtable_msize(uint64_t key_size, uint64_t val_size, uint64_t min_size);
 
@@ -91,6 +104,8 @@ void *ndl_rhashtable_pairs_val(ndl_rhashtable *table, void *curr);
  * cap() gets the capacity (in pairs) of the *current underlying hashtable*.
  *     This is not a meaningful number for most purposes.
  *
+ * probe_stats() gets probe length statistics, over both tables if migrating.
+ *
  * key_size() gets the sizeof(key) for the table.
  * val_size() gets the sizeof(value) for the table.
  */
@@ -99,9 +114,20 @@ uint64_t ndl_rhashtable_min (ndl_rhashtable *table);
 uint64_t ndl_rhashtable_cap (ndl_rhashtable *table);
 uint64_t ndl_rhashtable_size(ndl_rhashtable *table);
 
+void ndl_rhashtable_probe_stats(ndl_rhashtable *table, ndl_hashtable_stats *stats);
+
 uint64_t ndl_rhashtable_key_size(ndl_rhashtable *table);
 uint64_t ndl_rhashtable_val_size(ndl_rhashtable *table);
 
+/* Incremental resizing.
+ *
+ * incremental() enables (nonzero) or disables (0) incremental resizing.
+ *     Disabling finishes any migration in progress.
+ * migrating() returns 1 if a migration is in progress, 0 otherwise.
+ */
+void ndl_rhashtable_incremental(ndl_rhashtable *table, int enable);
+int  ndl_rhashtable_migrating  (ndl_rhashtable *table);
+
 /* Print entirety of the current rhashtable. */
 void ndl_rhashtable_print(ndl_rhashtable *table);
 
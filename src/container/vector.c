@@ -31,6 +31,11 @@ void ndl_vector_kill(ndl_vector *vector) {
 
 ndl_vector *ndl_vector_minit(void *region, uint64_t elem_size) {
 
+    return ndl_vector_aminit(region, elem_size, NULL);
+}
+
+ndl_vector *ndl_vector_aminit(void *region, uint64_t elem_size, ndl_arena *arena) {
+
     ndl_vector *ret = (ndl_vector *) region;
     if (ret == NULL)
         return NULL;
@@ -39,6 +44,7 @@ ndl_vector *ndl_vector_minit(void *region, uint64_t elem_size) {
     ret->elem_size = elem_size;
 
     ret->data = NULL;
+    ret->arena = arena;
 
     return ret;
 }
@@ -48,7 +54,12 @@ void ndl_vector_mkill(ndl_vector *vector) {
     if (vector == NULL)
         return;
 
-    if (vector->data != NULL)
+    if (vector->data == NULL)
+        return;
+
+    if (vector->arena != NULL)
+        ndl_arena_free(vector->arena, vector->data, vector->elem_cap * vector->elem_size);
+    else
         free(vector->data);
 
     return;
@@ -70,19 +81,30 @@ void *ndl_vector_get(ndl_vector *vector, uint64_t index) {
     return (void *) (vector->data + (index * vector->elem_size));
 }
 
+/* Move the data into a buffer of ncap elements. */
+static inline void *ndl_vector_resize(ndl_vector *vector, uint64_t ncap) {
+
+    if (vector->arena == NULL)
+        return realloc(vector->data, (size_t) (ncap * vector->elem_size));
+
+    return ndl_arena_realloc(vector->arena, vector->data,
+                             vector->elem_cap * vector->elem_size, ncap * vector->elem_size);
+}
+
 static inline void ndl_vector_shrink(ndl_vector *vector, int64_t delta) {
 
-    uint64_t elem_count = vector->elem_count;
+    uint64_t elem_count = vector->elem_count - (uint64_t) (-delta);
     uint64_t elem_cap = vector->elem_cap;
 
-    if (elem_count + (uint64_t) (-delta) >= (elem_cap >> 2))
+    if (elem_count >= (elem_cap >> 2))
         return;
 
-    uint64_t ncap = (elem_cap >> 2);
-    while (ncap > ((elem_cap + (uint64_t) (-delta)) << 2))
+    /* Halve until a quarter full, keeping room to grow back. */
+    uint64_t ncap = (elem_cap >> 1);
+    while ((ncap > 4) && (elem_count < (ncap >> 2)))
         ncap = ncap >> 1;
 
-    void *ndata = realloc(vector->data, (size_t) ncap);
+    void *ndata = ndl_vector_resize(vector, ncap);
     if (ndata == NULL)
         return;
 
@@ -104,7 +126,7 @@ static inline int ndl_vector_grow(ndl_vector *vector, int64_t delta) {
     while (ncap < (elem_cap + (uint64_t) delta))
         ncap = ncap << 1;
 
-    void *ndata = realloc(vector->data, (size_t) (ncap * vector->elem_size));
+    void *ndata = ndl_vector_resize(vector, ncap);
     if (ndata == NULL)
         return -1;
 
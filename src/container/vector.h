@@ -3,10 +3,14 @@
 
 #include <stdint.h>
 
+#include "arena.h"
+
 /* Malloc based resizable vector.
  * Amortized O(1) push/pop back, O(n) any other insert/delete
  * operation. Guaranteed to be contiguous, but
  * pointer may go bad between mutating calls.
+ *
+ * Vectors made with aminit() keep their data in the given arena instead.
  */
 
 typedef struct ndl_vector_s {
@@ -16,6 +20,8 @@ typedef struct ndl_vector_s {
 
     uint8_t *data;
 
+    ndl_arena *arena;
+
 } ndl_vector;
 
 /* Initialize and free vectors and their elements.
@@ -24,13 +30,15 @@ typedef struct ndl_vector_s {
  * kill() frees a vector.
  *
  * minit() initializes a vector in the given region of memory.
+ * aminit() is minit(), keeping the elements in the given arena. NULL for malloc.
  * mkill() kills a vector without freeing its root structure.
  * msize() gets the size of a vector's root structure.
  */
 ndl_vector *ndl_vector_init(uint64_t elem_size);
 void        ndl_vector_kill(ndl_vector *vector);
 
-ndl_vector *ndl_vector_minit(void *region, uint64_t elem_size);
+ndl_vector *ndl_vector_minit (void *region, uint64_t elem_size);
+ndl_vector *ndl_vector_aminit(void *region, uint64_t elem_size, ndl_arena *arena);
 void        ndl_vector_mkill(ndl_vector *vector);
 uint64_t    ndl_vector_msize(uint64_t elem_size);
 
@@ -182,11 +182,9 @@ static long int ndl_asm_parse_num(const char *src, ndl_asm_result *res, ndl_sym
 
     ndl_value val;
     if (!IS_TOKEN_NUMSEP(search[0])) {
-        val.type = EVAL_INT;
-        val.num = ival;
+        val = NDL_VALUE(EVAL_INT, num=inv? -ival : ival);
     } else {
-        val.type = EVAL_FLOAT;
-        val.real = (double) ival;
+        double real = (double) ival;
         double scale = 0.1;
 
         if (!IS_TOKEN_INUM(search[1]))
@@ -195,18 +193,13 @@ static long int ndl_asm_parse_num(const char *src, ndl_asm_result *res, ndl_sym
         res->column++;
         search++;
         while (IS_TOKEN_INUM(search[0])) {
-            val.real += scale * (search[0] - '0');
+            real += scale * (search[0] - '0');
             scale *= 0.1;
             search++;
             res->column++;
         }
-    }
 
-    if (inv) {
-        if (val.type == EVAL_FLOAT)
-            val.real = - val.real;
-        else
-            val.num = - val.num;
+        val = NDL_VALUE(EVAL_FLOAT, real=inv? -real : real);
     }
 
     int err = ndl_graph_set(res->graph, res->inst_tail, argname, val);
@@ -228,7 +221,7 @@ static long int ndl_asm_parse_label(const char *src, ndl_asm_result *res, ndl_sy
 
     /* If already in symbol table, resolve. Else, push to badref list. */
     ndl_value to = ndl_graph_get(res->graph, res->label_table, ret);
-    if (to.type == EVAL_REF || to.ref != NDL_NULL_REF) {
+    if (NDL_VALUE_TYPE(to) == EVAL_REF || NDL_VALUE_REF(to) != NDL_NULL_REF) {
 
         int err = ndl_graph_set(res->graph, res->inst_tail, argname, to);
         if (err != 0)
@@ -621,6 +614,18 @@ ndl_asm_result ndl_asm_parse(const char *source, ndl_graph *using) {
     if (res.badref_head == NDL_NULL_REF)
         return res;
 
+    /* The resolved references are stored in one batch. */
+    ndl_graph_batch *batch = ndl_graph_batch_begin(res.graph);
+    if (batch == NULL) {
+        ndl_asm_parse_kill(&res);
+        if (using == NULL)
+            ndl_graph_kill(res.graph);
+        res.msg = "Failed to resolve delayed references: out of memory.";
+        res.graph = NULL;
+        res.line = res.column = 0;
+        return res;
+    }
+
     while (res.badref_head != NDL_NULL_REF) {
 
         ndl_value inst   = ndl_graph_get(res.graph, res.badref_head, NDL_SYM("inst    "));
@@ -628,9 +633,10 @@ ndl_asm_result ndl_asm_parse(const char *source, ndl_graph *using) {
         ndl_value symbol = ndl_graph_get(res.graph, res.badref_head, NDL_SYM("symbol  "));
         ndl_value line   = ndl_graph_get(res.graph, res.badref_head, NDL_SYM("line    "));
         ndl_value column = ndl_graph_get(res.graph, res.badref_head, NDL_SYM("column  "));
-        if (((inst.type != EVAL_REF) || (symbol.type != EVAL_SYM) || (label.type != EVAL_SYM) ||
-                          (inst.ref == NDL_NULL_REF) || (symbol.sym == NDL_NULL_SYM) || (label.sym == NDL_NULL_SYM) ||
-                          (line.type != EVAL_INT) || (line.type != EVAL_INT))) {
+        if (((NDL_VALUE_TYPE(inst) != EVAL_REF) || (NDL_VALUE_TYPE(symbol) != EVAL_SYM) || (NDL_VALUE_TYPE(label) != EVAL_SYM) ||
+                          (NDL_VALUE_REF(inst) == NDL_NULL_REF) || (NDL_VALUE_SYM(symbol) == NDL_NULL_SYM) || (NDL_VALUE_SYM(label) == NDL_NULL_SYM) ||
+                          (NDL_VALUE_TYPE(line) != EVAL_INT) || (NDL_VALUE_TYPE(line) != EVAL_INT))) {
+            ndl_graph_batch_abort(batch);
             ndl_asm_parse_kill(&res);
             if (using == NULL)
                 ndl_graph_kill(res.graph);
@@ -640,35 +646,48 @@ ndl_asm_result ndl_asm_parse(const char *source, ndl_graph *using) {
             return res;
         }
 
-        ndl_value dest = ndl_graph_get(res.graph, res.label_table, label.sym);
-        if (dest.type != EVAL_REF) {
+        ndl_value dest = ndl_graph_get(res.graph, res.label_table, NDL_VALUE_SYM(label));
+        if (NDL_VALUE_TYPE(dest) != EVAL_REF) {
+            ndl_graph_batch_abort(batch);
             ndl_asm_parse_kill(&res);
             if (using == NULL)
                 ndl_graph_kill(res.graph);
             res.msg = "Failed to find label in delayed reference. Possibly internal error, probably bad label.";
             res.graph = NULL;
-            res.line = line.num;
-            res.column = column.num;
+            res.line = NDL_VALUE_NUM(line);
+            res.column = NDL_VALUE_NUM(column);
             return res;
         }
 
-        int err = ndl_graph_set(res.graph, inst.ref, symbol.sym, NDL_VALUE(EVAL_REF, ref=dest.ref));
+        int err = ndl_graph_batch_set(batch, NDL_VALUE_REF(inst), NDL_VALUE_SYM(symbol), NDL_VALUE(EVAL_REF, ref=NDL_VALUE_REF(dest)));
         ndl_value next = ndl_graph_get(res.graph, res.badref_head, NDL_SYM("brefnext"));
-        if ((next.type != EVAL_REF) || (err != 0)) {
+        if ((NDL_VALUE_TYPE(next) != EVAL_REF) || (err != 0)) {
+            ndl_graph_batch_abort(batch);
             ndl_asm_parse_kill(&res);
             if (using == NULL)
                 ndl_graph_kill(res.graph);
             res.msg = "Failed to resolve delayed reference: internal error.";
             res.graph = NULL;
-            res.line = line.num;
-            res.column = column.num;
+            res.line = NDL_VALUE_NUM(line);
+            res.column = NDL_VALUE_NUM(column);
             return res;
         }
 
-        res.badref_head = next.ref;
+        res.badref_head = NDL_VALUE_REF(next);
+    }
+
+    int err = ndl_graph_batch_commit(batch);
+    if (err != 0) {
+        ndl_asm_parse_kill(&res);
+        if (using == NULL)
+            ndl_graph_kill(res.graph);
+        res.msg = "Failed to resolve delayed references: internal error.";
+        res.graph = NULL;
+        res.line = res.column = 0;
+        return res;
     }
 
-    int err = ndl_graph_del(res.graph, res.root, NDL_SYM("brefhead"));
+    err = ndl_graph_del(res.graph, res.root, NDL_SYM("brefhead"));
     if (err != 0) {
         ndl_asm_parse_kill(&res);
         if (using == NULL)
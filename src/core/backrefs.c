@@ -0,0 +1,348 @@
+#include "backrefs.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+
+/* Array storage, from the arena or malloc. */
+static inline ndl_backref *ndl_backrefs_alloc(ndl_arena *arena, uint64_t cap) {
+
+    if (arena == NULL)
+        return malloc(cap * sizeof(ndl_backref));
+
+    return ndl_arena_alloc(arena, cap * sizeof(ndl_backref));
+}
+
+static inline ndl_backref *ndl_backrefs_realloc(ndl_arena *arena, ndl_backref *list,
+                                                uint64_t cap, uint64_t grown) {
+
+    if (arena == NULL)
+        return realloc(list, grown * sizeof(ndl_backref));
+
+    return ndl_arena_realloc(arena, list, cap * sizeof(ndl_backref), grown * sizeof(ndl_backref));
+}
+
+static inline void ndl_backrefs_free(ndl_arena *arena, ndl_backref *list, uint64_t cap) {
+
+    if (arena == NULL)
+        free(list);
+    else
+        ndl_arena_free(arena, list, cap * sizeof(ndl_backref));
+}
+
+/* Table storage, its root and buckets both from the arena, or malloc. */
+static inline ndl_rhashtable *ndl_backrefs_table_init(ndl_arena *arena) {
+
+    uint64_t size = ndl_rhashtable_msize(sizeof(ndl_ref), sizeof(uint64_t), 2 * NDL_BACKREFS_LIST_MAX);
+
+    if (arena == NULL)
+        return ndl_rhashtable_init(sizeof(ndl_ref), sizeof(uint64_t), 2 * NDL_BACKREFS_LIST_MAX);
+
+    void *region = ndl_arena_alloc(arena, size);
+    if (region == NULL)
+        return NULL;
+
+    ndl_rhashtable *table = ndl_rhashtable_aminit(region, sizeof(ndl_ref), sizeof(uint64_t),
+                                                  2 * NDL_BACKREFS_LIST_MAX, arena);
+    if (table == NULL)
+        ndl_arena_free(arena, region, size);
+
+    return table;
+}
+
+static inline void ndl_backrefs_table_kill(ndl_arena *arena, ndl_rhashtable *table) {
+
+    if (arena == NULL) {
+        ndl_rhashtable_kill(table);
+        return;
+    }
+
+    ndl_rhashtable_mkill(table);
+    ndl_arena_free(arena, table, ndl_rhashtable_msize(sizeof(ndl_ref), sizeof(uint64_t),
+                                                      2 * NDL_BACKREFS_LIST_MAX));
+}
+
+ndl_backrefs *ndl_backrefs_init(void) {
+
+    void *region = malloc(ndl_backrefs_msize());
+    if (region == NULL)
+        return NULL;
+
+    return ndl_backrefs_minit(region);
+}
+
+void ndl_backrefs_kill(ndl_backrefs *set) {
+
+    if (set == NULL)
+        return;
+
+    ndl_backrefs_mkill(set, NULL);
+
+    free(set);
+}
+
+ndl_backrefs *ndl_backrefs_minit(void *region) {
+
+    ndl_backrefs *ret = (ndl_backrefs *) region;
+    if (ret == NULL)
+        return NULL;
+
+    ret->size = 0;
+    ret->cap = 0;
+
+    return ret;
+}
+
+void ndl_backrefs_mkill(ndl_backrefs *set, ndl_arena *arena) {
+
+    if (set->cap == NDL_BACKREFS_HASHED)
+        ndl_backrefs_table_kill(arena, set->table);
+    else if (set->cap > 0)
+        ndl_backrefs_free(arena, set->list, set->cap);
+
+    set->size = set->cap = 0;
+}
+
+uint64_t ndl_backrefs_msize(void) {
+
+    return sizeof(ndl_backrefs);
+}
+
+/* Pointer to ref's count, or NULL. */
+static inline uint64_t *ndl_backrefs_find(ndl_backrefs *set, ndl_ref ref) {
+
+    if (set->cap == NDL_BACKREFS_HASHED)
+        return ndl_rhashtable_get(set->table, &ref);
+
+    if (set->cap == 0)
+        return ((set->size > 0) && (set->one.ref == ref))? &set->one.count : NULL;
+
+    uint64_t i;
+    for (i = 0; i < set->size; i++)
+        if (set->list[i].ref == ref)
+            return &set->list[i].count;
+
+    return NULL;
+}
+
+/* Move a full array into a table. */
+static int ndl_backrefs_to_table(ndl_backrefs *set, ndl_arena *arena) {
+
+    ndl_rhashtable *table = ndl_backrefs_table_init(arena);
+    if (table == NULL)
+        return -1;
+
+    uint64_t i;
+    for (i = 0; i < set->size; i++) {
+        if (ndl_rhashtable_put(table, &set->list[i].ref, &set->list[i].count) == NULL) {
+            ndl_backrefs_table_kill(arena, table);
+            return -1;
+        }
+    }
+
+    ndl_backrefs_free(arena, set->list, set->cap);
+
+    set->table = table;
+    set->cap = NDL_BACKREFS_HASHED;
+
+    return 0;
+}
+
+/* Move a shrunken table back into an array. Failing is harmless. */
+static void ndl_backrefs_to_list(ndl_backrefs *set, ndl_arena *arena) {
+
+    ndl_backref *list = ndl_backrefs_alloc(arena, NDL_BACKREFS_LIST_MAX / 2);
+    if (list == NULL)
+        return;
+
+    uint64_t i = 0;
+    void *curr = ndl_rhashtable_pairs_head(set->table);
+    while (curr != NULL) {
+
+        list[i].ref = *(ndl_ref *) ndl_rhashtable_pairs_key(set->table, curr);
+        list[i].count = *(uint64_t *) ndl_rhashtable_pairs_val(set->table, curr);
+        i++;
+
+        curr = ndl_rhashtable_pairs_next(set->table, curr);
+    }
+
+    ndl_backrefs_table_kill(arena, set->table);
+
+    set->list = list;
+    set->cap = NDL_BACKREFS_LIST_MAX / 2;
+}
+
+/* Add a source not yet in the set. */
+static int ndl_backrefs_insert(ndl_backrefs *set, ndl_arena *arena, ndl_ref ref, uint64_t count) {
+
+    if (set->cap == 0) {
+
+        if (set->size == 0) {
+            set->one.ref = ref;
+            set->one.count = count;
+            set->size = 1;
+            return 0;
+        }
+
+        ndl_backref *list = ndl_backrefs_alloc(arena, 4);
+        if (list == NULL)
+            return -1;
+
+        list[0] = set->one;
+        set->list = list;
+        set->cap = 4;
+
+    } else if (set->size == set->cap) {
+
+        if (set->cap >= NDL_BACKREFS_LIST_MAX) {
+            if (ndl_backrefs_to_table(set, arena) != 0)
+                return -1;
+        } else {
+            ndl_backref *list = ndl_backrefs_realloc(arena, set->list, set->cap, 2 * set->cap);
+            if (list == NULL)
+                return -1;
+
+            set->list = list;
+            set->cap *= 2;
+        }
+    }
+
+    if (set->cap == NDL_BACKREFS_HASHED) {
+        if (ndl_rhashtable_put(set->table, &ref, &count) == NULL)
+            return -1;
+    } else {
+        set->list[set->size].ref = ref;
+        set->list[set->size].count = count;
+    }
+
+    set->size++;
+
+    return 0;
+}
+
+/* Drop a source in the set. */
+static void ndl_backrefs_remove(ndl_backrefs *set, ndl_arena *arena, ndl_ref ref, uint64_t *count) {
+
+    set->size--;
+
+    if (set->cap == 0)
+        return;
+
+    if (set->cap == NDL_BACKREFS_HASHED) {
+        ndl_rhashtable_del(set->table, &ref);
+        if (set->size <= NDL_BACKREFS_LIST_MAX / 4)
+            ndl_backrefs_to_list(set, arena);
+        return;
+    }
+
+    /* Order doesn't matter; move the last entry into the gap. */
+    ndl_backref *pair = (ndl_backref *) ((uint8_t *) count - offsetof(ndl_backref, count));
+    *pair = set->list[set->size];
+
+    if (set->size == 0) {
+        ndl_backrefs_free(arena, set->list, set->cap);
+        set->cap = 0;
+    }
+}
+
+int ndl_backrefs_add(ndl_backrefs *set, ndl_arena *arena, ndl_ref ref) {
+
+    uint64_t *count = ndl_backrefs_find(set, ref);
+    if (count != NULL) {
+        (*count)++;
+        return 0;
+    }
+
+    return ndl_backrefs_insert(set, arena, ref, 1);
+}
+
+int ndl_backrefs_rm(ndl_backrefs *set, ndl_arena *arena, ndl_ref ref) {
+
+    uint64_t *count = ndl_backrefs_find(set, ref);
+    if (count == NULL)
+        return -1;
+
+    if (--(*count) == 0)
+        ndl_backrefs_remove(set, arena, ref, count);
+
+    return 0;
+}
+
+int ndl_backrefs_put(ndl_backrefs *set, ndl_arena *arena, ndl_ref ref, uint64_t count) {
+
+    uint64_t *curr = ndl_backrefs_find(set, ref);
+
+    if (count == 0) {
+        if (curr != NULL)
+            ndl_backrefs_remove(set, arena, ref, curr);
+        return 0;
+    }
+
+    if (curr != NULL) {
+        *curr = count;
+        return 0;
+    }
+
+    return ndl_backrefs_insert(set, arena, ref, count);
+}
+
+uint64_t ndl_backrefs_count(ndl_backrefs *set, ndl_ref ref) {
+
+    uint64_t *count = ndl_backrefs_find(set, ref);
+
+    return (count != NULL)? *count : 0;
+}
+
+uint64_t ndl_backrefs_size(ndl_backrefs *set) {
+
+    return set->size;
+}
+
+/* Inline and array iterators point at the ndl_backref. */
+void *ndl_backrefs_head(ndl_backrefs *set) {
+
+    if (set->cap == NDL_BACKREFS_HASHED)
+        return ndl_rhashtable_pairs_head(set->table);
+
+    if (set->size == 0)
+        return NULL;
+
+    return (set->cap == 0)? &set->one : &set->list[0];
+}
+
+void *ndl_backrefs_next(ndl_backrefs *set, void *prev) {
+
+    if (prev == NULL)
+        return NULL;
+
+    if (set->cap == NDL_BACKREFS_HASHED)
+        return ndl_rhashtable_pairs_next(set->table, prev);
+
+    if (set->cap == 0)
+        return NULL;
+
+    uint64_t index = (uint64_t) ((ndl_backref *) prev - set->list) + 1;
+
+    return (index < set->size)? &set->list[index] : NULL;
+}
+
+ndl_ref ndl_backrefs_ref(ndl_backrefs *set, void *curr) {
+
+    if (curr == NULL)
+        return NDL_NULL_REF;
+
+    if (set->cap == NDL_BACKREFS_HASHED)
+        return *(ndl_ref *) ndl_rhashtable_pairs_key(set->table, curr);
+
+    return ((ndl_backref *) curr)->ref;
+}
+
+uint64_t ndl_backrefs_refs(ndl_backrefs *set, void *curr) {
+
+    if (curr == NULL)
+        return 0;
+
+    if (set->cap == NDL_BACKREFS_HASHED)
+        return *(uint64_t *) ndl_rhashtable_pairs_val(set->table, curr);
+
+    return ((ndl_backref *) curr)->count;
+}
@@ -0,0 +1,96 @@
+#ifndef NODEL_BACKREFS_H
+#define NODEL_BACKREFS_H
+
+#include "node.h"
+#include "arena.h"
+#include "rehashtable.h"
+
+/* Multiset of source nodes referencing a node, with a count per source.
+ * The representation follows the number of distinct sources:
+ * a single source is stored inline (no allocation, the common case),
+ * a few are kept in a small unsorted array and scanned linearly,
+ * and high fan-in sets (hub nodes) move to an rhashtable, keeping
+ * operations O(1). Hashed sets drop back to an array once they shrink
+ * to a quarter of NDL_BACKREFS_LIST_MAX, so churn near the limit
+ * doesn't thrash.
+ *
+ * cap is 0 for the inline form, NDL_BACKREFS_HASHED for a table,
+ * and otherwise the array's capacity.
+ *
+ * Arrays and tables come from the arena passed to each call that may
+ * (re)allocate or free one, or from malloc if it's NULL. A set must be passed the
+ * same arena throughout; init() and kill() sets use malloc.
+ */
+#define NDL_BACKREFS_LIST_MAX 32
+#define NDL_BACKREFS_HASHED UINT64_MAX
+
+typedef struct ndl_backref_s {
+
+    ndl_ref ref;
+    uint64_t count;
+
+} ndl_backref;
+
+typedef struct ndl_backrefs_s {
+
+    uint64_t size, cap;
+
+    union {
+        ndl_backref one;
+        ndl_backref *list;
+        ndl_rhashtable *table;
+    };
+
+} ndl_backrefs;
+
+/* Create and destroy backref sets.
+ *
+ * init() allocates and initializes an empty set.
+ * kill() frees a set.
+ *
+ * minit() initializes an empty set in the given region. Never allocates.
+ * mkill() frees a set's resources, but not its region.
+ * msize() gets the size needed to store a set.
+ */
+ndl_backrefs *ndl_backrefs_init(void);
+void          ndl_backrefs_kill(ndl_backrefs *set);
+
+ndl_backrefs *ndl_backrefs_minit(void *region);
+void          ndl_backrefs_mkill(ndl_backrefs *set, ndl_arena *arena);
+uint64_t      ndl_backrefs_msize(void);
+
+/* Count references.
+ *
+ * add() adds one reference from ref.
+ *     Returns nonzero on error.
+ * rm() removes one reference from ref, dropping ref at zero.
+ *     Returns nonzero on error, or if ref isn't present.
+ * put() sets the number of references from ref. Zero drops ref.
+ *     Returns nonzero on error.
+ *
+ * count() gets the number of references from ref, or 0.
+ * size() gets the number of distinct sources.
+ */
+int ndl_backrefs_add(ndl_backrefs *set, ndl_arena *arena, ndl_ref ref);
+int ndl_backrefs_rm (ndl_backrefs *set, ndl_arena *arena, ndl_ref ref);
+int ndl_backrefs_put(ndl_backrefs *set, ndl_arena *arena, ndl_ref ref, uint64_t count);
+
+uint64_t ndl_backrefs_count(ndl_backrefs *set, ndl_ref ref);
+uint64_t ndl_backrefs_size (ndl_backrefs *set);
+
+/* Iterate over sources, in no particular order.
+ * Iterators __INVALIDATED__ by mutating operations.
+ *
+ * head() gets the first iterator. NULL on error or empty set.
+ * next() gets the next iterator. NULL on error or end of set.
+ *
+ * ref() gets the source at the iterator. NDL_NULL_REF on error.
+ * refs() gets the source's reference count at the iterator. 0 on error.
+ */
+void *ndl_backrefs_head(ndl_backrefs *set);
+void *ndl_backrefs_next(ndl_backrefs *set, void *prev);
+
+ndl_ref  ndl_backrefs_ref (ndl_backrefs *set, void *curr);
+uint64_t ndl_backrefs_refs(ndl_backrefs *set, void *curr);
+
+#endif /* NODEL_BACKREFS_H */
@@ -156,18 +156,18 @@ ndl_eval_result ndl_eval(ndl_graph *graph, ndl_ref local) {
     err.action = EACTION_FAIL;
 
     ndl_value pc = ndl_graph_get(graph, local, NDL_SYM("instpntr"));
-    if (pc.type != EVAL_REF || pc.ref == NDL_NULL_REF)
+    if (NDL_VALUE_TYPE(pc) != EVAL_REF || NDL_VALUE_REF(pc) == NDL_NULL_REF)
         return err;  /* Bad local. Abort thread. */
 
-    ndl_value opcode = ndl_graph_get(graph, pc.ref, NDL_SYM("opcode  "));
-    if (opcode.type != EVAL_SYM)
+    ndl_value opcode = ndl_graph_get(graph, NDL_VALUE_REF(pc), NDL_SYM("opcode  "));
+    if (NDL_VALUE_TYPE(opcode) != EVAL_SYM)
         return err; /* Bad instruction. Abort thread. */
 
-    ndl_eval_func op = ndl_eval_opcode_lookup(opcode.sym);
+    ndl_eval_func op = ndl_eval_opcode_lookup(NDL_VALUE_SYM(opcode));
     if (op == NULL)
         return err; /* Bad instruction. Abort thread. */
 
-    return op(graph, local, pc.ref);
+    return op(graph, local, NDL_VALUE_REF(pc));
 }
 
 ndl_eval_func ndl_eval_opcode_lookup(ndl_sym opcode) {
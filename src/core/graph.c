@@ -2,419 +2,2426 @@
 #include "nodepool.h"
 #include "ndlendian.h"
 #include "rehashtable.h"
+#include "vector.h"
 
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Serialization format, version 2.
+ * Columnar, native endian, with nodes in id order: a header, then an
+ * array per field. Saving and loading are straight passes over the
+ * pool, and a node's pairs are found by index, not by parsing all that
+ * comes before them.
+ *
+ * Header:
+ *   char magic[8]       NDL_GRAPH_MAGIC
+ *   uint32_t version    NDL_GRAPH_VERSION
+ *   uint32_t order      NDL_GRAPH_ORDER, in the writer's byte order
+ *   uint64_t size       Bytes, header included
+ *   uint64_t checksum   Over every column word: numbers read in the
+ *                       writer's order, types' words as big endian
+ *   uint64_t nodes, pairs, backrefs
+ *
+ * Columns, as uint64_t:
+ *   ids[nodes]          Ascending
+ *   marks[nodes]        -1 for roots, 0 otherwise
+ *   pair_ends[nodes]    Index past each node's last pair; its first is
+ *                       the previous node's end
+ *   backref_ends[nodes] Same, for backrefs
+ *   keys[pairs], words[pairs]
+ *   types[pairs]        As uint8_t, zero padded to a whole word
+ *   backrefs[backrefs]  Source and count, two words each
+ *
+ * Backrefs go last: the pool counts its pairs, but not its backrefs,
+ * so the writer finds out how many there are as it goes.
+ * Marks keep only whether a node is a root: other marks count the
+ * saving graph's collections, and mean nothing to the loading one's.
+ * Readers swap each number if order reads byte swapped.
+ * Version 1 files, which have no header, still load; see below.
+ */
+
+#define NDL_GRAPH_MAGIC   "\x89NDL\r\n\x1a\n"
+#define NDL_GRAPH_VERSION 2
+#define NDL_GRAPH_ORDER   0x01020304
+
+typedef struct ndl_graph_image_s {
+
+    char magic[8];
+    uint32_t version, order;
+
+    uint64_t size, checksum;
+    uint64_t nodes, pairs, backrefs;
+
+} ndl_graph_image;
+
+/* Column words following the header. */
+static inline uint64_t ndl_graph_image_words(uint64_t nodes, uint64_t pairs, uint64_t backrefs) {
+
+    return 4 * nodes + 2 * pairs + 2 * backrefs + (pairs + 7) / 8;
+}
+
+static inline uint64_t ndl_graph_image_word(uint64_t word, int swap) {
+
+    return swap? ENDIAN_SWAP_64(word) : word;
+}
+
+/* An image's columns, as parse() finds them. Graphs opened with
+ * open_mmap() keep theirs, with a bit per node set once it's faulted
+ * into the pool, until every node has been. scratch holds a node's
+ * pairs on the way in.
+ */
+struct ndl_graph_mapped_s {
+
+    void *base;
+    uint64_t len;
+
+    int swap;
+    uint64_t nodes, pairs, backrefs;
+
+    uint64_t *ids, *marks, *pair_ends, *backref_ends;
+    uint64_t *keys, *vals, *brefs;
+    uint8_t *types;
+
+    uint64_t *faulted, left;
+
+    ndl_node_pool_pair *scratch;
+    uint64_t cap;
+};
+
+/* Find an image's columns, and check they hold together: ids ascending,
+ * ends in order and in range, types known. Reads those columns alone,
+ * leaving the checksum to the caller. Nonzero if the image is damaged.
+ */
+static int ndl_graph_mapped_parse(ndl_graph_mapped *image, uint64_t maxlen, void *mem) {
+
+    ndl_graph_image *header = (ndl_graph_image *) mem;
+    if ((maxlen < sizeof(ndl_graph_image)) ||
+        (memcmp(header->magic, NDL_GRAPH_MAGIC, sizeof(header->magic)) != 0))
+        return -1;
+
+    int swap;
+    if (header->order == NDL_GRAPH_ORDER)
+        swap = 0;
+    else if (header->order == ENDIAN_SWAP_32((uint32_t) NDL_GRAPH_ORDER))
+        swap = 1;
+    else
+        return -1;
+
+    uint32_t version = swap? ENDIAN_SWAP_32(header->version) : header->version;
+
+    uint64_t size = ndl_graph_image_word(header->size, swap);
+    uint64_t nodes = ndl_graph_image_word(header->nodes, swap);
+    uint64_t pairs = ndl_graph_image_word(header->pairs, swap);
+    uint64_t backrefs = ndl_graph_image_word(header->backrefs, swap);
+
+    /* Counts past size / 8 can't fit, and could overflow the sum. */
+    if ((version != NDL_GRAPH_VERSION) || (size > maxlen) || (size < sizeof(ndl_graph_image)) ||
+        (nodes > size / 8) || (pairs > size / 8) || (backrefs > size / 8) ||
+        (size - sizeof(ndl_graph_image) != sizeof(uint64_t) * ndl_graph_image_words(nodes, pairs, backrefs)))
+        return -1;
+
+    image->base = NULL;
+    image->len = 0;
+
+    image->swap = swap;
+    image->nodes = nodes;
+    image->pairs = pairs;
+    image->backrefs = backrefs;
+
+    image->ids = (uint64_t *) (header + 1);
+    image->marks = image->ids + nodes;
+    image->pair_ends = image->marks + nodes;
+    image->backref_ends = image->pair_ends + nodes;
+    image->keys = image->backref_ends + nodes;
+    image->vals = image->keys + pairs;
+    image->types = (uint8_t *) (image->vals + pairs);
+    image->brefs = image->vals + pairs + (pairs + 7) / 8;
+
+    image->faulted = NULL;
+    image->left = nodes;
+
+    image->scratch = NULL;
+    image->cap = 0;
+
+    uint64_t i, pair = 0, backref = 0;
+    ndl_ref last = 0;
+    for (i = 0; i < nodes; i++) {
+
+        ndl_ref id = (ndl_ref) ndl_graph_image_word(image->ids[i], swap);
+        uint64_t pair_end = ndl_graph_image_word(image->pair_ends[i], swap);
+        uint64_t backref_end = ndl_graph_image_word(image->backref_ends[i], swap);
+
+        if ((id <= last) || (id >= NDL_NODE_POOL_MAX_ID) || (pair_end < pair) || (backref_end < backref))
+            return -1;
+
+        last = id;
+        pair = pair_end;
+        backref = backref_end;
+    }
+
+    if ((pair != pairs) || (backref != backrefs))
+        return -1;
+
+    for (i = 0; i < pairs; i++)
+        if (image->types[i] >= EVAL_SIZE)
+            return -1;
+
+    return 0;
+}
+
+/* Where node i's pairs and backrefs start. */
+static inline uint64_t ndl_graph_mapped_pairs(ndl_graph_mapped *image, uint64_t i) {
+
+    return (i == 0)? 0 : ndl_graph_image_word(image->pair_ends[i - 1], image->swap);
+}
+
+static inline uint64_t ndl_graph_mapped_backrefs(ndl_graph_mapped *image, uint64_t i) {
+
+    return (i == 0)? 0 : ndl_graph_image_word(image->backref_ends[i - 1], image->swap);
+}
+
+/* Index of a node that's still only in the image, or image->nodes. */
+static inline uint64_t ndl_graph_mapped_find(ndl_graph_mapped *image, ndl_ref node) {
+
+    uint64_t lo = 0, hi = image->nodes;
+
+    /* Ids are usually dense; look where it'd be if they are. */
+    ndl_ref first = (ndl_ref) ndl_graph_image_word(image->ids[0], image->swap);
+    uint64_t guess = (uint64_t) (node - first);
+
+    if ((node >= first) && (guess < hi) &&
+        ((ndl_ref) ndl_graph_image_word(image->ids[guess], image->swap) == node)) {
+        lo = guess;
+    } else {
+        while (lo < hi) {
+            uint64_t mid = lo + (hi - lo) / 2;
+            if ((ndl_ref) ndl_graph_image_word(image->ids[mid], image->swap) < node)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        if ((lo == image->nodes) || ((ndl_ref) ndl_graph_image_word(image->ids[lo], image->swap) != node))
+            return image->nodes;
+    }
+
+    if ((image->faulted != NULL) && (image->faulted[lo / 64] & ((uint64_t) 1 << (lo % 64))))
+        return image->nodes;
+
+    return lo;
+}
+
+/* Key's value in node i, straight from the image. */
+static ndl_value ndl_graph_mapped_get(ndl_graph_mapped *image, uint64_t i, ndl_sym key) {
+
+    uint64_t pair = ndl_graph_mapped_pairs(image, i);
+    uint64_t end = ndl_graph_image_word(image->pair_ends[i], image->swap);
+
+    for (; pair < end; pair++)
+        if (ndl_graph_image_word(image->keys[pair], image->swap) == key)
+            return NDL_VALUE(image->types[pair], num=(ndl_int) ndl_graph_image_word(image->vals[pair], image->swap));
+
+    return NDL_VALUE(EVAL_NONE, ref=NDL_NULL_REF);
+}
+
+/* Put node i in the pool: its mark, its pairs in one fill(), and its
+ * backrefs. Nonzero on error, leaving the pool without it.
+ */
+static int ndl_graph_mapped_load(ndl_node_pool *pool, ndl_graph_mapped *image, uint64_t i) {
+
+    ndl_arena *arena = ndl_node_pool_arena(pool);
+    if (arena == NULL)
+        return -1;
+
+    ndl_ref node = ndl_node_pool_alloc_pref(pool, (ndl_ref) ndl_graph_image_word(image->ids[i], image->swap));
+    if (node == NDL_NULL_REF)
+        return -1;
+
+    ndl_node_pool_header *header = ndl_node_pool_node_header(pool, node);
+    header->mark = (ndl_graph_image_word(image->marks[i], image->swap) == (uint64_t) -1)? -1 : 0;
+
+    uint64_t pair = ndl_graph_mapped_pairs(image, i);
+    uint64_t count = ndl_graph_image_word(image->pair_ends[i], image->swap) - pair;
+
+    if (count > image->cap) {
+        ndl_node_pool_pair *grown = realloc(image->scratch, count * sizeof(ndl_node_pool_pair));
+        if (grown == NULL) {
+            ndl_node_pool_free(pool, node);
+            return -1;
+        }
+        image->scratch = grown;
+        image->cap = count;
+    }
+
+    uint64_t j;
+    for (j = 0; j < count; j++, pair++) {
+        image->scratch[j].key = ndl_graph_image_word(image->keys[pair], image->swap);
+        image->scratch[j].val = NDL_VALUE(image->types[pair],
+                                          num=(ndl_int) ndl_graph_image_word(image->vals[pair], image->swap));
+    }
+
+    if (ndl_node_pool_fill(pool, node, count, image->scratch) != 0) {
+        ndl_node_pool_free(pool, node);
+        return -1;
+    }
+
+    /* fill() doesn't move the header. */
+    uint64_t backref = ndl_graph_mapped_backrefs(image, i);
+    uint64_t end = ndl_graph_image_word(image->backref_ends[i], image->swap);
+
+    for (; backref < end; backref++) {
+        if (ndl_backrefs_put(&header->backrefs, arena,
+                             (ndl_ref) ndl_graph_image_word(image->brefs[2 * backref], image->swap),
+                             ndl_graph_image_word(image->brefs[2 * backref + 1], image->swap)) != 0) {
+            ndl_node_pool_free(pool, node);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Drop a graph's mapping, once every node is in the pool, or the graph's gone. */
+static void ndl_graph_unmap(ndl_graph *graph) {
+
+    ndl_graph_mapped *image = graph->mapped;
+    if (image == NULL)
+        return;
+
+    munmap(image->base, image->len);
+    free(image->faulted);
+    free(image->scratch);
+    free(image);
+
+    graph->mapped = NULL;
+
+    /* New nodes may take any free id again. */
+    ndl_node_pool_set_counter((ndl_node_pool *) graph->pool, 1);
+}
+
+/* Drop any incremental collection in progress. Marks it left are
+ * older than the next sweep, so they're harmless.
+ */
+static void ndl_graph_clean_drop(ndl_graph *graph) {
+
+    graph->phase = NDL_GRAPH_IDLE;
+
+    if (ndl_vector_size(&graph->grey) > 0)
+        ndl_vector_delete_range(&graph->grey, 0, ndl_vector_size(&graph->grey));
+}
+
+/* Queue a node to be scanned during the mark phase. */
+static void ndl_graph_clean_grey(ndl_graph *graph, ndl_ref node) {
+
+    if (graph->phase != NDL_GRAPH_MARK)
+        return;
+
+    if (ndl_vector_push(&graph->grey, &node) == NULL)
+        ndl_graph_clean_drop(graph);
+}
+
+/* Shade a white node, so the running collection keeps it. */
+static void ndl_graph_clean_shade(ndl_graph *graph, ndl_ref node) {
+
+    if (graph->phase == NDL_GRAPH_IDLE)
+        return;
+
+    ndl_node_pool *pool = (ndl_node_pool *) graph->pool;
+
+    ndl_node_pool_header *header = ndl_node_pool_node_peek(pool, node);
+    if ((header == NULL) || (header->mark == -1) || (header->mark >= graph->sweep))
+        return;
+
+    ndl_node_pool_node_header(pool, node)->mark = graph->sweep;
+    ndl_graph_clean_grey(graph, node);
+}
+
+/* Fault node i of a mapped graph into the pool. A collection running
+ * took it as reached while it was in the image, so it's shaded.
+ */
+static int ndl_graph_fault_index(ndl_graph *graph, uint64_t i) {
+
+    ndl_graph_mapped *image = graph->mapped;
+
+    if (ndl_graph_mapped_load((ndl_node_pool *) graph->pool, image, i) != 0)
+        return -1;
+
+    image->faulted[i / 64] |= (uint64_t) 1 << (i % 64);
+
+    ndl_graph_clean_shade(graph, (ndl_ref) ndl_graph_image_word(image->ids[i], image->swap));
+
+    if (--image->left == 0)
+        ndl_graph_unmap(graph);
+
+    return 0;
+}
+
+/* Fault a node that's only in the image into the pool, before it's
+ * changed, its backrefs are, or anything wants its header.
+ * Nonzero on error; nodes that aren't mapped are left be.
+ */
+static int ndl_graph_fault(ndl_graph *graph, ndl_ref node) {
+
+    if (graph->mapped == NULL)
+        return 0;
+
+    uint64_t i = ndl_graph_mapped_find(graph->mapped, node);
+    if (i == graph->mapped->nodes)
+        return 0;
+
+    return ndl_graph_fault_index(graph, i);
+}
+
+/* The same, for the node a value references, if any. */
+static int ndl_graph_fault_value(ndl_graph *graph, ndl_value value) {
+
+    if ((graph->mapped == NULL) || (NDL_VALUE_TYPE(value) != EVAL_REF))
+        return 0;
+
+    return ndl_graph_fault(graph, NDL_VALUE_REF(value));
+}
+
+/* Whether a node is referenced by one still only in the image.
+ * Adds the backrefs looked at to *work.
+ */
+static int ndl_graph_mapped_refers(ndl_graph *graph, ndl_ref node, uint64_t *work) {
+
+    ndl_graph_mapped *image = graph->mapped;
+    if (image == NULL)
+        return 0;
+
+    ndl_node_pool_header *header = ndl_node_pool_node_peek((ndl_node_pool *) graph->pool, node);
+
+    void *curr = ndl_backrefs_head(&header->backrefs);
+    while (curr != NULL) {
+
+        (*work)++;
+        if (ndl_graph_mapped_find(image, ndl_backrefs_ref(&header->backrefs, curr)) < image->nodes)
+            return 1;
+
+        curr = ndl_backrefs_next(&header->backrefs, curr);
+    }
+
+    return 0;
+}
+
+/* Fault in every node left, for whatever walks the whole pool. */
+static int ndl_graph_fault_all(ndl_graph *graph) {
+
+    ndl_graph_mapped *image = graph->mapped;
+    if (image == NULL)
+        return 0;
+
+    uint64_t i;
+    for (i = 0; graph->mapped != NULL; i++) {
+        if (image->faulted[i / 64] & ((uint64_t) 1 << (i % 64)))
+            continue;
+        if (ndl_graph_fault_index(graph, i) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
 ndl_graph *ndl_graph_init(void) {
 
-    void *region = malloc(ndl_graph_msize());
-    if (region == NULL)
-        return NULL;
+    void *region = malloc(ndl_graph_msize());
+    if (region == NULL)
+        return NULL;
+
+    ndl_graph *ret = ndl_graph_minit(region);
+    if (ret == NULL)
+        free(region);
+
+    return ret;
+}
+
+void ndl_graph_kill(ndl_graph *graph) {
+
+    ndl_graph_mkill(graph);
+
+    free(graph);
+
+    return;
+}
+
+ndl_graph *ndl_graph_minit(void *region) {
+
+    ndl_graph *ret = (ndl_graph*) region;
+
+    ndl_node_pool *pool = ndl_node_pool_minit((void *) ret->pool);
+
+    if (pool == NULL)
+        return NULL;
+
+    ret->sweep = 0;
+    ret->threads = 1;
+
+    ret->roots = NULL;
+    ret->roots_data = NULL;
+
+    ret->phase = NDL_GRAPH_IDLE;
+    ret->cursor = 0;
+    ndl_vector_minit(&ret->grey, sizeof(ndl_ref));
+
+    ndl_vector_minit(&ret->young, sizeof(ndl_ref));
+    ndl_vector_minit(&ret->remembered, sizeof(ndl_ref));
+    ret->overflow = 0;
+
+    ret->refcount = 0;
+    ndl_vector_minit(&ret->pending, sizeof(ndl_ref));
+    ndl_vector_minit(&ret->suspects, sizeof(ndl_ref));
+
+    ret->mapped = NULL;
+
+    return ret;
+}
+
+void ndl_graph_mkill(ndl_graph *graph) {
+
+    ndl_graph_unmap(graph);
+
+    ndl_vector_mkill(&graph->grey);
+    ndl_vector_mkill(&graph->young);
+    ndl_vector_mkill(&graph->remembered);
+    ndl_vector_mkill(&graph->pending);
+    ndl_vector_mkill(&graph->suspects);
+    ndl_node_pool_mkill((ndl_node_pool *) graph->pool);
+
+    return;
+}
+
+uint64_t ndl_graph_msize(void) {
+
+    return sizeof(ndl_graph) + ndl_node_pool_msize();
+}
+
+ndl_graph *ndl_graph_snapshot(ndl_graph *graph) {
+
+    if (ndl_graph_fault_all(graph) != 0)
+        return NULL;
+
+    ndl_graph *ret = ndl_graph_init();
+    if (ret == NULL)
+        return NULL;
+
+    ndl_node_pool_mkill((ndl_node_pool *) ret->pool);
+    ndl_node_pool_snapshot((void *) ret->pool, (ndl_node_pool *) graph->pool);
+
+    return ret;
+}
+
+int ndl_graph_readonly(ndl_graph *graph) {
+
+    return ndl_node_pool_readonly((ndl_node_pool *) graph->pool);
+}
+
+/* Backreferences: node.backrefs[src] counts the src.key values referencing node. */
+static int ndl_graph_put_backref(ndl_node_pool *pool, ndl_ref node, ndl_ref src, uint64_t count) {
+
+    ndl_arena *arena = ndl_node_pool_arena(pool);
+    ndl_node_pool_header *header = ndl_node_pool_node_header(pool, node);
+    if ((arena == NULL) || (header == NULL))
+        return -1;
+
+    return ndl_backrefs_put(&header->backrefs, arena, src, count);
+}
+
+static int ndl_graph_add_backref(ndl_node_pool *pool, ndl_ref from, ndl_ref to) {
+
+    if (from == NDL_NULL_REF)
+        return 0;
+
+    ndl_arena *arena = ndl_node_pool_arena(pool);
+    ndl_node_pool_header *header = ndl_node_pool_node_header(pool, from);
+    if ((arena == NULL) || (header == NULL))
+        return -1;
+
+    return ndl_backrefs_add(&header->backrefs, arena, to);
+}
+
+static int ndl_graph_rm_backref(ndl_node_pool *pool, ndl_ref from, ndl_ref to) {
+
+    if (from == NDL_NULL_REF)
+        return 0;
+
+    ndl_node_pool_header *header = ndl_node_pool_node_header(pool, from);
+    if (header == NULL)
+        return 0;
+
+    ndl_backrefs_rm(&header->backrefs, ndl_node_pool_arena(pool), to);
+
+    return 0;
+}
+
+/* Take in a mark from a saved graph. Marks count this graph's
+ * collections, so start the next one past any loaded, or the nodes
+ * it marked would already look reached.
+ */
+static inline void ndl_graph_clean_adopt(ndl_graph *graph, int64_t mark) {
+
+    if (mark > graph->sweep)
+        graph->sweep = mark;
+}
+
+/* Generations. Young nodes are listed in graph->young, and flagged
+ * YOUNG; old nodes with references to young nodes are listed in
+ * graph->remembered, and flagged REMEMBERED. Freed nodes aren't taken
+ * off either list: entries count only while their flag is set, and
+ * duplicates left by reused ids are dropped by the next minor collection.
+ */
+#define NDL_GRAPH_YOUNG      1
+#define NDL_GRAPH_REMEMBERED 2
+#define NDL_GRAPH_SUSPECT    4
+
+static void ndl_graph_young_add(ndl_graph *graph, ndl_ref node) {
+
+    if (ndl_vector_push(&graph->young, &node) != NULL)
+        ndl_node_pool_node_header((ndl_node_pool *) graph->pool, node)->flags |= NDL_GRAPH_YOUNG;
+}
+
+/* Remember an old node, if it now references a young one.
+ * If the set can't grow, the next minor collection is a full one.
+ */
+static void ndl_graph_remember(ndl_graph *graph, ndl_ref node, ndl_ref target) {
+
+    ndl_node_pool *pool = (ndl_node_pool *) graph->pool;
+
+    ndl_node_pool_header *to = ndl_node_pool_node_header(pool, target);
+    if ((to == NULL) || !(to->flags & NDL_GRAPH_YOUNG))
+        return;
+
+    ndl_node_pool_header *from = ndl_node_pool_node_header(pool, node);
+    if ((from == NULL) || (from->flags & (NDL_GRAPH_YOUNG | NDL_GRAPH_REMEMBERED)))
+        return;
+
+    if (ndl_vector_push(&graph->remembered, &node) == NULL)
+        graph->overflow = 1;
+    else
+        from->flags |= NDL_GRAPH_REMEMBERED;
+}
+
+/* Make every node old. Always safe: with no young nodes, there are
+ * no references from old to young ones to remember.
+ */
+static void ndl_graph_tenure(ndl_graph *graph) {
+
+    ndl_node_pool *pool = (ndl_node_pool *) graph->pool;
+    ndl_vector *lists[2] = {&graph->young, &graph->remembered};
+
+    uint64_t i, j;
+    for (i = 0; i < 2; i++) {
+        for (j = 0; j < ndl_vector_size(lists[i]); j++) {
+            ndl_node_pool_header *header =
+                ndl_node_pool_node_header(pool, *(ndl_ref *) ndl_vector_get(lists[i], j));
+            if (header != NULL)
+                header->flags &= (uint32_t) ~(NDL_GRAPH_YOUNG | NDL_GRAPH_REMEMBERED);
+        }
+
+        if (ndl_vector_size(lists[i]) > 0)
+            ndl_vector_delete_range(lists[i], 0, ndl_vector_size(lists[i]));
+    }
+
+    graph->overflow = 0;
+}
+
+/* Reference counting. Nodes left without backrefs wait in
+ * graph->pending, and are checked again when they're freed, in case
+ * they've been referenced since. Nodes that lose a reference and live
+ * are flagged SUSPECT and listed in graph->suspects, like the
+ * remembered set.
+ */
+static void ndl_graph_release(ndl_graph *graph, ndl_ref node) {
+
+    if (!graph->refcount)
+        return;
+
+    ndl_node_pool_header *header = ndl_node_pool_node_header((ndl_node_pool *) graph->pool, node);
+    if ((header == NULL) || (header->mark == -1))
+        return;
+
+    if (ndl_backrefs_size(&header->backrefs) == 0) {
+        ndl_vector_push(&graph->pending, &node);
+        return;
+    }
+
+    if (!(header->flags & NDL_GRAPH_SUSPECT) && (ndl_vector_push(&graph->suspects, &node) != NULL))
+        header->flags |= NDL_GRAPH_SUSPECT;
+}
+
+/* Free up to budget pending nodes, queueing what they leave unreferenced. */
+static void ndl_graph_release_drain(ndl_graph *graph, uint64_t budget) {
+
+    ndl_node_pool *pool = (ndl_node_pool *) graph->pool;
+
+    uint64_t freed = 0;
+    while ((freed < budget) && (ndl_vector_size(&graph->pending) > 0)) {
+
+        ndl_ref node = *(ndl_ref *) ndl_vector_get(&graph->pending, ndl_vector_size(&graph->pending) - 1);
+        ndl_vector_pop(&graph->pending);
+
+        ndl_node_pool_header *header = ndl_node_pool_node_header(pool, node);
+        if ((header == NULL) || (header->mark == -1) || (ndl_backrefs_size(&header->backrefs) > 0))
+            continue;
+
+        void *curr = ndl_node_pool_node_pairs_head(pool, node);
+        while (curr != NULL) {
+
+            ndl_value val = ndl_node_pool_node_pairs_val(pool, node, curr);
+            if ((NDL_VALUE_TYPE(val) == EVAL_REF) && (NDL_VALUE_REF(val) != NDL_NULL_REF) && (NDL_VALUE_REF(val) != node)) {
+                ndl_graph_rm_backref(pool, NDL_VALUE_REF(val), node);
+                ndl_graph_release(graph, NDL_VALUE_REF(val));
+            }
+
+            curr = ndl_node_pool_node_pairs_next(pool, node, curr);
+        }
+
+        ndl_node_pool_free(pool, node);
+        freed++;
+    }
+}
+
+static void ndl_graph_clean_remove(ndl_graph *graph, ndl_ref node) {
+
+    ndl_node_pool *pool = (ndl_node_pool *) graph->pool;
+
+    /* Copy a page shared with a snapshot now, not under the iterator. */
+    ndl_node_pool_node_header(pool, node);
+
+    void *curr = ndl_node_pool_node_pairs_head(pool, node);
+
+    while (curr != NULL) {
+
+        /* A target still in the image has its backrefs there; fault it in
+         * to drop this one. Faulting doesn't touch this node's pairs.
+         */
+        ndl_value val = ndl_node_pool_node_pairs_val(pool, node, curr);
+        if ((NDL_VALUE_TYPE(val) == EVAL_REF) && (NDL_VALUE_REF(val) != NDL_NULL_REF)) {
+            ndl_graph_fault(graph, NDL_VALUE_REF(val));
+            ndl_graph_rm_backref(pool, NDL_VALUE_REF(val), node);
+        }
+
+        curr = ndl_node_pool_node_pairs_next(pool, node, curr);
+    }
+
+    ndl_node_pool_free(pool, node);
+}
+
+/* Lazy sweeping. clean() only marks, in the pool's live bits; the
+ * nodes it left unmarked are freed a few at a time by later allocs.
+ * They were unreachable when marked, so nothing can reach them since.
+ * The sweep's end hands the node arena's emptied spans back to the OS.
+ */
+int ndl_graph_clean_sweep(ndl_graph *graph, uint64_t budget) {
+
+    ndl_node_pool *pool = (ndl_node_pool *) graph->pool;
+
+    if (budget == 0)
+        budget = UINT64_MAX;
+
+    int sweeping = ndl_node_pool_sweeping(pool);
+
+    uint64_t freed;
+    for (freed = 0; freed < budget; freed++) {
+
+        ndl_ref node = ndl_node_pool_sweep_next(pool);
+        if (node == NDL_NULL_REF) {
+            if (sweeping)
+                ndl_node_pool_trim(pool);
+            return 1;
+        }
+
+        ndl_graph_clean_remove(graph, node);
+    }
+
+    return !ndl_node_pool_sweeping(pool);
+}
+
+/* Whether a node is waiting for the lazy sweep. */
+static inline int ndl_graph_clean_dead(ndl_graph *graph, ndl_ref node) {
+
+    ndl_node_pool *pool = (ndl_node_pool *) graph->pool;
+
+    return ndl_node_pool_sweeping(pool) && !ndl_node_pool_live(pool, node);
+}
+
+/* Node metadata (GC mark, backreferences) lives in the node pool's
+ * per-node header, never among a node's keys.
+ * The mark is -1 for root nodes, otherwise the last sweep to reach the node
+ * in a minor or incremental collection; clean() marks the pool's live bits.
+ */
+ndl_ref ndl_graph_alloc(ndl_graph *graph) {
+
+    ndl_node_pool *pool = (ndl_node_pool *) graph->pool;
+
+    ndl_graph_clean_sweep(graph, NDL_GRAPH_SWEEP_LAZY);
+
+    ndl_ref ret = ndl_node_pool_alloc(pool);
+
+    if (ret == NDL_NULL_REF)
+        return ret;
+
+    ndl_node_pool_node_header(pool, ret)->mark = -1;
+    ndl_graph_young_add(graph, ret);
+
+    return ret;
+}
+
+int ndl_graph_stat(ndl_graph *graph, ndl_ref node) {
+
+    if (graph->mapped != NULL) {
+        uint64_t i = ndl_graph_mapped_find(graph->mapped, node);
+        if (i < graph->mapped->nodes)
+            return (ndl_graph_image_word(graph->mapped->marks[i], graph->mapped->swap) == (uint64_t) -1)? 1 : 0;
+    }
+
+    ndl_node_pool_header *header = ndl_node_pool_node_peek((ndl_node_pool *) graph->pool, node);
+    if ((header == NULL) || ndl_graph_clean_dead(graph, node))
+        return -1;
+    else
+        return (header->mark == -1)? 1 : 0;
+}
+
+int ndl_graph_unmark(ndl_graph *graph, ndl_ref node) {
+
+    if (ndl_graph_fault(graph, node) != 0)
+        return -1;
+
+    ndl_node_pool_header *header = ndl_node_pool_node_header((ndl_node_pool *) graph->pool, node);
+    if (header == NULL)
+        return -1;
+
+    header->mark = 0;
+
+    /* It was a root when the collection started; keep it for this one. */
+    ndl_graph_clean_shade(graph, node);
+
+    ndl_graph_release(graph, node);
+    ndl_graph_release_drain(graph, NDL_GRAPH_RC_BUDGET);
+
+    return 0;
+}
+
+int ndl_graph_mark(ndl_graph *graph, ndl_ref node) {
+
+    if (ndl_graph_fault(graph, node) != 0)
+        return -1;
+
+    ndl_node_pool_header *header = ndl_node_pool_node_header((ndl_node_pool *) graph->pool, node);
+    if ((header == NULL) || ndl_graph_clean_dead(graph, node))
+        return -1;
+
+    /* The root pass may be past it; scan it now. */
+    if (header->mark != -1) {
+        header->mark = -1;
+        ndl_graph_clean_grey(graph, node);
+    }
+
+    return 0;
+}
+
+ndl_ref ndl_graph_salloc(ndl_graph *graph, ndl_ref base, ndl_sym key) {
+
+    ndl_graph_clean_sweep(graph, NDL_GRAPH_SWEEP_LAZY);
+
+    ndl_ref ret = ndl_node_pool_alloc((ndl_node_pool *) graph->pool);
+
+    if (ret == NDL_NULL_REF)
+        return ret;
+
+    ndl_graph_young_add(graph, ret);
+
+    int err = ndl_graph_set(graph, base, key, NDL_VALUE(EVAL_REF, ref=ret));
+
+    if (err != 0) {
+        ndl_node_pool_free((ndl_node_pool *) graph->pool, ret);
+        return NDL_NULL_REF;
+    }
+
+    return ret;
+}
+
+/* Push the external roots onto the mark stack. */
+static int ndl_graph_clean_roots(ndl_graph *graph, ndl_vector *stack) {
+
+    if (graph->roots == NULL)
+        return 0;
+
+    return graph->roots(graph->roots_data, stack);
+}
+
+/* Push the references held by a node onto the mark stack. */
+static int ndl_graph_clean_scan(ndl_node_pool *pool, ndl_ref node, ndl_vector *stack) {
+
+    void *curr = ndl_node_pool_node_pairs_head(pool, node);
+
+    while (curr != NULL) {
+
+        ndl_value next = ndl_node_pool_node_pairs_val(pool, node, curr);
+        ndl_ref target = NDL_VALUE_REF(next);
+        if ((NDL_VALUE_TYPE(next) == EVAL_REF) && (target != NDL_NULL_REF))
+            if (ndl_vector_push(stack, &target) == NULL)
+                return -1;
+
+        curr = ndl_node_pool_node_pairs_next(pool, node, curr);
+    }
+
+    return 0;
+}
+
+/* Nodes popped from the mark stack wait in a small FIFO, prefetched,
+ * so the cache misses of the next few nodes overlap with this one's scan.
+ */
+#define NDL_GRAPH_MARK_AHEAD 8
+
+/* Mark everything reachable from the stack. Full collections set live
+ * bits, and scan each node the first time its bit is set. Minor ones
+ * mark headers with the given sweep, leaving roots (scanned directly)
+ * alone, and don't mark or follow old nodes.
+ */
+static int ndl_graph_clean_mark(ndl_graph *graph, ndl_vector *stack, int64_t sweep, int minor) {
+
+    ndl_node_pool *pool = (ndl_node_pool *) graph->pool;
+
+    ndl_ref ahead[NDL_GRAPH_MARK_AHEAD];
+    uint64_t head = 0, count = 0;
+
+    while ((count > 0) || (ndl_vector_size(stack) > 0)) {
+
+        while ((count < NDL_GRAPH_MARK_AHEAD) && (ndl_vector_size(stack) > 0)) {
+
+            ndl_ref next = *(ndl_ref *) ndl_vector_get(stack, ndl_vector_size(stack) - 1);
+            ndl_vector_pop(stack);
+
+            ndl_node_pool_prefetch(pool, next);
+            ahead[(head + count++) % NDL_GRAPH_MARK_AHEAD] = next;
+        }
+
+        ndl_ref node = ahead[head];
+        head = (head + 1) % NDL_GRAPH_MARK_AHEAD;
+        count--;
+
+        if (!minor) {
+            if (ndl_node_pool_live_set(pool, node))
+                continue;
+        } else {
+            ndl_node_pool_header *header = ndl_node_pool_node_peek(pool, node);
+            if ((header == NULL) || (header->mark == -1) || (header->mark >= sweep))
+                continue;
+
+            if (!(header->flags & NDL_GRAPH_YOUNG))
+                continue;
+
+            ndl_node_pool_node_header(pool, node)->mark = sweep;
+        }
+
+        if (ndl_graph_clean_scan(pool, node, stack) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Parallel collection.
+ * Each worker owns a slice of the id space: it scans the slice for roots,
+ * then marks from a private stack, claiming each node with an atomic
+ * or on its live bit so it's scanned once. A worker with surplus work
+ * publishes half of its stack to a shared, locked buffer; workers that
+ * run dry take from their own buffer, then steal from the others'. When
+ * every worker is idle, marking is done, and the lazy sweep takes over.
+ */
+#define NDL_GRAPH_PUBLISH_MIN 64
+#define NDL_GRAPH_STEAL_MAX 256
+
+typedef struct ndl_graph_worker_s ndl_graph_worker;
+
+typedef struct ndl_graph_collector_s {
+
+    ndl_graph *graph;
+
+    uint64_t count;
+    ndl_graph_worker *workers;
+
+    uint64_t idle, failed, abort;
+
+} ndl_graph_collector;
+
+struct ndl_graph_worker_s {
+
+    ndl_graph_collector *gc;
+    ndl_ref lo, hi;
+    pthread_t thread;
+
+    ndl_vector stack;
+
+    pthread_mutex_t lock;
+    ndl_vector shared;
+    uint64_t available;
+};
+
+/* Move half of a worker's stack to its shared buffer. */
+static void ndl_graph_par_publish(ndl_graph_worker *worker) {
+
+    uint64_t size = ndl_vector_size(&worker->stack);
+    uint64_t half = size / 2;
+
+    pthread_mutex_lock(&worker->lock);
+
+    uint64_t i;
+    for (i = size - half; i < size; i++)
+        if (ndl_vector_push(&worker->shared, ndl_vector_get(&worker->stack, i)) == NULL)
+            break;
+
+    ndl_vector_delete_range(&worker->stack, size - half, i - (size - half));
+    __atomic_store_n(&worker->available, ndl_vector_size(&worker->shared), __ATOMIC_SEQ_CST);
+
+    pthread_mutex_unlock(&worker->lock);
+}
+
+/* Move up to STEAL_MAX refs from a shared buffer to a worker's stack. */
+static uint64_t ndl_graph_par_take(ndl_graph_worker *worker, ndl_graph_worker *from) {
+
+    if (__atomic_load_n(&from->available, __ATOMIC_SEQ_CST) == 0)
+        return 0;
+
+    pthread_mutex_lock(&from->lock);
+
+    uint64_t size = ndl_vector_size(&from->shared);
+    uint64_t count = (size < NDL_GRAPH_STEAL_MAX)? size : NDL_GRAPH_STEAL_MAX;
+
+    uint64_t i;
+    for (i = size - count; i < size; i++)
+        if (ndl_vector_push(&worker->stack, ndl_vector_get(&from->shared, i)) == NULL)
+            break;
+
+    count = i - (size - count);
+    ndl_vector_delete_range(&from->shared, size - count, count);
+    __atomic_store_n(&from->available, ndl_vector_size(&from->shared), __ATOMIC_SEQ_CST);
+
+    pthread_mutex_unlock(&from->lock);
+
+    return count;
+}
+
+/* Mark from a worker's stack until it's empty, as in ndl_graph_clean_mark. */
+static void ndl_graph_par_drain(ndl_graph_worker *worker) {
+
+    ndl_graph_collector *gc = worker->gc;
+    ndl_node_pool *pool = (ndl_node_pool *) gc->graph->pool;
+
+    ndl_ref ahead[NDL_GRAPH_MARK_AHEAD];
+    uint64_t head = 0, count = 0;
+
+    while ((count > 0) || (ndl_vector_size(&worker->stack) > 0)) {
+
+        while ((count < NDL_GRAPH_MARK_AHEAD) && (ndl_vector_size(&worker->stack) > 0)) {
+
+            ndl_ref next = *(ndl_ref *) ndl_vector_get(&worker->stack, ndl_vector_size(&worker->stack) - 1);
+            ndl_vector_pop(&worker->stack);
+
+            ndl_node_pool_prefetch(pool, next);
+            ahead[(head + count++) % NDL_GRAPH_MARK_AHEAD] = next;
+        }
+
+        ndl_ref node = ahead[head];
+        head = (head + 1) % NDL_GRAPH_MARK_AHEAD;
+        count--;
+
+        if (ndl_node_pool_live_claim(pool, node))
+            continue;
+
+        if (ndl_graph_clean_scan(pool, node, &worker->stack) != 0)
+            __atomic_store_n(&gc->failed, 1, __ATOMIC_SEQ_CST);
+
+        if ((ndl_vector_size(&worker->stack) >= NDL_GRAPH_PUBLISH_MIN) &&
+            (__atomic_load_n(&worker->available, __ATOMIC_SEQ_CST) == 0))
+            ndl_graph_par_publish(worker);
+    }
+}
+
+/* Find more work, or wait until every worker is idle. Returns nonzero when done. */
+static int ndl_graph_par_refill(ndl_graph_worker *worker) {
+
+    ndl_graph_collector *gc = worker->gc;
+    uint64_t self = (uint64_t) (worker - gc->workers);
+
+    uint64_t i;
+    for (i = 0; i < gc->count; i++)
+        if (ndl_graph_par_take(worker, &gc->workers[(self + i) % gc->count]) > 0)
+            return 0;
+
+    __atomic_add_fetch(&gc->idle, 1, __ATOMIC_SEQ_CST);
+
+    for (;;) {
+
+        if ((__atomic_load_n(&gc->idle, __ATOMIC_SEQ_CST) == gc->count) ||
+            __atomic_load_n(&gc->abort, __ATOMIC_SEQ_CST))
+            return 1;
+
+        for (i = 0; i < gc->count; i++) {
+            if (__atomic_load_n(&gc->workers[i].available, __ATOMIC_SEQ_CST) > 0) {
+                __atomic_sub_fetch(&gc->idle, 1, __ATOMIC_SEQ_CST);
+                return 0;
+            }
+        }
+
+        sched_yield();
+    }
+}
+
+static void *ndl_graph_par_run(void *arg) {
+
+    ndl_graph_worker *worker = (ndl_graph_worker *) arg;
+    ndl_graph_collector *gc = worker->gc;
+    ndl_node_pool *pool = (ndl_node_pool *) gc->graph->pool;
+
+    void *curr = ndl_node_pool_seek(pool, worker->lo);
+    while (curr != NULL) {
+
+        ndl_ref node = ndl_node_pool_node(pool, curr);
+        if ((node == NDL_NULL_REF) || (node >= worker->hi))
+            break;
+
+        if ((__atomic_load_n(&ndl_node_pool_node_peek(pool, node)->mark, __ATOMIC_RELAXED) == -1) &&
+            !ndl_node_pool_live_claim(pool, node)) {
+            if (ndl_graph_clean_scan(pool, node, &worker->stack) != 0)
+                __atomic_store_n(&gc->failed, 1, __ATOMIC_SEQ_CST);
+            ndl_graph_par_drain(worker);
+        }
+
+        curr = ndl_node_pool_next(pool, curr);
+    }
+
+    do {
+        ndl_graph_par_drain(worker);
+    } while (!ndl_graph_par_refill(worker));
+
+    return NULL;
+}
+
+/* Returns nonzero if marking couldn't be finished. */
+static int ndl_graph_clean_parallel(ndl_graph *graph) {
+
+    ndl_node_pool *pool = (ndl_node_pool *) graph->pool;
+
+    ndl_graph_collector gc;
+    gc.graph = graph;
+    gc.count = graph->threads;
+    gc.idle = gc.failed = gc.abort = 0;
+
+    gc.workers = calloc(gc.count, sizeof(ndl_graph_worker));
+    if (gc.workers == NULL)
+        return -1;
+
+    uint64_t span = ndl_node_pool_span(pool);
+    uint64_t per = (span + gc.count - 1) / gc.count;
+
+    uint64_t i;
+    for (i = 0; i < gc.count; i++) {
+
+        ndl_graph_worker *worker = &gc.workers[i];
+        worker->gc = &gc;
+        worker->lo = (ndl_ref) (i * per);
+        worker->hi = (ndl_ref) ((i + 1) * per);
+
+        ndl_vector_minit(&worker->stack, sizeof(ndl_ref));
+        ndl_vector_minit(&worker->shared, sizeof(ndl_ref));
+        pthread_mutex_init(&worker->lock, NULL);
+    }
+
+    /* Worker 0 marks from the external roots as it starts. */
+    if (ndl_graph_clean_roots(graph, &gc.workers[0].stack) != 0)
+        gc.failed = 1;
+
+    uint64_t started;
+    for (started = 1; started < gc.count; started++)
+        if (pthread_create(&gc.workers[started].thread, NULL,
+                           &ndl_graph_par_run, &gc.workers[started]) != 0)
+            break;
+
+    if (started < gc.count)
+        __atomic_store_n(&gc.abort, 1, __ATOMIC_SEQ_CST);
+
+    ndl_graph_par_run(&gc.workers[0]);
+
+    for (i = 1; i < started; i++)
+        pthread_join(gc.workers[i].thread, NULL);
+
+    for (i = 0; i < gc.count; i++) {
+        ndl_vector_mkill(&gc.workers[i].stack);
+        ndl_vector_mkill(&gc.workers[i].shared);
+        pthread_mutex_destroy(&gc.workers[i].lock);
+    }
+
+    free(gc.workers);
+
+    return (gc.abort || gc.failed)? -1 : 0;
+}
+
+void ndl_graph_set_threads(ndl_graph *graph, uint64_t threads) {
+
+    graph->threads = (threads > 0)? threads : 1;
+}
+
+void ndl_graph_set_roots(ndl_graph *graph, ndl_graph_roots_fn roots, void *data) {
+
+    graph->roots = roots;
+    graph->roots_data = data;
+}
+
+void ndl_graph_clean(ndl_graph *graph) {
+
+    ndl_node_pool *pool = (ndl_node_pool *) graph->pool;
+
+    if (ndl_graph_fault_all(graph) != 0)
+        return;
+
+    ndl_graph_clean_drop(graph);
+    ndl_graph_tenure(graph);
+
+    /* Nodes left by an unfinished sweep are still unreachable; they
+     * just go unmarked again.
+     */
+    ndl_node_pool_live_reset(pool);
+
+    /* Marking never frees; if it can't finish, free nothing. */
+    if (graph->threads > 1) {
+        if (ndl_graph_clean_parallel(graph) == 0)
+            return;
+        ndl_node_pool_live_reset(pool);
+    }
+
+    ndl_vector stack;
+    if (ndl_vector_minit(&stack, sizeof(ndl_ref)) == NULL) {
+        ndl_node_pool_sweep_stop(pool);
+        return;
+    }
+
+    int err = 0;
+
+    void *curr = ndl_node_pool_head(pool);
+    while ((curr != NULL) && (err == 0)) {
+
+        ndl_ref key = ndl_node_pool_node(pool, curr);
+        if (key == NDL_NULL_REF)
+            break;
+
+        if ((ndl_node_pool_node_peek(pool, key)->mark == -1) &&
+            !ndl_node_pool_live_set(pool, key)) {
+            err = ndl_graph_clean_scan(pool, key, &stack);
+            if (err == 0)
+                err = ndl_graph_clean_mark(graph, &stack, 0, 0);
+        }
+
+        curr = ndl_node_pool_next(pool, curr);
+    }
+
+    if (err == 0)
+        err = ndl_graph_clean_roots(graph, &stack);
+    if (err == 0)
+        err = ndl_graph_clean_mark(graph, &stack, 0, 0);
+
+    ndl_vector_mkill(&stack);
+
+    if (err != 0)
+        ndl_node_pool_sweep_stop(pool);
+}
+
+/* Scan grey nodes, shading what they reference. Returns the work done. */
+static uint64_t ndl_graph_clean_step_mark(ndl_graph *graph, uint64_t budget) {
+
+    ndl_node_pool *pool = (ndl_node_pool *) graph->pool;
+    uint64_t work = 0;
+
+    while ((work < budget) && (graph->phase == NDL_GRAPH_MARK) &&
+           (ndl_vector_size(&graph->grey) > 0)) {
+
+        ndl_ref node = *(ndl_ref *) ndl_vector_get(&graph->grey, ndl_vector_size(&graph->grey) - 1);
+        ndl_vector_pop(&graph->grey);
+        work++;
+
+        /* Shading can write to the node's page; copy it first, if shared. */
+        ndl_node_pool_node_header(pool, node);
+
+        void *curr = ndl_node_pool_node_pairs_head(pool, node);
+        while (curr != NULL) {
+
+            ndl_value next = ndl_node_pool_node_pairs_val(pool, node, curr);
+            if ((NDL_VALUE_TYPE(next) == EVAL_REF) && (NDL_VALUE_REF(next) != NDL_NULL_REF))
+                ndl_graph_clean_shade(graph, NDL_VALUE_REF(next));
+            work++;
+
+            curr = ndl_node_pool_node_pairs_next(pool, node, curr);
+        }
+    }
+
+    return work;
+}
+
+/* Shade the external roots. Their holders don't shade them as they
+ * change, so this runs once the root pass is done, and again until it
+ * turns up nothing new. Returns the work done, with *greyed nonzero if
+ * anything was shaded, or -1 on error.
+ */
+static int64_t ndl_graph_clean_step_roots(ndl_graph *graph, int *greyed) {
+
+    *greyed = 0;
+
+    ndl_vector roots;
+    if (ndl_vector_minit(&roots, sizeof(ndl_ref)) == NULL)
+        return -1;
+
+    if (ndl_graph_clean_roots(graph, &roots) != 0) {
+        ndl_vector_mkill(&roots);
+        return -1;
+    }
+
+    uint64_t i, size = ndl_vector_size(&graph->grey);
+    for (i = 0; i < ndl_vector_size(&roots); i++)
+        ndl_graph_clean_shade(graph, *(ndl_ref *) ndl_vector_get(&roots, i));
+
+    *greyed = ndl_vector_size(&graph->grey) > size;
+
+    ndl_vector_mkill(&roots);
+
+    return (int64_t) i;
+}
+
+int ndl_graph_clean_step(ndl_graph *graph, uint64_t budget) {
+
+    ndl_node_pool *pool = (ndl_node_pool *) graph->pool;
+
+    if (ndl_node_pool_readonly(pool))
+        return -1;
+
+    if (budget == 0)
+        budget = UINT64_MAX;
+
+    if (graph->phase == NDL_GRAPH_IDLE) {
+        ndl_graph_tenure(graph);
+        graph->sweep++;
+        graph->phase = NDL_GRAPH_MARK;
+        graph->cursor = 0;
+    }
+
+    uint64_t work = 0;
+
+    /* Mark: advance the root pass, draining the grey stack before each
+     * root so it stays short. Neither allocates nor frees nodes, but
+     * shading may copy pages a snapshot shares, so seek each root by id.
+     */
+    while ((work < budget) && (graph->phase == NDL_GRAPH_MARK)) {
+
+        if (ndl_vector_size(&graph->grey) > 0) {
+            work += ndl_graph_clean_step_mark(graph, budget - work);
+            continue;
+        }
+
+        ndl_ref node = ndl_node_pool_node(pool, ndl_node_pool_seek(pool, graph->cursor));
+        work++;
+
+        if (node == NDL_NULL_REF) {
+
+            int greyed;
+            int64_t done = ndl_graph_clean_step_roots(graph, &greyed);
+            if (done < 0) {
+                ndl_graph_clean_drop(graph);
+                return -1;
+            }
+
+            work += (uint64_t) done;
+            if (greyed)
+                continue;
+
+            graph->phase = NDL_GRAPH_SWEEP;
+            graph->cursor = 0;
+            break;
+        }
+
+        graph->cursor = node + 1;
+
+        /* Nodes still in the image aren't collected here, so what they
+         * reference is reached, like what roots do.
+         */
+        if (ndl_node_pool_node_peek(pool, node)->mark == -1)
+            ndl_graph_clean_grey(graph, node);
+        else if (ndl_graph_mapped_refers(graph, node, &work))
+            ndl_graph_clean_shade(graph, node);
+    }
+
+    /* Abandoned by a failed push. */
+    if (graph->phase == NDL_GRAPH_IDLE)
+        return -1;
+
+    /* Sweep: free white nodes from the cursor on.
+     * Freeing invalidates the iterator, so seek past a freed node.
+     */
+    void *curr = ndl_node_pool_seek(pool, graph->cursor);
+    while ((work < budget) && (graph->phase == NDL_GRAPH_SWEEP)) {
+
+        ndl_ref node = ndl_node_pool_node(pool, curr);
+        work++;
+
+        if (node == NDL_NULL_REF) {
+            graph->phase = NDL_GRAPH_IDLE;
+            ndl_node_pool_trim(pool);
+            return 1;
+        }
+
+        graph->cursor = node + 1;
+
+        int64_t mark = ndl_node_pool_node_peek(pool, node)->mark;
+        if ((mark != -1) && (mark < graph->sweep)) {
+            work += ndl_node_pool_node_size(pool, node);
+            ndl_graph_clean_remove(graph, node);
+            curr = ndl_node_pool_seek(pool, graph->cursor);
+        } else {
+            curr = ndl_node_pool_next(pool, curr);
+        }
+    }
+
+    return 0;
+}
+
+int ndl_graph_clean_busy(ndl_graph *graph) {
+
+    return graph->phase != NDL_GRAPH_IDLE;
+}
+
+/* Seed a minor collection's stack from the nodes flagged in a list. */
+static int ndl_graph_minor_seed(ndl_graph *graph, ndl_vector *list, uint32_t flag,
+                                ndl_vector *stack) {
+
+    ndl_node_pool *pool = (ndl_node_pool *) graph->pool;
+
+    uint64_t i;
+    for (i = 0; i < ndl_vector_size(list); i++) {
+
+        ndl_ref node = *(ndl_ref *) ndl_vector_get(list, i);
+
+        ndl_node_pool_header *header = ndl_node_pool_node_peek(pool, node);
+        if ((header == NULL) || !(header->flags & flag))
+            continue;
+
+        /* Young roots; every remembered node. */
+        if ((flag == NDL_GRAPH_YOUNG) && (header->mark != -1))
+            continue;
+
+        if (ndl_graph_clean_scan(pool, node, stack) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Whether an old node references any young one. */
+static int ndl_graph_minor_refers(ndl_node_pool *pool, ndl_ref node) {
+
+    void *curr = ndl_node_pool_node_pairs_head(pool, node);
+
+    while (curr != NULL) {
+
+        ndl_value val = ndl_node_pool_node_pairs_val(pool, node, curr);
+        if ((NDL_VALUE_TYPE(val) == EVAL_REF) && (NDL_VALUE_REF(val) != NDL_NULL_REF)) {
+            ndl_node_pool_header *header = ndl_node_pool_node_peek(pool, NDL_VALUE_REF(val));
+            if ((header != NULL) && (header->flags & NDL_GRAPH_YOUNG))
+                return 1;
+        }
+
+        curr = ndl_node_pool_node_pairs_next(pool, node, curr);
+    }
+
+    return 0;
+}
+
+int ndl_graph_clean_minor(ndl_graph *graph) {
+
+    ndl_node_pool *pool = (ndl_node_pool *) graph->pool;
+
+    if (graph->overflow) {
+        ndl_graph_clean(graph);
+        return 0;
+    }
+
+    ndl_graph_clean_drop(graph);
+
+    int64_t sweep = ++graph->sweep;
+
+    /* Mark. Nothing's changed yet if this fails. */
+    ndl_vector stack;
+    if (ndl_vector_minit(&stack, sizeof(ndl_ref)) == NULL)
+        return -1;
+
+    int err = ndl_graph_minor_seed(graph, &graph->young, NDL_GRAPH_YOUNG, &stack);
+    if (err == 0)
+        err = ndl_graph_clean_roots(graph, &stack);
+    if (err == 0)
+        err = ndl_graph_clean_mark(graph, &stack, sweep, 1);
+    if (err == 0)
+        err = ndl_graph_minor_seed(graph, &graph->remembered, NDL_GRAPH_REMEMBERED, &stack);
+    if (err == 0)
+        err = ndl_graph_clean_mark(graph, &stack, sweep, 1);
+
+    ndl_vector_mkill(&stack);
+
+    if (err != 0)
+        return -1;
+
+    /* Sort the young list into survivors (kept in place), promotions,
+     * and the dead. Clearing flags as entries are seen drops duplicates.
+     * Nodes that can't be listed as dead or promoted just become old.
+     */
+    ndl_vector dead, promoted;
+    ndl_vector_minit(&dead, sizeof(ndl_ref));
+    ndl_vector_minit(&promoted, sizeof(ndl_ref));
+
+    uint64_t i, kept = 0;
+    for (i = 0; i < ndl_vector_size(&graph->young); i++) {
+
+        ndl_ref node = *(ndl_ref *) ndl_vector_get(&graph->young, i);
+
+        ndl_node_pool_header *header = ndl_node_pool_node_header(pool, node);
+        if ((header == NULL) || !(header->flags & NDL_GRAPH_YOUNG))
+            continue;
+
+        header->flags &= (uint32_t) ~NDL_GRAPH_YOUNG;
+
+        if ((header->mark != -1) && (header->mark < sweep)) {
+            ndl_vector_push(&dead, &node);
+        } else if (++header->age >= NDL_GRAPH_PROMOTE_AGE) {
+            ndl_vector_push(&promoted, &node);
+        } else {
+            *(ndl_ref *) ndl_vector_get(&graph->young, kept++) = node;
+        }
+    }
+
+    if (ndl_vector_size(&graph->young) > kept)
+        ndl_vector_delete_range(&graph->young, kept, ndl_vector_size(&graph->young) - kept);
+
+    for (i = 0; i < kept; i++)
+        ndl_node_pool_node_header(pool, *(ndl_ref *) ndl_vector_get(&graph->young, i))->flags |= NDL_GRAPH_YOUNG;
+
+    /* Rebuild the remembered set from the old nodes that may still
+     * reference young ones: the last set, and the promoted.
+     */
+    uint64_t remembered = ndl_vector_size(&graph->remembered);
+    for (i = 0; i < ndl_vector_size(&promoted); i++)
+        if (ndl_vector_push(&graph->remembered, ndl_vector_get(&promoted, i)) == NULL)
+            graph->overflow = 1;
+
+    kept = 0;
+    for (i = 0; i < ndl_vector_size(&graph->remembered); i++) {
+
+        ndl_ref node = *(ndl_ref *) ndl_vector_get(&graph->remembered, i);
+
+        ndl_node_pool_header *header = ndl_node_pool_node_header(pool, node);
+        if ((header == NULL) || ((i < remembered) && !(header->flags & NDL_GRAPH_REMEMBERED)))
+            continue;
+
+        header->flags &= (uint32_t) ~NDL_GRAPH_REMEMBERED;
+
+        if (ndl_graph_minor_refers(pool, node))
+            *(ndl_ref *) ndl_vector_get(&graph->remembered, kept++) = node;
+    }
+
+    if (ndl_vector_size(&graph->remembered) > kept)
+        ndl_vector_delete_range(&graph->remembered, kept, ndl_vector_size(&graph->remembered) - kept);
+
+    for (i = 0; i < kept; i++)
+        ndl_node_pool_node_header(pool, *(ndl_ref *) ndl_vector_get(&graph->remembered, i))->flags |= NDL_GRAPH_REMEMBERED;
+
+    for (i = 0; i < ndl_vector_size(&dead); i++)
+        ndl_graph_clean_remove(graph, *(ndl_ref *) ndl_vector_get(&dead, i));
+
+    ndl_vector_mkill(&dead);
+    ndl_vector_mkill(&promoted);
+
+    return 0;
+}
+
+uint64_t ndl_graph_young(ndl_graph *graph) {
+
+    return ndl_vector_size(&graph->young);
+}
+
+void ndl_graph_set_refcount(ndl_graph *graph, int refcount) {
+
+    /* Releasing a node means reading its backrefs. */
+    if (refcount)
+        ndl_graph_fault_all(graph);
+
+    graph->refcount = refcount;
+}
+
+/* A node in the subgraph a cycle collection looks at. */
+typedef struct ndl_graph_trial_s {
+
+    uint64_t internal;
+    uint64_t live;
+
+} ndl_graph_trial;
+
+/* Total references to a node, over all sources. */
+static uint64_t ndl_graph_backref_total(ndl_backrefs *backrefs) {
+
+    uint64_t total = 0;
+
+    void *curr = ndl_backrefs_head(backrefs);
+    while (curr != NULL) {
+        total += ndl_backrefs_refs(backrefs, curr);
+        curr = ndl_backrefs_next(backrefs, curr);
+    }
+
+    return total;
+}
+
+/* Trial deletion. Gathers the subgraph reachable from the suspects,
+ * stopping at roots, while counting the references each of its nodes
+ * gets from within it. A node with more backrefs than that is referenced
+ * from outside; it, the roots, and all they reach are live.
+ */
+static int ndl_graph_cycles_trial(ndl_graph *graph, ndl_rhashtable *trial, ndl_vector *stack) {
+
+    ndl_node_pool *pool = (ndl_node_pool *) graph->pool;
+
+    uint64_t i;
+    for (i = 0; i < ndl_vector_size(&graph->suspects); i++) {
+
+        ndl_ref node = *(ndl_ref *) ndl_vector_get(&graph->suspects, i);
+
+        ndl_node_pool_header *header = ndl_node_pool_node_peek(pool, node);
+        if ((header == NULL) || !(header->flags & NDL_GRAPH_SUSPECT) ||
+            (ndl_rhashtable_get(trial, &node) != NULL))
+            continue;
+
+        ndl_graph_trial entry = {0, (header->mark == -1)};
+        if ((ndl_rhashtable_put(trial, &node, &entry) == NULL) ||
+            (ndl_vector_push(stack, &node) == NULL))
+            return -1;
+    }
+
+    while (ndl_vector_size(stack) > 0) {
+
+        ndl_ref node = *(ndl_ref *) ndl_vector_get(stack, ndl_vector_size(stack) - 1);
+        ndl_vector_pop(stack);
+
+        if (ndl_node_pool_node_peek(pool, node)->mark == -1)
+            continue;
+
+        void *curr = ndl_node_pool_node_pairs_head(pool, node);
+        while (curr != NULL) {
+
+            ndl_value val = ndl_node_pool_node_pairs_val(pool, node, curr);
+            curr = ndl_node_pool_node_pairs_next(pool, node, curr);
+
+            ndl_ref target = NDL_VALUE_REF(val);
+            if ((NDL_VALUE_TYPE(val) != EVAL_REF) || (target == NDL_NULL_REF))
+                continue;
+
+            ndl_graph_trial *found = ndl_rhashtable_get(trial, &target);
+            if (found != NULL) {
+                found->internal++;
+                continue;
+            }
+
+            ndl_node_pool_header *header = ndl_node_pool_node_peek(pool, target);
+            if (header == NULL)
+                continue;
+
+            ndl_graph_trial entry = {1, (header->mark == -1)};
+            if ((ndl_rhashtable_put(trial, &target, &entry) == NULL) ||
+                (ndl_vector_push(stack, &target) == NULL))
+                return -1;
+        }
+    }
+
+    /* Seed the live set, then spread it. */
+    void *curr = ndl_rhashtable_pairs_head(trial);
+    while (curr != NULL) {
+
+        ndl_ref node = *(ndl_ref *) ndl_rhashtable_pairs_key(trial, curr);
+        ndl_graph_trial *entry = ndl_rhashtable_pairs_val(trial, curr);
+
+        ndl_node_pool_header *header = ndl_node_pool_node_peek(pool, node);
+        if (!entry->live && (ndl_graph_backref_total(&header->backrefs) > entry->internal))
+            entry->live = 1;
+
+        if (entry->live && (ndl_vector_push(stack, &node) == NULL))
+            return -1;
+
+        curr = ndl_rhashtable_pairs_next(trial, curr);
+    }
+
+    while (ndl_vector_size(stack) > 0) {
+
+        ndl_ref node = *(ndl_ref *) ndl_vector_get(stack, ndl_vector_size(stack) - 1);
+        ndl_vector_pop(stack);
+
+        void *pair = ndl_node_pool_node_pairs_head(pool, node);
+        while (pair != NULL) {
+
+            ndl_value val = ndl_node_pool_node_pairs_val(pool, node, pair);
+            pair = ndl_node_pool_node_pairs_next(pool, node, pair);
+
+            ndl_ref target = NDL_VALUE_REF(val);
+            if ((NDL_VALUE_TYPE(val) != EVAL_REF) || (target == NDL_NULL_REF))
+                continue;
+
+            ndl_graph_trial *found = ndl_rhashtable_get(trial, &target);
+            if ((found == NULL) || found->live)
+                continue;
+
+            found->live = 1;
+            if (ndl_vector_push(stack, &target) == NULL)
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+int ndl_graph_clean_cycles(ndl_graph *graph) {
+
+    ndl_node_pool *pool = (ndl_node_pool *) graph->pool;
+
+    if (ndl_graph_fault_all(graph) != 0)
+        return -1;
+
+    ndl_graph_release_drain(graph, UINT64_MAX);
+
+    ndl_rhashtable *trial = ndl_rhashtable_init(sizeof(ndl_ref), sizeof(ndl_graph_trial), 64);
+    if (trial == NULL)
+        return -1;
+
+    ndl_vector stack;
+    ndl_vector_minit(&stack, sizeof(ndl_ref));
+
+    int err = ndl_graph_cycles_trial(graph, trial, &stack);
+
+    /* Collect the garbage before freeing any, to keep iterators valid. */
+    if (err == 0) {
+        void *curr = ndl_rhashtable_pairs_head(trial);
+        while ((curr != NULL) && (err == 0)) {
+
+            if (!((ndl_graph_trial *) ndl_rhashtable_pairs_val(trial, curr))->live)
+                if (ndl_vector_push(&stack, ndl_rhashtable_pairs_key(trial, curr)) == NULL)
+                    err = -1;
+
+            curr = ndl_rhashtable_pairs_next(trial, curr);
+        }
+    }
+
+    ndl_rhashtable_kill(trial);
+
+    if (err != 0) {
+        ndl_vector_mkill(&stack);
+        return -1;
+    }
+
+    uint64_t i;
+    for (i = 0; i < ndl_vector_size(&graph->suspects); i++) {
+        ndl_node_pool_header *header =
+            ndl_node_pool_node_header(pool, *(ndl_ref *) ndl_vector_get(&graph->suspects, i));
+        if (header != NULL)
+            header->flags &= (uint32_t) ~NDL_GRAPH_SUSPECT;
+    }
+
+    if (ndl_vector_size(&graph->suspects) > 0)
+        ndl_vector_delete_range(&graph->suspects, 0, ndl_vector_size(&graph->suspects));
+
+    for (i = 0; i < ndl_vector_size(&stack); i++)
+        ndl_graph_clean_remove(graph, *(ndl_ref *) ndl_vector_get(&stack, i));
+
+    ndl_vector_mkill(&stack);
+
+    return 0;
+}
+
+uint64_t ndl_graph_suspects(ndl_graph *graph) {
+
+    return ndl_vector_size(&graph->suspects);
+}
+
+int ndl_graph_set(ndl_graph *graph, ndl_ref node, ndl_sym key, ndl_value value) {
+
+    if (node == NDL_NULL_REF)
+        return -1;
+
+    if ((ndl_graph_fault(graph, node) != 0) || (ndl_graph_fault_value(graph, value) != 0))
+        return -1;
+
+    ndl_value val = ndl_node_pool_get((ndl_node_pool *) graph->pool,
+                                      node, key);
+
+    if (ndl_graph_fault_value(graph, val) != 0)
+        return -1;
+
+    int err = 0;
+    if (NDL_VALUE_TYPE(value) == EVAL_REF)
+        err = ndl_graph_add_backref((ndl_node_pool *) graph->pool,
+                                    NDL_VALUE_REF(value), node);
+
+    if (err != 0)
+        return err;
+
+    err = ndl_node_pool_put((ndl_node_pool *) graph->pool,
+                            node, key, value);
+
+    if (err != 0) {
+        if (NDL_VALUE_TYPE(value) == EVAL_REF)
+            ndl_graph_rm_backref((ndl_node_pool *) graph->pool,
+                                 NDL_VALUE_REF(value), node);
+        return err;
+    }
+
+    if (NDL_VALUE_TYPE(value) == EVAL_REF) {
+        ndl_graph_clean_shade(graph, NDL_VALUE_REF(value));
+        ndl_graph_remember(graph, node, NDL_VALUE_REF(value));
+    }
+
+    if (NDL_VALUE_TYPE(val) == EVAL_REF) {
+        ndl_graph_rm_backref((ndl_node_pool *) graph->pool,
+                             NDL_VALUE_REF(val), node);
+        ndl_graph_release(graph, NDL_VALUE_REF(val));
+    }
 
-    ndl_graph *ret = ndl_graph_minit(region);
-    if (ret == NULL)
-        free(region);
+    ndl_graph_release_drain(graph, NDL_GRAPH_RC_BUDGET);
 
-    return ret;
+    return 0;
 }
 
-void ndl_graph_kill(ndl_graph *graph) {
+int ndl_graph_del(ndl_graph *graph, ndl_ref node, ndl_sym key) {
 
-    ndl_graph_mkill(graph);
+    if (node == NDL_NULL_REF)
+        return -1;
 
-    free(graph);
+    if (ndl_graph_fault(graph, node) != 0)
+        return -1;
 
-    return;
-}
+    ndl_value val = ndl_node_pool_get((ndl_node_pool *) graph->pool,
+                                      node, key);
 
-ndl_graph *ndl_graph_minit(void *region) {
+    if (ndl_graph_fault_value(graph, val) != 0)
+        return -1;
 
-    ndl_graph *ret = (ndl_graph*) region;
+    if (NDL_VALUE_TYPE(val) == EVAL_REF)
+        ndl_graph_rm_backref((ndl_node_pool *) graph->pool,
+                             NDL_VALUE_REF(val), node);
 
-    ndl_node_pool *pool = ndl_node_pool_minit((void *) ret->pool);
+    int err = ndl_node_pool_del((ndl_node_pool *) graph->pool,
+                                node, key);
 
-    if (pool == NULL)
-        return NULL;
+    if (NDL_VALUE_TYPE(val) == EVAL_REF)
+        ndl_graph_release(graph, NDL_VALUE_REF(val));
 
-    ret->sweep = 0;
+    ndl_graph_release_drain(graph, NDL_GRAPH_RC_BUDGET);
 
-    return ret;
+    return err;
 }
 
-void ndl_graph_mkill(ndl_graph *graph) {
+int64_t ndl_graph_size(ndl_graph *graph, ndl_ref node) {
 
-    ndl_node_pool_mkill((ndl_node_pool *) graph->pool);
+    if (graph->mapped != NULL) {
+        uint64_t i = ndl_graph_mapped_find(graph->mapped, node);
+        if (i < graph->mapped->nodes)
+            return (int64_t) (ndl_graph_image_word(graph->mapped->pair_ends[i], graph->mapped->swap) -
+                              ndl_graph_mapped_pairs(graph->mapped, i));
+    }
 
-    return;
+    return (int64_t) ndl_node_pool_node_size((ndl_node_pool *) graph->pool, node);
 }
 
-uint64_t ndl_graph_msize(void) {
+ndl_value ndl_graph_get(ndl_graph *graph, ndl_ref node, ndl_sym key) {
 
-    return sizeof(ndl_graph) + ndl_node_pool_msize();
+    if (graph->mapped != NULL) {
+        uint64_t i = ndl_graph_mapped_find(graph->mapped, node);
+        if (i < graph->mapped->nodes)
+            return ndl_graph_mapped_get(graph->mapped, i, key);
+    }
+
+    return ndl_node_pool_get((ndl_node_pool *) graph->pool,
+                             node, key);
 }
 
-#define NDL_BACKREF(ref) (*((uint64_t*) "\0b\0\0\0\0b\0") | (((uint64_t) ref) << 16))
-#define NDL_DEBACKREF(ref) (int32_t) ((ref & 0x0000FFFFFFFF0000) >> 16)
-#define NDL_ISBACKREF(ref) ((ref & 0xFFFF00000000FFFF) == *((uint64_t*) "\0b\0\0\0\0b\0"))
+ndl_sym ndl_graph_index(ndl_graph *graph, ndl_ref node, int64_t index) {
 
-ndl_ref ndl_graph_alloc(ndl_graph *graph) {
+    if (index < 0)
+        return NDL_NULL_SYM;
 
-    ndl_ref ret = ndl_node_pool_alloc((ndl_node_pool *) graph->pool);
+    if (graph->mapped != NULL) {
+        uint64_t i = ndl_graph_mapped_find(graph->mapped, node);
+        if (i < graph->mapped->nodes) {
+            uint64_t pair = ndl_graph_mapped_pairs(graph->mapped, i) + (uint64_t) index;
+            if (pair >= ndl_graph_image_word(graph->mapped->pair_ends[i], graph->mapped->swap))
+                return NDL_NULL_SYM;
+            return ndl_graph_image_word(graph->mapped->keys[pair], graph->mapped->swap);
+        }
+    }
 
-    if (ret == NDL_NULL_REF)
-        return ret;
+    return ndl_node_pool_node_index((ndl_node_pool *) graph->pool, node, (uint64_t) index);
+}
 
-    int err = ndl_node_pool_put((ndl_node_pool *) graph->pool,
-                                ret, NDL_SYM("\0gcsweep"), NDL_VALUE(EVAL_INT, num=-1));
+/* Batches. Ops are sorted by node, keeping the order they were queued
+ * in; a delete is an op with type NDL_GRAPH_BATCH_DEL. Each applied op
+ * leaves up to two backref deltas on its targets, one removing the
+ * reference it replaced and one adding the reference it stored, which
+ * are sorted by target. Ids are dense, so both sorts are a few passes
+ * of a radix sort on the id. Additions from old nodes are told apart
+ * while the node is in cache, for the remembered set.
+ */
+#define NDL_GRAPH_BATCH_DEL EVAL_SIZE
+#define NDL_GRAPH_BATCH_RADIX 11
 
-    if (err != 0) {
-        ndl_node_pool_free((ndl_node_pool *) graph->pool, ret);
-        return NDL_NULL_REF;
-    }
+#define NDL_GRAPH_BATCH_RM      0
+#define NDL_GRAPH_BATCH_ADD     1
+#define NDL_GRAPH_BATCH_ADD_OLD 2
+
+typedef struct ndl_graph_batch_op_s {
+
+    ndl_ref node;
+    ndl_sym key;
+    ndl_value value;
+
+} ndl_graph_batch_op;
+
+typedef struct ndl_graph_batch_delta_s {
+
+    ndl_ref target, src;
+    uint32_t kind;
+
+} ndl_graph_batch_delta;
+
+ndl_graph_batch *ndl_graph_batch_begin(ndl_graph *graph) {
+
+    ndl_graph_batch *ret = malloc(sizeof(ndl_graph_batch));
+    if (ret == NULL)
+        return NULL;
+
+    ret->graph = graph;
+    ndl_vector_minit(&ret->ops, sizeof(ndl_graph_batch_op));
 
     return ret;
 }
 
-int ndl_graph_stat(ndl_graph *graph, ndl_ref node) {
+int ndl_graph_batch_set(ndl_graph_batch *batch, ndl_ref node, ndl_sym key, ndl_value value) {
 
-    ndl_value val = ndl_node_pool_get((ndl_node_pool *) graph->pool,
-                                      node, NDL_SYM("\0gcsweep"));
-    if (val.type != EVAL_INT)
+    if (node == NDL_NULL_REF)
         return -1;
-    else
-        return (val.num == -1)? 1 : 0;
+
+    ndl_graph_batch_op op = {.node = node, .key = key, .value = value};
+
+    return (ndl_vector_push(&batch->ops, &op) == NULL)? -1 : 0;
 }
 
-int ndl_graph_unmark(ndl_graph *graph, ndl_ref node) {
+int ndl_graph_batch_del(ndl_graph_batch *batch, ndl_ref node, ndl_sym key) {
 
-    return ndl_node_pool_put((ndl_node_pool *) graph->pool,
-                             node, NDL_SYM("\0gcsweep"), NDL_VALUE(EVAL_INT, num=0));
+    return ndl_graph_batch_set(batch, node, key, NDL_VALUE(NDL_GRAPH_BATCH_DEL, ref=NDL_NULL_REF));
 }
 
-int ndl_graph_mark(ndl_graph *graph, ndl_ref node) {
+void ndl_graph_batch_abort(ndl_graph_batch *batch) {
+
+    if (batch == NULL)
+        return;
 
-    return ndl_node_pool_put((ndl_node_pool *) graph->pool,
-                             node, NDL_SYM("\0gcsweep"), NDL_VALUE(EVAL_INT, num=-1));
+    ndl_vector_mkill(&batch->ops);
+    free(batch);
 }
 
-ndl_ref ndl_graph_salloc(ndl_graph *graph, ndl_ref base, ndl_sym key) {
+/* Stable sort of count items of size bytes, each starting with a ref
+ * below span, using tmp for as many. Returns whichever holds the result.
+ */
+static void *ndl_graph_batch_sort(void *items, void *tmp, uint64_t count, uint64_t size, uint64_t span) {
 
-    ndl_ref ret = ndl_node_pool_alloc((ndl_node_pool *) graph->pool);
+    uint64_t i;
+    for (i = 1; i < count; i++)
+        if (*(ndl_ref *) ((uint8_t *) items + (i - 1) * size) > *(ndl_ref *) ((uint8_t *) items + i * size))
+            break;
 
-    if (ret == NDL_NULL_REF)
-        return ret;
+    if (i >= count)
+        return items;
 
-    int err = ndl_node_pool_put((ndl_node_pool *) graph->pool,
-                                ret, NDL_SYM("\0gcsweep"), NDL_VALUE(EVAL_INT, num=0));
+    uint64_t shift;
+    for (shift = 0; (span >> shift) > 0; shift += NDL_GRAPH_BATCH_RADIX) {
 
-    err |= ndl_node_pool_put((ndl_node_pool *) graph->pool,
-                             ret, NDL_BACKREF(base), NDL_VALUE(EVAL_INT, ref=1));
+        uint64_t starts[1 << NDL_GRAPH_BATCH_RADIX] = {0};
+        uint64_t mask = (1 << NDL_GRAPH_BATCH_RADIX) - 1;
 
-    if (err == 0)
-        err |= ndl_node_pool_put((ndl_node_pool *) graph->pool,
-                                 base, key, NDL_VALUE(EVAL_REF, ref=ret));
+        for (i = 0; i < count; i++)
+            starts[(*(uint64_t *) ((uint8_t *) items + i * size) >> shift) & mask]++;
 
-    if (err != 0) {
-        ndl_node_pool_free((ndl_node_pool *) graph->pool, ret);
-        return NDL_NULL_REF;
+        uint64_t sum = 0;
+        for (i = 0; i <= mask; i++) {
+            uint64_t next = sum + starts[i];
+            starts[i] = sum;
+            sum = next;
+        }
+
+        for (i = 0; i < count; i++) {
+            uint8_t *item = (uint8_t *) items + i * size;
+            memcpy((uint8_t *) tmp + starts[(*(uint64_t *) item >> shift) & mask]++ * size, item, size);
+        }
+
+        void *swap = items;
+        items = tmp;
+        tmp = swap;
     }
 
-    return ret;
+    return items;
 }
 
-#define NDL_ISHIDDEN(sym) (((char*)&key)[0] == '\0')
+/* Whether every node a batch writes to or references exists. */
+static int ndl_graph_batch_check(ndl_node_pool *pool, ndl_graph_batch_op *ops, uint64_t count) {
 
-static void ndl_graph_clean_mark(ndl_graph *graph, ndl_ref root, int64_t sweep) {
+    ndl_ref last = NDL_NULL_REF;
 
-    ndl_value gcsweep = ndl_node_pool_get((ndl_node_pool *) graph->pool,
-                                          root, NDL_SYM("\0gcsweep"));
-    if (gcsweep.type != EVAL_INT)
-        return;
+    uint64_t i;
+    for (i = 0; i < count; i++) {
 
-    if (gcsweep.num == -1 && (sweep >= 0))
-        return;
+        if (ops[i].node != last) {
+            if (!ndl_node_pool_has(pool, ops[i].node))
+                return -1;
+            last = ops[i].node;
+        }
 
-    sweep = (sweep < 0)? -sweep : sweep; 
+        ndl_value val = ops[i].value;
+        if ((NDL_VALUE_TYPE(val) == EVAL_REF) && (NDL_VALUE_REF(val) != NDL_NULL_REF) && !ndl_node_pool_has(pool, NDL_VALUE_REF(val)))
+            return -1;
+    }
 
-    if (gcsweep.num >= sweep)
-        return;
+    return 0;
+}
 
-    if (gcsweep.num >= 0) {
+/* Apply sorted deltas a target at a time, adding before removing, so
+ * a source whose references only moved never leaves the set.
+ */
+static int ndl_graph_batch_reconcile(ndl_graph *graph, ndl_graph_batch_delta *deltas, uint64_t count) {
 
-        gcsweep.num = sweep;
+    ndl_node_pool *pool = (ndl_node_pool *) graph->pool;
 
-        ndl_node_pool_put((ndl_node_pool *) graph->pool,
-                          root, NDL_SYM("\0gcsweep"), gcsweep);
-    }
+    ndl_arena *arena = ndl_node_pool_arena(pool);
+    if (arena == NULL)
+        return -1;
 
-    void *curr = ndl_node_pool_node_pairs_head((ndl_node_pool *) graph->pool, root);
+    int err = 0;
+    uint64_t i = 0;
+    while (i < count) {
 
-    while (curr != NULL) {
+        ndl_ref target = deltas[i].target;
 
-        ndl_sym key = ndl_node_pool_node_pairs_key((ndl_node_pool *) graph->pool, root, curr);
+        uint64_t end;
+        for (end = i; (end < count) && (deltas[end].target == target); end++);
 
-        if (!NDL_ISHIDDEN(key)) {
-            ndl_value next = ndl_node_pool_get((ndl_node_pool *) graph->pool, root, key);
-            if (next.type == EVAL_REF && next.ref != NDL_NULL_REF)
-                ndl_graph_clean_mark(graph, next.ref, sweep);
+        ndl_node_pool_header *header = ndl_node_pool_node_header(pool, target);
+        if (header == NULL) {
+            i = end;
+            continue;
         }
 
-        curr = ndl_node_pool_node_pairs_next((ndl_node_pool *) graph->pool, root, curr);
-    }
-}
+        int added = 0, lost = 0;
 
-static int ndl_graph_add_backref(ndl_node_pool *pool, ndl_ref from, ndl_ref to) {
+        uint64_t j;
+        for (j = i; j < end; j++) {
+            if (deltas[j].kind == NDL_GRAPH_BATCH_RM)
+                continue;
 
-    if (from == NDL_NULL_REF)
-        return 0;
+            if (ndl_backrefs_add(&header->backrefs, arena, deltas[j].src) != 0)
+                err = -1;
+            added = 1;
+        }
 
-    ndl_value value = ndl_node_pool_get(pool, from, NDL_BACKREF(to));
+        for (j = i; j < end; j++) {
+            if (deltas[j].kind != NDL_GRAPH_BATCH_RM)
+                continue;
 
-    if (value.type == EVAL_NONE) {
-        value.type = EVAL_INT;
-        value.num = 1;
-    } else if (value.type != EVAL_INT) {
-        return -1;
-    } else {
-        value.num++;
+            ndl_backrefs_rm(&header->backrefs, arena, deltas[j].src);
+            lost = 1;
+        }
+
+        if (added) {
+            ndl_graph_clean_shade(graph, target);
+            if (header->flags & NDL_GRAPH_YOUNG)
+                for (j = i; j < end; j++)
+                    if (deltas[j].kind == NDL_GRAPH_BATCH_ADD_OLD)
+                        ndl_graph_remember(graph, deltas[j].src, target);
+        }
+
+        if (lost)
+            ndl_graph_release(graph, target);
+
+        i = end;
     }
 
-    return ndl_node_pool_put(pool, from, NDL_BACKREF(to), value);
+    return err;
 }
 
-static int ndl_graph_rm_backref(ndl_node_pool *pool, ndl_ref from, ndl_ref to) {
-
-    if (from == NDL_NULL_REF)
-        return 0;
+int ndl_graph_batch_commit(ndl_graph_batch *batch) {
 
-    ndl_value value = ndl_node_pool_get(pool, from, NDL_BACKREF(to));
+    ndl_graph *graph = batch->graph;
+    ndl_node_pool *pool = (ndl_node_pool *) graph->pool;
 
-    if (value.type == EVAL_NONE) {
+    uint64_t count = ndl_vector_size(&batch->ops);
+    if (count == 0) {
+        ndl_graph_batch_abort(batch);
         return 0;
     }
 
-    if (value.type != EVAL_INT)
-        return -1;
+    /* Fault in mapped nodes the batch changes, or changes the backrefs of. */
+    uint64_t i;
+    for (i = 0; (graph->mapped != NULL) && (i < count); i++) {
 
-    value.num--;
+        ndl_graph_batch_op *op = ndl_vector_get(&batch->ops, i);
 
-    if (value.num == 0) {
-        return ndl_node_pool_del(pool, from, NDL_BACKREF(to));
+        if ((ndl_graph_fault(graph, op->node) != 0) || (ndl_graph_fault_value(graph, op->value) != 0) ||
+            (ndl_graph_fault_value(graph, ndl_node_pool_get(pool, op->node, op->key)) != 0)) {
+            ndl_graph_batch_abort(batch);
+            return -1;
+        }
     }
 
-    return ndl_node_pool_put(pool, from, NDL_BACKREF(to), value);
-}
+    /* Room to sort the ops, then the deltas and their copy. */
+    uint64_t room = count * sizeof(ndl_graph_batch_op);
+    if (room < 4 * count * sizeof(ndl_graph_batch_delta))
+        room = 4 * count * sizeof(ndl_graph_batch_delta);
 
-static void ndl_graph_clean_remove(ndl_graph *graph, ndl_ref node) {
+    void *tmp = malloc(room);
+    if (tmp == NULL) {
+        ndl_graph_batch_abort(batch);
+        return -1;
+    }
+
+    uint64_t span = ndl_node_pool_span(pool);
+    ndl_graph_batch_op *ops = ndl_graph_batch_sort(ndl_vector_get(&batch->ops, 0), tmp, count,
+                                                   sizeof(ndl_graph_batch_op), span);
+    if (ndl_graph_batch_check(pool, ops, count) != 0) {
+        free(tmp);
+        ndl_graph_batch_abort(batch);
+        return -1;
+    }
+
+    /* The sorted ops may be in tmp; the deltas go wherever they aren't. */
+    ndl_graph_batch_delta *deltas = (ops == tmp)? malloc(4 * count * sizeof(ndl_graph_batch_delta)) : tmp;
+    if (deltas == NULL) {
+        free(tmp);
+        ndl_graph_batch_abort(batch);
+        return -1;
+    }
 
-    void *curr = ndl_node_pool_node_pairs_head((ndl_node_pool *) graph->pool, node);
+    int err = 0;
+    uint32_t add = NDL_GRAPH_BATCH_ADD;
+    uint64_t used = 0;
+    for (i = 0; i < count; i++) {
 
-    while (curr != NULL) {
+        ndl_graph_batch_op *op = &ops[i];
+        int del = (NDL_VALUE_TYPE(op->value) == NDL_GRAPH_BATCH_DEL);
 
-        ndl_sym key = ndl_node_pool_node_pairs_key((ndl_node_pool *) graph->pool, node, curr);
+        if ((i == 0) || (op->node != ops[i - 1].node))
+            add = (ndl_node_pool_node_peek(pool, op->node)->flags & NDL_GRAPH_YOUNG)?
+                  NDL_GRAPH_BATCH_ADD : NDL_GRAPH_BATCH_ADD_OLD;
 
-        if (!NDL_ISHIDDEN(key)) {
-            ndl_value val = ndl_node_pool_get((ndl_node_pool *) graph->pool, node, key);
-            if ((val.type == EVAL_REF) && (val.ref != NDL_NULL_REF))
-                ndl_graph_rm_backref((ndl_node_pool *) graph->pool, val.ref, node);
+        ndl_value old = op->value;
+        if (del) {
+            /* Only a missing key fails: the node was checked. */
+            if (ndl_node_pool_take(pool, op->node, op->key, &old) != 0)
+                continue;
+        } else if (ndl_node_pool_swap(pool, op->node, op->key, &old) != 0) {
+            err = -1;
+            break;
         }
 
-        curr = ndl_node_pool_node_pairs_next((ndl_node_pool *) graph->pool, node, curr);
+        if ((NDL_VALUE_TYPE(old) == EVAL_REF) && (NDL_VALUE_REF(old) != NDL_NULL_REF))
+            deltas[used++] = (ndl_graph_batch_delta) {NDL_VALUE_REF(old), op->node, NDL_GRAPH_BATCH_RM};
+
+        if (!del && (NDL_VALUE_TYPE(op->value) == EVAL_REF) && (NDL_VALUE_REF(op->value) != NDL_NULL_REF))
+            deltas[used++] = (ndl_graph_batch_delta) {NDL_VALUE_REF(op->value), op->node, add};
     }
 
-    ndl_node_pool_free((ndl_node_pool *) graph->pool, node);
+    ndl_graph_batch_delta *sorted = ndl_graph_batch_sort(deltas, deltas + 2 * count, used,
+                                                         sizeof(ndl_graph_batch_delta), span);
+    if (ndl_graph_batch_reconcile(graph, sorted, used) != 0)
+        err = -1;
+
+    if (deltas != tmp)
+        free(deltas);
+    free(tmp);
+    ndl_graph_batch_abort(batch);
+
+    ndl_graph_release_drain(graph, NDL_GRAPH_RC_BUDGET);
+
+    return err;
 }
 
-void ndl_graph_clean(ndl_graph *graph) {
+static inline ndl_backrefs *ndl_graph_backref_set(ndl_graph *graph, ndl_ref node) {
 
-    int64_t sweep = ++graph->sweep;
+    ndl_node_pool_header *header = ndl_node_pool_node_peek((ndl_node_pool *) graph->pool, node);
+    if (header == NULL)
+        return NULL;
 
-    ndl_node_pool *pool = (ndl_node_pool *) graph->pool;
+    return &header->backrefs;
+}
 
-    void *curr = ndl_node_pool_head(pool);
-    while (curr != NULL) {
+/* Dead sources waiting for the lazy sweep still hold backrefs. */
+void *ndl_graph_backref_head(ndl_graph *graph, ndl_ref node) {
 
-        ndl_ref key = ndl_node_pool_node(pool, curr);
-        if (key == NDL_NULL_REF)
-            break;
+    if (ndl_graph_fault(graph, node) != 0)
+        return NULL;
 
-        ndl_value gcsweep = ndl_node_pool_get(pool, key, NDL_SYM("\0gcsweep"));
+    ndl_graph_clean_sweep(graph, 0);
 
-        if ((gcsweep.type == EVAL_INT) && (gcsweep.num == -1))
-            ndl_graph_clean_mark(graph, key, -sweep);
+    ndl_backrefs *backrefs = ndl_graph_backref_set(graph, node);
+    if (backrefs == NULL)
+        return NULL;
 
-        curr = ndl_node_pool_next(pool, curr);
-    }
+    return ndl_backrefs_head(backrefs);
+}
 
-    curr = ndl_node_pool_head(pool);
-    while (curr != NULL) {
+void *ndl_graph_backref_next(ndl_graph *graph, ndl_ref node, void *prev) {
 
-        ndl_ref key = ndl_node_pool_node(pool, curr);
-        if (key == NDL_NULL_REF)
-            break;
+    ndl_backrefs *backrefs = ndl_graph_backref_set(graph, node);
+    if (backrefs == NULL)
+        return NULL;
 
-        ndl_value gcsweep = ndl_node_pool_get(pool, key, NDL_SYM("\0gcsweep"));
+    return ndl_backrefs_next(backrefs, prev);
+}
 
-        if (!((gcsweep.type == EVAL_INT) &&
-              ((gcsweep.num == -1) || (gcsweep.num >= sweep))))
-            ndl_graph_clean_remove(graph, key);
+ndl_ref ndl_graph_backref_node(ndl_graph *graph, ndl_ref node, void *curr) {
 
-        curr = ndl_node_pool_next(pool, curr);
-    }
+    ndl_backrefs *backrefs = ndl_graph_backref_set(graph, node);
+    if (backrefs == NULL)
+        return NDL_NULL_REF;
+
+    return ndl_backrefs_ref(backrefs, curr);
 }
 
-int ndl_graph_set(ndl_graph *graph, ndl_ref node, ndl_sym key, ndl_value value) {
+uint64_t ndl_graph_backref_count(ndl_graph *graph, ndl_ref node, void *curr) {
 
-    if (node == NDL_NULL_REF)
-        return -1;
+    ndl_backrefs *backrefs = ndl_graph_backref_set(graph, node);
+    if (backrefs == NULL)
+        return 0;
 
-    ndl_value val = ndl_node_pool_get((ndl_node_pool *) graph->pool,
-                                      node, key);
+    return ndl_backrefs_refs(backrefs, curr);
+}
 
-    int err = 0;
-    if (value.type == EVAL_REF)
-        err = ndl_graph_add_backref((ndl_node_pool *) graph->pool,
-                                    value.ref, node);
+uint64_t ndl_graph_backrefs(ndl_graph *graph, ndl_ref to, ndl_ref from) {
 
-    if (err != 0)
-        return err;
+    if (ndl_graph_fault(graph, to) != 0)
+        return 0;
 
-    err = ndl_node_pool_put((ndl_node_pool *) graph->pool,
-                            node, key, value);
+    ndl_graph_clean_sweep(graph, 0);
 
-    if (err != 0) {
-        if (value.type == EVAL_REF)
-            ndl_graph_rm_backref((ndl_node_pool *) graph->pool,
-                                 value.ref, node);
-        return err;
+    ndl_backrefs *backrefs = ndl_graph_backref_set(graph, to);
+    if (backrefs == NULL)
+        return 0;
+
+    return ndl_backrefs_count(backrefs, from);
+}
+
+/* Serialization, in the format described at the top of the file. */
+
+#define NDL_GRAPH_IMAGE_LANES 4
+
+/* Multiply-xorshift over the words, a lane per word mod LANES so the
+ * lanes' multiplies overlap, then the lanes folded into sum.
+ */
+static uint64_t ndl_graph_image_sum(uint64_t sum, uint64_t *words, uint64_t count, int swap) {
+
+    uint64_t lanes[NDL_GRAPH_IMAGE_LANES] = {0};
+
+    uint64_t i, j;
+    for (i = 0; i < count; i++) {
+        j = i % NDL_GRAPH_IMAGE_LANES;
+        lanes[j] = (lanes[j] ^ ndl_graph_image_word(words[i], swap)) * 0xFF51AFD7ED558CCD;
+        lanes[j] ^= lanes[j] >> 32;
     }
 
-    if (val.type == EVAL_REF)
-        ndl_graph_rm_backref((ndl_node_pool *) graph->pool,
-                             val.ref, node);
+    sum ^= count;
+    for (j = 0; j < NDL_GRAPH_IMAGE_LANES; j++) {
+        sum = (sum ^ lanes[j]) * 0xFF51AFD7ED558CCD;
+        sum ^= sum >> 32;
+    }
 
-    return 0;
+    return sum;
 }
 
-int ndl_graph_del(ndl_graph *graph, ndl_ref node, ndl_sym key) {
+/* Checksum an image's columns. */
+static uint64_t ndl_graph_image_check(uint64_t *ids, uint64_t nodes, uint64_t pairs,
+                                      uint64_t backrefs, int swap) {
 
-    if (node == NDL_NULL_REF)
-        return -1;
+    uint64_t numbers = 4 * nodes + 2 * pairs, types = (pairs + 7) / 8;
 
-    ndl_value val = ndl_node_pool_get((ndl_node_pool *) graph->pool,
-                                      node, key);
+    /* Type bytes are the same in either order; read them one way everywhere. */
+    uint16_t probe = 1;
+    int big = *(uint8_t *) &probe;
 
-    if (val.type == EVAL_REF)
-        ndl_graph_rm_backref((ndl_node_pool *) graph->pool,
-                             val.ref, node);
+    uint64_t sum = ndl_graph_image_sum(0x9E3779B97F4A7C15, ids, numbers, swap);
+    sum = ndl_graph_image_sum(sum, ids + numbers, types, big);
 
-    return ndl_node_pool_del((ndl_node_pool *) graph->pool,
-                             node, key);
+    return ndl_graph_image_sum(sum, ids + numbers + types, 2 * backrefs, swap);
 }
 
-int64_t ndl_graph_size(ndl_graph *graph, ndl_ref node) {
+uint64_t ndl_graph_mem_est(ndl_graph *graph) {
+
+    ndl_node_pool *pool = (ndl_node_pool *) graph->pool;
 
-    void *curr = ndl_node_pool_node_pairs_head((ndl_node_pool *) graph->pool, node);
+    ndl_graph_fault_all(graph);
+    ndl_graph_clean_sweep(graph, 0);
 
-    int sum = 0;
+    uint64_t backrefs = 0;
 
+    void *curr = ndl_node_pool_head(pool);
     while (curr != NULL) {
 
-        ndl_sym key = ndl_node_pool_node_pairs_key((ndl_node_pool *) graph->pool, node, curr);
-        if (!NDL_ISHIDDEN(key))
-            sum++;
+        ndl_ref node = ndl_node_pool_node(pool, curr);
+        if (node == NDL_NULL_REF)
+            break;
+
+        backrefs += ndl_backrefs_size(&ndl_node_pool_node_peek(pool, node)->backrefs);
 
-        curr = ndl_node_pool_node_pairs_next((ndl_node_pool *) graph->pool, node, curr);
+        curr = ndl_node_pool_next(pool, curr);
     }
 
-    return sum;
+    return sizeof(ndl_graph_image) + sizeof(uint64_t) *
+        ndl_graph_image_words(ndl_node_pool_size(pool), ndl_node_pool_pair_count(pool), backrefs);
 }
 
-ndl_value ndl_graph_get(ndl_graph *graph, ndl_ref node, ndl_sym key) {
+int64_t ndl_graph_to_mem(ndl_graph *graph, uint64_t maxlen, void *mem) {
 
-    return ndl_node_pool_get((ndl_node_pool *) graph->pool,
-                             node, key);
-}
+    ndl_node_pool *pool = (ndl_node_pool *) graph->pool;
 
-ndl_sym ndl_graph_index(ndl_graph *graph, ndl_ref node, int64_t index) {
+    if (ndl_graph_fault_all(graph) != 0)
+        return -1;
 
-    void *curr = ndl_node_pool_node_pairs_head((ndl_node_pool *) graph->pool, node);
+    /* Don't save the dead. */
+    ndl_graph_clean_sweep(graph, 0);
 
-    int sum = 0;
+    uint64_t nodes = ndl_node_pool_size(pool), pairs = ndl_node_pool_pair_count(pool);
 
-    while (curr != NULL) {
+    /* All but the backrefs, which are checked against maxlen as they're written. */
+    uint64_t size = sizeof(ndl_graph_image) + sizeof(uint64_t) * ndl_graph_image_words(nodes, pairs, 0);
+    if (size > maxlen)
+        return -1;
+
+    uint64_t room = (maxlen - size) / (2 * sizeof(uint64_t));
+
+    ndl_graph_image *image = (ndl_graph_image *) mem;
+
+    uint64_t *ids = (uint64_t *) (image + 1);
+    uint64_t *marks = ids + nodes;
+    uint64_t *pair_ends = marks + nodes;
+    uint64_t *backref_ends = pair_ends + nodes;
+    uint64_t *keys = backref_ends + nodes;
+    uint64_t *vals = keys + pairs;
+    uint8_t *types = (uint8_t *) (vals + pairs);
+    uint64_t *brefs = vals + pairs + (pairs + 7) / 8;
 
-        ndl_sym key = ndl_node_pool_node_pairs_key((ndl_node_pool *) graph->pool, node, curr);
+    memset(types, 0, sizeof(uint64_t) * ((pairs + 7) / 8));
 
-        if (!NDL_ISHIDDEN(key)) {
-            if (sum == index)
-                return key;
-            sum++;
+    uint64_t i = 0, pair = 0, backref = 0;
+
+    void *currnode = ndl_node_pool_head(pool);
+    while (currnode != NULL) {
+
+        ndl_ref node = ndl_node_pool_node(pool, currnode);
+        if (node == NDL_NULL_REF)
+            break;
+
+        ndl_node_pool_header *header = ndl_node_pool_node_peek(pool, node);
+
+        ids[i] = (uint64_t) node;
+        marks[i] = (header->mark == -1)? (uint64_t) -1 : 0;
+
+        void *currkv = ndl_node_pool_node_pairs_head(pool, node);
+        while (currkv != NULL) {
+
+            ndl_value val = ndl_node_pool_node_pairs_val(pool, node, currkv);
+
+            keys[pair] = ndl_node_pool_node_pairs_key(pool, node, currkv);
+            vals[pair] = NDL_VALUE_WORD(val);
+            types[pair] = (uint8_t) NDL_VALUE_TYPE(val);
+            pair++;
+
+            currkv = ndl_node_pool_node_pairs_next(pool, node, currkv);
         }
 
-        curr = ndl_node_pool_node_pairs_next((ndl_node_pool *) graph->pool, node, curr);
-    }
+        if (backref + ndl_backrefs_size(&header->backrefs) > room)
+            return -1;
+
+        void *currbr = ndl_backrefs_head(&header->backrefs);
+        while (currbr != NULL) {
 
-    return NDL_NULL_SYM;
-}
+            brefs[2 * backref] = (uint64_t) ndl_backrefs_ref(&header->backrefs, currbr);
+            brefs[2 * backref + 1] = ndl_backrefs_refs(&header->backrefs, currbr);
+            backref++;
 
-static inline void *ndl_graph_backref_next_back(ndl_graph *graph, ndl_ref node, void *curr) {
+            currbr = ndl_backrefs_next(&header->backrefs, currbr);
+        }
 
-    ndl_node_pool *pool = (ndl_node_pool *) graph->pool;
-    while (curr != NULL) {
-        ndl_sym key = ndl_node_pool_node_pairs_key(pool, node, curr);
-        if (NDL_ISBACKREF(key))
-            return curr;
+        pair_ends[i] = pair;
+        backref_ends[i] = backref;
+        i++;
 
-        curr = ndl_node_pool_node_pairs_next(pool, node, curr);
+        currnode = ndl_node_pool_next(pool, currnode);
     }
 
-    return NULL;
-}
-
-void *ndl_graph_backref_head(ndl_graph *graph, ndl_ref node) {
+    if ((i != nodes) || (pair != pairs))
+        return -1;
 
-    void *curr = ndl_node_pool_node_pairs_head((ndl_node_pool *) graph->pool, node);
+    size = sizeof(ndl_graph_image) + sizeof(uint64_t) * ndl_graph_image_words(nodes, pairs, backref);
 
-    return ndl_graph_backref_next_back(graph, node, curr);
-}
+    memcpy(image->magic, NDL_GRAPH_MAGIC, sizeof(image->magic));
+    image->version = NDL_GRAPH_VERSION;
+    image->order = NDL_GRAPH_ORDER;
 
-void *ndl_graph_backref_next(ndl_graph *graph, ndl_ref node, void *prev) {
+    image->size = size;
+    image->nodes = nodes;
+    image->pairs = pairs;
+    image->backrefs = backref;
 
-    prev = ndl_node_pool_node_pairs_next((ndl_node_pool *) graph->pool, node, prev);
+    image->checksum = ndl_graph_image_check(ids, nodes, pairs, backref, 0);
 
-    return ndl_graph_backref_next_back(graph, node, prev);
+    return (int64_t) size;
 }
 
-ndl_ref ndl_graph_backref_node(ndl_graph *graph, ndl_ref node, void *curr) {
+/* Load a version 2 image. Each node gets its pairs in one fill(), with
+ * its storage sized up front. NULL on error, or for a damaged image.
+ */
+static ndl_graph *ndl_graph_from_image(uint64_t maxlen, void *mem) {
 
-    ndl_sym key = ndl_node_pool_node_pairs_key((ndl_node_pool *) graph->pool, node, curr);
-    if ((key == NDL_NULL_SYM) || (!NDL_ISBACKREF(key)))
-        return NDL_NULL_REF;
-    else
-        return NDL_DEBACKREF(key);
-}
+    ndl_graph_mapped image;
+    if (ndl_graph_mapped_parse(&image, maxlen, mem) != 0)
+        return NULL;
 
-uint64_t ndl_graph_backref_count(ndl_graph *graph, ndl_ref node, void *curr) {
+    if (ndl_graph_image_check(image.ids, image.nodes, image.pairs, image.backrefs, image.swap) !=
+        ndl_graph_image_word(((ndl_graph_image *) mem)->checksum, image.swap))
+        return NULL;
 
-    ndl_value val = ndl_node_pool_node_pairs_val((ndl_node_pool *) graph->pool, node, curr);
-    if (val.type != EVAL_INT)
-        return 0;
-    else
-        return (uint64_t) val.num;
-}
+    ndl_graph *graph = ndl_graph_init();
+    if (graph == NULL)
+        return NULL;
 
-uint64_t ndl_graph_backrefs(ndl_graph *graph, ndl_ref to, ndl_ref from) {
+    uint64_t i;
+    for (i = 0; i < image.nodes; i++)
+        if (ndl_graph_mapped_load((ndl_node_pool *) graph->pool, &image, i) != 0)
+            break;
 
-    ndl_value val = ndl_node_pool_get((ndl_node_pool *) graph->pool, to, NDL_BACKREF(from));
-    if (val.type != EVAL_INT)
-        return 0;
-    else
-        return (uint64_t) val.num;
+    free(image.scratch);
+
+    if (i < image.nodes) {
+        ndl_graph_kill(graph);
+        return NULL;
+    }
+
+    return graph;
 }
 
-/* Serialization format:
+/* Serialization format, version 1, read only:
  * Entirely in big endian.
  * Nodes not ordered by ID.
  * KV pairs unordered.
@@ -431,6 +2438,9 @@ uint64_t ndl_graph_backrefs(ndl_graph *graph, ndl_ref to, ndl_ref from) {
  *   ]
  * ]
  *
+ * Node metadata is stored as hidden pairs, after the node's keys:
+ * the GC mark as "\0gcsweep" = int, and each backref as the key
+ * "\0b" src "b\0" (src as 32 bits, in the middle four bytes) = int count.
  *
  * Size:
  * sizeo(graphroot) = 4
@@ -441,137 +2451,58 @@ uint64_t ndl_graph_backrefs(ndl_graph *graph, ndl_ref to, ndl_ref from) {
  *               = 4 + 6*nodes + 17*keys
  */
 
-uint64_t ndl_graph_mem_est(ndl_graph *graph) {
-
-    uint64_t nodes = ndl_node_pool_size((ndl_node_pool *) graph->pool);
-
-    /* Assume there are not more than 16 keys per node.
-     * If there are, caller functions will just retry with more.
-     * If there are not, it's not an unreasonable amount of wasted memory.
-     */
-    uint64_t estkvpairs = nodes * 16;
-
-    return 4 + 6*nodes + 17*estkvpairs;
-}
+#define NDL_GCSWEEP NDL_SYM("\0gcsweep")
 
-#define MEMPUSH(type, value)              \
-    *((type *) &to[curr]) = (type) value; \
-    curr += sizeof(type)
+#define NDL_DEBACKREF(ref) (ndl_ref) (uint32_t) ((ref & 0x0000FFFFFFFF0000) >> 16)
+#define NDL_ISBACKREF(ref) ((ref & 0xFFFF00000000FFFF) == *((uint64_t*) "\0b\0\0\0\0b\0"))
 
 #define MEMPOP(type, var)          \
     var = *((type *) &from[curr]); \
     curr += sizeof(type)
 
-static inline int64_t ndl_graph_to_mem_kvpair(ndl_graph *graph, ndl_sym key, ndl_value val, uint64_t maxlen, char *to) {
-
-    uint64_t curr = 0;
-
-    if ((maxlen - curr) < (sizeof(uint64_t) + sizeof(uint8_t) + sizeof(uint64_t)))
-        return -1;
-
-    MEMPUSH(uint64_t, ENDIAN_TO_BIG_64(key));
-    MEMPUSH(uint8_t, ((uint8_t) val.type));
-    MEMPUSH(int64_t, ENDIAN_TO_BIG_64(((uint64_t) val.num)));
-
-    return (int64_t) curr;
-}
-
-static inline int64_t ndl_graph_to_mem_node(ndl_graph *graph, long int node, uint64_t maxlen, char *to) {
+static inline int64_t ndl_graph_from_v1_kv(ndl_graph *graph, ndl_ref node, uint64_t maxlen, char *from) {
 
     uint64_t curr = 0;
 
-    uint32_t id = (uint32_t) node;
-
-    uint16_t count = (uint16_t) ndl_node_pool_node_size((ndl_node_pool *) graph->pool, (ndl_ref) node);
+    uint64_t key;
+    uint8_t type;
+    uint64_t val;
 
-    if ((maxlen - curr) < (sizeof(id) + sizeof(count)))
+    if ((maxlen - curr) < sizeof(key) + sizeof(type) + sizeof(val))
         return -1;
 
-    MEMPUSH(uint32_t, ENDIAN_TO_BIG_32(id));
-    MEMPUSH(uint16_t, ENDIAN_TO_BIG_16(count));
-
-    void *currkv = ndl_node_pool_node_pairs_head((ndl_node_pool *) graph->pool, node);
-
-    while (currkv != NULL) {
-
-        ndl_sym key = ndl_node_pool_node_pairs_key((ndl_node_pool *) graph->pool, node, currkv);
-
-        ndl_value val = ndl_node_pool_node_pairs_val((ndl_node_pool *) graph->pool, (ndl_ref) node, currkv);
-
-        int64_t used = ndl_graph_to_mem_kvpair(graph, key, val, maxlen - curr, to + curr);
-
-        if (used < 0)
-            return -1;
-
-        curr += (uint64_t) used;
-
-        currkv = ndl_node_pool_node_pairs_next((ndl_node_pool *) graph->pool, node, currkv);
-    }
-
-    return (int64_t) curr;
-}
+    MEMPOP(uint64_t, key); key = ENDIAN_FROM_BIG_64(key);
+    MEMPOP(uint8_t, type);
+    MEMPOP(uint64_t, val); val = ENDIAN_FROM_BIG_64(val);
 
-int64_t ndl_graph_to_mem(ndl_graph *graph, uint64_t maxlen, void *mem) {
+    ndl_value value = NDL_VALUE(type, num=(ndl_int) val);
 
-    char *to = (char *) mem;
-    uint64_t curr = 0;
     ndl_node_pool *pool = (ndl_node_pool *) graph->pool;
 
-    uint32_t node_count = (uint32_t) ndl_node_pool_size(pool);
-    node_count = ENDIAN_TO_BIG_32(node_count);
-
-    if ((maxlen - curr) < sizeof(node_count))
-        return -1;
-
-    MEMPUSH(uint32_t, node_count);
-
-    void *currnode = ndl_node_pool_head(pool);
-
-    while (currnode != NULL) {
-
-        ndl_ref node = ndl_node_pool_node(pool, currnode);
-        if (node == NDL_NULL_REF)
-            break;
-
-        int64_t used = ndl_graph_to_mem_node(graph, node, maxlen - curr, to + curr);
+    if (key == NDL_GCSWEEP) {
 
-        if (used < 0)
+        if (NDL_VALUE_TYPE(value) != EVAL_INT)
             return -1;
 
-        curr += (uint64_t) used;
-
-        currnode = ndl_node_pool_next(pool, currnode);
-    }
-
-    return (int64_t) curr;
-}
-
-static inline int64_t ndl_graph_from_mem_kv(ndl_graph *graph, ndl_ref node, uint64_t maxlen, char *from) {
-
-    uint64_t curr = 0;
-
-    uint64_t key;
-    uint8_t type;
-    uint64_t val;
+        ndl_node_pool_node_header(pool, node)->mark = NDL_VALUE_NUM(value);
+        ndl_graph_clean_adopt(graph, NDL_VALUE_NUM(value));
 
-    if ((maxlen - curr) < sizeof(key) + sizeof(type) + sizeof(val))
-        return -1;
+    } else if (NDL_ISBACKREF(key)) {
 
-    MEMPOP(uint64_t, key); key = ENDIAN_FROM_BIG_64(key);
-    MEMPOP(uint8_t, type);
-    MEMPOP(uint64_t, val); val = ENDIAN_FROM_BIG_64(val);
+        if (NDL_VALUE_TYPE(value) != EVAL_INT)
+            return -1;
 
-    ndl_value value;
-    value.type = type;
-    value.num = (ndl_int) val;
+        if (ndl_graph_put_backref(pool, node, NDL_DEBACKREF(key), (uint64_t) NDL_VALUE_NUM(value)) != 0)
+            return -1;
 
-    if (ndl_node_pool_put((ndl_node_pool *) graph->pool, node, key, value) != 0)
+    } else if (ndl_node_pool_put(pool, node, key, value) != 0) {
         return -1;
+    }
 
     return (int64_t) curr;
 }
 
-static inline int64_t ndl_graph_from_mem_node(ndl_graph *graph, uint64_t maxlen, char *from) {
+static inline int64_t ndl_graph_from_v1_node(ndl_graph *graph, uint64_t maxlen, char *from) {
 
     uint64_t curr = 0;
 
@@ -592,7 +2523,7 @@ static inline int64_t ndl_graph_from_mem_node(ndl_graph *graph, uint64_t maxlen,
     unsigned int i;
     for (i = 0; i < count; i++) {
 
-        int64_t used = ndl_graph_from_mem_kv(graph, node, maxlen - curr, from + curr);
+        int64_t used = ndl_graph_from_v1_kv(graph, node, maxlen - curr, from + curr);
         if (used < 0)
             return -1;
 
@@ -602,12 +2533,7 @@ static inline int64_t ndl_graph_from_mem_node(ndl_graph *graph, uint64_t maxlen,
     return (int64_t) curr;
 }
 
-ndl_graph *ndl_graph_from_mem(uint64_t maxlen, void *mem) {
-
-    ndl_graph *graph = ndl_graph_init();
-
-    if (graph == NULL)
-        return NULL;
+static ndl_graph *ndl_graph_from_v1(uint64_t maxlen, void *mem) {
 
     char *from = mem;
     uint64_t curr = 0;
@@ -616,13 +2542,18 @@ ndl_graph *ndl_graph_from_mem(uint64_t maxlen, void *mem) {
     if ((maxlen - curr) < sizeof(count))
         return NULL;
 
+    ndl_graph *graph = ndl_graph_init();
+
+    if (graph == NULL)
+        return NULL;
+
     count = ENDIAN_FROM_BIG_32(*((uint32_t *) &from[curr]));
     curr += sizeof(count);
 
     unsigned int i;
     for (i = 0; i < count; i++) {
 
-        int64_t used = ndl_graph_from_mem_node(graph, maxlen - curr, from + curr);
+        int64_t used = ndl_graph_from_v1_node(graph, maxlen - curr, from + curr);
         if (used < 0) {
             ndl_graph_kill(graph);
             return NULL;
@@ -634,329 +2565,331 @@ ndl_graph *ndl_graph_from_mem(uint64_t maxlen, void *mem) {
     return graph;
 }
 
-static inline ndl_ref ndl_graph_copy_node(ndl_node_pool *to, ndl_node_pool *from, ndl_ref node) {
+ndl_graph *ndl_graph_from_mem(uint64_t maxlen, void *mem) {
 
-    ndl_ref new = ndl_node_pool_alloc(to);
-    if (new == NDL_NULL_REF)
-        return NDL_NULL_REF;
+    if ((maxlen >= sizeof(ndl_graph_image)) &&
+        (memcmp(mem, NDL_GRAPH_MAGIC, sizeof(((ndl_graph_image *) mem)->magic)) == 0))
+        return ndl_graph_from_image(maxlen, mem);
 
-    void *kvpair = ndl_node_pool_node_pairs_head(from, node);
-    while (kvpair != NULL) {
+    return ndl_graph_from_v1(maxlen, mem);
+}
 
-        ndl_sym key = ndl_node_pool_node_pairs_key(from, node, kvpair);
-        ndl_value val = ndl_node_pool_node_pairs_val(from, node, kvpair);
-        if (key == NDL_SYM("\0gcsweep")) {
-            if ((val.type == EVAL_INT) && (val.num == -1)) {
-                val.num = -2;
-            }
-        }
+/* The checksum would read the whole image, so it's skipped; parse()
+ * still reads the columns that say where everything is.
+ */
+ndl_graph *ndl_graph_open_mmap(const char *path) {
 
-        int err = ndl_node_pool_put(to, new, key, val);
-        if (err != 0) {
-            ndl_node_pool_free(to, new);
-            return NDL_NULL_REF;
-        }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
 
-        kvpair = ndl_node_pool_node_pairs_next(from, node, kvpair);
+    struct stat st;
+    if ((fstat(fd, &st) != 0) || (st.st_size <= 0)) {
+        close(fd);
+        return NULL;
     }
 
-    return new;
-}
-static inline int ndl_graph_copy_fix_node(ndl_node_pool *to, ndl_rhashtable *mapping, ndl_ref old) {
+    uint64_t len = (uint64_t) st.st_size;
+    void *mem = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
 
-    ndl_ref *new = ndl_rhashtable_get(mapping, &old);
-    if (new == NULL)
-        return -1;
+    if (mem == MAP_FAILED)
+        return NULL;
 
-    void *kvpair = ndl_node_pool_node_pairs_head(to, *new);
-    while (kvpair != NULL) {
+    /* Version 1 images can't be read in place; load them whole. */
+    if ((len < sizeof(ndl_graph_image)) ||
+        (memcmp(mem, NDL_GRAPH_MAGIC, sizeof(((ndl_graph_image *) mem)->magic)) != 0)) {
+        ndl_graph *graph = ndl_graph_from_v1(len, mem);
+        munmap(mem, len);
+        return graph;
+    }
 
-        ndl_sym key = ndl_node_pool_node_pairs_key(to, *new, kvpair);
-        if (key == NDL_NULL_SYM)
-            return -1;
+    ndl_graph_mapped *image = malloc(sizeof(ndl_graph_mapped));
+    ndl_graph *graph = ndl_graph_init();
 
-        ndl_value val = ndl_node_pool_node_pairs_val(to, *new, kvpair);
+    if ((image == NULL) || (graph == NULL) || (ndl_graph_mapped_parse(image, len, mem) != 0) ||
+        ((image->faulted = calloc(image->nodes / 64 + 1, sizeof(uint64_t))) == NULL)) {
+        free(image);
+        if (graph != NULL)
+            ndl_graph_kill(graph);
+        munmap(mem, len);
+        return NULL;
+    }
 
-        if (NDL_ISBACKREF(key)) {
+    image->base = mem;
+    image->len = len;
 
-            ndl_ref ref = NDL_DEBACKREF(key);
-            ndl_ref *nref = ndl_rhashtable_get(mapping, &ref);
-            if (nref == NULL)
-                return -1;
+    graph->mapped = image;
 
-            int err = ndl_node_pool_put(to, *new, NDL_BACKREF(nref), val);
-            if (err != 0)
-                return -1;
+    if (image->nodes == 0) {
+        ndl_graph_unmap(graph);
+        return graph;
+    }
 
-            err = ndl_node_pool_del(to, *new, key);
-            if (err != 0)
-                return -1;
+    /* Keep new nodes clear of the ids still in the image. */
+    ndl_node_pool_set_counter((ndl_node_pool *) graph->pool,
+                              (ndl_ref) ndl_graph_image_word(image->ids[image->nodes - 1], image->swap) + 1);
 
-        } else if (key == NDL_SYM("\0gcsweep")) {
+    return graph;
+}
 
-            if (val.type != EVAL_INT)
-                return -1;
+/* Copying. Both copies map old ids to new through a dense array indexed
+ * by old id, sized from the source pool's span, with 0 (never an id)
+ * for unmapped. New nodes are all allocated first, so each can then be
+ * written once, in full: its pairs, with references mapped, and its
+ * backrefs, with sources mapped. Nothing recurses. Copies made while
+ * a collection runs are shaded, as alloc() would, so it keeps them.
+ */
+typedef struct ndl_graph_copier_s {
 
-            if (val.num >= 0)
-                val.num = 0;
-            else
-                val.num = -1;
+    ndl_graph *graph;
+    ndl_node_pool *to, *from;
 
-            int err =  ndl_node_pool_put(to, *new, key, val);
-            if (err != 0)
-                return -1;
-        }
+    ndl_ref *map;
+    uint64_t span;
 
-        kvpair = ndl_node_pool_node_pairs_next(to, *new, kvpair);
-    }
+    ndl_vector order;
 
-    return 0;
-}
+} ndl_graph_copier;
 
-int ndl_graph_copy(ndl_graph *to, ndl_graph *from, ndl_ref *refs) {
+static int ndl_graph_copier_init(ndl_graph_copier *copier, ndl_graph *to, ndl_graph *from) {
 
-    /* Create mapping table.
-     * Iterate over nodes, insert with bad backrefs
-     * Iterate over nodes, correct backrefs, reset sweep (mark)
-     * Update refs
-     * Return
-     */
-    ndl_rhashtable *mapping = ndl_rhashtable_init(sizeof(ndl_ref), sizeof(ndl_ref), 16);
-    if (mapping == NULL)
+    copier->graph = to;
+    copier->to = (ndl_node_pool *) to->pool;
+    copier->from = (ndl_node_pool *) from->pool;
+
+    copier->span = ndl_node_pool_span(copier->from);
+    copier->map = calloc((copier->span > 0)? copier->span : 1, sizeof(ndl_ref));
+    if (copier->map == NULL)
         return -1;
 
-    ndl_node_pool *pool = (ndl_node_pool *) from->pool;
+    ndl_vector_minit(&copier->order, sizeof(ndl_ref));
 
-    void *curr = ndl_node_pool_head(pool);
-    while (curr != NULL) {
+    return 0;
+}
 
-        ndl_ref old = ndl_node_pool_node(pool, curr);
-        if (old == NDL_NULL_REF)
-            break;
+/* Ends a copy, freeing the copies made if it failed. */
+static void ndl_graph_copier_kill(ndl_graph_copier *copier, int failed) {
 
-        ndl_ref new = ndl_graph_copy_node((ndl_node_pool *) to->pool, pool, old);
-        void *mapping = ndl_rhashtable_put(mapping, &old, &new);
-        if ((new == NDL_NULL_REF) || (mapping == NULL)) {
-            ndl_rhashtable_kill(mapping);
-            return -1;
-        }
+    uint64_t i;
+    for (i = 0; failed && (i < ndl_vector_size(&copier->order)); i++)
+        ndl_node_pool_free(copier->to, copier->map[*(ndl_ref *) ndl_vector_get(&copier->order, i)]);
 
-        curr = ndl_node_pool_next(pool, curr);
-    }
+    ndl_vector_mkill(&copier->order);
+    free(copier->map);
+}
 
-    curr = ndl_node_pool_head(pool);
-    while (curr != NULL) {
+/* The copy of an old node, or NDL_NULL_REF if it has none. */
+static inline ndl_ref ndl_graph_copier_get(ndl_graph_copier *copier, ndl_ref old) {
 
-        ndl_ref old = ndl_node_pool_node(pool, curr);
-        if (old == NDL_NULL_REF)
-            break;
+    if ((old <= 0) || ((uint64_t) old >= copier->span) || (copier->map[old] == 0))
+        return NDL_NULL_REF;
 
-        int err = ndl_graph_copy_fix_node((ndl_node_pool *) to->pool, mapping, old);
-        if (err != 0) {
-            ndl_rhashtable_kill(mapping);
-            return -1;
-        }
+    return copier->map[old];
+}
 
-        curr = ndl_node_pool_next(pool, curr);
-    }
+/* Allocate a node's copy, unless it has one. Nonzero on error, or missing nodes. */
+static int ndl_graph_copier_add(ndl_graph_copier *copier, ndl_ref old) {
 
-    if (refs != NULL) {
+    if (ndl_graph_copier_get(copier, old) != NDL_NULL_REF)
+        return 0;
 
-        for (; *refs != NDL_NULL_REF; refs++) {
+    ndl_node_pool_header *header = ndl_node_pool_node_peek(copier->from, old);
+    if (header == NULL)
+        return -1;
 
-            ndl_ref *res = ndl_rhashtable_get(mapping, refs);
-            if (res == NULL) {
-                ndl_rhashtable_kill(mapping);
-                return -1;
-            }
+    ndl_ref new = ndl_node_pool_alloc(copier->to);
+    if (new == NDL_NULL_REF)
+        return -1;
 
-            *refs = *res;
-        }
+    if (ndl_vector_push(&copier->order, &old) == NULL) {
+        ndl_node_pool_free(copier->to, new);
+        return -1;
     }
 
-    ndl_rhashtable_kill(mapping);
+    copier->map[old] = new;
+    ndl_graph_clean_shade(copier->graph, new);
 
     return 0;
 }
 
-static inline int ndl_graph_dcopy_add(ndl_node_pool *to, ndl_node_pool *from,
-                                      ndl_ref node, ndl_rhashtable *mapping) {
+/* Fill in a node's copy. Backrefs from nodes left out of the copy are dropped. */
+static int ndl_graph_copier_write(ndl_graph_copier *copier, ndl_ref old, int keep_roots) {
 
-    /* If in mapping, return
-     * create a new node,
-     * set gc=-3
-     * add mapping,
-     * for each kv pair:
-     *   if ref, recurse
-     * return
-     */
-    void *ret = ndl_rhashtable_get(mapping, &node);
-    if (ret != NULL)
-        return 0;
+    ndl_node_pool *from = copier->from;
+    ndl_ref new = copier->map[old];
 
-    ndl_ref new = ndl_node_pool_alloc(to);
-    if (new == NDL_NULL_REF)
-        return -1;
+    void *curr = ndl_node_pool_node_pairs_head(from, old);
+    while (curr != NULL) {
 
-    ret = ndl_rhashtable_put(mapping, &node, &new);
-    if (ret == NULL) {
-        ndl_node_pool_free(to, new);
-        return -1;
-    }
+        ndl_value val = ndl_node_pool_node_pairs_val(from, old, curr);
+        if ((NDL_VALUE_TYPE(val) == EVAL_REF) && (NDL_VALUE_REF(val) != NDL_NULL_REF)) {
+            val = NDL_VALUE(EVAL_REF, ref=ndl_graph_copier_get(copier, NDL_VALUE_REF(val)));
+            if (NDL_VALUE_REF(val) == NDL_NULL_REF)
+                return -1;
+        }
 
-    int err = ndl_node_pool_put(to, new, NDL_SYM("\0gcsweep"), NDL_VALUE(EVAL_INT, num=-3));
-    if (err != 0) {
-        ndl_node_pool_free(to, new);
-        return -1;
+        if (ndl_node_pool_put(copier->to, new, ndl_node_pool_node_pairs_key(from, old, curr), val) != 0)
+            return -1;
+
+        curr = ndl_node_pool_node_pairs_next(from, old, curr);
     }
 
-    void *curr = ndl_node_pool_node_pairs_head(from, node);
-    while (curr != NULL) {
+    ndl_arena *arena = ndl_node_pool_arena(copier->to);
+    ndl_node_pool_header *header = ndl_node_pool_node_header(copier->to, new);
+    ndl_backrefs *backrefs = &ndl_node_pool_node_peek(from, old)->backrefs;
 
-        ndl_value val = ndl_node_pool_node_pairs_val(from, node, curr);
+    if ((arena == NULL) || (header == NULL))
+        return -1;
 
-        if ((val.type == EVAL_REF) && (val.ref != NDL_NULL_REF)) {
+    if (keep_roots && (ndl_node_pool_node_peek(from, old)->mark == -1))
+        header->mark = -1;
 
-            err = ndl_graph_dcopy_add(to, from, val.ref, mapping);
-            if (err != 0) {
-                ndl_node_pool_free(to, new);
-                return -1;
-            }
-        }
+    curr = ndl_backrefs_head(backrefs);
+    while (curr != NULL) {
+
+        ndl_ref src = ndl_graph_copier_get(copier, ndl_backrefs_ref(backrefs, curr));
+        if ((src != NDL_NULL_REF) &&
+            (ndl_backrefs_put(&header->backrefs, arena, src, ndl_backrefs_refs(backrefs, curr)) != 0))
+            return -1;
 
-        curr = ndl_node_pool_node_pairs_next(from, node, curr);
+        curr = ndl_backrefs_next(backrefs, curr);
     }
 
     return 0;
 }
 
-static inline int ndl_graph_dcopy_fix(ndl_node_pool *to, ndl_node_pool *from,
-                                      ndl_ref node, ndl_rhashtable *mapping) {
+/* Write every node added, in the order they were. */
+static int ndl_graph_copier_run(ndl_graph_copier *copier, int keep_roots) {
 
-    /*  
-     * if GC != -3, return,
-     * set GC to 0
-     * for each (origin) kv pair:
-     *    if GC, ignore
-     *    if backref, if remappable, remap, copy
-     *    if ref, remap, recurse
-     *    else, copy
-     * return
-     */
+    uint64_t i;
+    for (i = 0; i < ndl_vector_size(&copier->order); i++)
+        if (ndl_graph_copier_write(copier, *(ndl_ref *) ndl_vector_get(&copier->order, i), keep_roots) != 0)
+            return -1;
 
-    ndl_ref *new = ndl_rhashtable_get(mapping, &node);
-    if (new == NULL)
-        return -1;
+    return 0;
+}
 
-    ndl_value gc = ndl_node_pool_get(to, *new, NDL_SYM("\0gcsweep"));
-    if ((gc.type != EVAL_INT) || (gc.num != -3))
-        return 0;
+int ndl_graph_copy(ndl_graph *to, ndl_graph *from, ndl_ref *refs) {
 
-    gc.num = 0;
-    int err = ndl_node_pool_put(to, *new, NDL_SYM("\0gcsweep"), gc);
-    if (err != 0)
+    if ((ndl_graph_fault_all(to) != 0) || (ndl_graph_fault_all(from) != 0))
         return -1;
 
-    void *curr = ndl_node_pool_node_pairs_head(from, node);
-    while (curr != NULL) {
-
-        ndl_sym key = ndl_node_pool_node_pairs_key(from, node, curr);
-        ndl_value val = ndl_node_pool_node_pairs_val(from, node, curr);
+    ndl_graph_clean_sweep(from, 0);
 
-        if (key == NDL_SYM("\0gcsweep")) {
-            key = NDL_NULL_SYM;
-        } else if (NDL_ISBACKREF(key)) {
+    ndl_graph_copier copier;
+    if (ndl_graph_copier_init(&copier, to, from) != 0)
+        return -1;
 
-            ndl_ref old_ref = NDL_DEBACKREF(key);
-            ndl_ref *new_ref = ndl_rhashtable_get(mapping, &old_ref);
-            if (new_ref == NULL)
-                key = NDL_NULL_SYM;
-            else
-                key = NDL_BACKREF(*new_ref);
+    /* In id order, for locality on both sides. */
+    void *curr = ndl_node_pool_head(copier.from);
+    while (curr != NULL) {
 
-        } else if ((val.type == EVAL_REF) && (val.ref != NDL_NULL_REF)) {
+        if (ndl_graph_copier_add(&copier, ndl_node_pool_node(copier.from, curr)) != 0) {
+            ndl_graph_copier_kill(&copier, 1);
+            return -1;
+        }
 
-            err = ndl_graph_dcopy_fix(to, from, val.ref, mapping);
-            if (err != 0)
-                return -1;
+        curr = ndl_node_pool_next(copier.from, curr);
+    }
 
-            ndl_ref *new_ref = ndl_rhashtable_get(mapping, &val.ref);
-            if (new_ref == NULL)
-                return -1;
+    if (ndl_graph_copier_run(&copier, 1) != 0) {
+        ndl_graph_copier_kill(&copier, 1);
+        return -1;
+    }
 
-            val.ref = *new_ref;
-        }
+    for (; (refs != NULL) && (*refs != NDL_NULL_REF); refs++) {
 
-        if (key != NDL_NULL_SYM) {
-            err = ndl_node_pool_put(to, *new, key, val);
-            if (err != 0)
-                return -1;
+        ndl_ref new = ndl_graph_copier_get(&copier, *refs);
+        if (new == NDL_NULL_REF) {
+            ndl_graph_copier_kill(&copier, 1);
+            return -1;
         }
 
-        curr = ndl_node_pool_node_pairs_next(from, node, curr);
+        *refs = new;
     }
 
-    return 0;
+    int count = (int) ndl_vector_size(&copier.order);
+    ndl_graph_copier_kill(&copier, 0);
+
+    return count;
 }
 
+/* How far ahead of the queue's head dcopy() prefetches. */
+#define NDL_GRAPH_COPY_AHEAD 8
+
 int ndl_graph_dcopy(ndl_graph *to, ndl_graph *from, ndl_ref *roots) {
 
-    /* Create mapping table,
-     * for each root:
-     *    recursively add root and reachable to table with bad refs and bad GC
-     * for each root:
-     *    recursively correct references and GC
-     *    mark root
-     *    map root arg
-     * return
-     */
-    ndl_rhashtable *mapping = ndl_rhashtable_init(sizeof(ndl_ref), sizeof(ndl_ref), 16);
-    if (mapping == NULL)
+    if ((ndl_graph_fault_all(to) != 0) || (ndl_graph_fault_all(from) != 0))
         return -1;
 
-    ndl_node_pool *srcpool = (ndl_node_pool *) from->pool;
-    ndl_node_pool *dstpool = (ndl_node_pool *) to->pool;
+    ndl_graph_copier copier;
+    if (ndl_graph_copier_init(&copier, to, from) != 0)
+        return -1;
 
+    /* Breadth first: the order list is the queue. A node's references
+     * all have copies once it's dequeued, so it's written then, while
+     * it's in cache, and the backrefs come from the references copied.
+     */
     ndl_ref *base;
     for (base = roots; *base != NDL_NULL_REF; base++) {
-
-        int err = ndl_graph_dcopy_add(dstpool, srcpool, *base, mapping);
-        if (err != 0) {
-            ndl_rhashtable_kill(mapping);
+        if (ndl_graph_copier_add(&copier, *base) != 0) {
+            ndl_graph_copier_kill(&copier, 1);
             return -1;
         }
     }
 
-    for (base = roots; *base != NDL_NULL_REF; base++) {
+    uint64_t i;
+    for (i = 0; i < ndl_vector_size(&copier.order); i++) {
 
-        ndl_ref *new = ndl_rhashtable_get(mapping, base);
-        if (new == NULL) {
-            ndl_rhashtable_kill(mapping);
-            return -1;
-        }
+        if (i + NDL_GRAPH_COPY_AHEAD < ndl_vector_size(&copier.order))
+            ndl_node_pool_prefetch(copier.from, *(ndl_ref *) ndl_vector_get(&copier.order, i + NDL_GRAPH_COPY_AHEAD));
 
-        int err = ndl_graph_dcopy_fix(dstpool, srcpool, *base, mapping);
-        if (err != 0) {
-            ndl_rhashtable_kill(mapping);
-            return -1;
-        }
+        ndl_ref old = *(ndl_ref *) ndl_vector_get(&copier.order, i);
+        ndl_ref new = copier.map[old];
 
-        err = ndl_node_pool_put(dstpool, *new,
-                                NDL_SYM("\0gcsweep"), NDL_VALUE(EVAL_INT, num=-1));
-        if (err != 0) {
-            ndl_rhashtable_kill(mapping);
-            return -1;
+        void *curr = ndl_node_pool_node_pairs_head(copier.from, old);
+        while (curr != NULL) {
+
+            ndl_value val = ndl_node_pool_node_pairs_val(copier.from, old, curr);
+            ndl_sym key = ndl_node_pool_node_pairs_key(copier.from, old, curr);
+
+            int err = 0;
+            if ((NDL_VALUE_TYPE(val) == EVAL_REF) && (NDL_VALUE_REF(val) != NDL_NULL_REF)) {
+                err = ndl_graph_copier_add(&copier, NDL_VALUE_REF(val));
+                val = NDL_VALUE(EVAL_REF, ref=copier.map[NDL_VALUE_REF(val)]);
+            }
+
+            if ((err != 0) || (ndl_node_pool_put(copier.to, new, key, val) != 0) ||
+                ((NDL_VALUE_TYPE(val) == EVAL_REF) && (NDL_VALUE_REF(val) != NDL_NULL_REF) &&
+                 (ndl_graph_add_backref(copier.to, NDL_VALUE_REF(val), new) != 0))) {
+                ndl_graph_copier_kill(&copier, 1);
+                return -1;
+            }
+
+            curr = ndl_node_pool_node_pairs_next(copier.from, old, curr);
         }
+    }
 
-        *base = *new;
+    int count = 0;
+    for (base = roots; *base != NDL_NULL_REF; base++, count++) {
+        *base = ndl_graph_copier_get(&copier, *base);
+        ndl_node_pool_node_header(copier.to, *base)->mark = -1;
     }
 
-    ndl_rhashtable_kill(mapping);
+    ndl_graph_copier_kill(&copier, 0);
 
-    return 0;
+    return count;
+}
+
+int ndl_graph_set_hugepages(ndl_graph *graph, int enable) {
+
+    return ndl_node_pool_hugepages((ndl_node_pool *) graph->pool, enable);
 }
 
 void ndl_graph_print(ndl_graph *graph) {
+    ndl_graph_fault_all(graph);
+    ndl_graph_clean_sweep(graph, 0);
     printf("Printing graph.\n");
     printf("Sweep: %ld.\n", graph->sweep);
     ndl_node_pool_print((ndl_node_pool *) graph->pool);
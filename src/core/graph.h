@@ -2,10 +2,46 @@
 #define NODEL_GRAPH_H
 
 #include "node.h"
+#include "vector.h"
+
+/* Pushes the refs of nodes held outside the graph; see set_roots(). */
+typedef int (*ndl_graph_roots_fn)(void *data, ndl_vector *roots);
+
+/* A mapped image's columns; see open_mmap(). */
+typedef struct ndl_graph_mapped_s ndl_graph_mapped;
+
+/* Phases of an incremental collection; see clean_step(). */
+typedef enum {
+    NDL_GRAPH_IDLE = 0,
+    NDL_GRAPH_MARK,
+    NDL_GRAPH_SWEEP
+} ndl_graph_phase;
 
 typedef struct ndl_graph_s {
 
     int64_t sweep;
+    uint64_t threads;
+
+    /* External roots. See set_roots(). */
+    ndl_graph_roots_fn roots;
+    void *roots_data;
+
+    /* Incremental collection state. */
+    ndl_graph_phase phase;
+    ndl_ref cursor;
+    ndl_vector grey;
+
+    /* Generational state. See clean_minor(). */
+    ndl_vector young, remembered;
+    int overflow;
+
+    /* Reference counting state. See set_refcount(). */
+    int refcount;
+    ndl_vector pending, suspects;
+
+    /* The image nodes are still read from. See open_mmap(). */
+    ndl_graph_mapped *mapped;
+
     uint8_t pool[];
 } ndl_graph;
 
@@ -38,6 +74,74 @@ uint64_t   ndl_graph_msize(void);
  * unmark() turns a node into a normal node.
  *
  * clean() runs the mark-and-sweep GC.
+ * set_threads() sets how many threads clean() marks with.
+ *     1 (the default) collects on the calling thread alone. With more,
+ *     clean() starts threads - 1 workers and waits for them.
+ * clean_sweep() frees up to budget of the nodes clean() found dead, 0
+ *     meaning all. Returns 1 once none are left, 0 otherwise.
+ * set_roots() sets a function every collection calls for more roots,
+ *     or NULL (the default) for none. It pushes refs onto roots, and
+ *     returns nonzero on error, abandoning the collection.
+ *
+ * clean() only marks, setting a bit per live node in a bitmap beside
+ * the node pool, and costs what marking does. The dead are swept lazily:
+ * alloc() and salloc() each free up to NDL_GRAPH_SWEEP_LAZY of them
+ * first, and serializing, copying, printing, or reading backrefs
+ * finishes the sweep. Meanwhile stat() and mark() treat them as gone.
+ *
+ * Nodes pushed by the roots function are kept like root nodes, without
+ * marking them: it's for state kept outside the graph, like a runtime's
+ * process frames, that changes too often to mark and unmark. It's asked
+ * when a collection starts marking, or for an incremental one, each time
+ * its root pass finishes, until it yields nothing new to scan.
+ * Reference counting doesn't ask it.
+ *
+ * clean_step() does up to budget units of an incremental collection,
+ *     starting one if none is running. A unit is a node visited or a
+ *     key/value scanned; 0 means no limit. Returns 1 once the collection
+ *     has finished, 0 if there's more to do, and -1 on error (the
+ *     collection is abandoned, freeing nothing more).
+ * clean_busy() returns whether an incremental collection is running.
+ *
+ * Incremental collections are tri-color: nodes are white (unreached),
+ * grey (reached, waiting to be scanned), or black (scanned). Between
+ * steps, set() shades the referenced node (a Dijkstra insertion barrier),
+ * so a scanned node never points at a white one, and whatever the
+ * program can still reach survives the sweep. Nodes allocated during a
+ * collection survive it. Deleting a reference needs no barrier.
+ * clean() finishes the job in one go, dropping any collection in progress.
+ *
+ * clean_minor() collects young nodes only. Returns 0 on success,
+ *     nonzero on error, having freed nothing. Drops any incremental
+ *     collection in progress.
+ * young() gets the number of young nodes, roughly.
+ *
+ * Nodes made by alloc() and salloc() start young. A minor collection
+ * traces from young roots and from the remembered set, the old nodes
+ * set() has stored references to young nodes in, and never follows
+ * references into old nodes, which it assumes live. Its cost follows the
+ * number of young nodes, not the graph's size. Young nodes surviving
+ * NDL_GRAPH_PROMOTE_AGE minor collections become old; a full collection
+ * (clean(), or the start of an incremental one) makes every node old.
+ * Old garbage, and young garbage referenced by it, waits for a full one.
+ *
+ * set_refcount() turns reference counting on (nonzero) or off.
+ *     Off by default.
+ * clean_cycles() frees garbage cycles, and anything queued.
+ *     Returns 0 on success, nonzero on error, having freed nothing.
+ * suspects() gets the number of nodes clean_cycles() would start from.
+ *
+ * With reference counting on, a normal node is freed as soon as set(),
+ * del() or unmark() leaves it without backreferences, and so on down
+ * what it referenced. Each call frees at most NDL_GRAPH_RC_BUDGET nodes,
+ * queueing the rest for later calls. Nodes kept alive only by a cycle
+ * need clean_cycles(): it takes the nodes that lost a reference without
+ * dying (the suspects) and everything reachable from them, and counts
+ * the references each gets from within that subgraph. Nodes with more
+ * backrefs than that, roots, and whatever they reach are live; the rest
+ * are cyclic garbage. The cost follows the suspects' reach, not the
+ * graph's size. References held outside the graph don't count: a
+ * salloc()ed node is freed once its base stops referencing it.
  */
 ndl_ref ndl_graph_alloc (ndl_graph *graph);
 ndl_ref ndl_graph_salloc(ndl_graph *graph, ndl_ref base, ndl_sym key);
@@ -46,7 +150,24 @@ int ndl_graph_stat  (ndl_graph *graph, ndl_ref node);
 int ndl_graph_mark  (ndl_graph *graph, ndl_ref node);
 int ndl_graph_unmark(ndl_graph *graph, ndl_ref node);
 
-void ndl_graph_clean(ndl_graph *graph);
+void ndl_graph_clean      (ndl_graph *graph);
+void ndl_graph_set_threads(ndl_graph *graph, uint64_t threads);
+void ndl_graph_set_roots  (ndl_graph *graph, ndl_graph_roots_fn roots, void *data);
+
+#define NDL_GRAPH_SWEEP_LAZY 8
+int ndl_graph_clean_sweep(ndl_graph *graph, uint64_t budget);
+
+int ndl_graph_clean_step(ndl_graph *graph, uint64_t budget);
+int ndl_graph_clean_busy(ndl_graph *graph);
+
+#define NDL_GRAPH_PROMOTE_AGE 2
+int      ndl_graph_clean_minor(ndl_graph *graph);
+uint64_t ndl_graph_young      (ndl_graph *graph);
+
+#define NDL_GRAPH_RC_BUDGET 64
+void     ndl_graph_set_refcount(ndl_graph *graph, int refcount);
+int      ndl_graph_clean_cycles(ndl_graph *graph);
+uint64_t ndl_graph_suspects    (ndl_graph *graph);
 
 
 /* Manipulate key/values.
@@ -57,8 +178,9 @@ void ndl_graph_clean(ndl_graph *graph);
  * get() gets node.key's value.
  * del() del(node.key).
  *
- * size() gets the number of non-hidden keys (including self.)
- * index() gets the nth non-hidden key's symbol (including self, indexing from zero.)
+ * size() gets the number of keys. GC and backref metadata are never keys.
+ * index() gets the nth key's symbol (indexing from zero), in insertion order.
+ *     Both O(1). Indexes are stable until a key is deleted.
  */
 int       ndl_graph_set(ndl_graph *graph, ndl_ref node, ndl_sym key, ndl_value value);
 ndl_value ndl_graph_get(ndl_graph *graph, ndl_ref node, ndl_sym key);
@@ -68,6 +190,46 @@ int64_t ndl_graph_size (ndl_graph *graph, ndl_ref node);
 ndl_sym ndl_graph_index(ndl_graph *graph, ndl_ref node, int64_t index);
 
 
+/* Batched mutations.
+ * A batch queues set()s and del()s for commit() to apply together,
+ * sorted by node, in queued order within each node, so the last write
+ * to a key wins. Each store is one lookup, where set() needs two, and
+ * backrefs are reconciled once for the whole batch, sorted by target:
+ * each target's backref set is touched once, adding before removing,
+ * so a node whose references only moved within the batch is never
+ * left unreferenced.
+ *
+ * Reads don't see a batch until it's committed. The collector barriers
+ * apply as for set(), once per target the batch adds references to,
+ * and with reference counting on, targets that lost references are
+ * released when it commits.
+ *
+ * batch_begin() starts a batch of mutations to the graph.
+ *     Returns NULL on error.
+ * batch_set() queues set(node.key = value). Nonzero on error.
+ * batch_del() queues del(node.key). Nonzero on error. Unlike del(),
+ *     deleting a missing key isn't an error when committed.
+ * batch_commit() applies and frees the batch. Returns nonzero on error:
+ *     if a node or referenced node is missing, nothing is applied; out of
+ *     memory, part of it may be, with backrefs matching what was.
+ * batch_abort() frees the batch, applying nothing.
+ */
+typedef struct ndl_graph_batch_s {
+
+    ndl_graph *graph;
+    ndl_vector ops;
+
+} ndl_graph_batch;
+
+ndl_graph_batch *ndl_graph_batch_begin(ndl_graph *graph);
+
+int ndl_graph_batch_set(ndl_graph_batch *batch, ndl_ref node, ndl_sym key, ndl_value value);
+int ndl_graph_batch_del(ndl_graph_batch *batch, ndl_ref node, ndl_sym key);
+
+int  ndl_graph_batch_commit(ndl_graph_batch *batch);
+void ndl_graph_batch_abort (ndl_graph_batch *batch);
+
+
 /* Search backreferences.
  * You may iterate over all backrefs, or you may explicitly
  * check the number of backrefs from one node to another.
@@ -99,17 +261,67 @@ uint64_t ndl_graph_backrefs(ndl_graph *graph, ndl_ref to, ndl_ref from);
  * Root/normal property is preserved, as well as addressing.
  * Also copies hidden data, like backrefs and root property (in GC sweep number)
  *
- * mem_est() returns a guess upper bound on memory requirements.
- *     May be too small. Double size until success.
+ * Images are versioned and checksummed, with a column per field and
+ * nodes in id order; see graph.c. They're written in the machine's byte
+ * order, and read in either. Regions should be 8 byte aligned.
+ *
+ * mem_est() returns the bytes to_mem() will need, if the graph doesn't
+ *     change in between.
  * to_mem() saves a graph into a given region of memory.
  *     Returns number of bytes used. -1 on insufficient memory.
- * from_mem() retrieves a graph from a block of memory.
- *     Returns NULL on error.
+ * from_mem() retrieves a graph from a block of memory, in the current
+ *     format or the original, unversioned one.
+ *     Returns NULL on error, or if the image is damaged.
  */
 uint64_t   ndl_graph_mem_est (ndl_graph *graph);
 int64_t    ndl_graph_to_mem  (ndl_graph *graph, uint64_t maxlen, void *mem);
 ndl_graph *ndl_graph_from_mem(                  uint64_t maxlen, void *mem);
 
+/* Open a saved graph in place.
+ *
+ * open_mmap() maps the image at path read-only, and returns a graph that
+ *     reads nodes straight from it. NULL on error, or for a damaged image.
+ *     Version 1 images are loaded whole, as by from_mem().
+ *
+ * get(), size(), index() and stat() read a mapped node's columns without
+ * touching the pool. Anything that changes a node, its backrefs, or its
+ * mark faults it into the pool first, and reads go there from then on;
+ * set() faults in the node it stores a reference to and the node whose
+ * reference it replaces. Nodes made after opening get ids past the
+ * image's. Whatever walks the whole graph - clean(), clean_cycles(),
+ * set_refcount(), snapshot(), copy(), serializing and printing - faults
+ * in every node left. clean_minor() doesn't: mapped nodes are old.
+ * Nor does clean_step(): it keeps mapped nodes, and the nodes they
+ * reference, found by their backrefs, and faults in only the mapped
+ * nodes whose backrefs the nodes it frees are in. Once every node is
+ * in, the image is unmapped.
+ *
+ * The checksum isn't verified, as that would read the whole image;
+ * the columns locating each node's pairs are, at open.
+ */
+ndl_graph *ndl_graph_open_mmap(const char *path);
+
+
+/* Graph snapshots.
+ * A snapshot is a read-only graph with the nodes, keys, values, root
+ * markings and backrefs the graph had when it was taken, at the same
+ * addresses. Read it like any graph: get(), the iterators, stat(),
+ * to_mem(), copy() from it; writes to it fail, and it's never collected.
+ * It shares the graph's node pages copy-on-write, so the graph pays for
+ * it a page copy at a time, on its first write to each page afterwards.
+ * See ndl_node_pool_snapshot().
+ *
+ * A snapshot may be read on another thread while the graph runs, and
+ * killed on any thread, but only taken on the graph's. Garbage a lazy
+ * sweep hasn't freed yet is part of it.
+ *
+ * snapshot() takes a snapshot of the graph, in O(1).
+ *     Returns NULL on error. kill() releases it.
+ * readonly() returns whether the graph is a snapshot.
+ */
+ndl_graph *ndl_graph_snapshot(ndl_graph *graph);
+int        ndl_graph_readonly(ndl_graph *graph);
+
 
 /* Graph copy operations.
  * Copy operations do not preserve addresses, but they preserve structure
@@ -124,10 +336,24 @@ ndl_graph *ndl_graph_from_mem(                  uint64_t maxlen, void *mem);
  *     of root nodes. All nodes are marked as normal, and the roots as roots.
  *     Returns the number of copied roots on success, -1 on error.
  *     Writes the new addresses of the root nodes to the given array.
+ *
+ * Both map ids through an array as large as the source's id space, and
+ * write each new node once; neither recurses. On error, they free the
+ * nodes they made. References to missing nodes are errors.
  */
 int ndl_graph_copy (ndl_graph *to, ndl_graph *from, ndl_ref *refs);
 int ndl_graph_dcopy(ndl_graph *to, ndl_graph *from, ndl_ref *roots);
 
+/* Graph memory.
+ * Nodes' backrefs, and promoted nodes' pairs and key tables, come from
+ * a size class arena beside the node pool (see ndl_arena), freed in bulk when the graph is killed. The end
+ * of each sweep returns its emptied spans to the OS.
+ *
+ * set_hugepages() sets whether the arena maps new spans as huge pages.
+ *     Off by default. Returns nonzero for snapshots, or on error.
+ */
+int ndl_graph_set_hugepages(ndl_graph *graph, int enable);
+
 /* Print the entirety of a graph. */
 void ndl_graph_print(ndl_graph *graph);
 
@@ -228,7 +228,7 @@ int ndl_value_to_string(ndl_value value, int len, char *buff) {
      * "[Ref:     NULL]"
      */
 
-    const char *type = ndl_value_type_to_string[value.type];
+    const char *type = ndl_value_type_to_string[NDL_VALUE_TYPE(value)];
     int typelen = (signed) strlen(type);
 
     buff[0] = '[';
@@ -239,22 +239,22 @@ int ndl_value_to_string(ndl_value value, int len, char *buff) {
     int nlen = len - typelen - 3;
     char *nbuff = buff + typelen + 2;
 
-    switch (value.type) {
+    switch (NDL_VALUE_TYPE(value)) {
 
     case EVAL_NONE:
         ndl_prettyprint_none(nlen, nbuff);
         break;
     case EVAL_REF:
-        ndl_prettyprint_ref(value.ref, nlen, nbuff);
+        ndl_prettyprint_ref(NDL_VALUE_REF(value), nlen, nbuff);
         break;
     case EVAL_SYM:
-        ndl_prettyprint_sym(value.sym, nlen, nbuff);
+        ndl_prettyprint_sym(NDL_VALUE_SYM(value), nlen, nbuff);
         break;
     case EVAL_INT:
-        ndl_prettyprint_int(value.num, nlen, nbuff);
+        ndl_prettyprint_int(NDL_VALUE_NUM(value), nlen, nbuff);
         break;
     case EVAL_FLOAT:
-        ndl_prettyprint_float(value.real, nlen, nbuff);
+        ndl_prettyprint_float(NDL_VALUE_REAL(value), nlen, nbuff);
         break;
     default:
         ndl_prettyprint_none(nlen, nbuff);
@@ -51,8 +51,8 @@ typedef double   ndl_float;
 #define NDL_DESYM(sym) ((char*) &sym)
 
 
-/* Actual value structure. */
-struct ndl_value_s {
+/* Value fields, for building values; see NDL_VALUE(). */
+struct ndl_value_parts_s {
 
     enum ndl_value_type_e type;
     union {
@@ -62,18 +62,194 @@ struct ndl_value_s {
         ndl_float real; /* EVAL_FLOAT */
     };
 };
-typedef struct ndl_value_s ndl_value;
-
-/* Pretty prints a value.
- * NULL terminates, returns strlen(buff).
- */
-int ndl_value_to_string(ndl_value value, int len, char *buff);
+typedef struct ndl_value_parts_s ndl_value_parts;
 
 /* Value construction macro.
  * Usage: NDL_VALUE(EVAL_SYM, sym=NDL_SYM("hello   "))
  *        NDL_VALUE(EVAL_INT, num=27)
+ *
+ * Any type can be built from its payload's 64 bits as num; see NDL_VALUE_WORD().
+ *
+ * Value accessors. Values are read through these, never by field, so
+ * their representation can be picked at compile time:
+ *
+ * By default a value is its parts: a type and an 8 byte union,
+ * 16 bytes with padding.
+ *
+ * With NDL_VALUE_COMPACT defined, a value is 8 bytes, NaN-boxed.
+ * Floats are stored as themselves, every NaN as one quiet NaN. The rest
+ * live in the NaN space floats leave unused: negative quiet NaNs, whose
+ * top 13 bits are all set, with a 3 bit type tag and a 48 bit payload.
+ * That costs range:
+ *     Ints are 48 bits, signed. Wider ones keep their low 48 bits.
+ *     Refs are 48 bits, signed; plenty for node ids.
+ *     Syms are kept if every byte is a space, digit, letter or '_',
+ *         the characters assembler symbols are made of, at 6 bits each,
+ *         or if they're below 2^48. Other syms become EVAL_NONE.
+ * Every value has one encoding, so equal values have equal bits.
+ *
+ * VALUE_TYPE() gets the type. The rest get the payload of their type:
+ * VALUE_REF(), VALUE_SYM(), VALUE_NUM() and VALUE_REAL().
+ * VALUE_WORD() gets any type's payload as 64 bits, as the union holds it.
  */
+#ifndef NDL_VALUE_COMPACT
+
+typedef ndl_value_parts ndl_value;
+
 #define NDL_VALUE(type_e, value) ((ndl_value) {.type = type_e, .value})
 
+#define NDL_VALUE_TYPE(value) ((value).type)
+#define NDL_VALUE_REF(value)  ((value).ref)
+#define NDL_VALUE_SYM(value)  ((value).sym)
+#define NDL_VALUE_NUM(value)  ((value).num)
+#define NDL_VALUE_REAL(value) ((value).real)
+#define NDL_VALUE_WORD(value) ((value).sym)
+
+#else /* NDL_VALUE_COMPACT */
+
+typedef struct ndl_value_s {
+
+    uint64_t bits;
+
+} ndl_value;
+
+#define NDL_VALUE_BOXED   0xFFF8000000000000ull
+#define NDL_VALUE_NAN     0x7FF8000000000000ull
+#define NDL_VALUE_PAYLOAD 0x0000FFFFFFFFFFFFull
+
+/* Syms outside the 6 bit alphabet, but below 2^48. */
+#define NDL_VALUE_RAWSYM EVAL_FLOAT
+
+/* The 6 bit alphabet, in ASCII order: ' ' is 0, '0'-'9' are 1-10,
+ * 'A'-'Z' are 11-36, '_' is 37 and 'a'-'z' are 38-63.
+ * Packing gives ~0 if a byte is outside it.
+ */
+static inline uint64_t ndl_value_sym_pack(ndl_sym sym) {
+
+    uint64_t ret = 0;
+
+    int i;
+    for (i = 0; i < 8; i++) {
+        uint64_t c = (sym >> (8 * i)) & 0xFF, code;
+        if (c == ' ')
+            code = 0;
+        else if ((c >= '0') && (c <= '9'))
+            code = c - '0' + 1;
+        else if ((c >= 'A') && (c <= 'Z'))
+            code = c - 'A' + 11;
+        else if (c == '_')
+            code = 37;
+        else if ((c >= 'a') && (c <= 'z'))
+            code = c - 'a' + 38;
+        else
+            return ~(uint64_t) 0;
+
+        ret |= code << (6 * i);
+    }
+
+    return ret;
+}
+
+static inline ndl_sym ndl_value_sym_unpack(uint64_t packed) {
+
+    ndl_sym ret = 0;
+
+    int i;
+    for (i = 0; i < 8; i++) {
+        uint64_t code = (packed >> (6 * i)) & 0x3F, c;
+        if (code == 0)
+            c = ' ';
+        else if (code <= 10)
+            c = code - 1 + '0';
+        else if (code <= 36)
+            c = code - 11 + 'A';
+        else if (code == 37)
+            c = '_';
+        else
+            c = code - 38 + 'a';
+
+        ret |= c << (8 * i);
+    }
+
+    return ret;
+}
+
+static inline ndl_value ndl_value_box(uint64_t tag, uint64_t payload) {
+
+    return (ndl_value) {.bits = NDL_VALUE_BOXED | (tag << 48) | (payload & NDL_VALUE_PAYLOAD)};
+}
+
+static inline ndl_value ndl_value_pack(ndl_value_parts parts) {
+
+    switch (parts.type) {
+    case EVAL_FLOAT:
+        return (ndl_value) {.bits = (parts.real != parts.real)? NDL_VALUE_NAN : (uint64_t) parts.num};
+    case EVAL_SYM: {
+        uint64_t packed = ndl_value_sym_pack(parts.sym);
+        if (packed <= NDL_VALUE_PAYLOAD)
+            return ndl_value_box(EVAL_SYM, packed);
+        if (parts.sym <= NDL_VALUE_PAYLOAD)
+            return ndl_value_box(NDL_VALUE_RAWSYM, parts.sym);
+        return ndl_value_box(EVAL_NONE, 0);
+    }
+    default:
+        return ndl_value_box((uint64_t) parts.type & 7, (uint64_t) parts.num);
+    }
+}
+
+static inline enum ndl_value_type_e ndl_value_type(ndl_value value) {
+
+    if (value.bits < NDL_VALUE_BOXED)
+        return EVAL_FLOAT;
+
+    uint64_t tag = (value.bits >> 48) & 7;
+
+    return (tag == NDL_VALUE_RAWSYM)? EVAL_SYM : (enum ndl_value_type_e) tag;
+}
+
+static inline int64_t ndl_value_num(ndl_value value) {
+
+    return (int64_t) (value.bits << 16) >> 16;
+}
+
+static inline ndl_sym ndl_value_sym(ndl_value value) {
+
+    if (((value.bits >> 48) & 7) == NDL_VALUE_RAWSYM)
+        return value.bits & NDL_VALUE_PAYLOAD;
+
+    return ndl_value_sym_unpack(value.bits & NDL_VALUE_PAYLOAD);
+}
+
+static inline ndl_float ndl_value_real(ndl_value value) {
+
+    ndl_value_parts parts = {.num = (int64_t) value.bits};
+
+    return parts.real;
+}
+
+static inline uint64_t ndl_value_word(ndl_value value) {
+
+    switch (ndl_value_type(value)) {
+    case EVAL_FLOAT: return value.bits;
+    case EVAL_SYM:   return ndl_value_sym(value);
+    default:         return (uint64_t) ndl_value_num(value);
+    }
+}
+
+#define NDL_VALUE(type_e, value) ndl_value_pack((ndl_value_parts) {.type = type_e, .value})
+
+#define NDL_VALUE_TYPE(value) ndl_value_type(value)
+#define NDL_VALUE_REF(value)  ((ndl_ref) ndl_value_num(value))
+#define NDL_VALUE_SYM(value)  ndl_value_sym(value)
+#define NDL_VALUE_NUM(value)  ndl_value_num(value)
+#define NDL_VALUE_REAL(value) ndl_value_real(value)
+#define NDL_VALUE_WORD(value) ndl_value_word(value)
+
+#endif /* NDL_VALUE_COMPACT */
+
+/* Pretty prints a value.
+ * NULL terminates, returns strlen(buff).
+ */
+int ndl_value_to_string(ndl_value value, int len, char *buff);
 
 #endif /* NODEL_NODE_H */
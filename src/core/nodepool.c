@@ -4,284 +4,1518 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define NDL_NODE_POOL_ISFREE(count) ((count) == NDL_NODE_POOL_UNUSED)
+
+#define NDL_NODE_POOL_PRIVATE(shape) (((shape) != NULL) && ((shape)->id == 0))
+
+/* Free a promoted node's storage. Its pairs are lost. */
+static inline void ndl_node_pool_release(ndl_node_pool_entry *entry) {
+
+    ndl_rhashtable_mkill(&entry->table);
+    ndl_vector_mkill(&entry->pairs);
+
+    entry->count = 0;
+}
+
+/* The pool's arena, or NULL if it hasn't made one. Nodes only hold
+ * arena blocks once there is one, so NULL is fine for freeing them.
+ */
+static inline ndl_arena *ndl_node_pool_heap_arena(ndl_node_pool *pool) {
+
+    return (pool->heap != NULL)? &pool->heap->arena : NULL;
+}
+
+/* Free an allocated node's storage. */
+static inline void ndl_node_pool_entry_free(ndl_node_pool_entry *entry, ndl_arena *arena) {
+
+    if (entry->count == NDL_NODE_POOL_PROMOTED)
+        ndl_node_pool_release(entry);
+    else if (NDL_NODE_POOL_PRIVATE(entry->shape))
+        ndl_arena_free(arena, entry->shape, sizeof(ndl_node_pool_shape));
+
+    ndl_backrefs_mkill(&entry->header.backrefs, arena);
+}
+
+/* Free a page, and its nodes' storage. */
+static void ndl_node_pool_page_free(ndl_node_pool_page *page, ndl_arena *arena) {
+
+    uint64_t i;
+    for (i = 0; i < NDL_NODE_POOL_PAGE_SIZE; i++)
+        if (!NDL_NODE_POOL_ISFREE(page->entries[i].count))
+            ndl_node_pool_entry_free(&page->entries[i], arena);
+
+    free(page);
+}
+
+/* Drop a directory's hold on a page, freeing it if that was the last. */
+static inline void ndl_node_pool_page_release(ndl_node_pool_page *page, ndl_arena *arena) {
+
+    if (__atomic_sub_fetch(&page->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        ndl_node_pool_page_free(page, arena);
+}
+
+/* Drop a pool's hold on a directory, releasing its pages if that was the last. */
+static void ndl_node_pool_dir_release(ndl_node_pool_dir *dir, ndl_arena *arena) {
+
+    if ((dir == NULL) || (__atomic_sub_fetch(&dir->refs, 1, __ATOMIC_ACQ_REL) > 0))
+        return;
+
+    uint64_t i;
+    for (i = 0; i < dir->count; i++)
+        if (dir->pages[i] != NULL)
+            ndl_node_pool_page_release(dir->pages[i], arena);
+
+    free(dir);
+}
+
+/* Drop a pool's hold on its heap, unmapping it if that was the last. */
+static void ndl_node_pool_heap_release(ndl_node_pool_heap *heap) {
+
+    if ((heap == NULL) || (__atomic_sub_fetch(&heap->refs, 1, __ATOMIC_ACQ_REL) > 0))
+        return;
+
+    ndl_arena_mkill(&heap->arena);
+
+    free(heap);
+}
+
+/* Drop a pool's hold on its shapes, freeing them if that was the last. */
+static void ndl_node_pool_shapes_release(ndl_node_pool_shapes *shapes) {
+
+    if ((shapes == NULL) || (__atomic_sub_fetch(&shapes->refs, 1, __ATOMIC_ACQ_REL) > 0))
+        return;
+
+    uint64_t i, size = ndl_vector_size(&shapes->shapes);
+    for (i = 0; i < size; i++)
+        free(*(ndl_node_pool_shape **) ndl_vector_get(&shapes->shapes, i));
+
+    ndl_vector_mkill(&shapes->shapes);
+    ndl_rhashtable_mkill(&shapes->transitions);
+
+    free(shapes);
+}
 
 ndl_node_pool *ndl_node_pool_init(void) {
 
-    void *region = malloc(ndl_node_pool_msize());
-    if (region == NULL)
-        return NULL;
+    void *region = malloc(ndl_node_pool_msize());
+    if (region == NULL)
+        return NULL;
+
+    ndl_node_pool *res = ndl_node_pool_minit(region);
+    if (res == NULL)
+        free(region);
+
+    return res;
+}
+
+void ndl_node_pool_kill(ndl_node_pool *pool) {
+
+    ndl_node_pool_mkill(pool);
+    free(pool);
+}
+
+ndl_node_pool *ndl_node_pool_minit(void *region) {
+
+    ndl_node_pool *pool = (ndl_node_pool *) region;
+    if (pool == NULL)
+        return NULL;
+
+    pool->min_id = 1;
+    pool->size = 0;
+    pool->pairs = 0;
+
+    pool->page_count = 0;
+    pool->open_hint = 0;
+    pool->dir = NULL;
+    pool->full = NULL;
+
+    pool->shapes = NULL;
+    pool->heap = NULL;
+
+    pool->sweeping = 0;
+    pool->sweep_at = 0;
+
+    pool->readonly = 0;
+
+    return pool;
+}
+
+void ndl_node_pool_mkill(ndl_node_pool *pool) {
+
+    ndl_node_pool_dir_release(pool->dir, ndl_node_pool_heap_arena(pool));
+    ndl_node_pool_shapes_release(pool->shapes);
+    ndl_node_pool_heap_release(pool->heap);
+    free(pool->full);
+}
+
+uint64_t ndl_node_pool_msize(void) {
+
+    return sizeof(ndl_node_pool);
+}
+
+ndl_node_pool *ndl_node_pool_snapshot(void *region, ndl_node_pool *pool) {
+
+    ndl_node_pool *snap = ndl_node_pool_minit(region);
+    if (snap == NULL)
+        return NULL;
+
+    snap->min_id = pool->min_id;
+    snap->size = pool->size;
+    snap->pairs = pool->pairs;
+
+    snap->page_count = pool->page_count;
+    snap->dir = pool->dir;
+    if (snap->dir != NULL)
+        __atomic_add_fetch(&snap->dir->refs, 1, __ATOMIC_ACQ_REL);
+
+    snap->shapes = pool->shapes;
+    if (snap->shapes != NULL)
+        __atomic_add_fetch(&snap->shapes->refs, 1, __ATOMIC_ACQ_REL);
+
+    snap->heap = pool->heap;
+    if (snap->heap != NULL)
+        __atomic_add_fetch(&snap->heap->refs, 1, __ATOMIC_ACQ_REL);
+
+    snap->readonly = 1;
+
+    return snap;
+}
+
+int ndl_node_pool_readonly(ndl_node_pool *pool) {
+
+    return pool->readonly;
+}
+
+#define NDL_NODE_POOL_WORDS (NDL_NODE_POOL_PAGE_SIZE / 64)
+
+/* Entry storage for an id, allocated or not. NULL if its page doesn't exist. */
+static inline ndl_node_pool_entry *ndl_node_pool_entry_at(ndl_node_pool *pool, ndl_ref node) {
+
+    uint64_t index = (uint64_t) node >> NDL_NODE_POOL_PAGE_BITS;
+    if ((node < 0) || (index >= pool->page_count) || (pool->dir->pages[index] == NULL))
+        return NULL;
+
+    return &pool->dir->pages[index]->entries[(uint64_t) node & (NDL_NODE_POOL_PAGE_SIZE - 1)];
+}
+
+static inline ndl_node_pool_entry *ndl_node_pool_entry_get(ndl_node_pool *pool, ndl_ref node) {
+
+    ndl_node_pool_entry *entry = ndl_node_pool_entry_at(pool, node);
+    if ((entry == NULL) || NDL_NODE_POOL_ISFREE(entry->count))
+        return NULL;
+
+    return entry;
+}
+
+/* Make the directory the pool's own to write to, copying it if a
+ * snapshot shares it. Nonzero for snapshots, or on error.
+ */
+static int ndl_node_pool_dir_own(ndl_node_pool *pool) {
+
+    if (pool->readonly)
+        return -1;
+
+    ndl_node_pool_dir *dir = pool->dir;
+    if ((dir == NULL) || (__atomic_load_n(&dir->refs, __ATOMIC_ACQUIRE) == 1))
+        return 0;
+
+    uint64_t size = sizeof(ndl_node_pool_dir) + dir->count * sizeof(ndl_node_pool_page *);
+
+    ndl_node_pool_dir *own = malloc(size);
+    if (own == NULL)
+        return -1;
+
+    memcpy(own, dir, size);
+    own->refs = 1;
+
+    uint64_t i;
+    for (i = 0; i < own->count; i++)
+        if (own->pages[i] != NULL)
+            __atomic_add_fetch(&own->pages[i]->refs, 1, __ATOMIC_ACQ_REL);
+
+    pool->dir = own;
+    ndl_node_pool_dir_release(dir, ndl_node_pool_heap_arena(pool));
+
+    return 0;
+}
+
+/* Fill in a bitwise copy of an entry with storage of its own. */
+static int ndl_node_pool_entry_copy(ndl_node_pool_entry *to, ndl_node_pool_entry *from,
+                                    ndl_arena *arena) {
+
+    ndl_backrefs_minit(&to->header.backrefs);
+
+    void *curr = ndl_backrefs_head(&from->header.backrefs);
+    while (curr != NULL) {
+
+        if (ndl_backrefs_put(&to->header.backrefs, arena,
+                             ndl_backrefs_ref(&from->header.backrefs, curr),
+                             ndl_backrefs_refs(&from->header.backrefs, curr)) != 0) {
+            ndl_backrefs_mkill(&to->header.backrefs, arena);
+            return -1;
+        }
+
+        curr = ndl_backrefs_next(&from->header.backrefs, curr);
+    }
+
+    if ((from->count != NDL_NODE_POOL_PROMOTED) && NDL_NODE_POOL_PRIVATE(from->shape)) {
+
+        to->shape = ndl_arena_alloc(arena, sizeof(ndl_node_pool_shape));
+        if (to->shape == NULL) {
+            ndl_backrefs_mkill(&to->header.backrefs, arena);
+            return -1;
+        }
+
+        memcpy(to->shape, from->shape, sizeof(ndl_node_pool_shape));
+    }
+
+    if (from->count != NDL_NODE_POOL_PROMOTED)
+        return 0;
+
+    /* Rebuild the pairs rather than copy them, leaving out the holes. */
+    if (ndl_rhashtable_aminit(&to->table, sizeof(ndl_sym), sizeof(uint64_t),
+                              2 * NDL_NODE_POOL_INLINE, arena) == NULL) {
+        ndl_backrefs_mkill(&to->header.backrefs, arena);
+        return -1;
+    }
+
+    ndl_vector_aminit(&to->pairs, sizeof(ndl_node_pool_pair), arena);
+    to->holes = 0;
+
+    uint64_t i, size = ndl_vector_size(&from->pairs);
+    for (i = 0; i < size; i++) {
+
+        ndl_node_pool_pair *pair = (ndl_node_pool_pair *) ndl_vector_get(&from->pairs, i);
+        if (NDL_VALUE_TYPE(pair->val) == NDL_NODE_POOL_HOLE)
+            continue;
+
+        uint64_t index = ndl_vector_size(&to->pairs);
+        if ((ndl_vector_push(&to->pairs, pair) == NULL) ||
+            (ndl_rhashtable_put(&to->table, &pair->key, &index) == NULL)) {
+            ndl_node_pool_entry_free(to, arena);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Deep copy of a page, held by one directory. NULL on error. */
+static ndl_node_pool_page *ndl_node_pool_page_copy(ndl_node_pool_page *page, ndl_arena *arena) {
+
+    ndl_node_pool_page *copy = malloc(sizeof(ndl_node_pool_page));
+    if (copy == NULL)
+        return NULL;
+
+    memcpy(copy, page, sizeof(ndl_node_pool_page));
+    copy->refs = 1;
+
+    uint64_t i;
+    for (i = 0; i < NDL_NODE_POOL_PAGE_SIZE; i++) {
+
+        if (NDL_NODE_POOL_ISFREE(page->entries[i].count))
+            continue;
+
+        if (ndl_node_pool_entry_copy(&copy->entries[i], &page->entries[i], arena) != 0) {
+
+            /* Entries from i on still point at the original's storage. */
+            while (i-- > 0)
+                if (!NDL_NODE_POOL_ISFREE(copy->entries[i].count))
+                    ndl_node_pool_entry_free(&copy->entries[i], arena);
+
+            free(copy);
+            return NULL;
+        }
+    }
+
+    return copy;
+}
+
+/* Make a page the pool's own to write to, copying it (and the directory)
+ * if a snapshot shares it. NULL for missing pages, snapshots, or on error.
+ */
+static ndl_node_pool_page *ndl_node_pool_page_own(ndl_node_pool *pool, uint64_t index) {
+
+    if ((ndl_node_pool_dir_own(pool) != 0) || (index >= pool->page_count))
+        return NULL;
+
+    ndl_node_pool_page *page = pool->dir->pages[index];
+    if ((page == NULL) || (__atomic_load_n(&page->refs, __ATOMIC_ACQUIRE) == 1))
+        return page;
+
+    ndl_node_pool_page *copy = ndl_node_pool_page_copy(page, ndl_node_pool_heap_arena(pool));
+    if (copy == NULL)
+        return NULL;
+
+    pool->dir->pages[index] = copy;
+    ndl_node_pool_page_release(page, ndl_node_pool_heap_arena(pool));
+
+    return copy;
+}
+
+/* entry_get(), for writing to. */
+static inline ndl_node_pool_entry *ndl_node_pool_entry_own(ndl_node_pool *pool, ndl_ref node) {
+
+    ndl_node_pool_entry *entry = ndl_node_pool_entry_get(pool, node);
+    if (entry == NULL)
+        return NULL;
+
+    uint64_t index = (uint64_t) node >> NDL_NODE_POOL_PAGE_BITS;
+
+    /* Nothing's shared without a snapshot. */
+    if (!pool->readonly &&
+        (__atomic_load_n(&pool->dir->refs, __ATOMIC_ACQUIRE) == 1) &&
+        (__atomic_load_n(&pool->dir->pages[index]->refs, __ATOMIC_ACQUIRE) == 1))
+        return entry;
+
+    ndl_node_pool_page *page = ndl_node_pool_page_own(pool, index);
+    if (page == NULL)
+        return NULL;
+
+    return &page->entries[(uint64_t) node & (NDL_NODE_POOL_PAGE_SIZE - 1)];
+}
+
+/* Entry storage for an id, to write to, growing the directory and
+ * allocating its page as needed.
+ */
+static ndl_node_pool_entry *ndl_node_pool_entry_make(ndl_node_pool *pool, ndl_ref node) {
+
+    if ((node < 0) || (node > NDL_NODE_POOL_MAX_ID) || (ndl_node_pool_dir_own(pool) != 0))
+        return NULL;
+
+    uint64_t index = (uint64_t) node >> NDL_NODE_POOL_PAGE_BITS;
+
+    if (index >= pool->page_count) {
+
+        uint64_t count = (pool->page_count > 0)? pool->page_count * 2 : 64;
+        while (count <= index)
+            count *= 2;
+
+        ndl_node_pool_dir *dir = realloc(pool->dir, sizeof(ndl_node_pool_dir) +
+                                                    count * sizeof(ndl_node_pool_page *));
+        if (dir == NULL)
+            return NULL;
+
+        if (pool->dir == NULL)
+            dir->refs = 1;
+
+        memset(dir->pages + pool->page_count, 0, (count - pool->page_count) * sizeof(ndl_node_pool_page *));
+        dir->count = pool->page_count;
+        pool->dir = dir;
+
+        uint64_t *full = realloc(pool->full, (count / 64) * sizeof(uint64_t));
+        if (full == NULL)
+            return NULL;
+
+        memset(full + pool->page_count / 64, 0, ((count - pool->page_count) / 64) * sizeof(uint64_t));
+        pool->full = full;
+
+        pool->page_count = dir->count = count;
+    }
+
+    ndl_node_pool_page *page = ndl_node_pool_page_own(pool, index);
+    if ((page == NULL) && (pool->dir->pages[index] != NULL))
+        return NULL;
+
+    if (page == NULL) {
+
+        page = malloc(sizeof(ndl_node_pool_page));
+        if (page == NULL)
+            return NULL;
+
+        page->refs = 1;
+        page->used = 0;
+        memset(page->bits, 0, sizeof(page->bits));
+        memset(page->live, 0, sizeof(page->live));
+        if (index == 0)
+            page->bits[0] = page->live[0] = 1;
+
+        uint64_t i;
+        for (i = 0; i < NDL_NODE_POOL_PAGE_SIZE; i++) {
+            page->entries[i].id = (ndl_ref) ((index << NDL_NODE_POOL_PAGE_BITS) + i);
+            page->entries[i].count = NDL_NODE_POOL_UNUSED;
+        }
+
+        pool->dir->pages[index] = page;
+    }
+
+    return &page->entries[(uint64_t) node & (NDL_NODE_POOL_PAGE_SIZE - 1)];
+}
+
+/* Occupancy bookkeeping for an id being claimed or released. */
+static inline void ndl_node_pool_mark(ndl_node_pool *pool, ndl_ref node, int used) {
+
+    uint64_t index = (uint64_t) node >> NDL_NODE_POOL_PAGE_BITS;
+    uint64_t slot = (uint64_t) node & (NDL_NODE_POOL_PAGE_SIZE - 1);
+
+    ndl_node_pool_page *page = pool->dir->pages[index];
+
+    if (!used) {
+
+        page->bits[slot / 64] &= ~((uint64_t) 1 << (slot % 64));
+        page->used--;
+
+        pool->full[index / 64] &= ~((uint64_t) 1 << (index % 64));
+        if (index < pool->open_hint)
+            pool->open_hint = index;
+
+        return;
+    }
+
+    page->bits[slot / 64] |= (uint64_t) 1 << (slot % 64);
+    page->used++;
+
+    uint64_t i;
+    for (i = 0; i < NDL_NODE_POOL_WORDS; i++)
+        if (page->bits[i] != UINT64_MAX)
+            return;
+
+    pool->full[index / 64] |= (uint64_t) 1 << (index % 64);
+}
+
+/* Lowest page at or after start that isn't full, possibly past the directory. */
+static inline uint64_t ndl_node_pool_open_page(ndl_node_pool *pool, uint64_t start) {
+
+    uint64_t words = pool->page_count / 64;
+    uint64_t word = start / 64;
+    if (word >= words)
+        return (start > pool->page_count)? start : pool->page_count;
+
+    /* Snapshots don't keep full bits; any page may have room. */
+    if (pool->full == NULL)
+        return start;
+
+    uint64_t open = ~pool->full[word] & (UINT64_MAX << (start % 64));
+    while (open == 0) {
+        if (++word >= words)
+            return pool->page_count;
+        open = ~pool->full[word];
+    }
+
+    return word * 64 + (uint64_t) __builtin_ctzll(open);
+}
+
+/* Lowest free slot in a page, at or after start, or NDL_NODE_POOL_PAGE_SIZE. */
+static inline uint64_t ndl_node_pool_open_slot(ndl_node_pool_page *page, uint64_t start) {
+
+    uint64_t word = start / 64;
+    uint64_t open = ~page->bits[word] & (UINT64_MAX << (start % 64));
+    while (open == 0) {
+        if (++word >= NDL_NODE_POOL_WORDS)
+            return NDL_NODE_POOL_PAGE_SIZE;
+        open = ~page->bits[word];
+    }
+
+    return word * 64 + (uint64_t) __builtin_ctzll(open);
+}
+
+/* Lowest free id at or above min_id. */
+static ndl_ref ndl_node_pool_next_id(ndl_node_pool *pool) {
+
+    pool->open_hint = ndl_node_pool_open_page(pool, pool->open_hint);
+
+    uint64_t min_page = (uint64_t) pool->min_id >> NDL_NODE_POOL_PAGE_BITS;
+    uint64_t index = (pool->open_hint > min_page)? pool->open_hint : min_page;
+
+    for (;; index++) {
+
+        index = ndl_node_pool_open_page(pool, index);
+
+        uint64_t start = (index == min_page)?
+            ((uint64_t) pool->min_id & (NDL_NODE_POOL_PAGE_SIZE - 1)) : 0;
+
+        ndl_node_pool_page *page = (index < pool->page_count)? pool->dir->pages[index] : NULL;
+        if (page == NULL) {
+            if ((index == 0) && (start == 0))
+                start = 1;
+            return (ndl_ref) ((index << NDL_NODE_POOL_PAGE_BITS) + start);
+        }
+
+        uint64_t slot = ndl_node_pool_open_slot(page, start);
+        if (slot < NDL_NODE_POOL_PAGE_SIZE)
+            return (ndl_ref) ((index << NDL_NODE_POOL_PAGE_BITS) + slot);
+    }
+}
+
+/* Find key's index among an inline node's pairs, or -1. */
+static inline int64_t ndl_node_pool_inline_find(ndl_node_pool_entry *entry, ndl_sym key) {
+
+    if (entry->count == 0)
+        return -1;
+
+    ndl_sym *keys = entry->shape->keys;
+
+#ifdef __SSE2__
+
+    /* No 64 bit compare in SSE2: compare 32 bit halves, and require
+     * all 8 mask bits of a key to be set. Four keys per step.
+     */
+    __m128i needle = _mm_set1_epi64x((long long) key);
+
+    uint64_t i;
+    for (i = 0; i < entry->count; i += 4) {
+
+        __m128i lo = _mm_cmpeq_epi32(_mm_loadu_si128((__m128i *) &keys[i]), needle);
+        __m128i hi = _mm_cmpeq_epi32(_mm_loadu_si128((__m128i *) &keys[i + 2]), needle);
+
+        uint32_t mask = (uint32_t) _mm_movemask_epi8(lo) |
+                        ((uint32_t) _mm_movemask_epi8(hi) << 16);
+
+        uint32_t j;
+        for (j = 0; j < 4; j++) {
+            if (i + j >= entry->count)
+                return -1;
+            if (((mask >> (j * 8)) & 0xFF) == 0xFF)
+                return (int64_t) (i + j);
+        }
+    }
+
+#else
+
+    uint64_t i;
+    for (i = 0; i < entry->count; i++)
+        if (keys[i] == key)
+            return (int64_t) i;
+
+#endif
+
+    return -1;
+}
+
+/* Transition table keys. The empty shape has id 0. */
+typedef struct ndl_node_pool_step_s {
+
+    uint64_t from;
+    ndl_sym key;
+
+} ndl_node_pool_step;
+
+/* The pool's shapes, made on first use. NULL for snapshots, or on error. */
+static ndl_node_pool_shapes *ndl_node_pool_shapes_own(ndl_node_pool *pool) {
+
+    if (pool->readonly)
+        return NULL;
+
+    if (pool->shapes != NULL)
+        return pool->shapes;
+
+    ndl_node_pool_shapes *shapes = malloc(sizeof(ndl_node_pool_shapes));
+    if (shapes == NULL)
+        return NULL;
+
+    if (ndl_rhashtable_minit(&shapes->transitions, sizeof(ndl_node_pool_step),
+                             sizeof(ndl_node_pool_shape *), 64) == NULL) {
+        free(shapes);
+        return NULL;
+    }
+
+    ndl_vector_minit(&shapes->shapes, sizeof(ndl_node_pool_shape *));
+    shapes->refs = 1;
+
+    memset(&shapes->empty, 0, sizeof(shapes->empty));
+
+    pool->shapes = shapes;
+
+    return shapes;
+}
+
+/* The shape of from's keys, then key. Makes it if it's new.
+ * NULL past NDL_NODE_POOL_SHAPES_MAX, or on error.
+ */
+static ndl_node_pool_shape *ndl_node_pool_shape_next(ndl_node_pool *pool, ndl_node_pool_shape *from,
+                                                     ndl_sym key) {
+
+    ndl_node_pool_shapes *shapes = ndl_node_pool_shapes_own(pool);
+    if (shapes == NULL)
+        return NULL;
+
+    ndl_node_pool_shape *cache = (from != NULL)? from : &shapes->empty;
+    if ((cache->next != NULL) && (cache->next_key == key))
+        return cache->next;
+
+    ndl_node_pool_step step = {.from = cache->id, .key = key};
+
+    ndl_node_pool_shape **found = ndl_rhashtable_get(&shapes->transitions, &step);
+    if (found != NULL) {
+        cache->next_key = key;
+        cache->next = *found;
+        return *found;
+    }
+
+    uint64_t id = ndl_vector_size(&shapes->shapes) + 1;
+    if (id > NDL_NODE_POOL_SHAPES_MAX)
+        return NULL;
+
+    ndl_node_pool_shape *shape = calloc(1, sizeof(ndl_node_pool_shape));
+    if (shape == NULL)
+        return NULL;
+
+    shape->id = id;
+    shape->size = (from != NULL)? from->size + 1 : 1;
+    if (from != NULL)
+        memcpy(shape->keys, from->keys, from->size * sizeof(ndl_sym));
+    shape->keys[shape->size - 1] = key;
+
+    if (ndl_vector_push(&shapes->shapes, &shape) == NULL) {
+        free(shape);
+        return NULL;
+    }
+
+    if (ndl_rhashtable_put(&shapes->transitions, &step, &shape) == NULL) {
+        ndl_vector_pop(&shapes->shapes);
+        free(shape);
+        return NULL;
+    }
+
+    cache->next_key = key;
+    cache->next = shape;
+
+    return shape;
+}
+
+/* A private copy of from, which may be the empty shape. NULL on error. */
+static ndl_node_pool_shape *ndl_node_pool_shape_copy(ndl_node_pool *pool, ndl_node_pool_shape *from) {
+
+    ndl_arena *arena = ndl_node_pool_arena(pool);
+    if (arena == NULL)
+        return NULL;
+
+    ndl_node_pool_shape *shape = ndl_arena_alloc(arena, sizeof(ndl_node_pool_shape));
+    if (shape == NULL)
+        return NULL;
+
+    memset(shape, 0, sizeof(ndl_node_pool_shape));
+    if (from == NULL)
+        return shape;
+
+    shape->size = from->size;
+    memcpy(shape->keys, from->keys, from->size * sizeof(ndl_sym));
+
+    return shape;
+}
+
+/* The shape of an inline node's keys, but its index'th.
+ * NULL for the empty shape, past NDL_NODE_POOL_SHAPES_MAX, or on error.
+ */
+static ndl_node_pool_shape *ndl_node_pool_shape_without(ndl_node_pool *pool, ndl_node_pool_shape *from,
+                                                        uint64_t index) {
+
+    ndl_node_pool_shape *shape = NULL;
+
+    uint64_t i;
+    for (i = 0; i < from->size; i++) {
+
+        if (i == index)
+            continue;
+
+        shape = ndl_node_pool_shape_next(pool, shape, from->keys[i]);
+        if (shape == NULL)
+            return NULL;
+    }
+
+    return shape;
+}
+
+/* Move an inline node's pairs into an ordered vector and key index, in the same storage. */
+static int ndl_node_pool_promote(ndl_node_pool *pool, ndl_node_pool_entry *entry) {
+
+    ndl_node_pool_shape *shape = entry->shape;
+    ndl_value vals[NDL_NODE_POOL_INLINE];
+
+    uint64_t count = entry->count;
+    memcpy(vals, entry->vals, sizeof(vals));
+
+    ndl_arena *arena = ndl_node_pool_arena(pool);
+    if (arena == NULL)
+        return -1;
+
+    ndl_rhashtable *table = ndl_rhashtable_aminit(&entry->table, sizeof(ndl_sym),
+                                                  sizeof(uint64_t), 2 * NDL_NODE_POOL_INLINE, arena);
+    if (table == NULL)
+        return -1;
+
+    ndl_vector_aminit(&entry->pairs, sizeof(ndl_node_pool_pair), arena);
+    entry->holes = 0;
+
+    uint64_t i;
+    for (i = 0; i < count; i++) {
+
+        ndl_node_pool_pair pair = {.key = shape->keys[i], .val = vals[i]};
+
+        if ((ndl_vector_push(&entry->pairs, &pair) == NULL) ||
+            (ndl_rhashtable_put(table, &pair.key, &i) == NULL)) {
+            ndl_vector_mkill(&entry->pairs);
+            ndl_rhashtable_mkill(table);
+            entry->shape = shape;
+            memcpy(entry->vals, vals, sizeof(vals));
+            return -1;
+        }
+    }
+
+    if (NDL_NODE_POOL_PRIVATE(shape))
+        ndl_arena_free(arena, shape, sizeof(ndl_node_pool_shape));
+
+    entry->count = NDL_NODE_POOL_PROMOTED;
+
+    return 0;
+}
+
+static inline ndl_node_pool_pair *ndl_node_pool_pair_at(ndl_node_pool_entry *entry, uint64_t index) {
+
+    return (ndl_node_pool_pair *) ndl_vector_get(&entry->pairs, index);
+}
+
+/* Squeeze the holes out of a promoted node, and reindex the moved keys. */
+static void ndl_node_pool_compact(ndl_node_pool_entry *entry) {
+
+    uint64_t size = ndl_vector_size(&entry->pairs);
+
+    uint64_t i, live = 0;
+    for (i = 0; i < size; i++) {
+
+        ndl_node_pool_pair *pair = ndl_node_pool_pair_at(entry, i);
+        if (NDL_VALUE_TYPE(pair->val) == NDL_NODE_POOL_HOLE)
+            continue;
+
+        if (live != i) {
+            *ndl_node_pool_pair_at(entry, live) = *pair;
+            *(uint64_t *) ndl_rhashtable_get(&entry->table, &pair->key) = live;
+        }
+
+        live++;
+    }
+
+    ndl_vector_delete_range(&entry->pairs, live, size - live);
+    entry->holes = 0;
+}
+
+/* Promoted pair for a key, or NULL. */
+static inline ndl_node_pool_pair *ndl_node_pool_pair_find(ndl_node_pool_entry *entry, ndl_sym key) {
+
+    uint64_t *index = ndl_rhashtable_get(&entry->table, &key);
+    if (index == NULL)
+        return NULL;
+
+    return ndl_node_pool_pair_at(entry, *index);
+}
+
+static inline ndl_ref ndl_node_pool_claim(ndl_node_pool *pool, ndl_ref node) {
+
+    ndl_node_pool_entry *entry = ndl_node_pool_entry_make(pool, node);
+    if ((entry == NULL) || (node == 0))
+        return NDL_NULL_REF;
+
+    entry->count = 0;
+    entry->shape = NULL;
+    entry->header.mark = 0;
+    entry->header.age = entry->header.flags = 0;
+    ndl_backrefs_minit(&entry->header.backrefs);
+
+    ndl_node_pool_mark(pool, node, 1);
+    pool->size++;
 
-    ndl_node_pool *res = ndl_node_pool_minit(region);
-    if (res == NULL)
-        free(region);
+    if (pool->sweeping)
+        ndl_node_pool_live_set(pool, node);
 
-    return res;
+    return node;
 }
 
-void ndl_node_pool_kill(ndl_node_pool *pool) {
+ndl_ref ndl_node_pool_alloc(ndl_node_pool *pool) {
 
-    ndl_node_pool_mkill(pool);
-    free(pool);
+    return ndl_node_pool_claim(pool, ndl_node_pool_next_id(pool));
 }
 
-ndl_node_pool *ndl_node_pool_minit(void *region) {
+ndl_ref ndl_node_pool_alloc_pref(ndl_node_pool *pool, ndl_ref pref) {
 
-    ndl_node_pool *pool = (ndl_node_pool *) region;
-    if (pool == NULL)
-        return NULL;
+    if (ndl_node_pool_entry_get(pool, pref) != NULL)
+        return NDL_NULL_REF;
 
-    uint64_t node_size = ndl_rhashtable_msize(sizeof(ndl_sym), sizeof(ndl_value), 8);
+    return ndl_node_pool_claim(pool, pref);
+}
 
-    pool->last_id = 0;
-    ndl_rhashtable *nodemap = ndl_rhashtable_minit((void *) pool->nodemap,
-                                                   sizeof(ndl_ref), node_size, 128);
-    if (nodemap == NULL)
-        return NULL;
+int ndl_node_pool_free(ndl_node_pool *pool, ndl_ref node) {
 
-    return pool;
+    ndl_node_pool_entry *entry = ndl_node_pool_entry_own(pool, node);
+    if (entry == NULL)
+        return -1;
+
+    pool->pairs -= (entry->count == NDL_NODE_POOL_PROMOTED)?
+        ndl_vector_size(&entry->pairs) - entry->holes : entry->count;
+
+    ndl_node_pool_entry_free(entry, ndl_node_pool_heap_arena(pool));
+
+    entry->count = NDL_NODE_POOL_UNUSED;
+
+    ndl_node_pool_mark(pool, node, 0);
+    pool->size--;
+
+    /* Release empty pages. */
+    uint64_t index = (uint64_t) node >> NDL_NODE_POOL_PAGE_BITS;
+    if (pool->dir->pages[index]->used == 0) {
+        ndl_node_pool_page_release(pool->dir->pages[index], ndl_node_pool_heap_arena(pool));
+        pool->dir->pages[index] = NULL;
+    }
+
+    return 0;
 }
 
-void ndl_node_pool_mkill(ndl_node_pool *pool) {
+ndl_value ndl_node_pool_get(ndl_node_pool *pool, ndl_ref node, ndl_sym key) {
 
-    void *curr = ndl_rhashtable_pairs_head((ndl_rhashtable *) pool->nodemap);
-    while (curr != NULL) {
+    ndl_node_pool_entry *entry = ndl_node_pool_entry_get(pool, node);
+    if (entry == NULL)
+        return NDL_VALUE(EVAL_NONE, ref=NDL_NULL_REF);
 
-        void *node = ndl_rhashtable_pairs_val((ndl_rhashtable *) pool->nodemap, curr);
+    if (entry->count == NDL_NODE_POOL_PROMOTED) {
 
-        ndl_rhashtable_mkill((ndl_rhashtable *) node);
+        ndl_node_pool_pair *pair = ndl_node_pool_pair_find(entry, key);
+        if (pair == NULL)
+            return NDL_VALUE(EVAL_NONE, ref=NDL_NULL_REF);
 
-        curr = ndl_rhashtable_pairs_next((ndl_rhashtable *) pool->nodemap, curr);
+        return pair->val;
     }
 
-    ndl_rhashtable_mkill((ndl_rhashtable *) pool->nodemap);
+    int64_t index = ndl_node_pool_inline_find(entry, key);
+    if (index < 0)
+        return NDL_VALUE(EVAL_NONE, ref=NDL_NULL_REF);
+
+    return entry->vals[index];
 }
 
-uint64_t ndl_node_pool_msize(void) {
+int ndl_node_pool_put(ndl_node_pool *pool, ndl_ref node, ndl_sym key, ndl_value val) {
 
-    uint64_t node_size = ndl_rhashtable_msize(sizeof(ndl_sym), sizeof(ndl_value), 8);
-    uint64_t nodemap_size = ndl_rhashtable_msize(sizeof(ndl_ref), node_size, 128);
-    return sizeof(ndl_node_pool) + nodemap_size;
+    return ndl_node_pool_swap(pool, node, key, &val);
 }
 
-ndl_ref ndl_node_pool_alloc(ndl_node_pool *pool) {
+int ndl_node_pool_del(ndl_node_pool *pool, ndl_ref node, ndl_sym key) {
+
+    return ndl_node_pool_take(pool, node, key, NULL);
+}
+
+int ndl_node_pool_swap(ndl_node_pool *pool, ndl_ref node, ndl_sym key, ndl_value *val) {
+
+    ndl_node_pool_entry *entry = ndl_node_pool_entry_own(pool, node);
+    if (entry == NULL)
+        return -1;
+
+    ndl_value old;
+
+    if (entry->count != NDL_NODE_POOL_PROMOTED) {
+
+        int64_t index = ndl_node_pool_inline_find(entry, key);
+        if (index >= 0) {
+            old = entry->vals[index];
+            entry->vals[index] = *val;
+            *val = old;
+            return 0;
+        }
+
+        ndl_node_pool_shape *shape = NULL;
+        if (entry->count < NDL_NODE_POOL_INLINE) {
+
+            if (!NDL_NODE_POOL_PRIVATE(entry->shape))
+                shape = ndl_node_pool_shape_next(pool, entry->shape, key);
+
+            if (shape == NULL) {
+                shape = NDL_NODE_POOL_PRIVATE(entry->shape)?
+                    entry->shape : ndl_node_pool_shape_copy(pool, entry->shape);
+                if (shape != NULL)
+                    shape->keys[shape->size++] = key;
+            }
+        }
 
-    /* While last_id is taken, increment. */
-    ndl_rhashtable *nodemap = (ndl_rhashtable *) pool->nodemap;
+        if (shape != NULL) {
+            entry->shape = shape;
+            entry->vals[entry->count] = *val;
+            entry->count++;
+            pool->pairs++;
+            *val = NDL_VALUE(EVAL_NONE, ref=NDL_NULL_REF);
+            return 0;
+        }
 
-    void *val = (void *) nodemap; /* Any non-NULL pointer. */
-    while (val != NULL) {
-        pool->last_id++;
-        val = ndl_rhashtable_get(nodemap, &pool->last_id);
+        if (ndl_node_pool_promote(pool, entry) != 0)
+            return -1;
     }
 
-    void *region = (ndl_rhashtable *) ndl_rhashtable_put(nodemap, &pool->last_id, NULL);
-    if (region == NULL)
-        return NDL_NULL_REF;
+    ndl_node_pool_pair *pair = ndl_node_pool_pair_find(entry, key);
+    if (pair != NULL) {
+        old = pair->val;
+        pair->val = *val;
+        *val = old;
+        return 0;
+    }
 
-    ndl_rhashtable *new = ndl_rhashtable_minit(region, sizeof(ndl_sym), sizeof(ndl_value), 8);
-    if (new == NULL) {
-        ndl_rhashtable_del(nodemap, &pool->last_id);
-        pool->last_id--;
-        return NDL_NULL_REF;
+    uint64_t index = ndl_vector_size(&entry->pairs);
+    ndl_node_pool_pair next = {.key = key, .val = *val};
+
+    if (ndl_vector_push(&entry->pairs, &next) == NULL)
+        return -1;
+
+    if (ndl_rhashtable_put(&entry->table, &key, &index) == NULL) {
+        ndl_vector_pop(&entry->pairs);
+        return -1;
     }
 
-    return pool->last_id;
+    pool->pairs++;
+    *val = NDL_VALUE(EVAL_NONE, ref=NDL_NULL_REF);
+
+    return 0;
 }
 
-ndl_ref ndl_node_pool_alloc_pref(ndl_node_pool *pool, ndl_ref pref) {
+int ndl_node_pool_take(ndl_node_pool *pool, ndl_ref node, ndl_sym key, ndl_value *val) {
 
-    /* While last_id is taken, increment. */
-    ndl_rhashtable *nodemap = (ndl_rhashtable *) pool->nodemap;
+    ndl_node_pool_entry *entry = ndl_node_pool_entry_own(pool, node);
+    if (entry == NULL)
+        return -1;
 
-    void *val = ndl_rhashtable_get(nodemap, &pref);
-    if (val != NULL)
-        return NDL_NULL_REF;
+    if (entry->count != NDL_NODE_POOL_PROMOTED) {
+
+        int64_t index = ndl_node_pool_inline_find(entry, key);
+        if (index < 0)
+            return -1;
+
+        ndl_node_pool_shape *shape = entry->shape;
+        if (entry->count == 1) {
+            if (NDL_NODE_POOL_PRIVATE(shape))
+                ndl_arena_free(ndl_node_pool_heap_arena(pool), shape, sizeof(ndl_node_pool_shape));
+            shape = NULL;
+        } else if (!NDL_NODE_POOL_PRIVATE(shape)) {
+            shape = ndl_node_pool_shape_without(pool, shape, (uint64_t) index);
+            if ((shape == NULL) && ((shape = ndl_node_pool_shape_copy(pool, entry->shape)) == NULL))
+                return -1;
+        }
 
-    void *region = (ndl_rhashtable *) ndl_rhashtable_put(nodemap, &pref, NULL);
-    if (region == NULL)
-        return NDL_NULL_REF;
+        if (val != NULL)
+            *val = entry->vals[index];
 
-    ndl_rhashtable *new = ndl_rhashtable_minit(region, sizeof(ndl_sym), sizeof(ndl_value), 8);
-    if (new == NULL) {
-        ndl_rhashtable_del(nodemap, &pref);
-        return NDL_NULL_REF;
+        /* Keep insertion order. */
+        uint64_t rest = entry->count - (uint64_t) index - 1;
+        memmove(&entry->vals[index], &entry->vals[index + 1], rest * sizeof(ndl_value));
+
+        if (NDL_NODE_POOL_PRIVATE(shape)) {
+            memmove(&shape->keys[index], &shape->keys[index + 1], rest * sizeof(ndl_sym));
+            shape->size--;
+        }
+
+        entry->shape = shape;
+        entry->count--;
+        pool->pairs--;
+
+        return 0;
     }
 
-    return pref;
-}
+    ndl_node_pool_pair *pair = ndl_node_pool_pair_find(entry, key);
+    if (pair == NULL)
+        return -1;
 
-int ndl_node_pool_free(ndl_node_pool *pool, ndl_ref node) {
+    if (val != NULL)
+        *val = pair->val;
+
+    pair->val = NDL_VALUE(NDL_NODE_POOL_HOLE, ref=NDL_NULL_REF);
+    entry->holes++;
+    pool->pairs--;
+
+    if (ndl_rhashtable_del(&entry->table, &key) != 0)
+        return -1;
 
-    ndl_rhashtable *res = ndl_rhashtable_get((ndl_rhashtable *) pool->nodemap, &node);
-    if (res != NULL)
-        ndl_rhashtable_mkill(res);
+    if (entry->holes * 2 > ndl_vector_size(&entry->pairs))
+        ndl_node_pool_compact(entry);
 
-    return ndl_rhashtable_del((ndl_rhashtable *) pool->nodemap, &node);
+    return 0;
 }
 
-ndl_value ndl_node_pool_get(ndl_node_pool *pool, ndl_ref node, ndl_sym key) {
+int ndl_node_pool_fill(ndl_node_pool *pool, ndl_ref node, uint64_t count, ndl_node_pool_pair *pairs) {
+
+    ndl_node_pool_entry *entry = ndl_node_pool_entry_own(pool, node);
+    if ((entry == NULL) || (entry->count != 0))
+        return -1;
 
-    ndl_rhashtable *nodemap = (ndl_rhashtable *) pool->nodemap;
+    uint64_t i, j;
 
-    ndl_rhashtable *res = (ndl_rhashtable *) ndl_rhashtable_get(nodemap, &node);
-    if (res == NULL)
-        return NDL_VALUE(EVAL_NONE, ref=NDL_NULL_REF);
+    if (count <= NDL_NODE_POOL_INLINE) {
 
-    ndl_value *val = ndl_rhashtable_get(res, &key);
-    if (val == NULL)
-        return NDL_VALUE(EVAL_NONE, ref=NDL_NULL_REF);
+        for (i = 0; i < count; i++)
+            for (j = 0; j < i; j++)
+                if (pairs[i].key == pairs[j].key)
+                    return -1;
 
-    return *val;
-}
+        /* Walk the transitions, or past the cap, make the shape outright. */
+        ndl_node_pool_shape *shape = NULL;
+        for (i = 0; (i < count) && ((i == 0) || (shape != NULL)); i++)
+            shape = ndl_node_pool_shape_next(pool, shape, pairs[i].key);
 
-int ndl_node_pool_put(ndl_node_pool *pool, ndl_ref node, ndl_sym key, ndl_value val) {
+        if ((count > 0) && (shape == NULL)) {
 
-    ndl_rhashtable *nodemap = (ndl_rhashtable *) pool->nodemap;
+            shape = ndl_node_pool_shape_copy(pool, NULL);
+            if (shape == NULL)
+                return -1;
 
-    ndl_rhashtable *res = (ndl_rhashtable *) ndl_rhashtable_get(nodemap, &node);
-    if (res == NULL)
+            for (i = 0; i < count; i++)
+                shape->keys[i] = pairs[i].key;
+            shape->size = count;
+        }
+
+        for (i = 0; i < count; i++)
+            entry->vals[i] = pairs[i].val;
+
+        entry->shape = shape;
+        entry->count = count;
+        pool->pairs += count;
+
+        return 0;
+    }
+
+    ndl_arena *arena = ndl_node_pool_arena(pool);
+    if ((arena == NULL) ||
+        (ndl_rhashtable_aminit(&entry->table, sizeof(ndl_sym), sizeof(uint64_t), 2 * count, arena) == NULL))
         return -1;
 
-    void *slot = ndl_rhashtable_put(res, &key, &val);
-    if (slot == NULL)
+    ndl_vector_aminit(&entry->pairs, sizeof(ndl_node_pool_pair), arena);
+    entry->holes = 0;
+
+    for (i = 0; i < count; i++) {
+        if ((ndl_rhashtable_get(&entry->table, &pairs[i].key) != NULL) ||
+            (ndl_rhashtable_put(&entry->table, &pairs[i].key, &i) == NULL))
+            break;
+    }
+
+    if ((i < count) || (ndl_vector_insert_range(&entry->pairs, 0, count, pairs) == NULL)) {
+        ndl_node_pool_release(entry);
+        entry->shape = NULL;
         return -1;
+    }
+
+    entry->count = NDL_NODE_POOL_PROMOTED;
+    pool->pairs += count;
 
     return 0;
 }
 
-int ndl_node_pool_del(ndl_node_pool *pool, ndl_ref node, ndl_sym key) {
+/* Node iterators point at the node's entry. */
+static inline void *ndl_node_pool_scan(ndl_node_pool *pool, ndl_ref node) {
 
-    ndl_rhashtable *nodemap = (ndl_rhashtable *) pool->nodemap;
+    uint64_t index = (uint64_t) node >> NDL_NODE_POOL_PAGE_BITS;
+    uint64_t i = (uint64_t) node & (NDL_NODE_POOL_PAGE_SIZE - 1);
 
-    ndl_rhashtable *res = (ndl_rhashtable *) ndl_rhashtable_get(nodemap, &node);
-    if (res == NULL)
-        return -1;
+    for (; index < pool->page_count; index++, i = 0) {
+
+        ndl_node_pool_page *page = pool->dir->pages[index];
+        if (page == NULL)
+            continue;
+
+        for (; i < NDL_NODE_POOL_PAGE_SIZE; i++)
+            if (!NDL_NODE_POOL_ISFREE(page->entries[i].count))
+                return &page->entries[i];
+    }
 
-    return ndl_rhashtable_del(res, &key);
+    return NULL;
 }
 
 void *ndl_node_pool_head(ndl_node_pool *pool) {
 
-    return ndl_rhashtable_pairs_head((ndl_rhashtable *) pool->nodemap);
+    return ndl_node_pool_scan(pool, 0);
 }
 
 void *ndl_node_pool_next(ndl_node_pool *pool, void *prev) {
 
-    return ndl_rhashtable_pairs_next((ndl_rhashtable *) pool->nodemap, prev);
+    if (prev == NULL)
+        return NULL;
+
+    return ndl_node_pool_scan(pool, ((ndl_node_pool_entry *) prev)->id + 1);
 }
 
 ndl_ref ndl_node_pool_node(ndl_node_pool *pool, void *curr) {
 
-    ndl_ref *res = ndl_rhashtable_pairs_key((ndl_rhashtable *) pool->nodemap, curr);
-    if (res == NULL)
+    if (curr == NULL)
         return NDL_NULL_REF;
 
-    return *res;
+    return ((ndl_node_pool_entry *) curr)->id;
+}
+
+void *ndl_node_pool_seek(ndl_node_pool *pool, ndl_ref start) {
+
+    if (start < 0)
+        return NULL;
+
+    return ndl_node_pool_scan(pool, start);
 }
 
 uint64_t ndl_node_pool_size(ndl_node_pool *pool) {
 
-    return ndl_rhashtable_size((ndl_rhashtable *) pool->nodemap);
+    return pool->size;
+}
+
+uint64_t ndl_node_pool_pair_count(ndl_node_pool *pool) {
+
+    return pool->pairs;
+}
+
+uint64_t ndl_node_pool_span(ndl_node_pool *pool) {
+
+    return pool->page_count << NDL_NODE_POOL_PAGE_BITS;
+}
+
+/* Inline pair iterators point at the pair's value, promoted ones at the pair. */
+static inline void *ndl_node_pool_pairs_skip(ndl_node_pool_entry *entry, uint64_t index) {
+
+    ndl_node_pool_pair *pair = ndl_node_pool_pair_at(entry, index);
+    while ((pair != NULL) && (NDL_VALUE_TYPE(pair->val) == NDL_NODE_POOL_HOLE))
+        pair = ndl_node_pool_pair_at(entry, ++index);
+
+    return pair;
 }
 
 void *ndl_node_pool_node_pairs_head(ndl_node_pool *pool, ndl_ref node) {
 
-    void *res = ndl_rhashtable_get((ndl_rhashtable *) pool->nodemap, &node);
-    if (res == NULL)
+    ndl_node_pool_entry *entry = ndl_node_pool_entry_get(pool, node);
+    if (entry == NULL)
         return NULL;
 
-    return ndl_rhashtable_pairs_head((ndl_rhashtable *) res);
+    if (entry->count == NDL_NODE_POOL_PROMOTED)
+        return ndl_node_pool_pairs_skip(entry, 0);
+
+    return (entry->count > 0)? &entry->vals[0] : NULL;
 }
 
 void *ndl_node_pool_node_pairs_next(ndl_node_pool *pool, ndl_ref node, void *prev) {
 
-    void *res = ndl_rhashtable_get((ndl_rhashtable *) pool->nodemap, &node);
-    if (res == NULL)
+    ndl_node_pool_entry *entry = ndl_node_pool_entry_get(pool, node);
+    if ((entry == NULL) || (prev == NULL))
         return NULL;
 
-    return ndl_rhashtable_pairs_next((ndl_rhashtable *) res, prev);
+    if (entry->count == NDL_NODE_POOL_PROMOTED) {
+        uint64_t index = (uint64_t) ((ndl_node_pool_pair *) prev - ndl_node_pool_pair_at(entry, 0));
+        return ndl_node_pool_pairs_skip(entry, index + 1);
+    }
+
+    uint64_t index = (uint64_t) ((ndl_value *) prev - entry->vals) + 1;
+
+    return (index < entry->count)? &entry->vals[index] : NULL;
 }
 
 ndl_sym ndl_node_pool_node_pairs_key(ndl_node_pool *pool, ndl_ref node, void *curr) {
 
-    void *res = ndl_rhashtable_get((ndl_rhashtable *) pool->nodemap, &node);
-    if (res == NULL)
+    ndl_node_pool_entry *entry = ndl_node_pool_entry_get(pool, node);
+    if ((entry == NULL) || (curr == NULL))
         return NDL_NULL_SYM;
 
-    ndl_sym *ret = ndl_rhashtable_pairs_key((ndl_rhashtable *) res, curr);
-    if (ret == NULL)
-        return NDL_NULL_SYM;
-    else
-        return *ret;
+    if (entry->count == NDL_NODE_POOL_PROMOTED)
+        return ((ndl_node_pool_pair *) curr)->key;
+
+    return entry->shape->keys[(ndl_value *) curr - entry->vals];
 }
 
 ndl_value ndl_node_pool_node_pairs_val(ndl_node_pool *pool, ndl_ref node, void *curr) {
 
-    void *res = ndl_rhashtable_get((ndl_rhashtable *) pool->nodemap, &node);
-    if (res == NULL)
+    ndl_node_pool_entry *entry = ndl_node_pool_entry_get(pool, node);
+    if ((entry == NULL) || (curr == NULL))
         return NDL_VALUE(EVAL_NONE, ref=NDL_NULL_REF);
 
-    ndl_value *ret = ndl_rhashtable_pairs_val((ndl_rhashtable *) res, curr);
-    if (ret == NULL)
-        return NDL_VALUE(EVAL_NONE, ref=NDL_NULL_SYM);
-    else
-        return *ret;
+    if (entry->count == NDL_NODE_POOL_PROMOTED)
+        return ((ndl_node_pool_pair *) curr)->val;
+
+    return *(ndl_value *) curr;
 }
 
 uint64_t ndl_node_pool_node_size(ndl_node_pool *pool, ndl_ref node) {
 
-    ndl_rhashtable *nodeht = ndl_rhashtable_get((ndl_rhashtable *) pool->nodemap, &node);
-    if (nodeht == NULL)
+    ndl_node_pool_entry *entry = ndl_node_pool_entry_get(pool, node);
+    if (entry == NULL)
+        return 0;
+
+    if (entry->count == NDL_NODE_POOL_PROMOTED)
+        return ndl_vector_size(&entry->pairs) - entry->holes;
+
+    return entry->count;
+}
+
+ndl_sym ndl_node_pool_node_index(ndl_node_pool *pool, ndl_ref node, uint64_t index) {
+
+    ndl_node_pool_entry *entry = ndl_node_pool_entry_get(pool, node);
+    if (entry == NULL)
+        return NDL_NULL_SYM;
+
+    if (entry->count != NDL_NODE_POOL_PROMOTED)
+        return (index < entry->count)? entry->shape->keys[index] : NDL_NULL_SYM;
+
+    if ((entry->holes > 0) && pool->readonly) {
+
+        ndl_node_pool_pair *pair = ndl_node_pool_pairs_skip(entry, 0);
+        while ((pair != NULL) && (index-- > 0))
+            pair = ndl_node_pool_pairs_skip(entry, (uint64_t) (pair - ndl_node_pool_pair_at(entry, 0)) + 1);
+
+        return (pair != NULL)? pair->key : NDL_NULL_SYM;
+    }
+
+    if (entry->holes > 0) {
+
+        entry = ndl_node_pool_entry_own(pool, node);
+        if (entry == NULL)
+            return NDL_NULL_SYM;
+
+        ndl_node_pool_compact(entry);
+    }
+
+    ndl_node_pool_pair *pair = ndl_node_pool_pair_at(entry, index);
+
+    return (pair != NULL)? pair->key : NDL_NULL_SYM;
+}
+
+ndl_node_pool_header *ndl_node_pool_node_header(ndl_node_pool *pool, ndl_ref node) {
+
+    ndl_node_pool_entry *entry = ndl_node_pool_entry_own(pool, node);
+    if (entry == NULL)
+        return NULL;
+
+    return &entry->header;
+}
+
+ndl_node_pool_header *ndl_node_pool_node_peek(ndl_node_pool *pool, ndl_ref node) {
+
+    ndl_node_pool_entry *entry = ndl_node_pool_entry_get(pool, node);
+    if (entry == NULL)
+        return NULL;
+
+    return &entry->header;
+}
+
+void ndl_node_pool_prefetch(ndl_node_pool *pool, ndl_ref node) {
+
+    ndl_node_pool_entry *entry = ndl_node_pool_entry_at(pool, node);
+    if (entry == NULL)
+        return;
+
+    /* The mark is written; inline values are what marking reads. */
+    __builtin_prefetch(&entry->header, 1);
+    __builtin_prefetch(&entry->vals[0], 0);
+    __builtin_prefetch(&entry->vals[NDL_NODE_POOL_INLINE / 2], 0);
+}
+
+int ndl_node_pool_has(ndl_node_pool *pool, ndl_ref node) {
+
+    uint64_t index = (uint64_t) node >> NDL_NODE_POOL_PAGE_BITS;
+    if ((node <= 0) || (index >= pool->page_count) || (pool->dir->pages[index] == NULL))
+        return 0;
+
+    uint64_t slot = (uint64_t) node & (NDL_NODE_POOL_PAGE_SIZE - 1);
+
+    return (pool->dir->pages[index]->bits[slot / 64] >> (slot % 64)) & 1;
+}
+
+/* The live word holding a node's bit, or NULL if its page doesn't exist,
+ * or for snapshots.
+ */
+static inline uint64_t *ndl_node_pool_live_word(ndl_node_pool *pool, ndl_ref node) {
+
+    uint64_t index = (uint64_t) node >> NDL_NODE_POOL_PAGE_BITS;
+    if ((node < 0) || (index >= pool->page_count) || (pool->dir->pages[index] == NULL) ||
+        pool->readonly)
+        return NULL;
+
+    return &pool->dir->pages[index]->live[((uint64_t) node & (NDL_NODE_POOL_PAGE_SIZE - 1)) / 64];
+}
+
+void ndl_node_pool_live_reset(ndl_node_pool *pool) {
+
+    if (pool->readonly)
+        return;
+
+    uint64_t i;
+    for (i = 0; i < pool->page_count; i++)
+        if (pool->dir->pages[i] != NULL)
+            memset(pool->dir->pages[i]->live, 0, sizeof(pool->dir->pages[i]->live));
+
+    if ((pool->page_count > 0) && (pool->dir->pages[0] != NULL))
+        pool->dir->pages[0]->live[0] = 1;
+
+    pool->sweeping = 1;
+    pool->sweep_at = 0;
+}
+
+int ndl_node_pool_live_set(ndl_node_pool *pool, ndl_ref node) {
+
+    uint64_t *word = ndl_node_pool_live_word(pool, node);
+    if (word == NULL)
+        return 1;
+
+    uint64_t bit = (uint64_t) 1 << ((uint64_t) node % 64);
+    if (*word & bit)
+        return 1;
+
+    *word |= bit;
+
+    return 0;
+}
+
+int ndl_node_pool_live_claim(ndl_node_pool *pool, ndl_ref node) {
+
+    uint64_t *word = ndl_node_pool_live_word(pool, node);
+    if (word == NULL)
+        return 1;
+
+    uint64_t bit = (uint64_t) 1 << ((uint64_t) node % 64);
+    if (__atomic_load_n(word, __ATOMIC_RELAXED) & bit)
+        return 1;
+
+    return (__atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit) != 0;
+}
+
+int ndl_node_pool_live(ndl_node_pool *pool, ndl_ref node) {
+
+    uint64_t *word = ndl_node_pool_live_word(pool, node);
+    if (word == NULL)
         return 0;
 
-    return ndl_rhashtable_size(nodeht);
+    return (*word >> ((uint64_t) node % 64)) & 1;
+}
+
+ndl_ref ndl_node_pool_sweep_next(ndl_node_pool *pool) {
+
+    if (!pool->sweeping)
+        return NDL_NULL_REF;
+
+    uint64_t at = pool->sweep_at;
+    uint64_t index = at >> NDL_NODE_POOL_PAGE_BITS;
+
+    for (; index < pool->page_count; index++, at = index << NDL_NODE_POOL_PAGE_BITS) {
+
+        ndl_node_pool_page *page = pool->dir->pages[index];
+        if (page == NULL)
+            continue;
+
+        uint64_t word = (at & (NDL_NODE_POOL_PAGE_SIZE - 1)) / 64;
+        uint64_t dead = page->bits[word] & ~page->live[word] & (UINT64_MAX << (at % 64));
+
+        while (dead == 0) {
+            if (++word >= NDL_NODE_POOL_WORDS)
+                break;
+            dead = page->bits[word] & ~page->live[word];
+        }
+
+        if (dead != 0) {
+            ndl_ref node = (ndl_ref) ((index << NDL_NODE_POOL_PAGE_BITS) + word * 64 +
+                                      (uint64_t) __builtin_ctzll(dead));
+            pool->sweep_at = (uint64_t) node + 1;
+            return node;
+        }
+    }
+
+    pool->sweeping = 0;
+    pool->sweep_at = 0;
+
+    return NDL_NULL_REF;
+}
+
+void ndl_node_pool_sweep_stop(ndl_node_pool *pool) {
+
+    pool->sweeping = 0;
+    pool->sweep_at = 0;
+}
+
+int ndl_node_pool_sweeping(ndl_node_pool *pool) {
+
+    return pool->sweeping;
 }
 
 ndl_ref ndl_node_pool_get_counter(ndl_node_pool *pool) {
 
-    return pool->last_id;
+    return ndl_node_pool_next_id(pool);
 }
 
 void ndl_node_pool_set_counter(ndl_node_pool *pool, ndl_ref counter) {
 
-    pool->last_id = counter;
+    if ((counter < 1) || (counter > NDL_NODE_POOL_MAX_ID))
+        return;
+
+    pool->min_id = counter;
+}
+
+uint64_t ndl_node_pool_shape_count(ndl_node_pool *pool) {
+
+    if (pool->shapes == NULL)
+        return 0;
+
+    return ndl_vector_size(&pool->shapes->shapes);
+}
+
+ndl_arena *ndl_node_pool_arena(ndl_node_pool *pool) {
+
+    if (pool->readonly)
+        return NULL;
+
+    if (pool->heap != NULL)
+        return &pool->heap->arena;
+
+    ndl_node_pool_heap *heap = malloc(sizeof(ndl_node_pool_heap));
+    if (heap == NULL)
+        return NULL;
+
+    heap->refs = 1;
+    ndl_arena_minit(&heap->arena);
+
+    pool->heap = heap;
+
+    return &heap->arena;
+}
+
+uint64_t ndl_node_pool_trim(ndl_node_pool *pool) {
+
+    if (pool->readonly || (pool->heap == NULL))
+        return 0;
+
+    return ndl_arena_trim(&pool->heap->arena);
+}
+
+int ndl_node_pool_hugepages(ndl_node_pool *pool, int enable) {
+
+    ndl_arena *arena = ndl_node_pool_arena(pool);
+    if (arena == NULL)
+        return -1;
+
+    ndl_arena_hugepages(arena, enable);
+
+    return 0;
 }
 
 void ndl_node_pool_print(ndl_node_pool *pool) {
 
     printf("Printing pool.\n");
-    printf("Last id: %ld.\n", pool->last_id);
-
-    ndl_rhashtable *nodemap = (ndl_rhashtable *) pool->nodemap;
+    printf("Nodes: %ld, next id: %ld.\n", pool->size, ndl_node_pool_next_id(pool));
 
-    void *curr = ndl_rhashtable_pairs_head(nodemap);
+    void *curr = ndl_node_pool_head(pool);
     while (curr != NULL) {
 
-        ndl_ref *id = ndl_rhashtable_pairs_key(nodemap, curr);
-        ndl_rhashtable *node = ndl_rhashtable_pairs_val(nodemap, curr);
-        if ((id == NULL) || (node == NULL)) {
+        ndl_ref node = ndl_node_pool_node(pool, curr);
+        if (node == NDL_NULL_REF) {
             fprintf(stderr, "Got invalid iterator. Failed to print nodepool.\n");
             return;
         }
 
-        printf("Node %ld:\n", *id);
-        void *pair = ndl_rhashtable_pairs_head(node);
+        ndl_node_pool_header *header = ndl_node_pool_node_peek(pool, node);
+        printf("Node %ld (mark %ld, backrefs %ld):\n", node, header->mark,
+               ndl_backrefs_size(&header->backrefs));
+        void *pair = ndl_node_pool_node_pairs_head(pool, node);
         while (pair != NULL) {
 
-            ndl_sym *key = ndl_rhashtable_pairs_key(node, pair);
-            ndl_value *val = ndl_rhashtable_pairs_val(node, pair);
+            ndl_sym key = ndl_node_pool_node_pairs_key(pool, node, pair);
+            ndl_value val = ndl_node_pool_node_pairs_val(pool, node, pair);
 
             char keybuff[16], valbuff[16];
             keybuff[15] = valbuff[15] = '\0';
 
-            ndl_value_to_string(NDL_VALUE(EVAL_SYM, sym=*key), 15, keybuff);
-            ndl_value_to_string(*val, 15, valbuff);
+            ndl_value_to_string(NDL_VALUE(EVAL_SYM, sym=key), 15, keybuff);
+            ndl_value_to_string(val, 15, valbuff);
 
             printf("%s:%s\n", keybuff, valbuff);
 
-            pair = ndl_rhashtable_pairs_next(node, pair);
+            pair = ndl_node_pool_node_pairs_next(pool, node, pair);
         }
 
-        curr = ndl_rhashtable_pairs_next(nodemap, curr);
+        curr = ndl_node_pool_next(pool, curr);
     }
 }
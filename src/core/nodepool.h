@@ -2,21 +2,195 @@
 #define NODEL_NODEPOOL_H
 
 #include "node.h"
+#include "backrefs.h"
+#include "rehashtable.h"
+#include "vector.h"
 
 /* Pool of nodes used in a graph.
- * Effectively abstracts over a number of rehashtables and
- * indexes them arbitrarily.
- * nodemap is an embedded rhashtable mapping from
- * ndl_ref -> ndl_rhashtable.
- * Operations amortized O(1).
- * May be replaced in the future, or rhashtable improved
- * to remove O(n) latency spikes on resize.
+ * Nodes live in a paged directory, indexed directly by ndl_ref:
+ * pages[ref >> NDL_NODE_POOL_PAGE_BITS] holds the node's entry, so
+ * resolving a node is two array indexes, and entries never move.
+ * Pages are allocated on first use, and released once empty.
+ *
+ * Ids are handed out lowest-free-first, so the id space stays dense
+ * (for locality, and for the serialized format) without ever moving a
+ * live node. Each page keeps an occupancy bitmap, and the pool keeps a
+ * bitmap of full pages; alloc() is a find-first-zero over each, starting
+ * from a hint at the lowest page that may have room.
+ * Operations O(1), amortized over directory growth.
+ */
+
+/* Per-node metadata, kept apart from the node's key/value pairs so
+ * that key iteration only ever sees user keys.
+ * mark is the graph's GC/root word (zeroed on alloc.)
+ * age and flags are the graph's generational state (zeroed on alloc.)
+ * backrefs counts references to the node by source (empty on alloc.)
+ */
+typedef struct ndl_node_pool_header_s {
+
+    int64_t mark;
+    uint32_t age, flags;
+    ndl_backrefs backrefs;
+
+} ndl_node_pool_header;
+
+/* Shapes: the keys of small nodes, kept once per pool.
+ * Small nodes with the same keys, in the same order (instructions, say)
+ * share a shape, and keep only their values. A shape is found from the
+ * one with all but its last key by a transition, a (shape id, key)
+ * lookup in the pool's table, so putting a new key is a lookup, and
+ * deleting one, a walk from the empty shape. Each shape caches the last
+ * transition taken from it, which is all most puts need.
+ *
+ * A shape's keys never change once made, and shapes live until the pool
+ * and its snapshots are all killed. Past NDL_NODE_POOL_SHAPES_MAX, a node
+ * that needs a new shape gets a private one instead, with id 0: its own
+ * copy, changed in place, and freed with the node. The empty shape is NULL.
  */
+#define NDL_NODE_POOL_INLINE 8
+
+#define NDL_NODE_POOL_SHAPES_MAX (1 << 16)
+
+typedef struct ndl_node_pool_shape_s {
 
+    uint64_t id, size;
+    ndl_sym keys[NDL_NODE_POOL_INLINE];
+
+    ndl_sym next_key;
+    struct ndl_node_pool_shape_s *next;
+
+} ndl_node_pool_shape;
+
+/* shapes holds a pointer to each shape, by id - 1.
+ * refs counts the pools (and snapshots) holding the set.
+ * empty caches the empty shape's last transition.
+ */
+typedef struct ndl_node_pool_shapes_s {
+
+    uint64_t refs;
+    ndl_rhashtable transitions;
+    ndl_vector shapes;
+
+    ndl_node_pool_shape empty;
+
+} ndl_node_pool_shapes;
+
+/* Storage for a single node, kept in its directory page.
+ * Small nodes keep their values inline, in insertion order, and their
+ * keys in their shape, searched linearly (SSE2, four keys per step where
+ * available.) When a node grows past NDL_NODE_POOL_INLINE pairs, it is promoted, and count
+ * is set to NDL_NODE_POOL_PROMOTED: its pairs move to a vector, still in
+ * insertion order, and an rhashtable maps each key to its position.
+ * Deleted pairs leave holes (val.type == NDL_NODE_POOL_HOLE), compacted
+ * once they outnumber live pairs, or by the next node_index().
+ * Unallocated entries have count NDL_NODE_POOL_UNUSED.
+ *
+ * A get reads count, shape and a value, so they go first, where the
+ * first few values share a cache line with count more often than not;
+ * the header, which gets don't read, goes last. Entries aren't padded
+ * to whole lines, which would take 256 bytes for 200, so a get on a
+ * small node reads one or two lines of the entry, and the shape's keys.
+ */
+#define NDL_NODE_POOL_PROMOTED UINT64_MAX
+#define NDL_NODE_POOL_UNUSED  (UINT64_MAX - 1)
+
+#define NDL_NODE_POOL_HOLE EVAL_SIZE
+
+typedef struct ndl_node_pool_pair_s {
+
+    ndl_sym   key;
+    ndl_value val;
+
+} ndl_node_pool_pair;
+
+typedef struct ndl_node_pool_entry_s {
+
+    uint64_t count;
+
+    union {
+        struct {
+            ndl_node_pool_shape *shape;
+            ndl_value vals[NDL_NODE_POOL_INLINE];
+        };
+        struct {
+            ndl_rhashtable table;
+            ndl_vector pairs;
+            uint64_t holes;
+        };
+    };
+
+    ndl_ref id;
+    ndl_node_pool_header header;
+
+} ndl_node_pool_entry;
+
+#define NDL_NODE_POOL_PAGE_BITS 8
+#define NDL_NODE_POOL_PAGE_SIZE (1 << NDL_NODE_POOL_PAGE_BITS)
+
+/* Largest id the directory will index. */
+#define NDL_NODE_POOL_MAX_ID (((ndl_ref) 1 << 32) - 1)
+
+/* Id 0 is never handed out; its bit in page 0 is always set.
+ * live holds the graph's mark bits, one per slot, next to the occupancy
+ * bits, so a sweep finds the dead with a word op per 64 slots.
+ * refs counts the directories holding the page; see snapshot().
+ */
+typedef struct ndl_node_pool_page_s {
+
+    uint64_t refs;
+    uint64_t used;
+    uint64_t bits[NDL_NODE_POOL_PAGE_SIZE / 64];
+    uint64_t live[NDL_NODE_POOL_PAGE_SIZE / 64];
+    ndl_node_pool_entry entries[NDL_NODE_POOL_PAGE_SIZE];
+
+} ndl_node_pool_page;
+
+/* The page directory. refs counts the pools (and snapshots) holding it.
+ * count is always a multiple of 64, one word of full bits.
+ */
+typedef struct ndl_node_pool_dir_s {
+
+    uint64_t refs;
+    uint64_t count;
+    ndl_node_pool_page *pages[];
+
+} ndl_node_pool_dir;
+
+/* The arena behind nodes' small allocations: backref arrays and
+ * tables, private shapes, and promoted nodes' pairs and key tables.
+ * refs counts the pools (and snapshots) holding it.
+ */
+typedef struct ndl_node_pool_heap_s {
+
+    uint64_t refs;
+    ndl_arena arena;
+
+} ndl_node_pool_heap;
+
+/* page_count mirrors dir->count, 0 while there's no directory.
+ * sweeping is set from live_reset() until sweep_next() runs out, and
+ * sweep_at is the lowest id it hasn't looked at yet.
+ * pairs totals the nodes' pairs.
+ * readonly is set for snapshots.
+ * shapes is made on the first put, and shared with snapshots.
+ * heap is made on first use, and shared with snapshots.
+ */
 typedef struct ndl_node_pool_s {
 
-    ndl_ref last_id;
-    uint8_t nodemap[];
+    ndl_ref min_id;
+    uint64_t size, pairs;
+
+    uint64_t page_count, open_hint;
+    ndl_node_pool_dir *dir;
+    uint64_t *full;
+
+    ndl_node_pool_shapes *shapes;
+    ndl_node_pool_heap *heap;
+
+    int sweeping;
+    uint64_t sweep_at;
+
+    int readonly;
 
 } ndl_node_pool;
 
@@ -36,11 +210,33 @@ ndl_node_pool *ndl_node_pool_minit(void *region);
 void           ndl_node_pool_mkill(ndl_node_pool *pool);
 uint64_t       ndl_node_pool_msize(void);
 
+/* Copy-on-write snapshots.
+ * A snapshot is a read-only pool holding the same nodes as the original
+ * did when it was taken. It shares the original's directory, pages and shapes,
+ * so taking one is O(1). The original copies the directory on its next
+ * write, and a page (deep, pairs and backrefs) on its first write to
+ * it, leaving the snapshot the old one: a write costs at most a page copy,
+ * and only the first write to each page after a snapshot. Pages are
+ * freed by whichever of the pools and snapshots holding them lets go last.
+ *
+ * A snapshot can be read on another thread while the original is
+ * written, but not concurrently with taking or killing another snapshot
+ * of the same pool. Writes to a snapshot fail, and it has no mark bits.
+ * Mark bits aren't copied on write: the original may set them in pages
+ * a snapshot holds.
+ *
+ * snapshot() initializes a snapshot of pool in the given region, of msize().
+ *     mkill() releases it. Returns NULL on error.
+ * readonly() returns whether the pool is a snapshot.
+ */
+ndl_node_pool *ndl_node_pool_snapshot(void *region, ndl_node_pool *pool);
+int            ndl_node_pool_readonly(ndl_node_pool *pool);
+
 /* Allocate and free nodes from the pool.
  *
- * alloc() allocates a node from the pool.
+ * alloc() allocates the lowest free id (at or above the counter) from the pool.
  *     Returns NDL_NULL_REF on failure.
- * alloc_pref() allocates a node with a given ID.
+ * alloc_pref() allocates a node with a given ID, up to NDL_NODE_POOL_MAX_ID.
  *     Returns NDL_NULL_REF on failure.
  * free() frees a node from the pool.
  *     Returns nonzero on failure.
@@ -57,12 +253,26 @@ int     ndl_node_pool_free      (ndl_node_pool *pool, ndl_ref node);
  *     Returns nonzero on error.
  * del() deletes the given node's value at key.
  *     Returns nonzero on error, missing node, missing key.
+ *
+ * swap() is put(), but swaps *val with the old value, or EVAL_NONE if the
+ *     key is new. One lookup, for callers that need both.
+ * take() is del(), but stores the deleted value in *val, unless NULL.
+ *
+ * fill() puts count pairs into an empty node in one go, sizing its
+ *     storage up front rather than growing it a pair at a time.
+ *     Returns nonzero on error, for nonempty nodes, or if a key repeats,
+ *     leaving the node empty.
  */
 
 ndl_value ndl_node_pool_get(ndl_node_pool *pool, ndl_ref node, ndl_sym key);
 int       ndl_node_pool_put(ndl_node_pool *pool, ndl_ref node, ndl_sym key, ndl_value val);
 int       ndl_node_pool_del(ndl_node_pool *pool, ndl_ref node, ndl_sym key);
 
+int ndl_node_pool_swap(ndl_node_pool *pool, ndl_ref node, ndl_sym key, ndl_value *val);
+int ndl_node_pool_take(ndl_node_pool *pool, ndl_ref node, ndl_sym key, ndl_value *val);
+
+int ndl_node_pool_fill(ndl_node_pool *pool, ndl_ref node, uint64_t count, ndl_node_pool_pair *pairs);
+
 /* Node iteration and node-related metadata.
  * Iterators __INVALIDATED__ after mutating operations.
  *
@@ -72,22 +282,31 @@ int       ndl_node_pool_del(ndl_node_pool *pool, ndl_ref node, ndl_sym key);
  *     Returns NULL on error or end of list.
  * node() gets the node at the given iterator.
  *     Returns NDL_NULL_REF on error.
+ * seek() gets the iterator for the first node with an id at or above start.
+ *     Returns NULL on error or end of list.
  *
  * size() gets the number of nodes in a pool.
  *     Returns 0 on error.
+ * pair_count() gets the number of key/value pairs across every node.
+ * span() gets one past the largest id the directory can currently hold.
+ *     Every node's id is below it; [0, span) can be split to partition the pool.
  */
 void   *ndl_node_pool_head(ndl_node_pool *pool);
 void   *ndl_node_pool_next(ndl_node_pool *pool, void *prev);
 ndl_ref ndl_node_pool_node(ndl_node_pool *pool, void *curr);
+void   *ndl_node_pool_seek(ndl_node_pool *pool, ndl_ref start);
 
-uint64_t ndl_node_pool_size(ndl_node_pool *pool);
+uint64_t ndl_node_pool_size      (ndl_node_pool *pool);
+uint64_t ndl_node_pool_pair_count(ndl_node_pool *pool);
+uint64_t ndl_node_pool_span      (ndl_node_pool *pool);
 
 /* Node key/value iteration and metadata.
  * Iterators __INVALIDATED__ by mutating operations.
+ * Pairs are visited in insertion order.
  *
  * node_pairs_head() gets the first key/value pair iterator for the node.
  *     Returns NULL on error, end of list.
- * node_pairs_head() gets the next key/value pair iterator for the node.
+ * node_pairs_next() gets the next key/value pair iterator for the node.
  *     Returns NULL on error, end of list.
  *
  * node_pairs_key() gets the key of a node pair iterator.
@@ -96,7 +315,11 @@ uint64_t ndl_node_pool_size(ndl_node_pool *pool);
  *     Returns val.type = EVAL_NONE on error.
  *
  * node_size() returns the number of pairs for a given node.
- * Returns 0 on error.
+ *     Returns 0 on error.
+ * node_index() gets the key of the node's nth pair, in insertion order.
+ *     O(1), but compacts a promoted node with holes, invalidating iterators.
+ *     Snapshots don't compact, and skip holes in O(n) instead.
+ *     Returns NDL_NULL_SYM on error, or if out of range.
  */
 void *ndl_node_pool_node_pairs_head(ndl_node_pool *pool, ndl_ref node);
 void *ndl_node_pool_node_pairs_next(ndl_node_pool *pool, ndl_ref node, void *prev);
@@ -104,16 +327,79 @@ void *ndl_node_pool_node_pairs_next(ndl_node_pool *pool, ndl_ref node, void *pre
 ndl_sym   ndl_node_pool_node_pairs_key(ndl_node_pool *pool, ndl_ref node, void *curr);
 ndl_value ndl_node_pool_node_pairs_val(ndl_node_pool *pool, ndl_ref node, void *curr);
 
-uint64_t ndl_node_pool_node_size(ndl_node_pool *pool, ndl_ref node);
+uint64_t ndl_node_pool_node_size (ndl_node_pool *pool, ndl_ref node);
+ndl_sym  ndl_node_pool_node_index(ndl_node_pool *pool, ndl_ref node, uint64_t index);
+
+/* Node metadata.
+ *
+ * node_header() gets the node's metadata header, to write to.
+ *     Valid until the node is freed, or a snapshot is taken. Copies the
+ *     node's page if a snapshot shares it. Returns NULL on error.
+ * node_peek() gets the node's metadata header, to read only.
+ *     Valid until the pool is next written. Never copies. Returns NULL on error.
+ * prefetch() hints that the node's header and inline values will be read soon.
+ *     Never faults, and does nothing for missing nodes.
+ * has() returns whether the node exists, from its page's occupancy
+ *     bits, without reading the node.
+ */
+ndl_node_pool_header *ndl_node_pool_node_header(ndl_node_pool *pool, ndl_ref node);
+ndl_node_pool_header *ndl_node_pool_node_peek  (ndl_node_pool *pool, ndl_ref node);
+
+void ndl_node_pool_prefetch(ndl_node_pool *pool, ndl_ref node);
+int  ndl_node_pool_has     (ndl_node_pool *pool, ndl_ref node);
+
+/* Mark bits and lazy sweeping.
+ * A bit per slot, kept apart from the nodes, for a mark phase that
+ * doesn't write to them (nor copy pages snapshots share.) Between live_reset() and the end of the
+ * sweep, alloc() and alloc_pref() set the new node's bit, so nodes made
+ * mid-sweep survive it. Freeing nodes doesn't disturb a sweep.
+ *
+ * live_reset() clears every node's bit and starts a sweep.
+ * live_set() sets the node's bit. Returns its old value, 1 for missing nodes.
+ * live_claim() is live_set(), but atomic, for concurrent markers.
+ * live() gets the node's bit. 0 for missing nodes.
+ *
+ * sweep_next() gets the next node without its bit, in id order. The
+ *     caller frees it (or sets its bit) before the next call.
+ *     Returns NDL_NULL_REF once the sweep is done.
+ * sweep_stop() ends a sweep early, leaving the rest of the dead alone.
+ * sweeping() returns whether a sweep is running.
+ */
+void ndl_node_pool_live_reset(ndl_node_pool *pool);
+int  ndl_node_pool_live_set  (ndl_node_pool *pool, ndl_ref node);
+int  ndl_node_pool_live_claim(ndl_node_pool *pool, ndl_ref node);
+int  ndl_node_pool_live      (ndl_node_pool *pool, ndl_ref node);
+
+ndl_ref ndl_node_pool_sweep_next(ndl_node_pool *pool);
+void    ndl_node_pool_sweep_stop(ndl_node_pool *pool);
+int     ndl_node_pool_sweeping  (ndl_node_pool *pool);
 
 /* Nodepool metadata.
  *
  * get_counter() gets the next id to be assigned by the nodepool.
- * set_counter sets the next id to be assigned by the nodepool.
+ * set_counter() sets the lowest id alloc() may assign. Defaults to 1.
+ *
+ * shape_count() gets the number of shapes the pool and its snapshots have made.
  */
 ndl_ref ndl_node_pool_get_counter(ndl_node_pool *pool);
 void    ndl_node_pool_set_counter(ndl_node_pool *pool, ndl_ref counter);
 
+uint64_t ndl_node_pool_shape_count(ndl_node_pool *pool);
+
+/* Node storage.
+ * Nodes' backrefs and promoted storage come from an arena the pool
+ * shares with its snapshots. Sets in node headers must only be written through it.
+ *
+ * arena() gets the arena, making it on first use. NULL for snapshots,
+ *     or on error.
+ * trim() returns the arena's unused spans to the OS. Returns the bytes unmapped.
+ * hugepages() sets whether the arena maps new spans as huge pages.
+ *     Nonzero for snapshots, or on error.
+ */
+ndl_arena *ndl_node_pool_arena    (ndl_node_pool *pool);
+uint64_t   ndl_node_pool_trim     (ndl_node_pool *pool);
+int        ndl_node_pool_hugepages(ndl_node_pool *pool, int enable);
+
 /* Print the entirety of the pool. */
 void ndl_node_pool_print(ndl_node_pool *pool);
 
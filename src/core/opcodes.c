@@ -27,23 +27,23 @@
         return res;                \
     } while (0)
 
-#define ASSERTTYPE(value, etype) \
-    do {                         \
-        if (value.type != etype) \
-            FAIL;                \
+#define ASSERTTYPE(value, etype)            \
+    do {                                    \
+        if (NDL_VALUE_TYPE(value) != etype) \
+            FAIL;                           \
     } while (0)
 
-#define ASSERTNOTNONE(value)         \
-    do {                             \
-        if (value.type == EVAL_NONE) \
-            FAIL;                    \
+#define ASSERTNOTNONE(value)                    \
+    do {                                        \
+        if (NDL_VALUE_TYPE(value) == EVAL_NONE) \
+            FAIL;                               \
     } while (0)
 
-#define ASSERTREF(value)               \
-    ASSERTTYPE(value, EVAL_REF);       \
-    do {                               \
-        if (value.ref == NDL_NULL_REF) \
-            FAIL;                      \
+#define ASSERTREF(value)                          \
+    ASSERTTYPE(value, EVAL_REF);                  \
+    do {                                          \
+        if (NDL_VALUE_REF(value) == NDL_NULL_REF) \
+            FAIL;                                 \
     } while (0)
 
 #define LOAD(node, name, sym, type)             \
@@ -60,29 +60,29 @@
         ASSERTREF(name);                        \
     } while (0)
 
-#define LOADVAL(node, node2, name, esym, etype)         \
-    ndl_value name;                                     \
-    do {                                                \
-        name = ndl_graph_get(graph, node, esym);        \
-        if (name.type == EVAL_SYM) {                    \
-            LOAD(node2, name ## 2, name.sym, etype);    \
-            name = name ## 2;                           \
-        } else if (name.type != etype) {                \
-            FAIL;                                       \
-        }                                               \
+#define LOADVAL(node, node2, name, esym, etype)                 \
+    ndl_value name;                                             \
+    do {                                                        \
+        name = ndl_graph_get(graph, node, esym);                \
+        if (NDL_VALUE_TYPE(name) == EVAL_SYM) {                 \
+            LOAD(node2, name ## 2, NDL_VALUE_SYM(name), etype); \
+            name = name ## 2;                                   \
+        } else if (NDL_VALUE_TYPE(name) != etype) {             \
+            FAIL;                                               \
+        }                                                       \
     } while (0)
 
-#define NTLOADVAL(node, node2, name, esym)      \
-    ndl_value name;                             \
-    do {                                        \
-        name = ndl_graph_get(graph, node, esym);\
-        if (name.type == EVAL_SYM) {            \
-            NTLOAD(node2, name ## 2, name.sym); \
-            ASSERTNOTNONE(name ## 2);           \
-            name = name ## 2;                   \
-        } else if (name.type == EVAL_NONE) {    \
-            FAIL;                               \
-        }                                       \
+#define NTLOADVAL(node, node2, name, esym)                 \
+    ndl_value name;                                        \
+    do {                                                   \
+        name = ndl_graph_get(graph, node, esym);           \
+        if (NDL_VALUE_TYPE(name) == EVAL_SYM) {            \
+            NTLOAD(node2, name ## 2, NDL_VALUE_SYM(name)); \
+            ASSERTNOTNONE(name ## 2);                      \
+            name = name ## 2;                              \
+        } else if (NDL_VALUE_TYPE(name) == EVAL_NONE) {    \
+            FAIL;                                          \
+        }                                                  \
     } while (0)
 
 #define NTLOAD(node, name, sym)                 \
@@ -121,21 +121,19 @@
 #define LOADSYMAB LOADSYMA; LOAD(pc, symb, DS("symb    "), EVAL_SYM)
 #define LOADSYMABC LOADSYMAB; LOAD(pc, symc, DS("symc    "), EVAL_SYM)
 
-#define NEWLINKED(node, name, sym)                     \
-    ndl_value name;                                    \
-    do {                                               \
-        name.type = EVAL_REF;                          \
-        name.ref = ndl_graph_salloc(graph, node, sym); \
-        res.mod[res.mod_count++] = node;               \
-        res.mod[res.mod_count++] = name.ref;           \
-        ASSERTREF(name);                               \
+#define NEWLINKED(node, name, sym)                                                \
+    ndl_value name = NDL_VALUE(EVAL_REF, ref=ndl_graph_salloc(graph, node, sym)); \
+    do {                                                                          \
+        res.mod[res.mod_count++] = node;                                          \
+        res.mod[res.mod_count++] = NDL_VALUE_REF(name);                           \
+        ASSERTREF(name);                                                          \
     } while (0)
 
 BEGINOP(new) {
     INITRES;
     LOADSYMA;
 
-    NEWLINKED(local, new, syma.sym);
+    NEWLINKED(local, new, NDL_VALUE_SYM(syma));
 
     ADVANCE;
 }
@@ -146,7 +144,7 @@ BEGINOP(copy) {
     NTLOADVAL(pc, local, val, DS("syma    "));
     LOAD(pc, symb, DS("symb    "), EVAL_SYM);
 
-    STORE(local, val, symb.sym);
+    STORE(local, val, NDL_VALUE_SYM(symb));
 
     ADVANCE;
 }
@@ -158,9 +156,9 @@ BEGINOP(load) {
     LOAD(pc, symb, DS("symb    "), EVAL_SYM);
     LOAD(pc, symc, DS("symc    "), EVAL_SYM);
 
-    NTLOAD(sec.ref, val, symb.sym);
+    NTLOAD(NDL_VALUE_REF(sec), val, NDL_VALUE_SYM(symb));
 
-    STORE(local, val, symc.sym);
+    STORE(local, val, NDL_VALUE_SYM(symc));
 
     ADVANCE;
 }
@@ -172,7 +170,7 @@ BEGINOP(save) {
     LOAD(pc, symb, DS("symb    "), EVAL_SYM);
     LOADVAL(pc, local, sec, DS("symc    "), EVAL_REF);
 
-    STORE(sec.ref, val, symb.sym);
+    STORE(NDL_VALUE_REF(sec), val, NDL_VALUE_SYM(symb));
 
     ADVANCE;
 }
@@ -181,8 +179,8 @@ BEGINOP(drop) {
     INITRES;
     LOADSYMAB;
 
-    LOADREF(local, sec, syma.sym);
-    DROP(sec.ref, symb.sym);
+    LOADREF(local, sec, NDL_VALUE_SYM(syma));
+    DROP(NDL_VALUE_REF(sec), NDL_VALUE_SYM(symb));
 
     ADVANCE;
 }
@@ -191,11 +189,11 @@ BEGINOP(type) {
     INITRES;
     LOADSYMABC;
 
-    LOADREF(local, sec, syma.sym);
-    ndl_value val = ndl_graph_get(graph, sec.ref, symb.sym);
+    LOADREF(local, sec, NDL_VALUE_SYM(syma));
+    ndl_value val = ndl_graph_get(graph, NDL_VALUE_REF(sec), NDL_VALUE_SYM(symb));
 
     char *type;
-    switch (val.type) {
+    switch (NDL_VALUE_TYPE(val)) {
     case EVAL_NONE:  type = "none    "; break;
     case EVAL_REF:   type = "ref     "; break;
     case EVAL_SYM:   type = "sym     "; break;
@@ -206,7 +204,7 @@ BEGINOP(type) {
 
     ndl_sym typesym = NDL_SYM(type);
 
-    STORE(local, NDL_VALUE(EVAL_SYM, sym=typesym), symc.sym);
+    STORE(local, NDL_VALUE(EVAL_SYM, sym=typesym), NDL_VALUE_SYM(symc));
 
     ADVANCE;
 }
@@ -215,9 +213,9 @@ BEGINOP(count) {
     INITRES;
     LOADSYMAB;
 
-    LOADREF(local, sec, syma.sym);
-    int64_t size = ndl_graph_size(graph, sec.ref);
-    STORE(local, NDL_VALUE(EVAL_INT, num=size), symb.sym);
+    LOADREF(local, sec, NDL_VALUE_SYM(syma));
+    int64_t size = ndl_graph_size(graph, NDL_VALUE_REF(sec));
+    STORE(local, NDL_VALUE(EVAL_INT, num=size), NDL_VALUE_SYM(symb));
 
     ADVANCE;
 }
@@ -226,92 +224,92 @@ BEGINOP(iload) {
     INITRES;
     LOADSYMABC;
 
-    LOADREF(local, sec, syma.sym);
-    LOAD(local, i, symb.sym, EVAL_INT);
-    ndl_sym key = ndl_graph_index(graph, sec.ref, i.num);
-    STORE(local, NDL_VALUE(EVAL_SYM, sym=key), symc.sym);
+    LOADREF(local, sec, NDL_VALUE_SYM(syma));
+    LOAD(local, i, NDL_VALUE_SYM(symb), EVAL_INT);
+    ndl_sym key = ndl_graph_index(graph, NDL_VALUE_REF(sec), NDL_VALUE_NUM(i));
+    STORE(local, NDL_VALUE(EVAL_SYM, sym=key), NDL_VALUE_SYM(symc));
 
     ADVANCE;
 }
 
-#define ONEARGFPOP(name, expr)                                      \
-    BEGINOP(name) {                                                 \
-        INITRES;                                                    \
-        LOADVAL(pc, local, a, DS("syma    "), EVAL_FLOAT);          \
-        LOAD(pc, symb, DS("symb    "), EVAL_SYM);                   \
-        STORE(local, NDL_VALUE(EVAL_FLOAT, real=(expr)), symb.sym); \
-        ADVANCE;                                                    \
+#define ONEARGFPOP(name, expr)                                                 \
+    BEGINOP(name) {                                                            \
+        INITRES;                                                               \
+        LOADVAL(pc, local, a, DS("syma    "), EVAL_FLOAT);                     \
+        LOAD(pc, symb, DS("symb    "), EVAL_SYM);                              \
+        STORE(local, NDL_VALUE(EVAL_FLOAT, real=(expr)), NDL_VALUE_SYM(symb)); \
+        ADVANCE;                                                               \
     }
 
-#define TWOARGFPOP(name, expr)                                      \
-    BEGINOP(name) {                                                 \
-        INITRES;                                                    \
-        LOADVAL(pc, local, a, DS("syma    "), EVAL_FLOAT);          \
-        LOADVAL(pc, local, b, DS("symb    "), EVAL_FLOAT);          \
-        LOAD(pc, symc, DS("symc    "), EVAL_SYM);                   \
-        STORE(local, NDL_VALUE(EVAL_FLOAT, real=(expr)), symc.sym); \
-        ADVANCE;                                                    \
+#define TWOARGFPOP(name, expr)                                                 \
+    BEGINOP(name) {                                                            \
+        INITRES;                                                               \
+        LOADVAL(pc, local, a, DS("syma    "), EVAL_FLOAT);                     \
+        LOADVAL(pc, local, b, DS("symb    "), EVAL_FLOAT);                     \
+        LOAD(pc, symc, DS("symc    "), EVAL_SYM);                              \
+        STORE(local, NDL_VALUE(EVAL_FLOAT, real=(expr)), NDL_VALUE_SYM(symc)); \
+        ADVANCE;                                                               \
     }
 
-TWOARGFPOP(fadd, a.real + b.real)
-TWOARGFPOP(fsub, a.real - b.real)
-ONEARGFPOP(fneg, - a.real)
-TWOARGFPOP(fmul, a.real * b.real)
-TWOARGFPOP(fdiv, a.real / b.real)
-TWOARGFPOP(fmod, fmod(a.real, b.real))
-ONEARGFPOP(fsqrt, sqrt(a.real))
+TWOARGFPOP(fadd, NDL_VALUE_REAL(a) + NDL_VALUE_REAL(b))
+TWOARGFPOP(fsub, NDL_VALUE_REAL(a) - NDL_VALUE_REAL(b))
+ONEARGFPOP(fneg, - NDL_VALUE_REAL(a))
+TWOARGFPOP(fmul, NDL_VALUE_REAL(a) * NDL_VALUE_REAL(b))
+TWOARGFPOP(fdiv, NDL_VALUE_REAL(a) / NDL_VALUE_REAL(b))
+TWOARGFPOP(fmod, fmod(NDL_VALUE_REAL(a), NDL_VALUE_REAL(b)))
+ONEARGFPOP(fsqrt, sqrt(NDL_VALUE_REAL(a)))
 
 BEGINOP(ftoi) {
     INITRES;
     LOADVAL(pc, local, a, DS("syma    "), EVAL_FLOAT);
     LOAD(pc, symb, DS("symb    "), EVAL_SYM);
 
-    STORE(local, NDL_VALUE(EVAL_INT, num=(int)a.real), symb.sym);
+    STORE(local, NDL_VALUE(EVAL_INT, num=(int)NDL_VALUE_REAL(a)), NDL_VALUE_SYM(symb));
 
     ADVANCE;
 }
 
-#define ONEARGINTOP(name, expr)                                  \
-    BEGINOP(name) {                                              \
-        INITRES;                                                 \
-        LOADVAL(pc, local, a, DS("syma    "), EVAL_INT);         \
-        LOAD(pc, symb, DS("symb    "), EVAL_SYM);                \
-        STORE(local, NDL_VALUE(EVAL_INT, num=(expr)), symb.sym); \
-        ADVANCE;                                                 \
+#define ONEARGINTOP(name, expr)                                             \
+    BEGINOP(name) {                                                         \
+        INITRES;                                                            \
+        LOADVAL(pc, local, a, DS("syma    "), EVAL_INT);                    \
+        LOAD(pc, symb, DS("symb    "), EVAL_SYM);                           \
+        STORE(local, NDL_VALUE(EVAL_INT, num=(expr)), NDL_VALUE_SYM(symb)); \
+        ADVANCE;                                                            \
     }
 
-#define TWOARGINTOP(name, expr)                                  \
-    BEGINOP(name) {                                              \
-        INITRES;                                                 \
-        LOADVAL(pc, local, a, DS("syma    "), EVAL_INT);         \
-        LOADVAL(pc, local, b, DS("symb    "), EVAL_INT);         \
-        LOAD(pc, symc, DS("symc    "), EVAL_SYM);                \
-        STORE(local, NDL_VALUE(EVAL_INT, num=(expr)), symc.sym); \
-        ADVANCE;                                                 \
+#define TWOARGINTOP(name, expr)                                             \
+    BEGINOP(name) {                                                         \
+        INITRES;                                                            \
+        LOADVAL(pc, local, a, DS("syma    "), EVAL_INT);                    \
+        LOADVAL(pc, local, b, DS("symb    "), EVAL_INT);                    \
+        LOAD(pc, symc, DS("symc    "), EVAL_SYM);                           \
+        STORE(local, NDL_VALUE(EVAL_INT, num=(expr)), NDL_VALUE_SYM(symc)); \
+        ADVANCE;                                                            \
     }
 
-TWOARGINTOP(and, a.num & b.num)
-TWOARGINTOP(or,  a.num | b.num)
-TWOARGINTOP(xor, a.num ^ b.num)
-ONEARGINTOP(not, ~a.num)
-TWOARGINTOP(lshift, a.num << b.num)
-TWOARGINTOP(rshift, a.num >> b.num)
-TWOARGINTOP(ulshift, (int64_t) (((uint64_t) a.num) << b.num))
-TWOARGINTOP(urshift, (int64_t) (((uint64_t) a.num) >> b.num))
-
-TWOARGINTOP(add, a.num + b.num)
-TWOARGINTOP(sub, a.num - b.num)
-ONEARGINTOP(neg, - a.num)
-TWOARGINTOP(mul, a.num * b.num)
-TWOARGINTOP(div, a.num / b.num)
-TWOARGINTOP(mod, a.num % b.num)
+TWOARGINTOP(and, NDL_VALUE_NUM(a) & NDL_VALUE_NUM(b))
+TWOARGINTOP(or,  NDL_VALUE_NUM(a) | NDL_VALUE_NUM(b))
+TWOARGINTOP(xor, NDL_VALUE_NUM(a) ^ NDL_VALUE_NUM(b))
+ONEARGINTOP(not, ~NDL_VALUE_NUM(a))
+TWOARGINTOP(lshift, NDL_VALUE_NUM(a) << NDL_VALUE_NUM(b))
+TWOARGINTOP(rshift, NDL_VALUE_NUM(a) >> NDL_VALUE_NUM(b))
+TWOARGINTOP(ulshift, (int64_t) (((uint64_t) NDL_VALUE_NUM(a)) << NDL_VALUE_NUM(b)))
+TWOARGINTOP(urshift, (int64_t) (((uint64_t) NDL_VALUE_NUM(a)) >> NDL_VALUE_NUM(b)))
+
+TWOARGINTOP(add, NDL_VALUE_NUM(a) + NDL_VALUE_NUM(b))
+TWOARGINTOP(sub, NDL_VALUE_NUM(a) - NDL_VALUE_NUM(b))
+ONEARGINTOP(neg, - NDL_VALUE_NUM(a))
+TWOARGINTOP(mul, NDL_VALUE_NUM(a) * NDL_VALUE_NUM(b))
+TWOARGINTOP(div, NDL_VALUE_NUM(a) / NDL_VALUE_NUM(b))
+TWOARGINTOP(mod, NDL_VALUE_NUM(a) % NDL_VALUE_NUM(b))
 
 BEGINOP(itof) {
     INITRES;
     LOADVAL(pc, local, a, DS("syma    "), EVAL_INT);
     LOAD(pc, symb, DS("symb    "), EVAL_SYM);
 
-    STORE(local, NDL_VALUE(EVAL_FLOAT, real=(double)a.num), symb.sym);
+    STORE(local, NDL_VALUE(EVAL_FLOAT, real=(double)NDL_VALUE_NUM(a)), NDL_VALUE_SYM(symb));
 
     ADVANCE;
 }
@@ -321,7 +319,7 @@ BEGINOP(itos) {
     LOADVAL(pc, local, a, DS("syma    "), EVAL_INT);
     LOAD(pc, symb, DS("symb    "), EVAL_SYM);
 
-    STORE(local, NDL_VALUE(EVAL_SYM, sym=(ndl_sym) a.num), symb.sym);
+    STORE(local, NDL_VALUE(EVAL_SYM, sym=(ndl_sym) NDL_VALUE_NUM(a)), NDL_VALUE_SYM(symb));
 
     ADVANCE;
 }
@@ -330,8 +328,8 @@ BEGINOP(stoi) {
     INITRES;
     LOADSYMAB;
 
-    LOAD(local, a, syma.sym, EVAL_SYM);
-    STORE(local, NDL_VALUE(EVAL_INT, num=(int64_t) a.sym), symb.sym);
+    LOAD(local, a, NDL_VALUE_SYM(syma), EVAL_SYM);
+    STORE(local, NDL_VALUE(EVAL_INT, num=(int64_t) NDL_VALUE_SYM(a)), NDL_VALUE_SYM(symb));
 
     ADVANCE;
 }
@@ -340,21 +338,21 @@ BEGINOP(branch) {
     INITRES;
 
     NTLOADVAL(pc, local, a, DS("syma    "));
-    LOADVAL(pc, local, b, DS("symb    "), a.type);
+    LOADVAL(pc, local, b, DS("symb    "), NDL_VALUE_TYPE(a));
 
     int cmp;
 
-    switch (a.type) {
+    switch (NDL_VALUE_TYPE(a)) {
     case EVAL_INT:
     case EVAL_SYM:
     case EVAL_REF:
-        if (a.num < b.num) cmp = -1;
-        else if (a.num == b.num) cmp = 0;
+        if ((ndl_int) NDL_VALUE_WORD(a) < (ndl_int) NDL_VALUE_WORD(b)) cmp = -1;
+        else if (NDL_VALUE_WORD(a) == NDL_VALUE_WORD(b)) cmp = 0;
         else cmp = 1;
         break;
     case EVAL_FLOAT:
-        if (a.real < b.real) cmp = -1;
-        else if (a.real == b.real) cmp = 0;
+        if (NDL_VALUE_REAL(a) < NDL_VALUE_REAL(b)) cmp = -1;
+        else if (NDL_VALUE_REAL(a) == NDL_VALUE_REAL(b)) cmp = 0;
         else cmp = 1;
         break;
     case EVAL_NONE:
@@ -371,7 +369,7 @@ BEGINOP(branch) {
     if (cmp ==  1) branch = DS("gt      ");
 
     ndl_value next = ndl_graph_get(graph, pc, branch);
-    if (next.type == EVAL_NONE) {
+    if (NDL_VALUE_TYPE(next) == EVAL_NONE) {
         next = ndl_graph_get(graph, pc, DS("next    "));
     }
     ASSERTNOTNONE(next);
@@ -388,7 +386,7 @@ BEGINOP(push) {
     LOADREF(pc, next, DS("next    "));
     STORE(local, next, DS("instrpntr"));
 
-    LOADREF(local, invoke, syma.sym);
+    LOADREF(local, invoke, NDL_VALUE_SYM(syma));
 
     res.action = EACTION_CALL;
     res.actval = invoke;
@@ -400,7 +398,7 @@ BEGINOP(fork) {
     INITRES;
     LOADSYMA;
 
-    LOADREF(local, fork, syma.sym);
+    LOADREF(local, fork, NDL_VALUE_SYM(syma));
 
     res.action = EACTION_FORK;
     res.actval = fork;
@@ -443,8 +441,7 @@ BEGINOP(excall) {
     INITRES;
 
     res.action = EACTION_EXCALL;
-    res.actval.type = EVAL_REF;
-    res.actval.ref = pc;
+    res.actval = NDL_VALUE(EVAL_REF, ref=pc);
 
     ADVANCE;
 }
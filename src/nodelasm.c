@@ -85,7 +85,7 @@ static ndl_graph *assemble_assemble(ndl_vector *code) {
     ndl_ref roots[2] = {res.inst_head, NDL_NULL_REF};
 
     int err = ndl_graph_dcopy(clean, res.graph, roots);
-    if (err != 0) {
+    if (err < 0) {
         fprintf(stderr, "Failed to copy graph.\n");
 
         ndl_graph_kill(res.graph);
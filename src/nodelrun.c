@@ -20,7 +20,7 @@
         exit(EXIT_FAILURE);           \
     } while (0)
 
-#define FILE_BUFFER_SIZE (uint64_t) (2 << 10)
+#define STDIN_BUFFER_SIZE (uint64_t) (2 << 10)
 
 static inline ndl_value parse_sym(char *arg) {
 
@@ -28,10 +28,10 @@ static inline ndl_value parse_sym(char *arg) {
     if (len > 8)
         FAIL("Symbol is too long: '%s. Must be eight characters or fewer.\n", arg);
 
-    ndl_value ret = NDL_VALUE(EVAL_SYM, sym=NDL_SYM("        "));
-    memcpy((char *) &ret.sym, arg, len);
+    ndl_sym ret = NDL_SYM("        ");
+    memcpy((char *) &ret, arg, len);
 
-    return ret;
+    return NDL_VALUE(EVAL_SYM, sym=ret);
 }
 
 static inline ndl_value parse_int(char *arg) {
@@ -64,41 +64,51 @@ static inline ndl_value parse_arg(char *arg) {
     return parse_int(arg);
 }
 
-int main(int argc, char *argv[]) {
+/* Files are mapped; stdin is read in whole, however long. */
+static ndl_graph *load_graph(char *path) {
 
-    if (argc < 2)
-        FAIL("Usage: %s [file] arg...\n", argv[0]);
+    if (strcmp(path, "-"))
+        return ndl_graph_open_mmap(path);
 
-    if (argc > 2 + 15)
-        FAIL("Too many arguments. Usage: %s [file] arg...\n", argv[0]);
+    uint64_t cap = STDIN_BUFFER_SIZE;
+    uint64_t curr = 0;
 
-    char *buff = (char*) malloc(FILE_BUFFER_SIZE);
+    char *buff = (char *) malloc(cap);
     if (buff == NULL)
         FAIL("Failed to allocate file buffer.\n");
 
-    FILE *in;
-
-    if (strcmp(argv[1], "-"))
-        in = fopen(argv[1], "r");
-    else
-        in = stdin;
-    if (in == NULL)
-        FAIL("Failed to open file.\n");
-
-    uint64_t curr = 0;
     uint64_t used = 1;
-
     while (used > 0) {
-        used = fread(&buff[curr], sizeof(char), FILE_BUFFER_SIZE - curr, in);
-        if (used > 0) curr += used;
-    }
 
-    if (in != stdin)
-        fclose(in);
+        if (curr == cap) {
+            cap *= 2;
+            buff = (char *) realloc(buff, cap);
+            if (buff == NULL)
+                FAIL("Failed to allocate file buffer.\n");
+        }
+
+        used = fread(&buff[curr], sizeof(char), cap - curr, stdin);
+        curr += used;
+    }
 
     ndl_graph *graph = ndl_graph_from_mem(curr, buff);
+
+    free(buff);
+
+    return graph;
+}
+
+int main(int argc, char *argv[]) {
+
+    if (argc < 2)
+        FAIL("Usage: %s [file] arg...\n", argv[0]);
+
+    if (argc > 2 + 15)
+        FAIL("Too many arguments. Usage: %s [file] arg...\n", argv[0]);
+
+    ndl_graph *graph = load_graph(argv[1]);
     if (graph == NULL)
-        FAIL("Failed to load graph: Bad file format.\n");
+        FAIL("Failed to load graph: Missing file or bad file format.\n");
 
     ndl_runtime *runtime = ndl_runtime_init(graph);
 
@@ -126,6 +136,9 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
+    /* The runtime keeps the frame alive from here on. */
+    ndl_graph_unmark(graph, local);
+
     ndl_proc_resume(proc);
     ndl_runtime_run_for(runtime, NDL_TIME_ZERO);
 
@@ -133,7 +146,6 @@ int main(int argc, char *argv[]) {
 
     ndl_runtime_kill(runtime);
     ndl_graph_kill(graph);
-    free(buff);
 
     exit(EXIT_SUCCESS);
 }
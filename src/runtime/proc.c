@@ -352,16 +352,16 @@ static int ndl_proc_die_reason(ndl_proc *proc, ndl_proc_reason reason) {
 
 static ndl_proc_reason ndl_proc_excall(ndl_proc *proc, ndl_eval_result res) {
 
-    ndl_ref inst = res.actval.ref;
+    ndl_ref inst = NDL_VALUE_REF(res.actval);
     ndl_value val = ndl_graph_get(proc->runtime->graph, inst, NDL_SYM("syma    "));
-    if ((val.type != EVAL_SYM) || (val.sym == NDL_NULL_SYM))
+    if ((NDL_VALUE_TYPE(val) != EVAL_SYM) || (NDL_VALUE_SYM(val) == NDL_NULL_SYM))
         return ECAUSE_BAD_DATA;
 
     ndl_excall *table = ndl_eval_excall();
     if (table == NULL)
         return ECAUSE_INTERNAL;
 
-    ndl_excall_func func = ndl_excall_get(table, val.sym);
+    ndl_excall_func func = ndl_excall_get(table, NDL_VALUE_SYM(val));
     if (func == NULL)
         return ECAUSE_BAD_DATA;
 
@@ -413,22 +413,21 @@ static void ndl_proc_step(ndl_proc *proc) {
     switch (res.action) {
     case EACTION_CALL:
 
-        if (res.actval.type != EVAL_REF || res.actval.ref == NDL_NULL_REF) {
+        if (NDL_VALUE_TYPE(res.actval) != EVAL_REF || NDL_VALUE_REF(res.actval) == NDL_NULL_REF) {
             reason = ECAUSE_BAD_DATA;
         } else {
-            ndl_graph_unmark(graph, local);
-            ndl_graph_mark(graph, res.actval.ref);
-            proc->local = res.actval.ref;
+            /* No marking: the runtime roots processes' frames as it collects. */
+            proc->local = NDL_VALUE_REF(res.actval);
         }
 
         break;
 
     case EACTION_FORK:
 
-        if ((res.actval.type != EVAL_REF) || (res.actval.ref == NDL_NULL_REF)) {
+        if ((NDL_VALUE_TYPE(res.actval) != EVAL_REF) || (NDL_VALUE_REF(res.actval) == NDL_NULL_REF)) {
             reason = ECAUSE_BAD_DATA;
         } else {
-            nproc = ndl_runtime_proc_init(proc-> runtime, res.actval.ref, proc->period);
+            nproc = ndl_runtime_proc_init(proc-> runtime, NDL_VALUE_REF(res.actval), proc->period);
             if (nproc == NULL) {
                 reason = ECAUSE_INTERNAL;
                 break;
@@ -451,20 +450,20 @@ static void ndl_proc_step(ndl_proc *proc) {
         break;
 
     case EACTION_WAIT:
-        if ((res.actval.type != EVAL_REF) || (res.actval.ref == NDL_NULL_REF)) {
+        if ((NDL_VALUE_TYPE(res.actval) != EVAL_REF) || (NDL_VALUE_REF(res.actval) == NDL_NULL_REF)) {
             reason = ECAUSE_BAD_DATA;
         } else {
-            err = ndl_proc_wait(proc, res.actval.ref);
+            err = ndl_proc_wait(proc, NDL_VALUE_REF(res.actval));
             if (err != 0)
                 reason = ECAUSE_INTERNAL;
         }
         break;
 
     case EACTION_SLEEP:
-        if ((res.actval.type != EVAL_INT) || (res.actval.num < 0)) {
+        if ((NDL_VALUE_TYPE(res.actval) != EVAL_INT) || (NDL_VALUE_NUM(res.actval) < 0)) {
             reason = ECAUSE_BAD_DATA;
         } else {
-            err = ndl_proc_sleep(proc, ndl_time_from_usec(1000 * res.actval.num));
+            err = ndl_proc_sleep(proc, ndl_time_from_usec(1000 * NDL_VALUE_NUM(res.actval)));
             if (err != 0)
                 reason = ECAUSE_INTERNAL;
         }
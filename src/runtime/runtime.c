@@ -1,8 +1,10 @@
 #include "runtime.h"
 #include "eval.h"
+#include "nodepool.h"
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <limits.h>
 
@@ -33,6 +35,30 @@ static int ndl_runtime_clockevent_cmp(void *a, void *b) {
     return -ndl_time_cmp(at->when, bt->when);
 }
 
+/* The graph's external roots: living processes' frames and waits. */
+static int ndl_runtime_roots(void *data, ndl_vector *roots) {
+
+    ndl_runtime *runtime = (ndl_runtime *) data;
+
+    void *curr = ndl_rhashtable_pairs_head(runtime->procs);
+    while (curr != NULL) {
+
+        ndl_proc *proc = ndl_rhashtable_pairs_val(runtime->procs, curr);
+        curr = ndl_rhashtable_pairs_next(runtime->procs, curr);
+
+        if ((proc == NULL) || (proc->state == ESTATE_DEAD))
+            continue;
+
+        if (ndl_vector_push(roots, &proc->local) == NULL)
+            return -1;
+
+        if ((proc->state == ESTATE_WAITING) && (ndl_vector_push(roots, &proc->waiting) == NULL))
+            return -1;
+    }
+
+    return 0;
+}
+
 ndl_runtime *ndl_runtime_init(ndl_graph *graph) {
 
     ndl_runtime *rt = malloc(sizeof(ndl_runtime));
@@ -121,6 +147,12 @@ ndl_runtime *ndl_runtime_minit(void *region, ndl_graph *graph) {
     }
     ret->clockevents = clockevents;
 
+    ret->gc_budget = NDL_RUNTIME_GC_BUDGET;
+    ret->gc_live = 0;
+    memset(&ret->gc_stats, 0, sizeof(ret->gc_stats));
+
+    ndl_graph_set_roots(ret->graph, &ndl_runtime_roots, ret);
+
     ndl_eval_opcodes_ref();
 
     return ret;
@@ -131,9 +163,12 @@ void ndl_runtime_mkill(ndl_runtime *runtime) {
     if (runtime == NULL)
         return;
 
-    if (runtime->graph != NULL)
+    if (runtime->graph != NULL) {
         if (runtime->free_graph == 1)
             ndl_graph_kill(runtime->graph);
+        else
+            ndl_graph_set_roots(runtime->graph, NULL, NULL);
+    }
 
     if (runtime->procs != NULL) ndl_rhashtable_kill(runtime->procs);
     if (runtime->waitevents != NULL) ndl_rhashtable_kill(runtime->waitevents);
@@ -210,6 +245,16 @@ int ndl_runtime_graph_free(ndl_runtime *runtime) {
     return runtime->free_graph;
 }
 
+void ndl_runtime_set_gc(ndl_runtime *runtime, uint64_t budget) {
+
+    runtime->gc_budget = budget;
+}
+
+ndl_runtime_gc_stats ndl_runtime_gc_report(ndl_runtime *runtime) {
+
+    return runtime->gc_stats;
+}
+
 uint64_t ndl_runtime_proc_count(ndl_runtime *runtime) {
 
     return ndl_rhashtable_size(runtime->procs);
@@ -391,6 +436,59 @@ ndl_time ndl_runtime_run_timeto(ndl_runtime *runtime) {
     return ndl_runtime_run_ctimeto(runtime, now);
 }
 
+/* Take a GC step, if one's running or due. */
+static int ndl_runtime_run_cgc(ndl_runtime *runtime) {
+
+    ndl_graph *graph = runtime->graph;
+    uint64_t nodes = ndl_node_pool_size((ndl_node_pool *) graph->pool);
+
+    if (!ndl_graph_clean_busy(graph) &&
+        ((nodes < NDL_RUNTIME_GC_MIN) || (nodes < 2 * runtime->gc_live))) {
+
+        if (ndl_graph_young(graph) < NDL_RUNTIME_GC_NURSERY)
+            return 0;
+
+        if (ndl_graph_clean_minor(graph) != 0)
+            return -1;
+
+        runtime->gc_stats.minor++;
+        return 1;
+    }
+
+    /* An abandoned collection is simply retried later. */
+    int done = ndl_graph_clean_step(graph, runtime->gc_budget);
+    if (done == 1) {
+        runtime->gc_live = ndl_node_pool_size((ndl_node_pool *) graph->pool);
+        runtime->gc_stats.major++;
+    }
+
+    return (done < 0)? -1 : 1;
+}
+
+int ndl_runtime_run_gc(ndl_runtime *runtime) {
+
+    if (runtime->gc_budget == 0)
+        return 0;
+
+    ndl_time start = ndl_time_get();
+    int res = ndl_runtime_run_cgc(runtime);
+    ndl_time end = ndl_time_get();
+
+    if (res == 0)
+        return 0;
+
+    ndl_runtime_gc_stats *stats = &runtime->gc_stats;
+    int64_t pause = ndl_time_to_usec(ndl_time_sub(end, start));
+
+    stats->pauses++;
+    stats->pause_total += pause;
+    stats->pause_last = pause;
+    if (pause > stats->pause_max)
+        stats->pause_max = pause;
+
+    return res;
+}
+
 int ndl_runtime_run_for(ndl_runtime *runtime, ndl_time timeout) {
 
     ndl_time curr = ndl_time_get();
@@ -418,6 +516,8 @@ int ndl_runtime_run_for(ndl_runtime *runtime, ndl_time timeout) {
         if (!ndl_runtime_proc_alive(runtime))
             break;
 
+        ndl_runtime_run_gc(runtime);
+
         curr = ndl_time_get();
         if (ndl_time_cmp(curr, NDL_TIME_ZERO) == 0)
             return -1;
@@ -441,4 +541,9 @@ void ndl_runtime_print(ndl_runtime *runtime) {
     printf("Printing runtime.\n");
     ndl_rhashtable_print(runtime->procs);
     ndl_heap_print(runtime->clockevents);
+
+    ndl_runtime_gc_stats *stats = &runtime->gc_stats;
+    printf("GC: %lu major, %lu minor, %lu pauses: %ld usec total, %ld usec max, %ld usec last.\n",
+           stats->major, stats->minor, stats->pauses,
+           stats->pause_total, stats->pause_max, stats->pause_last);
 }
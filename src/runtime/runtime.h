@@ -29,6 +29,17 @@ typedef struct ndl_runtime_clockevent_s {
 
 } ndl_runtime_clockevent;
 
+/* Garbage collection statistics, kept by run_gc().
+ * A pause is a run_gc() call that did any collecting; times in usec.
+ */
+typedef struct ndl_runtime_gc_stats_s {
+
+    uint64_t minor, major;
+    uint64_t pauses;
+    int64_t pause_total, pause_max, pause_last;
+
+} ndl_runtime_gc_stats;
+
 /* Holds all information necessary for a runtime to run.
  * Includes the following:
  * - Graph, and whether or not to graph_kill() on runtime_kill().
@@ -57,6 +68,13 @@ struct ndl_runtime_s {
      * Maps from node ID to event list head.
      */
     ndl_rhashtable *waitevents;
+
+    /* Incremental GC, stepped between events. 0 budget is off.
+     * gc_live is the node count after the last finished collection.
+     */
+    uint64_t gc_budget;
+    uint64_t gc_live;
+    ndl_runtime_gc_stats gc_stats;
 };
 
 /* Create and destroy a runtime.
@@ -120,6 +138,21 @@ ndl_proc *ndl_runtime_proc_proc(ndl_runtime *runtime, void *curr);
  * graph_free() returns whether the graph will (1) or will not (0)
  *     be deleted when the runtime is kill()d.
  *
+ * set_gc() sets the budget of the GC steps run_for() takes between
+ *     events, in ndl_graph_clean_step() units. 0 is off.
+ *     Defaults to NDL_RUNTIME_GC_BUDGET.
+ * gc_report() gets the GC statistics so far.
+ *
+ * The runtime owns its graph's collections. Every living process' local
+ * node, and the node it's waiting on, is a root, passed to the graph
+ * (see ndl_graph_set_roots()) when a collection asks, so processes never
+ * mark or unmark their frames. Collections are scheduled on heap growth:
+ * a full one starts once the graph has doubled since the last (and has
+ * at least NDL_RUNTIME_GC_MIN nodes), then runs a step at a time until
+ * it's done; and on allocation: otherwise, once NDL_RUNTIME_GC_NURSERY
+ * nodes have been allocated (and are still young), a minor collection
+ * runs in their place.
+ *
  * proc_count() gets the number of processes in the runtime.
  * proc_alive() gets the number of active processes in the runtime.
  * proc_alive() gets whether there are processes running or sleeping.
@@ -127,6 +160,12 @@ ndl_proc *ndl_runtime_proc_proc(ndl_runtime *runtime, void *curr);
 ndl_graph *ndl_runtime_graph     (ndl_runtime *runtime);
 int        ndl_runtime_graph_free(ndl_runtime *runtime);
 
+#define NDL_RUNTIME_GC_BUDGET 1024
+#define NDL_RUNTIME_GC_MIN 4096
+#define NDL_RUNTIME_GC_NURSERY 4096
+void                 ndl_runtime_set_gc   (ndl_runtime *runtime, uint64_t budget);
+ndl_runtime_gc_stats ndl_runtime_gc_report(ndl_runtime *runtime);
+
 uint64_t ndl_runtime_proc_count(ndl_runtime *runtime);
 uint64_t ndl_runtime_proc_living(ndl_runtime *runtime);
 int      ndl_runtime_proc_alive(ndl_runtime *runtime);
@@ -148,7 +187,11 @@ int      ndl_runtime_proc_alive(ndl_runtime *runtime);
  *     Returns NDL_TIME_ZERO if we're running late,
  *     there are no processes left, or on error.
  *
- * run_for() calls run_step() and run_sleep() repeatedly.
+ * run_gc() runs a GC step or minor collection, if one's due.
+ *     Returns 1 if it collected, 0 if not, and -1 on error.
+ *
+ * run_for() calls run_step() and run_sleep() repeatedly,
+ *     with run_gc() in between.
  *     If timeout is not NDL_TIME_ZERO, attempts to exit before timeout.
  *     Timeout is relative (ends before (now + timeout.))
  *     Returns zero if timeout is reached or runtime is inactive.
@@ -159,6 +202,8 @@ int ndl_runtime_run_ready(ndl_runtime *runtime, ndl_time timeout);
 ndl_time ndl_runtime_run_sleep (ndl_runtime *runtime, ndl_time timeout);
 ndl_time ndl_runtime_run_timeto(ndl_runtime *runtime);
 
+int ndl_runtime_run_gc(ndl_runtime *runtime);
+
 int ndl_runtime_run_for(ndl_runtime *runtime, ndl_time timeout);
 
 /* Print the entire runtime to console. */
@@ -76,11 +76,18 @@ static inline void ndl_test_init(void) {
     ndl_test_register("ndl.hashtable.alloc", &ndl_test_hashtable_alloc);
     ndl_test_register("ndl.hashtable.minit", &ndl_test_hashtable_minit);
     ndl_test_register("ndl.hashtable.it", &ndl_test_hashtable_it);
+    ndl_test_register("ndl.hashtable.churn", &ndl_test_hashtable_churn);
 
     ndl_test_register("ndl.rehashtable.alloc", &ndl_test_rehashtable_alloc);
     ndl_test_register("ndl.rehashtable.minit", &ndl_test_rehashtable_minit);
     ndl_test_register("ndl.rehashtable.it", &ndl_test_rehashtable_it);
     ndl_test_register("ndl.rehashtable.volume", &ndl_test_rehashtable_volume);
+    ndl_test_register("ndl.rehashtable.incremental", &ndl_test_rehashtable_incremental);
+    ndl_test_register("ndl.rehashtable.latency", &ndl_test_rehashtable_latency);
+
+    ndl_test_register("ndl.arena.alloc", &ndl_test_arena_alloc);
+    ndl_test_register("ndl.arena.trim", &ndl_test_arena_trim);
+    ndl_test_register("ndl.arena.remote", &ndl_test_arena_remote);
 
     ndl_test_register("ndl.vector.msize", &ndl_test_vector_msize);
     ndl_test_register("ndl.vector.init", &ndl_test_vector_init);
@@ -96,8 +103,24 @@ static inline void ndl_test_init(void) {
 
     /* Core. */
     ndl_test_register("ndl.node.value.print", &ndl_test_node_value_print);
+    ndl_test_register("ndl.node.value.pack", &ndl_test_node_value_pack);
 
     ndl_test_register("ndl.asm.syntax", &ndl_test_asm_syntax);
+    ndl_test_register("ndl.asm.symbols", &ndl_test_asm_symbols);
+
+    ndl_test_register("ndl.nodepool.inline", &ndl_test_nodepool_inline);
+    ndl_test_register("ndl.nodepool.directory", &ndl_test_nodepool_directory);
+    ndl_test_register("ndl.nodepool.ids", &ndl_test_nodepool_ids);
+    ndl_test_register("ndl.nodepool.order", &ndl_test_nodepool_order);
+    ndl_test_register("ndl.nodepool.live", &ndl_test_nodepool_live);
+    ndl_test_register("ndl.nodepool.snapshot", &ndl_test_nodepool_snapshot);
+    ndl_test_register("ndl.nodepool.shapes", &ndl_test_nodepool_shapes);
+    ndl_test_register("ndl.nodepool.fill", &ndl_test_nodepool_fill);
+    ndl_test_register("ndl.nodepool.arena", &ndl_test_nodepool_arena);
+
+    ndl_test_register("ndl.backrefs.alloc", &ndl_test_backrefs_alloc);
+    ndl_test_register("ndl.backrefs.small", &ndl_test_backrefs_small);
+    ndl_test_register("ndl.backrefs.hub", &ndl_test_backrefs_hub);
 
     ndl_test_register("ndl.graph.alloc", &ndl_test_graph_alloc);
     ndl_test_register("ndl.graph.minit", &ndl_test_graph_minit);
@@ -105,11 +128,45 @@ static inline void ndl_test_init(void) {
     ndl_test_register("ndl.graph.gc", &ndl_test_graph_gc);
     ndl_test_register("ndl.graph.kv_it", &ndl_test_graph_kv_it);
     ndl_test_register("ndl.graph.backref", &ndl_test_graph_backref);
+    ndl_test_register("ndl.graph.metadata", &ndl_test_graph_metadata);
+    ndl_test_register("ndl.graph.deep", &ndl_test_graph_deep);
+    ndl_test_register("ndl.graph.parallel", &ndl_test_graph_parallel);
+    ndl_test_register("ndl.graph.incremental", &ndl_test_graph_incremental);
+    ndl_test_register("ndl.graph.minor", &ndl_test_graph_minor);
+    ndl_test_register("ndl.graph.refcount", &ndl_test_graph_refcount);
+    ndl_test_register("ndl.graph.lazy", &ndl_test_graph_lazy);
+    ndl_test_register("ndl.graph.roots", &ndl_test_graph_roots);
+    ndl_test_register("ndl.graph.snapshot", &ndl_test_graph_snapshot);
+    ndl_test_register("ndl.graph.copy", &ndl_test_graph_copy);
+    ndl_test_register("ndl.graph.batch", &ndl_test_graph_batch);
+    ndl_test_register("ndl.graph.format", &ndl_test_graph_format);
+    ndl_test_register("ndl.graph.mmap", &ndl_test_graph_mmap);
 
     /* Runtime */
     ndl_test_register("ndl.time.conv", &ndl_test_time_conv);
     ndl_test_register("ndl.time.add", &ndl_test_time_add);
     ndl_test_register("ndl.time.get", &ndl_test_time_get);
+
+    ndl_test_register("ndl.runtime.gc", &ndl_test_runtime_gc);
+
+    /* Benchmarks. */
+    ndl_test_register("bench.hashtable.probe.pool", &ndl_bench_hashtable_probe_pool);
+    ndl_test_register("bench.hashtable.probe.node", &ndl_bench_hashtable_probe_node);
+    ndl_test_register("bench.hashtable.get", &ndl_bench_hashtable_get);
+    ndl_test_register("bench.nodepool.get", &ndl_bench_nodepool_get);
+    ndl_test_register("bench.nodepool.index", &ndl_bench_nodepool_index);
+    ndl_test_register("bench.graph.chain", &ndl_bench_graph_chain);
+    ndl_test_register("bench.graph.fan", &ndl_bench_graph_fan);
+    ndl_test_register("bench.graph.random", &ndl_bench_graph_random);
+    ndl_test_register("bench.graph.parallel", &ndl_bench_graph_parallel);
+    ndl_test_register("bench.graph.incremental", &ndl_bench_graph_incremental);
+    ndl_test_register("bench.graph.minor", &ndl_bench_graph_minor);
+    ndl_test_register("bench.graph.refcount", &ndl_bench_graph_refcount);
+    ndl_test_register("bench.graph.lazy", &ndl_bench_graph_lazy);
+    ndl_test_register("bench.graph.snapshot", &ndl_bench_graph_snapshot);
+    ndl_test_register("bench.graph.copy", &ndl_bench_graph_copy);
+    ndl_test_register("bench.graph.batch", &ndl_bench_graph_batch);
+    ndl_test_register("bench.graph.image", &ndl_bench_graph_image);
 }
 
 int main(int argc, char *argv[]) {
@@ -0,0 +1,773 @@
+#include "test.h"
+
+#include "graph.h"
+#include "nodepool.h"
+#include "ndltime.h"
+
+#include <string.h>
+#include <unistd.h>
+
+/* Mark phase benchmarks for ndl_graph_clean.
+ * Every node is reachable, so a clean() is a full mark, and leaves
+ * nothing to sweep. Shapes stress different things: long chains are
+ * as deep as the graph (and overflowed the old recursive mark), wide
+ * fans push a lot at once, and random graphs defeat the cache.
+ */
+
+#define NDL_BENCH_GRAPH_NODES 10000000
+#define NDL_BENCH_GRAPH_FAN 4096
+
+static char *ndl_bench_graph_clean(const char *name, ndl_graph *graph, uint64_t nodes) {
+
+    ndl_time start = ndl_time_get();
+    ndl_graph_clean(graph);
+    ndl_time end = ndl_time_get();
+
+    uint64_t left = ndl_node_pool_size((ndl_node_pool *) graph->pool);
+    ndl_graph_kill(graph);
+
+    if (left != nodes)
+        return "Clean freed reachable nodes";
+
+    int64_t usec = ndl_time_to_usec(ndl_time_sub(end, start));
+    printf("  %s: %ld nodes cleaned in %ld usec (%.1f ns/node).\n",
+           name, nodes, usec, 1000.0 * (double) usec / (double) nodes);
+
+    return NULL;
+}
+
+char *ndl_bench_graph_chain(void) {
+
+    ndl_graph *graph = ndl_graph_init();
+    if (graph == NULL)
+        return "Failed to allocate graph";
+
+    ndl_ref prev = ndl_graph_alloc(graph);
+
+    uint64_t i;
+    for (i = 1; i < NDL_BENCH_GRAPH_NODES; i++) {
+        prev = ndl_graph_salloc(graph, prev, NDL_SYM("next    "));
+        if (prev == NDL_NULL_REF) {
+            ndl_graph_kill(graph);
+            return "Failed to build chain";
+        }
+    }
+
+    return ndl_bench_graph_clean("Chain", graph, NDL_BENCH_GRAPH_NODES);
+}
+
+char *ndl_bench_graph_fan(void) {
+
+    ndl_graph *graph = ndl_graph_init();
+    if (graph == NULL)
+        return "Failed to allocate graph";
+
+    /* A root with FAN children, each with an even share of the rest. */
+    ndl_ref root = ndl_graph_alloc(graph);
+    uint64_t per = (NDL_BENCH_GRAPH_NODES - 1 - NDL_BENCH_GRAPH_FAN) / NDL_BENCH_GRAPH_FAN;
+    uint64_t count = 1;
+
+    uint64_t i, j;
+    for (i = 0; i < NDL_BENCH_GRAPH_FAN; i++) {
+
+        ndl_ref mid = ndl_graph_salloc(graph, root, (ndl_sym) (i + 1));
+        if (mid == NDL_NULL_REF) {
+            ndl_graph_kill(graph);
+            return "Failed to build fan";
+        }
+        count++;
+
+        for (j = 0; j < per; j++, count++) {
+            if (ndl_graph_salloc(graph, mid, (ndl_sym) (j + 1)) == NDL_NULL_REF) {
+                ndl_graph_kill(graph);
+                return "Failed to build fan";
+            }
+        }
+    }
+
+    return ndl_bench_graph_clean("Fan", graph, count);
+}
+
+static uint64_t ndl_bench_graph_rand(uint64_t *state) {
+
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+
+    return *state = x;
+}
+
+char *ndl_bench_graph_random(void) {
+
+    ndl_graph *graph = ndl_graph_init();
+    if (graph == NULL)
+        return "Failed to allocate graph";
+
+    ndl_ref *nodes = malloc(NDL_BENCH_GRAPH_NODES * sizeof(ndl_ref));
+    if (nodes == NULL) {
+        ndl_graph_kill(graph);
+        return "Out of memory, couldn't run benchmark";
+    }
+
+    /* A random tree, so every node is reachable, plus one random edge per node. */
+    uint64_t state = 0x9E3779B97F4A7C15;
+    nodes[0] = ndl_graph_alloc(graph);
+
+    uint64_t i;
+    for (i = 1; i < NDL_BENCH_GRAPH_NODES; i++) {
+        ndl_ref parent = nodes[ndl_bench_graph_rand(&state) % i];
+        nodes[i] = ndl_graph_salloc(graph, parent, (ndl_sym) i);
+        if (nodes[i] == NDL_NULL_REF) {
+            free(nodes);
+            ndl_graph_kill(graph);
+            return "Failed to build random graph";
+        }
+    }
+
+    for (i = 0; i < NDL_BENCH_GRAPH_NODES; i++) {
+        ndl_ref other = nodes[ndl_bench_graph_rand(&state) % NDL_BENCH_GRAPH_NODES];
+        if (ndl_graph_set(graph, nodes[i], NDL_SYM("rand    "), NDL_VALUE(EVAL_REF, ref=other)) != 0) {
+            free(nodes);
+            ndl_graph_kill(graph);
+            return "Failed to build random graph";
+        }
+    }
+
+    free(nodes);
+
+    return ndl_bench_graph_clean("Random", graph, NDL_BENCH_GRAPH_NODES);
+}
+
+#define NDL_BENCH_GRAPH_PARALLEL_NODES 2000000
+
+/* The random graph again, cleaned with more and more mark threads. */
+char *ndl_bench_graph_parallel(void) {
+
+    ndl_graph *graph = ndl_graph_init();
+    if (graph == NULL)
+        return "Failed to allocate graph";
+
+    /* As in the random benchmark, with ids standing in for the node list. */
+    uint64_t state = 0x9E3779B97F4A7C15;
+    ndl_graph_alloc(graph);
+
+    uint64_t i;
+    for (i = 1; i < NDL_BENCH_GRAPH_PARALLEL_NODES; i++) {
+        ndl_ref parent = (ndl_ref) (ndl_bench_graph_rand(&state) % i + 1);
+        if (ndl_graph_salloc(graph, parent, (ndl_sym) i) == NDL_NULL_REF) {
+            ndl_graph_kill(graph);
+            return "Failed to build random graph";
+        }
+    }
+
+    for (i = 0; i < NDL_BENCH_GRAPH_PARALLEL_NODES; i++) {
+        ndl_ref other = (ndl_ref) (ndl_bench_graph_rand(&state) % NDL_BENCH_GRAPH_PARALLEL_NODES + 1);
+        if (ndl_graph_set(graph, (ndl_ref) i + 1, NDL_SYM("rand    "), NDL_VALUE(EVAL_REF, ref=other)) != 0) {
+            ndl_graph_kill(graph);
+            return "Failed to build random graph";
+        }
+    }
+
+    printf("  %ld CPUs online.\n", sysconf(_SC_NPROCESSORS_ONLN));
+
+    uint64_t threads;
+    for (threads = 1; threads <= 16; threads *= 2) {
+
+        ndl_graph_set_threads(graph, threads);
+
+        ndl_time start = ndl_time_get();
+        ndl_graph_clean(graph);
+        ndl_time end = ndl_time_get();
+
+        if (ndl_node_pool_size((ndl_node_pool *) graph->pool) != NDL_BENCH_GRAPH_PARALLEL_NODES) {
+            ndl_graph_kill(graph);
+            return "Clean freed reachable nodes";
+        }
+
+        int64_t usec = ndl_time_to_usec(ndl_time_sub(end, start));
+        printf("  %2ld threads: %ld nodes cleaned in %ld usec (%.1f ns/node).\n",
+               threads, (uint64_t) NDL_BENCH_GRAPH_PARALLEL_NODES, usec,
+               1000.0 * (double) usec / (double) NDL_BENCH_GRAPH_PARALLEL_NODES);
+    }
+
+    ndl_graph_kill(graph);
+
+    return NULL;
+}
+
+#define NDL_BENCH_GRAPH_STEP_BUDGET 1024
+
+/* Incremental collection of the random graph, with half of it garbage.
+ * Reports the longest step, which bounds the pause a caller sees.
+ */
+char *ndl_bench_graph_incremental(void) {
+
+    ndl_graph *graph = ndl_graph_init();
+    if (graph == NULL)
+        return "Failed to allocate graph";
+
+    uint64_t state = 0x9E3779B97F4A7C15;
+    ndl_graph_alloc(graph);
+
+    uint64_t i;
+    for (i = 1; i < NDL_BENCH_GRAPH_PARALLEL_NODES; i++) {
+        ndl_ref parent = (ndl_ref) (ndl_bench_graph_rand(&state) % i + 1);
+        if (ndl_graph_salloc(graph, parent, (ndl_sym) i) == NDL_NULL_REF) {
+            ndl_graph_kill(graph);
+            return "Failed to build random graph";
+        }
+    }
+
+    /* A second, unrooted tree. */
+    ndl_ref base = ndl_graph_alloc(graph);
+    for (i = 1; i < NDL_BENCH_GRAPH_PARALLEL_NODES; i++) {
+        ndl_ref parent = base + (ndl_ref) (ndl_bench_graph_rand(&state) % i);
+        if (ndl_graph_salloc(graph, parent, (ndl_sym) i) == NDL_NULL_REF) {
+            ndl_graph_kill(graph);
+            return "Failed to build random graph";
+        }
+    }
+    ndl_graph_unmark(graph, base);
+
+    int64_t total = 0, worst = 0;
+    uint64_t steps = 0;
+
+    int done = 0;
+    while (done == 0) {
+
+        ndl_time start = ndl_time_get();
+        done = ndl_graph_clean_step(graph, NDL_BENCH_GRAPH_STEP_BUDGET);
+        ndl_time end = ndl_time_get();
+
+        int64_t usec = ndl_time_to_usec(ndl_time_sub(end, start));
+        total += usec;
+        worst = (usec > worst)? usec : worst;
+        steps++;
+    }
+
+    uint64_t left = ndl_node_pool_size((ndl_node_pool *) graph->pool);
+    ndl_graph_kill(graph);
+
+    if ((done != 1) || (left != NDL_BENCH_GRAPH_PARALLEL_NODES))
+        return "Incremental clean kept garbage or freed live nodes";
+
+    printf("  %ld steps of %d units: %ld usec total, %.1f usec mean, %ld usec worst.\n",
+           steps, NDL_BENCH_GRAPH_STEP_BUDGET, total, (double) total / (double) steps, worst);
+
+    return NULL;
+}
+
+#define NDL_BENCH_GRAPH_YOUNG 100000
+#define NDL_BENCH_GRAPH_ROUNDS 10
+
+/* Short-lived nodes on top of the old random graph, as a program's
+ * frames would be: each round allocates YOUNG nodes under a temporary
+ * root, keeps one in a hundred by storing it in an old node, and drops
+ * the root. Compares minor collections with full ones.
+ */
+char *ndl_bench_graph_minor(void) {
+
+    ndl_graph *graph = ndl_graph_init();
+    if (graph == NULL)
+        return "Failed to allocate graph";
+
+    uint64_t state = 0x9E3779B97F4A7C15;
+    ndl_graph_alloc(graph);
+
+    uint64_t i;
+    for (i = 1; i < NDL_BENCH_GRAPH_PARALLEL_NODES; i++) {
+        ndl_ref parent = (ndl_ref) (ndl_bench_graph_rand(&state) % i + 1);
+        if (ndl_graph_salloc(graph, parent, (ndl_sym) i) == NDL_NULL_REF) {
+            ndl_graph_kill(graph);
+            return "Failed to build random graph";
+        }
+    }
+
+    ndl_graph_clean(graph);
+
+    int64_t usec[2] = {0, 0};
+
+    int full;
+    for (full = 0; full < 2; full++) {
+
+        uint64_t round;
+        for (round = 0; round < NDL_BENCH_GRAPH_ROUNDS; round++) {
+
+            ndl_ref temp = ndl_graph_alloc(graph);
+
+            for (i = 0; i < NDL_BENCH_GRAPH_YOUNG; i++) {
+
+                ndl_ref node = ndl_graph_salloc(graph, temp, (ndl_sym) (i + 1));
+                if (node == NDL_NULL_REF) {
+                    ndl_graph_kill(graph);
+                    return "Failed to allocate young nodes";
+                }
+
+                if ((i % 100) == 0) {
+                    ndl_ref old = (ndl_ref) (ndl_bench_graph_rand(&state) % NDL_BENCH_GRAPH_PARALLEL_NODES + 1);
+                    ndl_graph_set(graph, old, NDL_SYM("young   "), NDL_VALUE(EVAL_REF, ref=node));
+                }
+            }
+
+            ndl_graph_unmark(graph, temp);
+
+            ndl_time start = ndl_time_get();
+            if (full)
+                ndl_graph_clean(graph);
+            else
+                ndl_graph_clean_minor(graph);
+            ndl_time end = ndl_time_get();
+
+            usec[full] += ndl_time_to_usec(ndl_time_sub(end, start));
+        }
+    }
+
+    ndl_graph_clean_sweep(graph, 0);
+
+    uint64_t left = ndl_node_pool_size((ndl_node_pool *) graph->pool);
+    ndl_graph_kill(graph);
+
+    if (left > NDL_BENCH_GRAPH_PARALLEL_NODES + 2 * NDL_BENCH_GRAPH_ROUNDS * NDL_BENCH_GRAPH_YOUNG / 100)
+        return "Collections left garbage";
+
+    printf("  %d young nodes per round over %d old: minor %ld usec, full %ld usec per collection.\n",
+           NDL_BENCH_GRAPH_YOUNG, NDL_BENCH_GRAPH_PARALLEL_NODES,
+           usec[0] / NDL_BENCH_GRAPH_ROUNDS, usec[1] / NDL_BENCH_GRAPH_ROUNDS);
+
+    return NULL;
+}
+
+#define NDL_BENCH_GRAPH_RC_ROUNDS 100000
+#define NDL_BENCH_GRAPH_RC_SLOTS 16
+
+/* A root whose slots keep being replaced with small fresh trees, with
+ * and without reference counting. Reports time (a final full clean
+ * included) and nodes still allocated before that clean.
+ */
+char *ndl_bench_graph_refcount(void) {
+
+    int refcount;
+    for (refcount = 1; refcount >= 0; refcount--) {
+
+        ndl_graph *graph = ndl_graph_init();
+        if (graph == NULL)
+            return "Failed to allocate graph";
+
+        ndl_graph_set_refcount(graph, refcount);
+
+        ndl_time start = ndl_time_get();
+
+        ndl_ref root = ndl_graph_alloc(graph);
+
+        uint64_t i, j;
+        for (i = 0; i < NDL_BENCH_GRAPH_RC_ROUNDS; i++) {
+
+            ndl_ref tree = ndl_graph_salloc(graph, root, (ndl_sym) (i % NDL_BENCH_GRAPH_RC_SLOTS));
+            for (j = 0; j < 7; j++)
+                ndl_graph_salloc(graph, tree, (ndl_sym) j);
+        }
+
+        uint64_t peak = ndl_node_pool_size((ndl_node_pool *) graph->pool);
+
+        ndl_graph_clean(graph);
+        ndl_graph_clean_sweep(graph, 0);
+
+        ndl_time end = ndl_time_get();
+
+        uint64_t left = ndl_node_pool_size((ndl_node_pool *) graph->pool);
+        ndl_graph_kill(graph);
+
+        if (left != 1 + 8 * NDL_BENCH_GRAPH_RC_SLOTS)
+            return "Clean left garbage or freed live nodes";
+
+        printf("  Refcount %s: %ld usec, %ld nodes before the final clean.\n",
+               refcount? "on " : "off", ndl_time_to_usec(ndl_time_sub(end, start)), peak);
+    }
+
+    return NULL;
+}
+
+#define NDL_BENCH_GRAPH_LAZY_ALLOCS 100000
+
+/* The incremental benchmark's half-garbage random graph, cleaned with
+ * lazy sweeping: reports the clean (the mark alone), allocs made while
+ * the sweep is pending (each sweeping a few nodes), and the rest of it.
+ */
+char *ndl_bench_graph_lazy(void) {
+
+    ndl_graph *graph = ndl_graph_init();
+    if (graph == NULL)
+        return "Failed to allocate graph";
+
+    uint64_t state = 0x9E3779B97F4A7C15;
+    ndl_ref root = ndl_graph_alloc(graph);
+
+    uint64_t i;
+    for (i = 1; i < NDL_BENCH_GRAPH_PARALLEL_NODES; i++) {
+        ndl_ref parent = (ndl_ref) (ndl_bench_graph_rand(&state) % i + 1);
+        if (ndl_graph_salloc(graph, parent, (ndl_sym) i) == NDL_NULL_REF) {
+            ndl_graph_kill(graph);
+            return "Failed to build random graph";
+        }
+    }
+
+    ndl_ref base = ndl_graph_alloc(graph);
+    for (i = 1; i < NDL_BENCH_GRAPH_PARALLEL_NODES; i++) {
+        ndl_ref parent = base + (ndl_ref) (ndl_bench_graph_rand(&state) % i);
+        if (ndl_graph_salloc(graph, parent, (ndl_sym) i) == NDL_NULL_REF) {
+            ndl_graph_kill(graph);
+            return "Failed to build random graph";
+        }
+    }
+    ndl_graph_unmark(graph, base);
+
+    ndl_time start = ndl_time_get();
+    ndl_graph_clean(graph);
+    ndl_time marked = ndl_time_get();
+
+    ndl_ref holder = ndl_graph_salloc(graph, root, NDL_SYM("holder  "));
+    for (i = 0; i < NDL_BENCH_GRAPH_LAZY_ALLOCS; i++) {
+        if (ndl_graph_salloc(graph, holder, (ndl_sym) (i + 1)) == NDL_NULL_REF) {
+            ndl_graph_kill(graph);
+            return "Failed to allocate during the sweep";
+        }
+    }
+    ndl_time allocated = ndl_time_get();
+
+    ndl_graph_clean_sweep(graph, 0);
+    ndl_time swept = ndl_time_get();
+
+    uint64_t left = ndl_node_pool_size((ndl_node_pool *) graph->pool);
+    ndl_graph_kill(graph);
+
+    if (left != NDL_BENCH_GRAPH_PARALLEL_NODES + 1 + NDL_BENCH_GRAPH_LAZY_ALLOCS)
+        return "Lazy sweep kept garbage or freed live nodes";
+
+    printf("  %d live, %d dead: clean %ld usec, %d allocs %ld usec, rest of the sweep %ld usec.\n",
+           NDL_BENCH_GRAPH_PARALLEL_NODES, NDL_BENCH_GRAPH_PARALLEL_NODES,
+           ndl_time_to_usec(ndl_time_sub(marked, start)), NDL_BENCH_GRAPH_LAZY_ALLOCS,
+           ndl_time_to_usec(ndl_time_sub(allocated, marked)),
+           ndl_time_to_usec(ndl_time_sub(swept, allocated)));
+
+    return NULL;
+}
+
+#define NDL_BENCH_GRAPH_SNAPSHOT_WRITES 100000
+
+/* Snapshots of the random graph, against a full copy. Writes after a
+ * snapshot pay for copying the pages they land on: random ones touch
+ * most pages, clustered ones a few hundred.
+ */
+static int64_t ndl_bench_graph_writes(ndl_graph *graph, uint64_t *state, uint64_t span, ndl_sym key) {
+
+    ndl_time start = ndl_time_get();
+
+    uint64_t i;
+    for (i = 0; i < NDL_BENCH_GRAPH_SNAPSHOT_WRITES; i++) {
+        ndl_ref node = (ndl_ref) (ndl_bench_graph_rand(state) % span + 1);
+        if (ndl_graph_set(graph, node, key, NDL_VALUE(EVAL_INT, num=(int64_t) i)) != 0)
+            return -1;
+    }
+
+    return ndl_time_to_usec(ndl_time_sub(ndl_time_get(), start));
+}
+
+char *ndl_bench_graph_snapshot(void) {
+
+    ndl_graph *graph = ndl_graph_init();
+    if (graph == NULL)
+        return "Failed to allocate graph";
+
+    uint64_t state = 0x9E3779B97F4A7C15;
+    ndl_graph_alloc(graph);
+
+    uint64_t i;
+    for (i = 1; i < NDL_BENCH_GRAPH_PARALLEL_NODES; i++) {
+        ndl_ref parent = (ndl_ref) (ndl_bench_graph_rand(&state) % i + 1);
+        if (ndl_graph_salloc(graph, parent, (ndl_sym) i) == NDL_NULL_REF) {
+            ndl_graph_kill(graph);
+            return "Failed to build random graph";
+        }
+    }
+
+    ndl_graph *copy = ndl_graph_init();
+    ndl_time start = ndl_time_get();
+    int err = (copy != NULL)? ndl_graph_copy(copy, graph, NULL) : -1;
+    ndl_time copied = ndl_time_get();
+
+    ndl_graph *snap = ndl_graph_snapshot(graph);
+    ndl_time snapped = ndl_time_get();
+
+    ndl_graph_kill(copy);
+
+    if ((err < 0) || (snap == NULL)) {
+        ndl_graph_kill(graph);
+        return "Failed to copy or snapshot graph";
+    }
+
+    int64_t random = ndl_bench_graph_writes(graph, &state, NDL_BENCH_GRAPH_PARALLEL_NODES, NDL_SYM("a       "));
+    int64_t again = ndl_bench_graph_writes(graph, &state, NDL_BENCH_GRAPH_PARALLEL_NODES, NDL_SYM("b       "));
+    ndl_graph_kill(snap);
+
+    snap = ndl_graph_snapshot(graph);
+    int64_t local = ndl_bench_graph_writes(graph, &state, NDL_BENCH_GRAPH_SNAPSHOT_WRITES, NDL_SYM("c       "));
+    ndl_graph_kill(snap);
+
+    int64_t plain = ndl_bench_graph_writes(graph, &state, NDL_BENCH_GRAPH_PARALLEL_NODES, NDL_SYM("d       "));
+    ndl_graph_kill(graph);
+
+    if ((random < 0) || (again < 0) || (local < 0) || (plain < 0))
+        return "Failed to write graph";
+
+    printf("  %d nodes: copy %ld usec, snapshot %ld usec.\n", NDL_BENCH_GRAPH_PARALLEL_NODES,
+           ndl_time_to_usec(ndl_time_sub(copied, start)), ndl_time_to_usec(ndl_time_sub(snapped, copied)));
+    printf("  %d writes: %ld usec without a snapshot; with one, random %ld usec "
+           "(again %ld usec), clustered %ld usec.\n", NDL_BENCH_GRAPH_SNAPSHOT_WRITES,
+           plain, random, again, local);
+
+    return NULL;
+}
+
+#define NDL_BENCH_GRAPH_COPY_NODES 1000000
+
+/* dcopy() of a random tree hanging off one root, beside as much garbage,
+ * and copy() of the lot.
+ */
+char *ndl_bench_graph_copy(void) {
+
+    ndl_graph *graph = ndl_graph_init();
+    if (graph == NULL)
+        return "Failed to allocate graph";
+
+    /* Two interleaved trees, so the live one is spread over the ids. */
+    ndl_ref *trees = malloc(2 * NDL_BENCH_GRAPH_COPY_NODES * sizeof(ndl_ref));
+    if (trees == NULL) {
+        ndl_graph_kill(graph);
+        return "Failed to allocate node list";
+    }
+
+    uint64_t state = 0x9E3779B97F4A7C15;
+    ndl_ref root = trees[0] = ndl_graph_alloc(graph);
+    trees[1] = ndl_graph_alloc(graph);
+
+    uint64_t i;
+    for (i = 2; i < 2 * NDL_BENCH_GRAPH_COPY_NODES; i++) {
+        ndl_ref parent = trees[ndl_bench_graph_rand(&state) % (i / 2) * 2 + i % 2];
+        if ((trees[i] = ndl_graph_salloc(graph, parent, (ndl_sym) i)) == NDL_NULL_REF) {
+            free(trees);
+            ndl_graph_kill(graph);
+            return "Failed to build random graph";
+        }
+    }
+
+    free(trees);
+    ndl_graph_unmark(graph, root + 1);
+
+    ndl_graph *sub = ndl_graph_init();
+    ndl_graph *all = ndl_graph_init();
+    ndl_ref roots[2] = {root, NDL_NULL_REF};
+
+    ndl_time start = ndl_time_get();
+    int subcount = (sub != NULL)? ndl_graph_dcopy(sub, graph, roots) : -1;
+    ndl_time dcopied = ndl_time_get();
+    int allcount = (all != NULL)? ndl_graph_copy(all, graph, NULL) : -1;
+    ndl_time copied = ndl_time_get();
+
+    uint64_t subsize = (sub != NULL)? ndl_node_pool_size((ndl_node_pool *) sub->pool) : 0;
+
+    ndl_graph_kill(sub);
+    ndl_graph_kill(all);
+    ndl_graph_kill(graph);
+
+    if ((subcount != 1) || (allcount != 2 * NDL_BENCH_GRAPH_COPY_NODES) ||
+        (subsize != NDL_BENCH_GRAPH_COPY_NODES))
+        return "Copies went wrong";
+
+    printf("  dcopy %ld reachable nodes: %ld usec. copy %d nodes: %ld usec.\n",
+           subsize, ndl_time_to_usec(ndl_time_sub(dcopied, start)), allcount,
+           ndl_time_to_usec(ndl_time_sub(copied, dcopied)));
+
+    return NULL;
+}
+
+#define NDL_BENCH_GRAPH_BATCH_NODES 1000000
+#define NDL_BENCH_GRAPH_BATCH_KEYS 4
+
+/* A loader's stores, node by node, each referencing a random node:
+ * through set(), then through one batch.
+ */
+static int64_t ndl_bench_graph_load(ndl_graph *graph, int batched) {
+
+    uint64_t state = 0x9E3779B97F4A7C15;
+
+    uint64_t i;
+    for (i = 0; i < NDL_BENCH_GRAPH_BATCH_NODES; i++)
+        if (ndl_graph_alloc(graph) == NDL_NULL_REF)
+            return -1;
+
+    ndl_time start = ndl_time_get();
+
+    ndl_graph_batch *batch = batched? ndl_graph_batch_begin(graph) : NULL;
+    if (batched && (batch == NULL))
+        return -1;
+
+    int err = 0;
+    for (i = 0; i < NDL_BENCH_GRAPH_BATCH_NODES * NDL_BENCH_GRAPH_BATCH_KEYS; i++) {
+
+        ndl_ref node = (ndl_ref) (i / NDL_BENCH_GRAPH_BATCH_KEYS + 1);
+        ndl_sym key = (ndl_sym) (i % NDL_BENCH_GRAPH_BATCH_KEYS + 1);
+        ndl_value val = NDL_VALUE(EVAL_REF, ref=(ndl_ref) (ndl_bench_graph_rand(&state) % NDL_BENCH_GRAPH_BATCH_NODES + 1));
+
+        err |= batched? ndl_graph_batch_set(batch, node, key, val) : ndl_graph_set(graph, node, key, val);
+    }
+
+    if (batched)
+        err |= ndl_graph_batch_commit(batch);
+
+    ndl_time end = ndl_time_get();
+
+    return (err != 0)? -1 : ndl_time_to_usec(ndl_time_sub(end, start));
+}
+
+char *ndl_bench_graph_batch(void) {
+
+    ndl_graph *one = ndl_graph_init();
+    ndl_graph *many = ndl_graph_init();
+
+    int64_t single = (one != NULL)? ndl_bench_graph_load(one, 0) : -1;
+    int64_t batched = (many != NULL)? ndl_bench_graph_load(many, 1) : -1;
+
+    /* Spot check the two agree. */
+    ndl_ref node = NDL_BENCH_GRAPH_BATCH_NODES / 2;
+    ndl_ref to = (single >= 0)? NDL_VALUE_REF(ndl_graph_get(one, node, 1)) : NDL_NULL_REF;
+    int same = (batched >= 0) && (NDL_VALUE_REF(ndl_graph_get(many, node, 1)) == to) &&
+               (ndl_graph_backrefs(one, to, node) == ndl_graph_backrefs(many, to, node));
+
+    ndl_graph_kill(one);
+    ndl_graph_kill(many);
+
+    if ((single < 0) || (batched < 0))
+        return "Failed to load graph";
+
+    if (!same)
+        return "Batched stores didn't match set()";
+
+    printf("  %d stores: set() %ld usec, batched %ld usec.\n",
+           NDL_BENCH_GRAPH_BATCH_NODES * NDL_BENCH_GRAPH_BATCH_KEYS, single, batched);
+
+    return NULL;
+}
+
+#define NDL_BENCH_GRAPH_IMAGE_NODES 1000000
+#define NDL_BENCH_GRAPH_IMAGE_WALK  1000
+#define NDL_BENCH_GRAPH_IMAGE_STEP  1024
+
+/* Saving and loading a program sized graph: a few keys per node, and
+ * references to random nodes, so backrefs come along too. Then mapping
+ * it instead, and reading as much as a short run would.
+ */
+char *ndl_bench_graph_image(void) {
+
+    ndl_graph *graph = ndl_graph_init();
+    if (graph == NULL)
+        return "Failed to allocate graph";
+
+    uint64_t state = 0x9E3779B97F4A7C15;
+
+    uint64_t i;
+    for (i = 0; i < NDL_BENCH_GRAPH_IMAGE_NODES; i++) {
+        ndl_ref node = ndl_graph_alloc(graph);
+        if ((node == NDL_NULL_REF) ||
+            (ndl_graph_set(graph, node, NDL_SYM("instr   "), NDL_VALUE(EVAL_SYM, sym=NDL_SYM("add     "))) != 0) ||
+            (ndl_graph_set(graph, node, NDL_SYM("arg     "), NDL_VALUE(EVAL_INT, num=(ndl_int) i)) != 0)) {
+            ndl_graph_kill(graph);
+            return "Failed to build graph";
+        }
+    }
+
+    for (i = 1; i <= NDL_BENCH_GRAPH_IMAGE_NODES; i++) {
+        ndl_ref next = (ndl_ref) (ndl_bench_graph_rand(&state) % NDL_BENCH_GRAPH_IMAGE_NODES) + 1;
+        if (ndl_graph_set(graph, (ndl_ref) i, NDL_SYM("next    "), NDL_VALUE(EVAL_REF, ref=next)) != 0) {
+            ndl_graph_kill(graph);
+            return "Failed to link graph";
+        }
+    }
+
+    uint64_t len = ndl_graph_mem_est(graph);
+    void *mem = malloc(len);
+    if (mem == NULL) {
+        ndl_graph_kill(graph);
+        return "Failed to allocate image";
+    }
+
+    /* Fault the image in first; the OS's share isn't the format's. */
+    memset(mem, 0, len);
+
+    ndl_time start = ndl_time_get();
+    int64_t used = ndl_graph_to_mem(graph, len, mem);
+    ndl_time saved = ndl_time_get();
+    ndl_graph *copy = (used > 0)? ndl_graph_from_mem((uint64_t) used, mem) : NULL;
+    ndl_time loaded = ndl_time_get();
+
+    ndl_graph_kill(graph);
+
+    if (copy == NULL) {
+        free(mem);
+        return "Failed to save and load graph";
+    }
+
+    ndl_graph_kill(copy);
+
+    /* Mapped: open, then follow a short walk, as a program's start would. */
+    char path[] = "/tmp/ndl_bench_XXXXXX";
+    int fd = mkstemp(path);
+    int wrote = (fd >= 0) && (write(fd, mem, (size_t) used) == used);
+    if (fd >= 0)
+        close(fd);
+
+    free(mem);
+
+    if (!wrote) {
+        unlink(path);
+        return "Failed to write image";
+    }
+
+    ndl_time opening = ndl_time_get();
+    ndl_graph *mapped = ndl_graph_open_mmap(path);
+
+    ndl_ref curr = 1;
+    for (i = 0; (mapped != NULL) && (i < NDL_BENCH_GRAPH_IMAGE_WALK); i++)
+        curr = NDL_VALUE_REF(ndl_graph_get(mapped, curr, NDL_SYM("next    ")));
+
+    ndl_time walked = ndl_time_get();
+
+    unlink(path);
+
+    if (mapped == NULL)
+        return "Failed to map graph";
+
+    /* Then write to it, and take a collector step, as the runtime would. */
+    ndl_graph_set(mapped, curr, NDL_SYM("seen    "), NDL_VALUE(EVAL_INT, num=1));
+
+    ndl_time stepping = ndl_time_get();
+    ndl_graph_clean_step(mapped, NDL_BENCH_GRAPH_IMAGE_STEP);
+    ndl_time stepped = ndl_time_get();
+
+    uint64_t faulted = ndl_node_pool_size((ndl_node_pool *) mapped->pool);
+
+    ndl_graph_kill(mapped);
+
+    if (curr == NDL_NULL_REF)
+        return "Mapped graph lost a reference";
+
+    printf("  %d nodes, %ld bytes: to_mem %ld usec, from_mem %ld usec, "
+           "open_mmap and %d gets %ld usec.\n",
+           NDL_BENCH_GRAPH_IMAGE_NODES, used, ndl_time_to_usec(ndl_time_sub(saved, start)),
+           ndl_time_to_usec(ndl_time_sub(loaded, saved)), NDL_BENCH_GRAPH_IMAGE_WALK,
+           ndl_time_to_usec(ndl_time_sub(walked, opening)));
+    printf("  First clean_step(%d) on the mapped graph: %ld usec, %lu nodes faulted in.\n",
+           NDL_BENCH_GRAPH_IMAGE_STEP, ndl_time_to_usec(ndl_time_sub(stepped, stepping)), faulted);
+
+    return NULL;
+}
@@ -0,0 +1,255 @@
+#include "test.h"
+
+#include "hashtable.h"
+#include "ndltime.h"
+#include "node.h"
+
+#include <string.h>
+
+/* Probe length benchmarks for the hashtable.
+ * Compares the original additive hash ((3 * sum) % capacity) against the
+ * current mixing hash, on the key distributions nodel actually produces:
+ * sequential node ids in the node pool, and space padded symbols
+ * (plus hidden gc / backref keys) in per-node key tables.
+ */
+
+#define NDL_BENCH_HIST_SIZE 7
+
+static const char *ndl_bench_hist_names[NDL_BENCH_HIST_SIZE] = {
+    "1", "2", "3", "4", "5-8", "9-16", "17+"
+};
+
+typedef struct ndl_bench_hist_s {
+
+    uint64_t count[NDL_BENCH_HIST_SIZE];
+    uint64_t total, sum, max;
+
+} ndl_bench_hist;
+
+static void ndl_bench_hist_add(ndl_bench_hist *hist, uint64_t probes) {
+
+    int bucket;
+    if      (probes <= 4)  bucket = (int) probes - 1;
+    else if (probes <= 8)  bucket = 4;
+    else if (probes <= 16) bucket = 5;
+    else                   bucket = 6;
+
+    hist->count[bucket]++;
+    hist->total++;
+    hist->sum += probes;
+    if (probes > hist->max)
+        hist->max = probes;
+}
+
+static void ndl_bench_hist_print(const char *name, ndl_bench_hist *hist) {
+
+    printf("    %-8s mean %5.2f max %4ld |", name,
+           (hist->total > 0)? (double) hist->sum / (double) hist->total : 0.0, hist->max);
+
+    int i;
+    for (i = 0; i < NDL_BENCH_HIST_SIZE; i++)
+        printf(" %s:%5.1f%%", ndl_bench_hist_names[i],
+               (hist->total > 0)? 100.0 * (double) hist->count[i] / (double) hist->total : 0.0);
+
+    printf("\n");
+}
+
+/* Replay of the original hash and linear probing, for 8 byte keys.
+ * Records the probe length of each key as it is inserted. Keys are unique.
+ */
+static int ndl_bench_legacy_fill(uint64_t *keys, uint64_t count, uint64_t cap, ndl_bench_hist *hist) {
+
+    uint8_t *used = calloc(cap, sizeof(uint8_t));
+    if (used == NULL)
+        return -1;
+
+    uint64_t i;
+    for (i = 0; i < count; i++) {
+
+        uint64_t sum = keys[i];
+        uint64_t hash = (sum + (sum << 1)) % cap;
+
+        uint64_t probes = 1;
+        while (used[hash]) {
+            hash = (hash + 1) % cap;
+            probes++;
+        }
+
+        used[hash] = 1;
+        ndl_bench_hist_add(hist, probes);
+    }
+
+    free(used);
+
+    return 0;
+}
+
+static int ndl_bench_current_fill(uint64_t *keys, uint64_t count, uint64_t cap, ndl_bench_hist *hist) {
+
+    ndl_hashtable *table = ndl_hashtable_init(sizeof(uint64_t), sizeof(uint64_t), cap);
+    if (table == NULL)
+        return -1;
+
+    uint64_t i;
+    for (i = 0; i < count; i++) {
+        if (ndl_hashtable_put(table, &keys[i], &keys[i]) == NULL) {
+            ndl_hashtable_kill(table);
+            return -1;
+        }
+    }
+
+    for (i = 0; i < count; i++)
+        ndl_bench_hist_add(hist, ndl_hashtable_probes(table, &keys[i]));
+
+    ndl_hashtable_kill(table);
+
+    return 0;
+}
+
+/* Smallest power of two capacity that an rhashtable would hold count keys in. */
+static uint64_t ndl_bench_rcap(uint64_t count, uint64_t min) {
+
+    uint64_t cap = min;
+    while (count * 4 > cap * 3)
+        cap <<= 1;
+
+    return cap;
+}
+
+static char *ndl_bench_hashtable_compare(const char *name, uint64_t *keys,
+                                         uint64_t per_table, uint64_t tables, uint64_t min) {
+
+    ndl_bench_hist legacy, current;
+    memset(&legacy, 0, sizeof(legacy));
+    memset(&current, 0, sizeof(current));
+
+    uint64_t cap = ndl_bench_rcap(per_table, min);
+
+    uint64_t i;
+    for (i = 0; i < tables; i++) {
+        if (ndl_bench_legacy_fill(keys + i * per_table, per_table, cap, &legacy) != 0)
+            return "Failed to replay legacy hash";
+        if (ndl_bench_current_fill(keys + i * per_table, per_table, cap, &current) != 0)
+            return "Failed to fill hashtable";
+    }
+
+    printf("  %s: %ld table(s) of %ld keys, capacity %ld.\n", name, tables, per_table, cap);
+    ndl_bench_hist_print("legacy", &legacy);
+    ndl_bench_hist_print("current", &current);
+
+    return NULL;
+}
+
+#define NDL_BENCH_POOL_NODES 100000
+
+char *ndl_bench_hashtable_probe_pool(void) {
+
+    uint64_t *keys = malloc(sizeof(uint64_t) * NDL_BENCH_POOL_NODES);
+    if (keys == NULL)
+        return "Out of memory, couldn't run benchmark";
+
+    /* Ids as handed out by the node pool's counter. */
+    uint64_t i;
+    for (i = 0; i < NDL_BENCH_POOL_NODES; i++)
+        keys[i] = i + 1;
+
+    char *err = ndl_bench_hashtable_compare("Sequential ids", keys, NDL_BENCH_POOL_NODES, 1, 128);
+
+    /* Ids surviving a GC: every third node, with a dense block of roots. */
+    for (i = 0; (err == NULL) && (i < NDL_BENCH_POOL_NODES); i++)
+        keys[i] = (i < NDL_BENCH_POOL_NODES / 10)? i + 1 : i * 3 + 7;
+
+    if (err == NULL)
+        err = ndl_bench_hashtable_compare("Strided ids", keys, NDL_BENCH_POOL_NODES, 1, 128);
+
+    free(keys);
+
+    return err;
+}
+
+#define NDL_BENCH_NODE_COUNT 1000
+#define NDL_BENCH_NODE_KEYS 12
+
+char *ndl_bench_hashtable_probe_node(void) {
+
+    const char *inst[NDL_BENCH_NODE_KEYS] = {
+        "opcode  ", "syma    ", "symb    ", "symc    ", "next    ", "\0gcsweep",
+        "gt      ", "eq      ", "lt      ", "instpntr", "arg1    ", "arg2    "
+    };
+
+    uint64_t *keys = malloc(sizeof(uint64_t) * NDL_BENCH_NODE_KEYS * NDL_BENCH_NODE_COUNT);
+    if (keys == NULL)
+        return "Out of memory, couldn't run benchmark";
+
+    /* Instruction-like nodes: fixed symbols, plus two backref keys
+     * (the hidden "\0b....b\0" form) from neighbouring instructions.
+     */
+    uint64_t per_node = 8;
+    uint64_t i;
+    for (i = 0; i < NDL_BENCH_NODE_COUNT; i++) {
+
+        uint64_t *node = keys + i * per_node;
+
+        int j;
+        for (j = 0; j < 6; j++)
+            memcpy(&node[j], inst[j], sizeof(uint64_t));
+
+        node[6] = NDL_SYM("\0b\0\0\0\0b\0") | ((i + 1) << 16);
+        node[7] = NDL_SYM("\0b\0\0\0\0b\0") | ((i + 2) << 16);
+    }
+
+    char *err = ndl_bench_hashtable_compare("Instruction nodes", keys, per_node,
+                                            NDL_BENCH_NODE_COUNT, 8);
+
+    /* Frame-like nodes: every symbol above, no backrefs. */
+    per_node = NDL_BENCH_NODE_KEYS;
+    for (i = 0; i < NDL_BENCH_NODE_COUNT; i++) {
+
+        int j;
+        for (j = 0; j < NDL_BENCH_NODE_KEYS; j++)
+            memcpy(&keys[i * per_node + (uint64_t) j], inst[j], sizeof(uint64_t));
+    }
+
+    if (err == NULL)
+        err = ndl_bench_hashtable_compare("Frame nodes", keys, per_node,
+                                          NDL_BENCH_NODE_COUNT, 8);
+
+    free(keys);
+
+    return err;
+}
+
+#define NDL_BENCH_LOOKUPS 10000000
+
+char *ndl_bench_hashtable_get(void) {
+
+    uint64_t count = 1 << 16;
+
+    ndl_hashtable *table = ndl_hashtable_init(sizeof(uint64_t), sizeof(uint64_t),
+                                              ndl_bench_rcap(count, 8));
+    if (table == NULL)
+        return "Failed to allocate table";
+
+    uint64_t i;
+    for (i = 1; i <= count; i++)
+        ndl_hashtable_put(table, &i, &i);
+
+    ndl_time start = ndl_time_get();
+
+    uint64_t sum = 0;
+    for (i = 0; i < NDL_BENCH_LOOKUPS; i++) {
+        uint64_t key = (i & (count - 1)) + 1;
+        uint64_t *val = ndl_hashtable_get(table, &key);
+        sum += (val != NULL)? *val : 0;
+    }
+
+    ndl_time end = ndl_time_get();
+
+    ndl_hashtable_kill(table);
+
+    int64_t usec = ndl_time_to_usec(ndl_time_sub(end, start));
+    printf("  %d lookups over %ld sequential ids: %ld usec (%.1f ns/get, checksum %ld).\n",
+           NDL_BENCH_LOOKUPS, count, usec, 1000.0 * (double) usec / NDL_BENCH_LOOKUPS, sum);
+
+    return NULL;
+}
@@ -0,0 +1,91 @@
+#include "test.h"
+
+#include "nodepool.h"
+#include "ndltime.h"
+
+/* Node lookup benchmarks for the node pool.
+ * Resolves keys on a large pool of small, instruction-like nodes,
+ * as ndl_graph_get does for every opcode argument.
+ */
+
+#define NDL_BENCH_POOL_SIZE (1 << 20)
+#define NDL_BENCH_POOL_GETS 10000000
+
+char *ndl_bench_nodepool_get(void) {
+
+    ndl_node_pool *pool = ndl_node_pool_init();
+    if (pool == NULL)
+        return "Failed to allocate pool";
+
+    uint64_t i;
+    for (i = 0; i < NDL_BENCH_POOL_SIZE; i++) {
+
+        ndl_ref node = ndl_node_pool_alloc(pool);
+        if ((node == NDL_NULL_REF) ||
+            ndl_node_pool_put(pool, node, NDL_SYM("opcode  "), NDL_VALUE(EVAL_SYM, sym=NDL_SYM("add     "))) ||
+            ndl_node_pool_put(pool, node, NDL_SYM("arg1    "), NDL_VALUE(EVAL_INT, num=(ndl_int) i)) ||
+            ndl_node_pool_put(pool, node, NDL_SYM("next    "), NDL_VALUE(EVAL_REF, ref=node + 1))) {
+            ndl_node_pool_kill(pool);
+            return "Failed to build pool";
+        }
+    }
+
+    ndl_time start = ndl_time_get();
+
+    /* Strided walk, so lookups aren't served from one cache line. */
+    ndl_int sum = 0;
+    for (i = 0; i < NDL_BENCH_POOL_GETS; i++) {
+        ndl_ref node = (ndl_ref) ((i * 7919) & (NDL_BENCH_POOL_SIZE - 1)) + 1;
+        sum += NDL_VALUE_NUM(ndl_node_pool_get(pool, node, NDL_SYM("arg1    ")));
+    }
+
+    ndl_time end = ndl_time_get();
+
+    ndl_node_pool_kill(pool);
+
+    int64_t usec = ndl_time_to_usec(ndl_time_sub(end, start));
+    printf("  %d gets over %d nodes: %ld usec (%.1f ns/get, checksum %ld).\n",
+           NDL_BENCH_POOL_GETS, NDL_BENCH_POOL_SIZE, usec,
+           1000.0 * (double) usec / NDL_BENCH_POOL_GETS, sum);
+
+    return NULL;
+}
+
+#define NDL_BENCH_NODE_KEYS 100000
+
+char *ndl_bench_nodepool_index(void) {
+
+    ndl_node_pool *pool = ndl_node_pool_init();
+    if (pool == NULL)
+        return "Failed to allocate pool";
+
+    ndl_ref node = ndl_node_pool_alloc(pool);
+
+    uint64_t i;
+    for (i = 0; i < NDL_BENCH_NODE_KEYS; i++) {
+        if (ndl_node_pool_put(pool, node, (ndl_sym) (i + 1), NDL_VALUE(EVAL_INT, num=(ndl_int) i)) != 0) {
+            ndl_node_pool_kill(pool);
+            return "Failed to build node";
+        }
+    }
+
+    ndl_time start = ndl_time_get();
+
+    /* What an iload loop does: size, then every key by index, then its value. */
+    ndl_int sum = 0;
+    uint64_t size = ndl_node_pool_node_size(pool, node);
+    for (i = 0; i < size; i++) {
+        ndl_sym key = ndl_node_pool_node_index(pool, node, i);
+        sum += NDL_VALUE_NUM(ndl_node_pool_get(pool, node, key));
+    }
+
+    ndl_time end = ndl_time_get();
+
+    ndl_node_pool_kill(pool);
+
+    int64_t usec = ndl_time_to_usec(ndl_time_sub(end, start));
+    printf("  Indexed walk over a %d key node: %ld usec (checksum %ld).\n",
+           NDL_BENCH_NODE_KEYS, usec, sum);
+
+    return NULL;
+}
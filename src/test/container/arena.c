@@ -0,0 +1,223 @@
+#include "test.h"
+
+#include "arena.h"
+
+#include <pthread.h>
+#include <string.h>
+
+/* Blocks are aligned, distinct, reused once freed, and keep their
+ * contents across a move.
+ */
+char *ndl_test_arena_alloc(void) {
+
+    ndl_arena *arena = ndl_arena_init();
+    if (arena == NULL)
+        return "Failed to allocate arena";
+
+    uint8_t *a = ndl_arena_alloc(arena, 24);
+    uint8_t *b = ndl_arena_alloc(arena, 24);
+    if ((a == NULL) || (b == NULL)) {
+        ndl_arena_kill(arena);
+        return "Failed to allocate blocks";
+    }
+
+    if ((((uintptr_t) a | (uintptr_t) b) & 15) || (b - a < 24)) {
+        ndl_arena_kill(arena);
+        return "Blocks misaligned or overlapping";
+    }
+
+    ndl_arena_free(arena, a, 24);
+    if (ndl_arena_alloc(arena, 32) != a) {
+        ndl_arena_kill(arena);
+        return "Freed block not reused";
+    }
+
+    memset(a, 7, 32);
+    uint8_t *moved = ndl_arena_realloc(arena, a, 32, 1000);
+    if ((moved == NULL) || (moved[0] != 7) || (moved[31] != 7)) {
+        ndl_arena_kill(arena);
+        return "Realloc lost contents";
+    }
+
+    void *big = ndl_arena_alloc(arena, NDL_ARENA_MAX + 1);
+    if (big == NULL) {
+        ndl_arena_kill(arena);
+        return "Failed to allocate large block";
+    }
+
+    ndl_arena_free(arena, big, NDL_ARENA_MAX + 1);
+
+    if (ndl_arena_spans(arena) != 2) {
+        ndl_arena_kill(arena);
+        return "Expected a span per class used";
+    }
+
+    ndl_arena_kill(arena);
+
+    return NULL;
+}
+
+/* Trimming unmaps spans with nothing in use, and only those. */
+char *ndl_test_arena_trim(void) {
+
+    ndl_arena *arena = ndl_arena_init();
+    if (arena == NULL)
+        return "Failed to allocate arena";
+
+    uint64_t count = 4 * NDL_ARENA_SPAN / 64;
+
+    void **blocks = malloc(count * sizeof(void *));
+    if (blocks == NULL) {
+        ndl_arena_kill(arena);
+        return "Out of memory, couldn't run test";
+    }
+
+    uint64_t i;
+    for (i = 0; i < count; i++) {
+        blocks[i] = ndl_arena_alloc(arena, 64);
+        if (blocks[i] == NULL) {
+            free(blocks);
+            ndl_arena_kill(arena);
+            return "Failed to allocate blocks";
+        }
+        memset(blocks[i], (int) i, 64);
+    }
+
+    uint64_t spans = ndl_arena_spans(arena);
+    if (spans < 4) {
+        free(blocks);
+        ndl_arena_kill(arena);
+        return "Expected several spans";
+    }
+
+    if (ndl_arena_trim(arena) != 0) {
+        free(blocks);
+        ndl_arena_kill(arena);
+        return "Unmapped spans in use";
+    }
+
+    /* Keep the last block; its span must survive. */
+    for (i = 0; i + 1 < count; i++)
+        ndl_arena_free(arena, blocks[i], 64);
+
+    uint64_t unmapped = ndl_arena_trim(arena);
+    if ((unmapped == 0) || (ndl_arena_spans(arena) != 1) ||
+        (ndl_arena_mapped(arena) != NDL_ARENA_SPAN)) {
+        free(blocks);
+        ndl_arena_kill(arena);
+        return "Didn't unmap the empty spans";
+    }
+
+    if (((uint8_t *) blocks[count - 1])[63] != (uint8_t) (count - 1)) {
+        free(blocks);
+        ndl_arena_kill(arena);
+        return "Lost a live block";
+    }
+
+    /* Allocating again must not hand out unmapped memory. */
+    for (i = 0; i + 1 < count; i++) {
+        blocks[i] = ndl_arena_alloc(arena, 64);
+        if (blocks[i] == NULL) {
+            free(blocks);
+            ndl_arena_kill(arena);
+            return "Failed to allocate after trimming";
+        }
+        memset(blocks[i], 1, 64);
+    }
+
+    for (i = 0; i < count; i++)
+        ndl_arena_free(arena, blocks[i], 64);
+
+    free(blocks);
+
+    ndl_arena_trim(arena);
+    if ((ndl_arena_spans(arena) != 0) || (ndl_arena_mapped(arena) != 0)) {
+        ndl_arena_kill(arena);
+        return "Didn't unmap every span";
+    }
+
+    ndl_arena_kill(arena);
+
+    return NULL;
+}
+
+typedef struct {
+
+    ndl_arena *arena;
+    void **blocks;
+    uint64_t count;
+
+} ndl_test_arena_frees;
+
+static void *ndl_test_arena_free_all(void *data) {
+
+    ndl_test_arena_frees *frees = (ndl_test_arena_frees *) data;
+
+    uint64_t i;
+    for (i = 0; i < frees->count; i++)
+        ndl_arena_free(frees->arena, frees->blocks[i], 48);
+
+    return NULL;
+}
+
+/* Blocks freed from other threads come back to the allocating one. */
+char *ndl_test_arena_remote(void) {
+
+#define NDL_TEST_ARENA_THREADS 4
+#define NDL_TEST_ARENA_BLOCKS  4096
+
+    ndl_arena *arena = ndl_arena_init();
+    if (arena == NULL)
+        return "Failed to allocate arena";
+
+    void **blocks = malloc(NDL_TEST_ARENA_THREADS * NDL_TEST_ARENA_BLOCKS * sizeof(void *));
+    if (blocks == NULL) {
+        ndl_arena_kill(arena);
+        return "Out of memory, couldn't run test";
+    }
+
+    uint64_t i;
+    for (i = 0; i < NDL_TEST_ARENA_THREADS * NDL_TEST_ARENA_BLOCKS; i++) {
+        blocks[i] = ndl_arena_alloc(arena, 48);
+        if (blocks[i] == NULL) {
+            free(blocks);
+            ndl_arena_kill(arena);
+            return "Failed to allocate blocks";
+        }
+    }
+
+    uint64_t spans = ndl_arena_spans(arena);
+
+    pthread_t threads[NDL_TEST_ARENA_THREADS];
+    ndl_test_arena_frees frees[NDL_TEST_ARENA_THREADS];
+
+    for (i = 0; i < NDL_TEST_ARENA_THREADS; i++) {
+        frees[i].arena = arena;
+        frees[i].blocks = &blocks[i * NDL_TEST_ARENA_BLOCKS];
+        frees[i].count = NDL_TEST_ARENA_BLOCKS;
+        pthread_create(&threads[i], NULL, &ndl_test_arena_free_all, &frees[i]);
+    }
+
+    for (i = 0; i < NDL_TEST_ARENA_THREADS; i++)
+        pthread_join(threads[i], NULL);
+
+    /* Every freed block is handed out again before a new span is opened. */
+    for (i = 0; i < NDL_TEST_ARENA_THREADS * NDL_TEST_ARENA_BLOCKS; i++) {
+        if (ndl_arena_alloc(arena, 48) == NULL) {
+            free(blocks);
+            ndl_arena_kill(arena);
+            return "Failed to reallocate blocks";
+        }
+    }
+
+    free(blocks);
+
+    if (ndl_arena_spans(arena) != spans) {
+        ndl_arena_kill(arena);
+        return "Lost remotely freed blocks";
+    }
+
+    ndl_arena_kill(arena);
+
+    return NULL;
+}
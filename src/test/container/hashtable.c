@@ -41,7 +41,7 @@ char *ndl_test_hashtable_it(void) {
     if (table == NULL)
         return "Failed to allocate table";
 
-    if (ndl_hashtable_msize(sizeof(int), sizeof(int), 16) != 224) {
+    if (ndl_hashtable_msize(sizeof(int), sizeof(int), 16) != 208) {
         ndl_hashtable_print(table);
         ndl_hashtable_kill(table);
         return "Required wrong amount of memory";
@@ -114,3 +114,73 @@ char *ndl_test_hashtable_it(void) {
 
     return 0;
 }
+
+/* Total displacement under linear probing doesn't depend on insertion order,
+ * so a table churned with deletes must match one built fresh from its keys.
+ */
+char *ndl_test_hashtable_churn(void) {
+
+    uint64_t live = 40, cap = 64;
+
+    ndl_hashtable *table = ndl_hashtable_init(sizeof(uint64_t), sizeof(uint64_t), cap);
+    ndl_hashtable *fresh = ndl_hashtable_init(sizeof(uint64_t), sizeof(uint64_t), cap);
+    if (table == NULL || fresh == NULL) {
+        ndl_hashtable_kill(table);
+        ndl_hashtable_kill(fresh);
+        return "Failed to allocate table";
+    }
+
+    uint64_t i, j;
+    for (i = 0; i < 10000; i++) {
+
+        uint64_t key = i * 7919;
+        if (ndl_hashtable_put(table, &key, &i) == NULL) {
+            ndl_hashtable_kill(table);
+            ndl_hashtable_kill(fresh);
+            return "Failed to put item";
+        }
+
+        if (i < live)
+            continue;
+
+        key = (i - live) * 7919;
+        if (ndl_hashtable_del(table, &key) != 0) {
+            ndl_hashtable_kill(table);
+            ndl_hashtable_kill(fresh);
+            return "Failed to delete item";
+        }
+
+        for (j = i - live + 1; j <= i; j++) {
+            key = j * 7919;
+            uint64_t *val = ndl_hashtable_get(table, &key);
+            if (val == NULL || *val != j) {
+                ndl_hashtable_print(table);
+                ndl_hashtable_kill(table);
+                ndl_hashtable_kill(fresh);
+                return "Lost an item after deleting";
+            }
+        }
+    }
+
+    void *curr = ndl_hashtable_pairs_head(table);
+    while (curr != NULL) {
+        ndl_hashtable_put(fresh, ndl_hashtable_pairs_key(table, curr),
+                          ndl_hashtable_pairs_val(table, curr));
+        curr = ndl_hashtable_pairs_next(table, curr);
+    }
+
+    ndl_hashtable_stats churned, built;
+    ndl_hashtable_probe_stats(table, &churned);
+    ndl_hashtable_probe_stats(fresh, &built);
+
+    ndl_hashtable_kill(table);
+    ndl_hashtable_kill(fresh);
+
+    if (churned.size != live || built.size != live)
+        return "Wrong number of items after churn";
+
+    if (churned.probes != built.probes)
+        return "Deletion left probe sequences longer than a fresh table";
+
+    return NULL;
+}
@@ -4,6 +4,7 @@
 #include "test.h"
 
 #include "hashtable.h"
+#include "ndltime.h"
 
 char *ndl_test_rehashtable_alloc(void) {
 
@@ -46,7 +47,7 @@ char *ndl_test_rehashtable_it(void) {
     if (table == NULL)
         return "Failed to allocate table";
 
-    if (ndl_rhashtable_msize(sizeof(int), sizeof(int), 16) != 16) {
+    if (ndl_rhashtable_msize(sizeof(int), sizeof(int), 16) != 48) {
         ndl_rhashtable_print(table);
         ndl_rhashtable_kill(table);
         return "Required wrong amount of memory";
@@ -181,3 +182,146 @@ char *ndl_test_rehashtable_volume(void) {
 
     return 0;
 }
+
+char *ndl_test_rehashtable_incremental(void) {
+
+    ndl_rhashtable *table = ndl_rhashtable_init(sizeof(uint64_t), sizeof(uint64_t), 8);
+    if (table == NULL)
+        return "Failed to allocate table";
+
+    ndl_rhashtable_incremental(table, 1);
+
+    /* Check every operation against both tables, mid-migration. */
+    int migrated = 0;
+    uint64_t i, j;
+    for (i = 1; i <= 2000; i++) {
+
+        uint64_t val = i * 3;
+        if (ndl_rhashtable_put(table, &i, &val) == NULL) {
+            ndl_rhashtable_kill(table);
+            return "Failed to put item";
+        }
+
+        if (!ndl_rhashtable_migrating(table))
+            continue;
+        migrated = 1;
+
+        for (j = 1; j <= i; j++) {
+            uint64_t *got = ndl_rhashtable_get(table, &j);
+            if (got == NULL || *got != j * 3) {
+                ndl_rhashtable_print(table);
+                ndl_rhashtable_kill(table);
+                return "Lost an item while migrating";
+            }
+        }
+
+        uint64_t count = 0;
+        void *curr = ndl_rhashtable_pairs_head(table);
+        while (curr != NULL) {
+            count++;
+            curr = ndl_rhashtable_pairs_next(table, curr);
+        }
+
+        if (count != i || ndl_rhashtable_size(table) != i) {
+            ndl_rhashtable_kill(table);
+            return "Iteration saw the wrong number of items while migrating";
+        }
+    }
+
+    if (!migrated) {
+        ndl_rhashtable_kill(table);
+        return "Never observed a migration in progress";
+    }
+
+    /* Overwrite, then delete down through shrinking migrations. */
+    for (i = 1; i <= 2000; i++) {
+        uint64_t val = i;
+        ndl_rhashtable_put(table, &i, &val);
+    }
+
+    for (i = 1; i <= 1990; i++) {
+
+        if (ndl_rhashtable_del(table, &i) != 0) {
+            ndl_rhashtable_kill(table);
+            return "Failed to delete item";
+        }
+
+        if (ndl_rhashtable_get(table, &i) != NULL) {
+            ndl_rhashtable_kill(table);
+            return "Deleted item still present";
+        }
+
+        j = 2000;
+        uint64_t *got = ndl_rhashtable_get(table, &j);
+        if (got == NULL || *got != 2000) {
+            ndl_rhashtable_kill(table);
+            return "Lost an item while shrinking";
+        }
+    }
+
+    if (ndl_rhashtable_size(table) != 10) {
+        ndl_rhashtable_kill(table);
+        return "Wrong number of items after deleting";
+    }
+
+    ndl_rhashtable_incremental(table, 0);
+    if (ndl_rhashtable_migrating(table) || ndl_rhashtable_cap(table) > 64) {
+        ndl_rhashtable_kill(table);
+        return "Disabling incremental mode didn't finish the migration";
+    }
+
+    ndl_rhashtable_kill(table);
+
+    return NULL;
+}
+
+/* Worst-case single put() over a million inserts. The last stop-the-world
+ * resize here copies ~800K pairs, ~10-100ms; incremental puts should stay
+ * orders of magnitude under the bound. Best of a few runs, to ignore
+ * preemption.
+ */
+#define NDL_TEST_RHASHTABLE_OPS (1 << 20)
+#define NDL_TEST_RHASHTABLE_MAX_USEC 5000
+#define NDL_TEST_RHASHTABLE_RUNS 3
+
+char *ndl_test_rehashtable_latency(void) {
+
+    int64_t best = -1;
+
+    int run;
+    for (run = 0; run < NDL_TEST_RHASHTABLE_RUNS; run++) {
+
+        ndl_rhashtable *table = ndl_rhashtable_init(sizeof(uint64_t), sizeof(uint64_t), 8);
+        if (table == NULL)
+            return "Failed to allocate table";
+
+        ndl_rhashtable_incremental(table, 1);
+
+        int64_t worst = 0;
+        uint64_t i;
+        for (i = 1; i <= NDL_TEST_RHASHTABLE_OPS; i++) {
+
+            ndl_time start = ndl_time_get();
+            void *ret = ndl_rhashtable_put(table, &i, &i);
+            int64_t usec = ndl_time_to_usec(ndl_time_sub(ndl_time_get(), start));
+
+            if (ret == NULL) {
+                ndl_rhashtable_kill(table);
+                return "Failed to put item";
+            }
+
+            if (usec > worst)
+                worst = usec;
+        }
+
+        ndl_rhashtable_kill(table);
+
+        if (best < 0 || worst < best)
+            best = worst;
+
+        if (best <= NDL_TEST_RHASHTABLE_MAX_USEC)
+            return NULL;
+    }
+
+    return "Worst-case put() latency over bound";
+}
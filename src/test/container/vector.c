@@ -97,6 +97,14 @@ char *ndl_test_vector_stack(void) {
         return "Wrong number of elements";
     }
 
+    /* Popping shrinks the backend; what's left must survive it. */
+    for (i = 0; i < 25; i++) {
+        if (*((int *) ndl_vector_get(vec, (uint64_t) i)) != i) {
+            ndl_vector_kill(vec);
+            return "Lost elements after shrinking";
+        }
+    }
+
     ndl_vector_kill(vec);
 
     return NULL;
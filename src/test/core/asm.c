@@ -28,3 +28,32 @@ char *ndl_test_asm_syntax(void) {
 
     return 0;
 }
+
+char *ndl_test_asm_symbols(void) {
+
+    char *src =
+        "add A_1, 1 -> Bz9 | x=:Loop \n"
+        "Loop:                       \n"
+        "sub Bz9, 1 -> Bz9           \n";
+
+    ndl_asm_result res = ndl_asm_parse(src, NULL);
+    if (res.msg != NULL) {
+        ndl_asm_print_err(res);
+        return "Failed to assemble program";
+    }
+
+    ndl_value syma = ndl_graph_get(res.graph, res.inst_head, NDL_SYM("syma    "));
+    ndl_value x = ndl_graph_get(res.graph, res.inst_head, NDL_SYM("x       "));
+    ndl_value next = ndl_graph_get(res.graph, res.inst_head, NDL_SYM("next    "));
+
+    int ok = (NDL_VALUE_TYPE(syma) == EVAL_SYM) && (NDL_VALUE_SYM(syma) == NDL_SYM("A_1     ")) &&
+             (NDL_VALUE_TYPE(x) == EVAL_REF) && (NDL_VALUE_TYPE(next) == EVAL_REF) &&
+             (NDL_VALUE_REF(x) == NDL_VALUE_REF(next));
+
+    ndl_graph_kill(res.graph);
+
+    if (!ok)
+        return "Symbols or labels didn't survive assembly";
+
+    return 0;
+}
@@ -0,0 +1,140 @@
+#include "test.h"
+
+#include "backrefs.h"
+
+char *ndl_test_backrefs_alloc(void) {
+
+    ndl_backrefs *set = ndl_backrefs_init();
+    if (set == NULL)
+        return "Failed to allocate backref set";
+
+    if ((ndl_backrefs_size(set) != 0) || (ndl_backrefs_head(set) != NULL)) {
+        ndl_backrefs_kill(set);
+        return "New set isn't empty";
+    }
+
+    ndl_backrefs_kill(set);
+
+    return NULL;
+}
+
+/* Fill to count sources (source i referencing i times, capped at 3),
+ * check every count and the iterator's total, then drain.
+ */
+static char *ndl_test_backrefs_fill(uint64_t count) {
+
+    ndl_backrefs set;
+    ndl_backrefs_minit(&set);
+
+    uint64_t i, j, refs = 0;
+    for (i = 1; i <= count; i++) {
+        for (j = 0; j < ((i < 3)? i : 3); j++, refs++) {
+            if (ndl_backrefs_add(&set, NULL, (ndl_ref) (i << 32)) != 0) {
+                ndl_backrefs_mkill(&set, NULL);
+                return "Failed to add backref";
+            }
+        }
+    }
+
+    if (ndl_backrefs_size(&set) != count) {
+        ndl_backrefs_mkill(&set, NULL);
+        return "Wrong number of sources";
+    }
+
+    for (i = 1; i <= count; i++) {
+        if (ndl_backrefs_count(&set, (ndl_ref) (i << 32)) != ((i < 3)? i : 3)) {
+            ndl_backrefs_mkill(&set, NULL);
+            return "Wrong count for a 64 bit source";
+        }
+    }
+
+    uint64_t total = 0, seen = 0;
+    void *curr = ndl_backrefs_head(&set);
+    while (curr != NULL) {
+        ndl_ref ref = ndl_backrefs_ref(&set, curr);
+        uint64_t num = ndl_backrefs_refs(&set, curr);
+        if (num != ndl_backrefs_count(&set, ref)) {
+            ndl_backrefs_mkill(&set, NULL);
+            return "Iterator disagrees with count()";
+        }
+        total += num;
+        seen++;
+        curr = ndl_backrefs_next(&set, curr);
+    }
+
+    if ((seen != count) || (total != refs)) {
+        ndl_backrefs_mkill(&set, NULL);
+        return "Iteration missed sources";
+    }
+
+    /* Drain from the front, through every representation. */
+    for (i = 1; i <= count; i++) {
+        for (j = 0; j < ((i < 3)? i : 3); j++) {
+            if (ndl_backrefs_rm(&set, NULL, (ndl_ref) (i << 32)) != 0) {
+                ndl_backrefs_mkill(&set, NULL);
+                return "Failed to remove backref";
+            }
+        }
+
+        if ((ndl_backrefs_count(&set, (ndl_ref) (i << 32)) != 0) ||
+            (ndl_backrefs_size(&set) != count - i)) {
+            ndl_backrefs_mkill(&set, NULL);
+            return "Source survived removal";
+        }
+    }
+
+    if ((ndl_backrefs_rm(&set, NULL, 1) == 0) || (set.cap != 0)) {
+        ndl_backrefs_mkill(&set, NULL);
+        return "Empty set didn't return to inline form";
+    }
+
+    ndl_backrefs_mkill(&set, NULL);
+
+    return NULL;
+}
+
+char *ndl_test_backrefs_small(void) {
+
+    char *err = ndl_test_backrefs_fill(1);
+    if (err == NULL)
+        err = ndl_test_backrefs_fill(2);
+    if (err == NULL)
+        err = ndl_test_backrefs_fill(NDL_BACKREFS_LIST_MAX);
+
+    return err;
+}
+
+char *ndl_test_backrefs_hub(void) {
+
+    char *err = ndl_test_backrefs_fill(NDL_BACKREFS_LIST_MAX + 1);
+    if (err == NULL)
+        err = ndl_test_backrefs_fill(100000);
+
+    if (err != NULL)
+        return err;
+
+    ndl_backrefs set;
+    ndl_backrefs_minit(&set);
+
+    uint64_t i;
+    for (i = 1; i <= 1000; i++)
+        ndl_backrefs_put(&set, NULL, (ndl_ref) i, i);
+
+    if ((set.cap != NDL_BACKREFS_HASHED) || (ndl_backrefs_count(&set, 500) != 500)) {
+        ndl_backrefs_mkill(&set, NULL);
+        return "put() didn't build a hashed set";
+    }
+
+    for (i = 1; i <= 995; i++)
+        ndl_backrefs_put(&set, NULL, (ndl_ref) i, 0);
+
+    if ((set.cap == NDL_BACKREFS_HASHED) || (ndl_backrefs_size(&set) != 5) ||
+        (ndl_backrefs_count(&set, 1000) != 1000)) {
+        ndl_backrefs_mkill(&set, NULL);
+        return "Shrunken set didn't return to an array";
+    }
+
+    ndl_backrefs_mkill(&set, NULL);
+
+    return NULL;
+}
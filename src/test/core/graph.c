@@ -1,6 +1,12 @@
 #include "test.h"
 
 #include "graph.h"
+#include "nodepool.h"
+#include "ndlendian.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
 
 char *ndl_test_graph_alloc(void) {
 
@@ -217,3 +223,1458 @@ char *ndl_test_graph_backref(void) {
 
     return NULL;
 }
+
+char *ndl_test_graph_metadata(void) {
+
+    ndl_graph *graph = ndl_graph_init();
+    if (graph == NULL)
+        return "Failed to allocate graph";
+
+    ndl_ref a = ndl_graph_alloc(graph);
+    ndl_ref aa = ndl_graph_salloc(graph, a, NDL_SYM("next    "));
+    if ((a == NDL_NULL_REF) || (aa == NDL_NULL_REF)) {
+        ndl_graph_print(graph);
+        ndl_graph_kill(graph);
+        return "Failed to allocate nodes";
+    }
+
+    int err = ndl_graph_set(graph, a, NDL_SYM("self    "), NDL_VALUE(EVAL_REF, ref=a));
+    err |= ndl_graph_set(graph, aa, NDL_SYM("back    "), NDL_VALUE(EVAL_REF, ref=a));
+    if (err != 0) {
+        ndl_graph_print(graph);
+        ndl_graph_kill(graph);
+        return "Failed to add references";
+    }
+
+    /* Marks and backrefs must not show up as keys. */
+    if ((ndl_graph_size(graph, a) != 2) || (ndl_graph_size(graph, aa) != 1) ||
+        (ndl_graph_index(graph, aa, 0) != NDL_SYM("back    ")) ||
+        (ndl_graph_index(graph, aa, 1) != NDL_NULL_SYM)) {
+        ndl_graph_print(graph);
+        ndl_graph_kill(graph);
+        return "Metadata visible among keys";
+    }
+
+    uint64_t total = 0;
+    void *curr = ndl_graph_backref_head(graph, a);
+    while (curr != NULL) {
+        ndl_ref src = ndl_graph_backref_node(graph, a, curr);
+        if ((src != a) && (src != aa)) {
+            ndl_graph_print(graph);
+            ndl_graph_kill(graph);
+            return "Got bad backref source";
+        }
+        total += ndl_graph_backref_count(graph, a, curr);
+        curr = ndl_graph_backref_next(graph, a, curr);
+    }
+
+    if (total != 2) {
+        ndl_graph_print(graph);
+        ndl_graph_kill(graph);
+        return "Got wrong backref total";
+    }
+
+    uint64_t len = ndl_graph_mem_est(graph);
+    void *mem = malloc(len);
+    if (mem == NULL) {
+        ndl_graph_kill(graph);
+        return "Out of memory, couldn't run test";
+    }
+
+    int64_t used = ndl_graph_to_mem(graph, len, mem);
+    ndl_graph *copy = (used < 0)? NULL : ndl_graph_from_mem((uint64_t) used, mem);
+    free(mem);
+    ndl_graph_kill(graph);
+
+    if (copy == NULL)
+        return "Failed to serialize and reload graph";
+
+    if ((ndl_graph_stat(copy, a) != 1) || (ndl_graph_stat(copy, aa) != 0) ||
+        (ndl_graph_size(copy, a) != 2) ||
+        (ndl_graph_backrefs(copy, a, aa) != 1) || (ndl_graph_backrefs(copy, aa, a) != 1)) {
+        ndl_graph_print(copy);
+        ndl_graph_kill(copy);
+        return "Reloaded graph lost metadata";
+    }
+
+    ndl_graph_kill(copy);
+
+    return NULL;
+}
+
+char *ndl_test_graph_deep(void) {
+
+    ndl_graph *graph = ndl_graph_init();
+    if (graph == NULL)
+        return "Failed to allocate graph";
+
+    /* Deep enough to overflow the C stack, if marking recursed. */
+    ndl_ref root = ndl_graph_alloc(graph);
+    ndl_ref prev = root;
+
+    int i;
+    for (i = 0; i < 500000; i++) {
+        prev = ndl_graph_salloc(graph, prev, NDL_SYM("next    "));
+        if (prev == NDL_NULL_REF) {
+            ndl_graph_kill(graph);
+            return "Failed to build chain";
+        }
+    }
+
+    ndl_graph_clean(graph);
+    if (ndl_graph_stat(graph, prev) != 0) {
+        ndl_graph_kill(graph);
+        return "Cleaned a reachable node";
+    }
+
+    ndl_graph_unmark(graph, root);
+    ndl_graph_clean(graph);
+    if ((ndl_graph_stat(graph, root) != -1) || (ndl_graph_stat(graph, prev) != -1)) {
+        ndl_graph_kill(graph);
+        return "Failed to clean unreachable chain";
+    }
+
+    ndl_graph_kill(graph);
+
+    return NULL;
+}
+
+static uint64_t ndl_test_graph_rand(uint64_t *state) {
+
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+
+    return *state = x;
+}
+
+/* A few roots, random edges between nodes, and a lot of garbage. */
+static ndl_graph *ndl_test_graph_random(uint64_t count) {
+
+    ndl_graph *graph = ndl_graph_init();
+    if (graph == NULL)
+        return NULL;
+
+    uint64_t state = 0x9E3779B97F4A7C15;
+
+    /* Ids are handed out lowest-first, from 1. */
+    uint64_t i;
+    for (i = 0; i < count; i++) {
+
+        ndl_ref node = ((i % 64) == 0)? ndl_graph_alloc(graph)
+                                      : ndl_graph_salloc(graph, (ndl_ref) (ndl_test_graph_rand(&state) % i + 1),
+                                                         NDL_SYM("child   "));
+        if (node == NDL_NULL_REF)
+            break;
+
+        ndl_ref other = (ndl_ref) (ndl_test_graph_rand(&state) % (i + 1) + 1);
+        if ((ndl_test_graph_rand(&state) % 4) == 0)
+            ndl_graph_set(graph, node, NDL_SYM("rand    "), NDL_VALUE(EVAL_REF, ref=other));
+
+        if ((ndl_test_graph_rand(&state) % 8) == 0)
+            ndl_graph_unmark(graph, node);
+    }
+
+    if (i != count) {
+        ndl_graph_kill(graph);
+        return NULL;
+    }
+
+    return graph;
+}
+
+char *ndl_test_graph_parallel(void) {
+
+    ndl_graph *serial = ndl_test_graph_random(20000);
+    if (serial == NULL)
+        return "Failed to build graph";
+
+    ndl_graph *parallel = ndl_test_graph_random(20000);
+    if (parallel == NULL) {
+        ndl_graph_kill(serial);
+        return "Failed to build graph";
+    }
+
+    ndl_graph_set_threads(parallel, 4);
+
+    int round;
+    for (round = 0; round < 3; round++) {
+
+        ndl_graph_clean(serial);
+        ndl_graph_clean(parallel);
+
+        ndl_ref node;
+        for (node = 1; node <= 20000; node++) {
+            if (ndl_graph_stat(serial, node) != ndl_graph_stat(parallel, node)) {
+                ndl_graph_kill(serial);
+                ndl_graph_kill(parallel);
+                return "Parallel clean disagrees with serial clean";
+            }
+        }
+
+        /* Drop some roots, so the next round has new garbage. */
+        for (node = round + 1; node <= 20000; node += 128) {
+            ndl_graph_unmark(serial, node);
+            ndl_graph_unmark(parallel, node);
+        }
+    }
+
+    ndl_graph_kill(serial);
+    ndl_graph_kill(parallel);
+
+    return NULL;
+}
+
+/* Follow up to len random references from node. */
+static ndl_ref ndl_test_graph_walk(ndl_graph *graph, ndl_ref node, uint64_t len, uint64_t *state) {
+
+    uint64_t i;
+    for (i = 0; i < len; i++) {
+
+        int64_t size = ndl_graph_size(graph, node);
+        if (size <= 0)
+            break;
+
+        ndl_sym key = ndl_graph_index(graph, node, (int64_t) (ndl_test_graph_rand(state) % (uint64_t) size));
+        ndl_value val = ndl_graph_get(graph, node, key);
+        if ((NDL_VALUE_TYPE(val) != EVAL_REF) || (NDL_VALUE_REF(val) == NDL_NULL_REF))
+            break;
+
+        node = NDL_VALUE_REF(val);
+    }
+
+    return node;
+}
+
+/* Whether exactly the nodes reachable from roots are left, among ids below max. */
+static int ndl_test_graph_exact(ndl_graph *graph, ndl_ref max, int exact) {
+
+    uint8_t *seen = calloc((uint64_t) max, 1);
+    ndl_ref *stack = malloc((uint64_t) max * sizeof(ndl_ref));
+    if ((seen == NULL) || (stack == NULL)) {
+        free(seen);
+        free(stack);
+        return 0;
+    }
+
+    uint64_t top = 0;
+
+    ndl_ref node;
+    for (node = 1; node < max; node++) {
+        if (ndl_graph_stat(graph, node) == 1) {
+            seen[node] = 1;
+            stack[top++] = node;
+        }
+    }
+
+    while (top > 0) {
+
+        node = stack[--top];
+
+        int64_t i, size = ndl_graph_size(graph, node);
+        for (i = 0; i < size; i++) {
+            ndl_value val = ndl_graph_get(graph, node, ndl_graph_index(graph, node, i));
+            if ((NDL_VALUE_TYPE(val) == EVAL_REF) && (NDL_VALUE_REF(val) > 0) && (NDL_VALUE_REF(val) < max) && !seen[NDL_VALUE_REF(val)]) {
+                seen[NDL_VALUE_REF(val)] = 1;
+                stack[top++] = NDL_VALUE_REF(val);
+            }
+        }
+    }
+
+    int ret = 1;
+    for (node = 1; node < max; node++) {
+        int alive = ndl_graph_stat(graph, node) != -1;
+        if ((seen[node] && !alive) || (exact && !seen[node] && alive))
+            ret = 0;
+    }
+
+    free(seen);
+    free(stack);
+
+    return ret;
+}
+
+char *ndl_test_graph_incremental(void) {
+
+    ndl_graph *graph = ndl_test_graph_random(20000);
+    if (graph == NULL)
+        return "Failed to build graph";
+
+    ndl_ref roots[64];
+    uint64_t root_count = 0;
+
+    ndl_ref node;
+    for (node = 1; (node <= 20000) && (root_count < 64); node++)
+        if (ndl_graph_stat(graph, node) == 1)
+            roots[root_count++] = node;
+
+    if (root_count == 0) {
+        ndl_graph_kill(graph);
+        return "Built a graph without roots";
+    }
+
+    /* Between small steps, move references around behind the collector,
+     * hang new nodes off reachable ones, and drop some references.
+     */
+    uint64_t state = 0x2545F4914F6CDD1D;
+    uint64_t steps = 0;
+
+    int done = 0;
+    while (done == 0) {
+
+        done = ndl_graph_clean_step(graph, 16);
+        steps++;
+
+        ndl_ref from = ndl_test_graph_walk(graph, roots[ndl_test_graph_rand(&state) % root_count], 8, &state);
+        ndl_ref to = ndl_test_graph_walk(graph, roots[ndl_test_graph_rand(&state) % root_count], 8, &state);
+        ndl_ref moved = ndl_test_graph_walk(graph, from, 1, &state);
+
+        int64_t size = ndl_graph_size(graph, from);
+        if ((moved != from) && (size > 0)) {
+            ndl_graph_set(graph, to, NDL_SYM("moved   "), NDL_VALUE(EVAL_REF, ref=moved));
+            ndl_graph_del(graph, from, ndl_graph_index(graph, from, 0));
+        }
+
+        if ((steps % 4) == 0)
+            ndl_graph_salloc(graph, to, NDL_SYM("new     "));
+    }
+
+    if (done != 1) {
+        ndl_graph_kill(graph);
+        return "Incremental clean failed";
+    }
+
+    if (steps < 100) {
+        ndl_graph_kill(graph);
+        return "Incremental clean didn't split the work";
+    }
+
+    if (!ndl_test_graph_exact(graph, 40000, 0)) {
+        ndl_graph_kill(graph);
+        return "Incremental clean freed a reachable node";
+    }
+
+    /* Left alone, a collection frees all the garbage. */
+    if ((ndl_graph_clean_step(graph, 0) != 1) || ndl_graph_clean_busy(graph) ||
+        !ndl_test_graph_exact(graph, 40000, 1)) {
+        ndl_graph_kill(graph);
+        return "Incremental clean left garbage";
+    }
+
+    ndl_graph_kill(graph);
+
+    /* Marks saved by a few collections mustn't pass for the reloaded
+     * graph's own: what's hung off a saved node is still reached.
+     */
+    graph = ndl_graph_init();
+    if (graph == NULL)
+        return "Failed to allocate graph";
+
+    ndl_ref a = ndl_graph_salloc(graph, ndl_graph_alloc(graph), NDL_SYM("a       "));
+    ndl_graph_salloc(graph, a, NDL_SYM("b       "));
+
+    int i;
+    for (i = 0; i < 5; i++)
+        ndl_graph_clean_step(graph, 0);
+
+    uint64_t len = ndl_graph_mem_est(graph);
+    uint8_t *mem = malloc(len);
+    int64_t used = (mem != NULL)? ndl_graph_to_mem(graph, len, mem) : -1;
+    ndl_graph_kill(graph);
+
+    graph = (used > 0)? ndl_graph_from_mem((uint64_t) used, mem) : NULL;
+    free(mem);
+
+    if (graph == NULL)
+        return "Failed to reload graph";
+
+    ndl_ref c = ndl_graph_salloc(graph, a, NDL_SYM("c       "));
+    while ((done = ndl_graph_clean_step(graph, 1)) == 0);
+
+    if ((done != 1) || (ndl_graph_stat(graph, c) != 0) ||
+        !ndl_test_graph_exact(graph, 8, 1)) {
+        ndl_graph_kill(graph);
+        return "Incremental clean after reloading freed a reachable node";
+    }
+
+    ndl_graph_kill(graph);
+
+    return NULL;
+}
+
+char *ndl_test_graph_minor(void) {
+
+    ndl_graph *graph = ndl_graph_init();
+    if (graph == NULL)
+        return "Failed to allocate graph";
+
+    /* An old chain. */
+    ndl_ref root = ndl_graph_alloc(graph);
+    ndl_ref old = root;
+
+    int i;
+    for (i = 0; i < 1000; i++)
+        old = ndl_graph_salloc(graph, old, NDL_SYM("next    "));
+
+    ndl_graph_clean(graph);
+    if ((old == NDL_NULL_REF) || (ndl_graph_young(graph) != 0)) {
+        ndl_graph_kill(graph);
+        return "Full clean didn't make nodes old";
+    }
+
+    /* Young garbage, and young nodes kept by old or young references. */
+    ndl_ref temp = ndl_graph_alloc(graph);
+    ndl_ref last = temp;
+    for (i = 0; i < 1000; i++)
+        last = ndl_graph_salloc(graph, temp, (ndl_sym) (i + 1));
+
+    ndl_ref kept = ndl_graph_salloc(graph, root, NDL_SYM("young   "));
+    ndl_ref deep = ndl_graph_salloc(graph, kept, NDL_SYM("young   "));
+    ndl_graph_set(graph, old, NDL_SYM("moved   "), NDL_VALUE(EVAL_REF, ref=last));
+    ndl_graph_unmark(graph, temp);
+
+    if ((ndl_graph_clean_minor(graph) != 0) ||
+        (ndl_graph_stat(graph, temp) != -1) || (ndl_graph_stat(graph, temp + 1) != -1) ||
+        (ndl_graph_stat(graph, kept) != 0) || (ndl_graph_stat(graph, deep) != 0) ||
+        (ndl_graph_stat(graph, last) != 0) || (ndl_graph_stat(graph, old) != 0) ||
+        (ndl_graph_young(graph) != 3)) {
+        ndl_graph_kill(graph);
+        return "Minor clean freed the wrong nodes";
+    }
+
+    /* A node promoted before what it references must be remembered:
+     * deep is promoted by the next clean, after only by the one after.
+     */
+    ndl_ref after = ndl_graph_salloc(graph, deep, NDL_SYM("after   "));
+    ndl_graph_clean_minor(graph);
+    ndl_graph_del(graph, root, NDL_SYM("young   "));
+    ndl_graph_set(graph, old, NDL_SYM("holder  "), NDL_VALUE(EVAL_REF, ref=kept));
+    ndl_graph_clean_minor(graph);
+
+    if ((ndl_graph_young(graph) != 0) ||
+        (ndl_graph_stat(graph, deep) != 0) || (ndl_graph_stat(graph, after) != 0)) {
+        ndl_graph_kill(graph);
+        return "Minor clean lost a node referenced by a promoted one";
+    }
+
+    if (!ndl_test_graph_exact(graph, 4000, 0)) {
+        ndl_graph_kill(graph);
+        return "Minor clean freed a reachable node";
+    }
+
+    ndl_graph_clean(graph);
+    if (!ndl_test_graph_exact(graph, 4000, 1)) {
+        ndl_graph_kill(graph);
+        return "Full clean after minor cleans left garbage";
+    }
+
+    ndl_graph_kill(graph);
+
+    return NULL;
+}
+
+char *ndl_test_graph_refcount(void) {
+
+    ndl_graph *graph = ndl_graph_init();
+    if (graph == NULL)
+        return "Failed to allocate graph";
+
+    ndl_graph_set_refcount(graph, 1);
+
+    /* Dropping the only reference to a long chain frees it, a bit
+     * per call, and the rest on clean_cycles().
+     */
+    ndl_ref root = ndl_graph_alloc(graph);
+    ndl_ref head = ndl_graph_salloc(graph, root, NDL_SYM("chain   "));
+    ndl_ref last = head;
+
+    int i;
+    for (i = 0; i < 1000; i++)
+        last = ndl_graph_salloc(graph, last, NDL_SYM("next    "));
+
+    ndl_graph_del(graph, root, NDL_SYM("chain   "));
+    if ((ndl_graph_stat(graph, head) != -1) || (ndl_graph_stat(graph, last) != 0)) {
+        ndl_graph_kill(graph);
+        return "Dropping a chain didn't free it incrementally";
+    }
+
+    if ((ndl_graph_clean_cycles(graph) != 0) || (ndl_graph_stat(graph, last) != -1)) {
+        ndl_graph_kill(graph);
+        return "Failed to free the rest of a chain";
+    }
+
+    /* Overwriting a reference frees the old target. */
+    ndl_ref a = ndl_graph_salloc(graph, root, NDL_SYM("a       "));
+    ndl_ref b = ndl_graph_salloc(graph, a, NDL_SYM("b       "));
+    ndl_graph_set(graph, root, NDL_SYM("a       "), NDL_VALUE(EVAL_INT, num=0));
+    if ((ndl_graph_stat(graph, a) != -1) || (ndl_graph_stat(graph, b) != -1)) {
+        ndl_graph_kill(graph);
+        return "Overwriting the only reference didn't free nodes";
+    }
+
+    /* A cycle, a self loop, and a cycle still referenced from a root. */
+    ndl_ref x = ndl_graph_salloc(graph, root, NDL_SYM("x       "));
+    ndl_ref y = ndl_graph_salloc(graph, x, NDL_SYM("y       "));
+    ndl_graph_set(graph, y, NDL_SYM("x       "), NDL_VALUE(EVAL_REF, ref=x));
+
+    ndl_ref self = ndl_graph_salloc(graph, root, NDL_SYM("self    "));
+    ndl_graph_set(graph, self, NDL_SYM("self    "), NDL_VALUE(EVAL_REF, ref=self));
+
+    ndl_ref held = ndl_graph_alloc(graph);
+    ndl_ref p = ndl_graph_salloc(graph, root, NDL_SYM("p       "));
+    ndl_ref q = ndl_graph_salloc(graph, p, NDL_SYM("q       "));
+    ndl_graph_set(graph, q, NDL_SYM("p       "), NDL_VALUE(EVAL_REF, ref=p));
+    ndl_graph_set(graph, held, NDL_SYM("q       "), NDL_VALUE(EVAL_REF, ref=q));
+
+    ndl_graph_del(graph, root, NDL_SYM("x       "));
+    ndl_graph_del(graph, root, NDL_SYM("self    "));
+    ndl_graph_del(graph, root, NDL_SYM("p       "));
+
+    if ((ndl_graph_stat(graph, x) != 0) || (ndl_graph_stat(graph, self) != 0) ||
+        (ndl_graph_suspects(graph) == 0)) {
+        ndl_graph_kill(graph);
+        return "Reference counting freed a cycle";
+    }
+
+    if ((ndl_graph_clean_cycles(graph) != 0) ||
+        (ndl_graph_stat(graph, x) != -1) || (ndl_graph_stat(graph, y) != -1) ||
+        (ndl_graph_stat(graph, self) != -1) ||
+        (ndl_graph_stat(graph, p) != 0) || (ndl_graph_stat(graph, q) != 0) ||
+        (ndl_graph_suspects(graph) != 0)) {
+        ndl_graph_kill(graph);
+        return "Cycle collection freed the wrong nodes";
+    }
+
+    /* Unmarking the root holding the last cycle frees everything under it. */
+    ndl_graph_unmark(graph, held);
+    ndl_graph_clean_cycles(graph);
+    if ((ndl_graph_stat(graph, held) != -1) ||
+        (ndl_graph_stat(graph, p) != -1) || (ndl_graph_stat(graph, q) != -1)) {
+        ndl_graph_kill(graph);
+        return "Failed to free a cycle under an unmarked root";
+    }
+
+    if (!ndl_test_graph_exact(graph, 2000, 1)) {
+        ndl_graph_kill(graph);
+        return "Reference counting left garbage or freed live nodes";
+    }
+
+    ndl_graph_kill(graph);
+
+    return NULL;
+}
+
+char *ndl_test_graph_lazy(void) {
+
+    ndl_graph *graph = ndl_graph_init();
+    if (graph == NULL)
+        return "Failed to allocate graph";
+
+    ndl_node_pool *pool = (ndl_node_pool *) graph->pool;
+
+    /* A live chain, and garbage referencing it. */
+    ndl_ref root = ndl_graph_alloc(graph);
+    ndl_ref last = root;
+
+    int i;
+    for (i = 0; i < 1000; i++)
+        last = ndl_graph_salloc(graph, last, NDL_SYM("next    "));
+
+    ndl_ref temp = ndl_graph_alloc(graph);
+    for (i = 0; i < 2000; i++)
+        ndl_graph_salloc(graph, temp, (ndl_sym) (i + 1));
+
+    ndl_graph_set(graph, temp, NDL_SYM("last    "), NDL_VALUE(EVAL_REF, ref=last));
+    ndl_graph_unmark(graph, temp);
+
+    /* Clean only marks; the dead read as gone until they're swept. */
+    uint64_t size = ndl_node_pool_size(pool);
+    ndl_graph_clean(graph);
+
+    if ((ndl_node_pool_size(pool) != size) || (ndl_graph_stat(graph, temp) != -1) ||
+        (ndl_graph_stat(graph, temp + 1) != -1) || (ndl_graph_stat(graph, last) != 0) ||
+        (ndl_graph_mark(graph, temp) != -1)) {
+        ndl_graph_kill(graph);
+        return "Clean swept eagerly, or dead nodes still read as live";
+    }
+
+    /* Allocs sweep a few each, and what they make survives the sweep. */
+    ndl_ref made = ndl_graph_salloc(graph, root, NDL_SYM("made    "));
+    if ((made == NDL_NULL_REF) ||
+        (ndl_node_pool_size(pool) != size + 1 - NDL_GRAPH_SWEEP_LAZY)) {
+        ndl_graph_kill(graph);
+        return "Alloc didn't sweep lazily";
+    }
+
+    if (ndl_graph_backrefs(graph, last, temp) != 0) {
+        ndl_graph_kill(graph);
+        return "Dead node still references a live one";
+    }
+
+    if ((ndl_graph_clean_sweep(graph, 0) != 1) || (ndl_graph_stat(graph, made) != 0) ||
+        (ndl_node_pool_size(pool) != 1002) || !ndl_test_graph_exact(graph, 4000, 1)) {
+        ndl_graph_kill(graph);
+        return "Sweep left garbage or freed live nodes";
+    }
+
+    /* A clean mid-sweep, marking in parallel. */
+    ndl_graph_set_threads(graph, 4);
+
+    for (i = 0; i < 2; i++) {
+
+        temp = ndl_graph_alloc(graph);
+        int j;
+        for (j = 0; j < 500; j++)
+            ndl_graph_salloc(graph, temp, (ndl_sym) (j + 1));
+        ndl_graph_unmark(graph, temp);
+
+        ndl_graph_clean(graph);
+        ndl_graph_salloc(graph, last, NDL_SYM("next    "));
+        last = NDL_VALUE_REF(ndl_graph_get(graph, last, NDL_SYM("next    ")));
+    }
+
+    if ((ndl_graph_clean_sweep(graph, 0) != 1) || (ndl_node_pool_size(pool) != 1004) ||
+        !ndl_test_graph_exact(graph, 4000, 1)) {
+        ndl_graph_kill(graph);
+        return "Clean during a sweep left garbage or freed live nodes";
+    }
+
+    ndl_graph_kill(graph);
+
+    return NULL;
+}
+
+/* Roots function for the roots test: one node, through a pointer. */
+static int ndl_test_graph_roots_fn(void *data, ndl_vector *roots) {
+
+    return (ndl_vector_push(roots, data) == NULL)? -1 : 0;
+}
+
+char *ndl_test_graph_roots(void) {
+
+    ndl_graph *graph = ndl_graph_init();
+    if (graph == NULL)
+        return "Failed to allocate graph";
+
+    /* held is referenced by nothing, and kept by the roots function alone. */
+    ndl_ref root = ndl_graph_alloc(graph);
+    ndl_ref held = ndl_graph_salloc(graph, root, NDL_SYM("held    "));
+    ndl_ref child = ndl_graph_salloc(graph, held, NDL_SYM("child   "));
+    ndl_ref other = ndl_graph_salloc(graph, root, NDL_SYM("other   "));
+    ndl_graph_del(graph, root, NDL_SYM("held    "));
+    ndl_graph_del(graph, root, NDL_SYM("other   "));
+
+    ndl_graph_set_roots(graph, &ndl_test_graph_roots_fn, &held);
+
+    ndl_graph_clean(graph);
+    ndl_graph_clean_sweep(graph, 0);
+    if ((ndl_graph_stat(graph, held) != 0) || (ndl_graph_stat(graph, child) != 0) ||
+        (ndl_graph_stat(graph, other) != -1)) {
+        ndl_graph_kill(graph);
+        return "Clean ignored the roots function";
+    }
+
+    ndl_ref young = ndl_graph_salloc(graph, child, NDL_SYM("young   "));
+    if ((ndl_graph_clean_minor(graph) != 0) || (ndl_graph_stat(graph, young) != 0)) {
+        ndl_graph_kill(graph);
+        return "Minor clean ignored the roots function";
+    }
+
+    /* Switch roots mid-collection, as a process calling into a frame
+     * does, dropping the only reference to the new one.
+     */
+    ndl_ref next = ndl_graph_salloc(graph, held, NDL_SYM("next    "));
+
+    if (ndl_graph_clean_step(graph, 1) != 0) {
+        ndl_graph_kill(graph);
+        return "Incremental clean finished in one unit";
+    }
+
+    ndl_ref prev = held;
+    held = next;
+    ndl_graph_del(graph, prev, NDL_SYM("next    "));
+
+    if ((ndl_graph_clean_step(graph, 0) != 1) ||
+        (ndl_graph_stat(graph, next) != 0) || (ndl_graph_stat(graph, prev) != -1) ||
+        (ndl_graph_stat(graph, child) != -1)) {
+        ndl_graph_kill(graph);
+        return "Incremental clean missed a root switched mid-collection";
+    }
+
+    ndl_graph_kill(graph);
+
+    return NULL;
+}
+
+/* Hash of every node's id, root marking, pairs and backref count. */
+static uint64_t ndl_test_graph_digest(ndl_graph *graph) {
+
+    ndl_node_pool *pool = (ndl_node_pool *) graph->pool;
+    uint64_t hash = 0;
+
+    void *curr = ndl_node_pool_head(pool);
+    while (curr != NULL) {
+
+        ndl_ref node = ndl_node_pool_node(pool, curr);
+        hash = hash * 31 + (uint64_t) node * 2 + (uint64_t) ndl_graph_stat(graph, node);
+        hash = hash * 31 + ndl_backrefs_size(&ndl_node_pool_node_peek(pool, node)->backrefs);
+
+        void *pair = ndl_node_pool_node_pairs_head(pool, node);
+        while (pair != NULL) {
+            hash = hash * 31 + ndl_node_pool_node_pairs_key(pool, node, pair);
+            hash = hash * 31 + NDL_VALUE_WORD(ndl_node_pool_node_pairs_val(pool, node, pair));
+            pair = ndl_node_pool_node_pairs_next(pool, node, pair);
+        }
+
+        curr = ndl_node_pool_next(pool, curr);
+    }
+
+    return hash;
+}
+
+typedef struct ndl_test_graph_reader_s {
+
+    ndl_graph *snap;
+    uint64_t digest;
+    int changed;
+
+} ndl_test_graph_reader;
+
+/* Digests a snapshot over and over, while the test writes the graph. */
+static void *ndl_test_graph_read(void *arg) {
+
+    ndl_test_graph_reader *reader = (ndl_test_graph_reader *) arg;
+
+    int i;
+    for (i = 0; i < 20; i++)
+        if (ndl_test_graph_digest(reader->snap) != reader->digest)
+            reader->changed = 1;
+
+    return NULL;
+}
+
+char *ndl_test_graph_snapshot(void) {
+
+    ndl_graph *graph = ndl_test_graph_random(4000);
+    if (graph == NULL)
+        return "Failed to build random graph";
+
+    ndl_graph_clean(graph);
+    ndl_graph_clean_sweep(graph, 0);
+
+    ndl_test_graph_reader reader = {ndl_graph_snapshot(graph), ndl_test_graph_digest(graph), 0};
+    if ((reader.snap == NULL) || !ndl_graph_readonly(reader.snap) || ndl_graph_readonly(graph)) {
+        ndl_graph_kill(graph);
+        return "Failed to take snapshot";
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, &ndl_test_graph_read, &reader) != 0) {
+        ndl_graph_kill(reader.snap);
+        ndl_graph_kill(graph);
+        return "Failed to start reader";
+    }
+
+    /* Rewire, grow and collect the graph under the reader. */
+    uint64_t state = 0x2545F4914F6CDD1D;
+    int i;
+    for (i = 0; i < 4000; i++) {
+        ndl_ref node = (ndl_ref) (ndl_test_graph_rand(&state) % 4000 + 1);
+        ndl_ref other = (ndl_ref) (ndl_test_graph_rand(&state) % 4000 + 1);
+        if (ndl_graph_stat(graph, node) == -1)
+            continue;
+        if (ndl_graph_stat(graph, other) != -1)
+            ndl_graph_set(graph, node, NDL_SYM("rand    "), NDL_VALUE(EVAL_REF, ref=other));
+        else
+            ndl_graph_del(graph, node, NDL_SYM("child   "));
+        if ((i % 1000) == 0)
+            ndl_graph_clean(graph);
+    }
+    ndl_graph_clean_sweep(graph, 0);
+
+    pthread_join(thread, NULL);
+
+    if (reader.changed || (ndl_test_graph_digest(reader.snap) != reader.digest) ||
+        (ndl_test_graph_digest(graph) == reader.digest) || !ndl_test_graph_exact(reader.snap, 4001, 1)) {
+        ndl_graph_kill(reader.snap);
+        ndl_graph_kill(graph);
+        return "Snapshot changed under the graph's writes";
+    }
+
+    /* Snapshots are read-only, and outlive their graph. */
+    ndl_ref root = 1;
+    ndl_graph_kill(graph);
+
+    if ((ndl_graph_alloc(reader.snap) != NDL_NULL_REF) ||
+        (ndl_graph_salloc(reader.snap, root, NDL_SYM("new     ")) != NDL_NULL_REF) ||
+        (ndl_graph_set(reader.snap, root, NDL_SYM("new     "), NDL_VALUE(EVAL_INT, num=1)) == 0) ||
+        (ndl_graph_unmark(reader.snap, root) == 0) || (ndl_graph_clean_step(reader.snap, 0) != -1)) {
+        ndl_graph_kill(reader.snap);
+        return "Wrote to a snapshot";
+    }
+
+    ndl_graph_clean(reader.snap);
+
+    /* A snapshot serializes like the graph it was. */
+    uint64_t size = ndl_graph_mem_est(reader.snap);
+    void *mem = malloc(size);
+    int64_t used = (mem != NULL)? ndl_graph_to_mem(reader.snap, size, mem) : -1;
+    ndl_graph *loaded = (used > 0)? ndl_graph_from_mem((uint64_t) used, mem) : NULL;
+    free(mem);
+
+    int same = (loaded != NULL) && (ndl_test_graph_digest(loaded) == reader.digest) &&
+               (ndl_test_graph_digest(reader.snap) == reader.digest);
+
+    if (loaded != NULL)
+        ndl_graph_kill(loaded);
+    ndl_graph_kill(reader.snap);
+
+    if (!same)
+        return "Snapshot didn't survive its graph, or serialize";
+
+    return NULL;
+}
+
+/* Whether new[i] is a copy of old[i], for i below count, down to
+ * references, root markings (if roots) and backrefs among them.
+ */
+static int ndl_test_graph_same(ndl_graph *to, ndl_graph *from, ndl_ref *new, ndl_ref *old,
+                               uint64_t count, int roots) {
+
+    ndl_ref max = 0;
+    uint64_t i;
+    for (i = 0; i < count; i++)
+        max = (old[i] > max)? old[i] : max;
+
+    ndl_ref *map = calloc((uint64_t) max + 1, sizeof(ndl_ref));
+    if (map == NULL)
+        return 0;
+
+    for (i = 0; i < count; i++)
+        map[old[i]] = new[i];
+
+    int ret = 1;
+    for (i = 0; ret && (i < count); i++) {
+
+        int64_t j, size = ndl_graph_size(from, old[i]);
+        if ((size != ndl_graph_size(to, new[i])) ||
+            (roots && (ndl_graph_stat(from, old[i]) != ndl_graph_stat(to, new[i]))))
+            ret = 0;
+
+        for (j = 0; ret && (j < size); j++) {
+
+            ndl_sym key = ndl_graph_index(from, old[i], j);
+            ndl_value a = ndl_graph_get(from, old[i], key);
+            ndl_value b = ndl_graph_get(to, new[i], key);
+
+            /* References to nodes outside old aren't checked. */
+            if (NDL_VALUE_TYPE(a) != NDL_VALUE_TYPE(b))
+                ret = 0;
+            else if (NDL_VALUE_TYPE(a) != EVAL_REF)
+                ret = (NDL_VALUE_WORD(a) == NDL_VALUE_WORD(b));
+            else if ((NDL_VALUE_REF(a) > 0) && (NDL_VALUE_REF(a) <= max) && (map[NDL_VALUE_REF(a)] != 0))
+                ret = (map[NDL_VALUE_REF(a)] == NDL_VALUE_REF(b));
+        }
+
+        void *curr = ndl_graph_backref_head(from, old[i]);
+        while (ret && (curr != NULL)) {
+
+            ndl_ref src = ndl_graph_backref_node(from, old[i], curr);
+            if ((src <= max) && (map[src] != 0) &&
+                (ndl_graph_backrefs(to, new[i], map[src]) != ndl_graph_backref_count(from, old[i], curr)))
+                ret = 0;
+
+            curr = ndl_graph_backref_next(from, old[i], curr);
+        }
+    }
+
+    free(map);
+
+    return ret;
+}
+
+char *ndl_test_graph_copy(void) {
+
+    ndl_graph *from = ndl_test_graph_random(4000);
+    ndl_graph *to = ndl_graph_init();
+    if ((from == NULL) || (to == NULL)) {
+        ndl_graph_kill(from);
+        ndl_graph_kill(to);
+        return "Failed to allocate graphs";
+    }
+
+    /* Offset the copy's ids, and promote a node. */
+    ndl_graph_alloc(to);
+    ndl_graph_alloc(to);
+
+    int i;
+    for (i = 0; i < 20; i++)
+        ndl_graph_set(from, 1, (ndl_sym) (i + 1), NDL_VALUE(EVAL_REF, ref=(ndl_ref) (i + 100)));
+
+    uint64_t count = ndl_node_pool_size((ndl_node_pool *) from->pool);
+    ndl_ref *old = malloc((count + 1) * sizeof(ndl_ref));
+    ndl_ref *new = malloc((count + 1) * sizeof(ndl_ref));
+
+    uint64_t j = 0;
+    void *curr = ndl_node_pool_head((ndl_node_pool *) from->pool);
+    for (; curr != NULL; curr = ndl_node_pool_next((ndl_node_pool *) from->pool, curr))
+        old[j] = new[j] = ndl_node_pool_node((ndl_node_pool *) from->pool, curr), j++;
+    new[count] = NDL_NULL_REF;
+
+    if ((ndl_graph_copy(to, from, new) != (int) count) || (new[0] == old[0]) ||
+        !ndl_test_graph_same(to, from, new, old, count, 1)) {
+        free(old);
+        free(new);
+        ndl_graph_kill(from);
+        ndl_graph_kill(to);
+        return "Copy didn't preserve the graph's structure";
+    }
+
+    free(old);
+    free(new);
+    ndl_graph_kill(to);
+
+    /* dcopy() a chain deeper than any stack, off one of the roots. */
+    ndl_ref last = 1;
+    for (i = 0; i < 200000; i++)
+        last = ndl_graph_salloc(from, last, NDL_SYM("chain   "));
+
+    ndl_graph_clean(from);
+    ndl_graph_clean_sweep(from, 0);
+
+    to = ndl_graph_init();
+    ndl_ref roots[3] = {1, last, NDL_NULL_REF};
+    ndl_ref olds[2] = {1, last};
+
+    if ((ndl_graph_dcopy(to, from, roots) != 2) || !ndl_test_graph_same(to, from, roots, olds, 2, 0) ||
+        (ndl_graph_stat(to, roots[0]) != 1) || (ndl_graph_stat(to, roots[1]) != 1) ||
+        !ndl_test_graph_exact(to, (ndl_ref) ndl_node_pool_span((ndl_node_pool *) to->pool), 1)) {
+        ndl_graph_kill(from);
+        ndl_graph_kill(to);
+        return "Dcopy didn't copy exactly what the roots reach";
+    }
+
+    /* Everything copied is reachable from the roots; check the chain's length. */
+    uint64_t length = 0;
+    ndl_ref node = roots[0];
+    while ((node = NDL_VALUE_REF(ndl_graph_get(to, node, NDL_SYM("chain   ")))) != roots[1])
+        length++;
+
+    ndl_graph_kill(from);
+    ndl_graph_kill(to);
+
+    if (length != 199999)
+        return "Dcopy broke the chain";
+
+    /* Copies into a graph mid-collection survive it, even with ids below
+     * the root pass's cursor.
+     */
+    from = ndl_graph_init();
+    to = ndl_graph_init();
+    if ((from == NULL) || (to == NULL)) {
+        ndl_graph_kill(from);
+        ndl_graph_kill(to);
+        return "Failed to allocate graphs";
+    }
+
+    ndl_ref head = ndl_graph_alloc(from);
+    ndl_graph_salloc(from, ndl_graph_salloc(from, head, NDL_SYM("chain   ")), NDL_SYM("chain   "));
+
+    for (i = 0; i < 100; i++)
+        ndl_graph_alloc(to);
+    for (node = 2; node < 10; node++)
+        ndl_graph_unmark(to, node);
+
+    ndl_graph_clean(to);
+    ndl_graph_clean_sweep(to, 0);
+
+    ndl_graph_clean_step(to, 20);
+    if ((to->phase != NDL_GRAPH_MARK) || (to->cursor < 10)) {
+        ndl_graph_kill(from);
+        ndl_graph_kill(to);
+        return "Collection didn't stop mid-mark";
+    }
+
+    ndl_ref copied[2] = {head, NDL_NULL_REF};
+    ndl_ref whole[2] = {head, NDL_NULL_REF};
+    if ((ndl_graph_dcopy(to, from, copied) != 1) || (ndl_graph_copy(to, from, whole) != 3) ||
+        (copied[0] >= to->cursor) || (ndl_graph_clean_step(to, 0) != 1)) {
+        ndl_graph_kill(from);
+        ndl_graph_kill(to);
+        return "Failed to copy mid-collection";
+    }
+
+    ndl_ref tops[2] = {copied[0], whole[0]};
+    for (i = 0; i < 2; i++) {
+        length = 0;
+        for (node = tops[i]; node != NDL_NULL_REF; node = NDL_VALUE_REF(ndl_graph_get(to, node, NDL_SYM("chain   ")))) {
+            if (ndl_graph_stat(to, node) == -1)
+                break;
+            length++;
+        }
+
+        if (length != 3) {
+            ndl_graph_kill(from);
+            ndl_graph_kill(to);
+            return "Collection freed nodes copied in mid-collection";
+        }
+    }
+
+    ndl_graph_kill(from);
+    ndl_graph_kill(to);
+
+    return NULL;
+}
+
+char *ndl_test_graph_batch(void) {
+
+    /* The same random mutations, one by one and batched, on equal graphs. */
+    uint64_t count = 2000;
+    ndl_graph *one = ndl_test_graph_random(count);
+    ndl_graph *many = ndl_test_graph_random(count);
+    ndl_graph_batch *batch = (many != NULL)? ndl_graph_batch_begin(many) : NULL;
+    ndl_ref *ids = malloc(count * sizeof(ndl_ref));
+    if ((one == NULL) || (batch == NULL) || (ids == NULL)) {
+        ndl_graph_batch_abort(batch);
+        ndl_graph_kill(one);
+        ndl_graph_kill(many);
+        free(ids);
+        return "Failed to allocate graphs";
+    }
+
+    uint64_t state = 0x2545F4914F6CDD1D;
+
+    uint64_t i;
+    for (i = 0; i < count; i++)
+        ids[i] = (ndl_ref) (i + 1);
+
+    /* Enough keys to promote some nodes. */
+    for (i = 0; i < 40000; i++) {
+
+        ndl_ref node = (ndl_ref) (ndl_test_graph_rand(&state) % count + 1);
+        ndl_sym key = (ndl_sym) (ndl_test_graph_rand(&state) % ((node % 16 == 0)? 24 : 4) + 1);
+
+        uint64_t op = ndl_test_graph_rand(&state) % 4;
+        ndl_value val = (op == 0)? NDL_VALUE(EVAL_INT, num=(int64_t) i)
+                                 : NDL_VALUE(EVAL_REF, ref=(ndl_ref) (ndl_test_graph_rand(&state) % count + 1));
+
+        if (op == 3) {
+            ndl_graph_del(one, node, key);
+            ndl_graph_batch_del(batch, node, key);
+        } else {
+            ndl_graph_set(one, node, key, val);
+            ndl_graph_batch_set(batch, node, key, val);
+        }
+    }
+
+    if ((ndl_graph_batch_commit(batch) != 0) ||
+        !ndl_test_graph_same(many, one, ids, ids, count, 1) ||
+        !ndl_test_graph_same(one, many, ids, ids, count, 1)) {
+        ndl_graph_kill(one);
+        ndl_graph_kill(many);
+        free(ids);
+        return "Batch didn't match the same sets and deletes";
+    }
+
+    free(ids);
+    ndl_graph_kill(one);
+
+    /* A missing target fails the whole batch. */
+    batch = ndl_graph_batch_begin(many);
+    ndl_graph_batch_set(batch, 1, NDL_SYM("fine    "), NDL_VALUE(EVAL_INT, num=1));
+    ndl_graph_batch_set(batch, 2, NDL_SYM("bad     "), NDL_VALUE(EVAL_REF, ref=(ndl_ref) (count * 64)));
+    if ((ndl_graph_batch_commit(batch) == 0) ||
+        (NDL_VALUE_TYPE(ndl_graph_get(many, 1, NDL_SYM("fine    "))) != EVAL_NONE)) {
+        ndl_graph_kill(many);
+        return "A batch with a missing target was applied";
+    }
+
+    /* Nor can a snapshot take one. */
+    ndl_graph *snap = ndl_graph_snapshot(many);
+    batch = ndl_graph_batch_begin(snap);
+    ndl_graph_batch_set(batch, 1, NDL_SYM("fine    "), NDL_VALUE(EVAL_INT, num=1));
+    if ((ndl_graph_batch_commit(batch) == 0) ||
+        (NDL_VALUE_TYPE(ndl_graph_get(snap, 1, NDL_SYM("fine    "))) != EVAL_NONE)) {
+        ndl_graph_kill(snap);
+        ndl_graph_kill(many);
+        return "A batch was applied to a snapshot";
+    }
+
+    ndl_graph_kill(snap);
+    ndl_graph_kill(many);
+
+    /* Moving a counted node's only reference within a batch keeps it. */
+    ndl_graph *graph = ndl_graph_init();
+    if (graph == NULL)
+        return "Failed to allocate graph";
+
+    ndl_graph_set_refcount(graph, 1);
+
+    ndl_ref root = ndl_graph_alloc(graph);
+    ndl_ref child = ndl_graph_salloc(graph, root, NDL_SYM("old     "));
+
+    batch = ndl_graph_batch_begin(graph);
+    ndl_graph_batch_del(batch, root, NDL_SYM("old     "));
+    ndl_graph_batch_set(batch, root, NDL_SYM("new     "), NDL_VALUE(EVAL_REF, ref=child));
+    ndl_graph_batch_del(batch, root, NDL_SYM("missing "));
+    if ((ndl_graph_batch_commit(batch) != 0) || (ndl_graph_stat(graph, child) != 0) ||
+        (ndl_graph_backrefs(graph, child, root) != 1) ||
+        (NDL_VALUE_TYPE(ndl_graph_get(graph, root, NDL_SYM("old     "))) != EVAL_NONE)) {
+        ndl_graph_kill(graph);
+        return "Batch lost a moved reference";
+    }
+
+    batch = ndl_graph_batch_begin(graph);
+    ndl_graph_batch_set(batch, root, NDL_SYM("new     "), NDL_VALUE(EVAL_INT, num=0));
+    if ((ndl_graph_batch_commit(batch) != 0) || (ndl_graph_stat(graph, child) != -1)) {
+        ndl_graph_kill(graph);
+        return "Batch didn't release a dropped node";
+    }
+
+    /* An old node given a young one remembers it. */
+    ndl_graph_set_refcount(graph, 0);
+
+    ndl_ref old = ndl_graph_alloc(graph);
+    ndl_graph_clean(graph);
+
+    ndl_ref young = ndl_graph_alloc(graph);
+    ndl_graph_unmark(graph, young);
+
+    batch = ndl_graph_batch_begin(graph);
+    ndl_graph_batch_set(batch, old, NDL_SYM("young   "), NDL_VALUE(EVAL_REF, ref=young));
+    if ((ndl_graph_batch_commit(batch) != 0) || (ndl_graph_clean_minor(graph) != 0) ||
+        (ndl_graph_stat(graph, young) != 0)) {
+        ndl_graph_kill(graph);
+        return "Batch didn't remember an old node's young reference";
+    }
+
+    ndl_graph_kill(graph);
+
+    return NULL;
+}
+
+/* Write a number big endian, byte by byte. Returns the new offset. */
+static uint64_t ndl_test_graph_big(uint8_t *mem, uint64_t curr, uint64_t num, uint64_t bytes) {
+
+    uint64_t i;
+    for (i = 0; i < bytes; i++)
+        mem[curr + i] = (uint8_t) (num >> (8 * (bytes - 1 - i)));
+
+    return curr + bytes;
+}
+
+/* Images round trip, load in either byte order, are refused once
+ * damaged, and version 1 images still load.
+ */
+char *ndl_test_graph_format(void) {
+
+    ndl_graph *graph = ndl_test_graph_random(2000);
+    if (graph == NULL)
+        return "Failed to build graph";
+
+    /* Past the inline limit, and every value type. */
+    ndl_ref wide = ndl_graph_alloc(graph);
+    uint64_t i;
+    for (i = 0; i < 12; i++)
+        ndl_graph_set(graph, wide, (ndl_sym) i + 1, NDL_VALUE(EVAL_INT, num=(ndl_int) i));
+    ndl_graph_set(graph, wide, NDL_SYM("sym     "), NDL_VALUE(EVAL_SYM, sym=NDL_SYM("hello   ")));
+    ndl_graph_set(graph, wide, NDL_SYM("real    "), NDL_VALUE(EVAL_FLOAT, real=0.5));
+    ndl_graph_set(graph, wide, NDL_SYM("self    "), NDL_VALUE(EVAL_REF, ref=wide));
+
+    /* Marked by a few collections; only the root bit is saved. */
+    ndl_ref held = ndl_graph_salloc(graph, wide, NDL_SYM("held    "));
+    for (i = 0; i < 3; i++)
+        ndl_graph_clean_step(graph, 0);
+
+    uint64_t digest = ndl_test_graph_digest(graph);
+
+    uint64_t len = ndl_graph_mem_est(graph);
+    uint8_t *mem = malloc(len);
+    if (mem == NULL) {
+        ndl_graph_kill(graph);
+        return "Out of memory, couldn't run test";
+    }
+
+    int64_t used = ndl_graph_to_mem(graph, len, mem);
+    ndl_graph_kill(graph);
+
+    if ((used < 0) || ((uint64_t) used != len)) {
+        free(mem);
+        return "Image size differs from estimate";
+    }
+
+    ndl_graph *copy = ndl_graph_from_mem(len, mem);
+    if (copy == NULL) {
+        free(mem);
+        return "Failed to reload graph";
+    }
+
+    if ((ndl_test_graph_digest(copy) != digest) ||
+        (NDL_VALUE_TYPE(ndl_graph_get(copy, wide, NDL_SYM("real    "))) != EVAL_FLOAT) ||
+        (NDL_VALUE_REAL(ndl_graph_get(copy, wide, NDL_SYM("real    "))) != 0.5) ||
+        (ndl_graph_backrefs(copy, wide, wide) != 1)) {
+        ndl_graph_kill(copy);
+        free(mem);
+        return "Reloaded graph differs";
+    }
+
+    uint64_t *marks = (uint64_t *) &mem[56] + *(uint64_t *) &mem[32];
+    for (i = 0; i < *(uint64_t *) &mem[32]; i++) {
+        if ((marks[i] != 0) && (marks[i] != (uint64_t) -1)) {
+            ndl_graph_kill(copy);
+            free(mem);
+            return "Saved a collection's mark";
+        }
+    }
+
+    ndl_ref hung = ndl_graph_salloc(copy, held, NDL_SYM("hung    "));
+
+    int done;
+    while ((done = ndl_graph_clean_step(copy, 1)) == 0);
+
+    if ((done != 1) || (ndl_graph_stat(copy, hung) != 0)) {
+        ndl_graph_kill(copy);
+        free(mem);
+        return "Incremental clean of a reloaded graph freed a reachable node";
+    }
+
+    ndl_graph_kill(copy);
+
+    /* Byte swap the header's numbers and every column word but the types'. */
+    uint64_t nodes = *(uint64_t *) &mem[32], pairs = *(uint64_t *) &mem[40];
+    uint64_t first = 7 + 4 * nodes + 2 * pairs, last = first + (pairs + 7) / 8;
+
+    uint32_t *half = (uint32_t *) &mem[8];
+    half[0] = ENDIAN_SWAP_32(half[0]);
+    half[1] = ENDIAN_SWAP_32(half[1]);
+
+    uint64_t *words = (uint64_t *) mem;
+    for (i = 2; i < (uint64_t) used / 8; i++)
+        if ((i < first) || (i >= last))
+            words[i] = ENDIAN_SWAP_64(words[i]);
+
+    copy = ndl_graph_from_mem(len, mem);
+    if (copy == NULL) {
+        free(mem);
+        return "Failed to load byte swapped image";
+    }
+
+    if (ndl_test_graph_digest(copy) != digest) {
+        ndl_graph_kill(copy);
+        free(mem);
+        return "Byte swapped image differs";
+    }
+
+    ndl_graph_kill(copy);
+
+    mem[len / 2] ^= 1;
+    copy = ndl_graph_from_mem(len, mem);
+    free(mem);
+
+    if (copy != NULL) {
+        ndl_graph_kill(copy);
+        return "Loaded a damaged image";
+    }
+
+    /* Version 1: node 7, a root, with self = 7 and a backref to itself. */
+    uint8_t old[4 + 6 + 3 * 17];
+    uint64_t curr = 0;
+
+    curr = ndl_test_graph_big(old, curr, 1, 4);
+    curr = ndl_test_graph_big(old, curr, 7, 4);
+    curr = ndl_test_graph_big(old, curr, 3, 2);
+
+    uint64_t keys[3] = {NDL_SYM("self    "), NDL_SYM("\0gcsweep"),
+                        NDL_SYM("\0b\0\0\0\0b\0") | ((uint64_t) 7 << 16)};
+    uint8_t types[3] = {EVAL_REF, EVAL_INT, EVAL_INT};
+    uint64_t vals[3] = {7, (uint64_t) -1, 1};
+
+    for (i = 0; i < 3; i++) {
+        curr = ndl_test_graph_big(old, curr, keys[i], 8);
+        old[curr++] = types[i];
+        curr = ndl_test_graph_big(old, curr, vals[i], 8);
+    }
+
+    copy = ndl_graph_from_mem(curr, old);
+    if (copy == NULL)
+        return "Failed to load version 1 image";
+
+    if ((ndl_graph_stat(copy, 7) != 1) || (ndl_graph_size(copy, 7) != 1) ||
+        (NDL_VALUE_REF(ndl_graph_get(copy, 7, NDL_SYM("self    "))) != 7) ||
+        (ndl_graph_backrefs(copy, 7, 7) != 1)) {
+        ndl_graph_kill(copy);
+        return "Version 1 image loaded wrong";
+    }
+
+    ndl_graph_kill(copy);
+
+    return NULL;
+}
+
+/* Mapped graphs read nodes in place, fault them into the pool as they're
+ * changed, and end up where a loaded graph with the same changes does.
+ */
+char *ndl_test_graph_mmap(void) {
+
+    ndl_graph *graph = ndl_graph_init();
+    if (graph == NULL)
+        return "Failed to allocate graph";
+
+    ndl_ref a = ndl_graph_alloc(graph);
+    ndl_ref b = ndl_graph_salloc(graph, a, NDL_SYM("next    "));
+    ndl_ref c = ndl_graph_alloc(graph);
+
+    ndl_graph_set(graph, a, NDL_SYM("val     "), NDL_VALUE(EVAL_INT, num=5));
+    ndl_graph_set(graph, b, NDL_SYM("back    "), NDL_VALUE(EVAL_REF, ref=a));
+
+    uint64_t i;
+    for (i = 0; i < 12; i++)
+        ndl_graph_set(graph, c, (ndl_sym) i + 1, NDL_VALUE(EVAL_INT, num=(ndl_int) i));
+
+    ndl_ref u = ndl_graph_salloc(graph, a, NDL_SYM("u       "));
+    ndl_ref d = ndl_graph_salloc(graph, u, NDL_SYM("d       "));
+    ndl_ref e = ndl_graph_alloc(graph);
+    ndl_ref w = ndl_graph_salloc(graph, e, NDL_SYM("w       "));
+    ndl_ref v = ndl_graph_salloc(graph, e, NDL_SYM("v       "));
+
+    /* Leave marks from past collections on the saved nodes. */
+    for (i = 0; i < 3; i++)
+        ndl_graph_clean_step(graph, 0);
+
+    uint64_t len = ndl_graph_mem_est(graph);
+    uint8_t *mem = malloc(len);
+    int64_t used = (mem != NULL)? ndl_graph_to_mem(graph, len, mem) : -1;
+    ndl_graph_kill(graph);
+
+    char path[] = "/tmp/ndl_test_XXXXXX";
+    int fd = (used > 0)? mkstemp(path) : -1;
+    int wrote = (fd >= 0) && (write(fd, mem, (size_t) used) == used);
+    if (fd >= 0)
+        close(fd);
+
+    if (!wrote) {
+        if (fd >= 0)
+            unlink(path);
+        free(mem);
+        return "Failed to write image";
+    }
+
+    ndl_graph *mapped = ndl_graph_open_mmap(path);
+    unlink(path);
+
+    ndl_graph *loaded = ndl_graph_from_mem((uint64_t) used, mem);
+    free(mem);
+
+    if ((mapped == NULL) || (loaded == NULL)) {
+        if (mapped != NULL)
+            ndl_graph_kill(mapped);
+        if (loaded != NULL)
+            ndl_graph_kill(loaded);
+        return "Failed to open image";
+    }
+
+    ndl_node_pool *pool = (ndl_node_pool *) mapped->pool;
+
+    if ((NDL_VALUE_NUM(ndl_graph_get(mapped, a, NDL_SYM("val     "))) != 5) ||
+        (NDL_VALUE_REF(ndl_graph_get(mapped, b, NDL_SYM("back    "))) != a) ||
+        (ndl_graph_size(mapped, c) != 12) || (ndl_graph_index(mapped, c, 3) != 4) ||
+        (ndl_graph_index(mapped, c, 12) != NDL_NULL_SYM) ||
+        (ndl_graph_stat(mapped, a) != 1) || (ndl_graph_stat(mapped, b) != 0) ||
+        (ndl_graph_stat(mapped, v + 1) != -1) || (ndl_node_pool_size(pool) != 0)) {
+        ndl_graph_kill(mapped);
+        ndl_graph_kill(loaded);
+        return "Mapped reads differ, or touched the pool";
+    }
+
+    /* New nodes stay clear of the image; references fault in their targets. */
+    ndl_graph *graphs[2] = {mapped, loaded};
+    ndl_ref made[2];
+    for (i = 0; i < 2; i++) {
+        made[i] = ndl_graph_alloc(graphs[i]);
+        ndl_graph_set(graphs[i], made[i], NDL_SYM("ref     "), NDL_VALUE(EVAL_REF, ref=b));
+    }
+
+    if ((made[0] <= v) || (made[0] != made[1]) || (ndl_node_pool_size(pool) != 2) ||
+        (ndl_graph_backrefs(mapped, b, made[0]) != 1) || (ndl_graph_backrefs(mapped, b, a) != 1)) {
+        ndl_graph_kill(mapped);
+        ndl_graph_kill(loaded);
+        return "Mapped node faulted in wrong";
+    }
+
+    /* Replacing a reference faults in the node it came from. */
+    for (i = 0; i < 2; i++)
+        ndl_graph_set(graphs[i], a, NDL_SYM("next    "), NDL_VALUE(EVAL_INT, num=0));
+
+    if ((ndl_node_pool_size(pool) != 3) || (ndl_graph_backrefs(mapped, b, a) != 0) ||
+        (NDL_VALUE_NUM(ndl_graph_get(mapped, a, NDL_SYM("val     "))) != 5)) {
+        ndl_graph_kill(mapped);
+        ndl_graph_kill(loaded);
+        return "Changed mapped node lost its pairs or backrefs";
+    }
+
+    /* Incremental collections leave nodes in the image be, keep what
+     * hangs off saved ones, and fault in what the freed reference.
+     */
+    ndl_ref hung[2];
+    for (i = 0; i < 2; i++) {
+        hung[i] = ndl_graph_salloc(graphs[i], b, NDL_SYM("hung    "));
+        ndl_graph_del(graphs[i], a, NDL_SYM("u       "));
+        ndl_graph_set(graphs[i], w, NDL_SYM("x       "), NDL_VALUE(EVAL_INT, num=1));
+    }
+
+    if ((ndl_graph_clean_step(mapped, 1) != 0) || (ndl_node_pool_size(pool) != 6) ||
+        (mapped->mapped == NULL)) {
+        ndl_graph_kill(mapped);
+        ndl_graph_kill(loaded);
+        return "Incremental clean faulted in the image";
+    }
+
+    /* v, reached only through the image, is faulted in mid-sweep. */
+    int done, swept = 0;
+    while ((done = ndl_graph_clean_step(mapped, 1)) == 0) {
+        if ((mapped->phase == NDL_GRAPH_SWEEP) && !swept) {
+            for (i = 0; i < 2; i++)
+                ndl_graph_set(graphs[i], v, NDL_SYM("x       "), NDL_VALUE(EVAL_INT, num=1));
+            swept = 1;
+        }
+    }
+
+    ndl_graph_clean_step(loaded, 0);
+
+    if ((done != 1) || (hung[0] != hung[1]) || (ndl_graph_stat(mapped, hung[0]) != 0) ||
+        (ndl_graph_stat(mapped, u) != -1) || (ndl_graph_backrefs(mapped, d, u) != 0) ||
+        (ndl_graph_stat(mapped, c) != 1) || (ndl_graph_stat(mapped, e) != 1) ||
+        (ndl_graph_stat(mapped, w) != 0) || (ndl_graph_stat(mapped, v) != 0) || !swept ||
+        (mapped->mapped == NULL)) {
+        ndl_graph_kill(mapped);
+        ndl_graph_kill(loaded);
+        return "Incremental clean of a mapped graph freed the wrong nodes";
+    }
+
+    /* d was faulted in mid-collection, so the next one frees it. */
+    if ((ndl_graph_clean_step(mapped, 0) != 1) || (ndl_graph_stat(mapped, d) != -1) ||
+        (ndl_graph_stat(loaded, d) != -1)) {
+        ndl_graph_kill(mapped);
+        ndl_graph_kill(loaded);
+        return "Incremental clean kept a node faulted in while freeing";
+    }
+
+    /* Collecting faults in the rest. */
+    ndl_graph_clean(mapped);
+    ndl_graph_clean(loaded);
+
+    if ((mapped->mapped != NULL) || (ndl_test_graph_digest(mapped) != ndl_test_graph_digest(loaded))) {
+        ndl_graph_kill(mapped);
+        ndl_graph_kill(loaded);
+        return "Mapped graph ended up unlike the loaded one";
+    }
+
+    ndl_graph_kill(mapped);
+    ndl_graph_kill(loaded);
+
+    if (ndl_graph_open_mmap("/nonexistent/ndl") != NULL)
+        return "Opened a missing file";
+
+    return NULL;
+}
@@ -3,6 +3,7 @@
 #include "node.h"
 
 #include <string.h>
+#include <math.h>
 
 typedef struct ndl_value_expected_s {
 
@@ -52,7 +53,11 @@ char *ndl_test_node_value_print(void) {
         "[Ref:     ABC4]",
         "[Ref:   ABCDEF]",
         "[Sym: hello   ]",
+#ifndef NDL_VALUE_COMPACT
         "[Sym: 0hello 0]",
+#else
+        "[None:        ]", /* Out of the compact sym range. */
+#endif
         "[Sym: 00000000]",
         "[Sym:         ]",
         "[Sym: next    ]",
@@ -76,7 +81,7 @@ char *ndl_test_node_value_print(void) {
     buff[15] = '\0';
 
     int i;
-    for (i = 0; values[i].type != EVAL_NONE || values[i].ref != NDL_NULL_REF; i++) {
+    for (i = 0; NDL_VALUE_TYPE(values[i]) != EVAL_NONE || NDL_VALUE_REF(values[i]) != NDL_NULL_REF; i++) {
         ndl_value_to_string(values[i], 15, buff);
         if (strcmp(expected[i], buff) != 0) {
             printf("Expected: %s.\n", expected[i]);
@@ -88,3 +93,60 @@ char *ndl_test_node_value_print(void) {
     return 0;
 }
 
+
+char *ndl_test_node_value_pack(void) {
+
+    ndl_int nums[] = {0, 1, -1, 27, -10000000009, ((ndl_int) 1 << 47) - 1, -((ndl_int) 1 << 47)};
+    ndl_ref refs[] = {NDL_NULL_REF, 0, 1, 0xABCDEF, ((ndl_ref) 1 << 40) + 5};
+    ndl_sym syms[] = {NDL_NULL_SYM, 1, 0xFFFFFFFFFFFF, NDL_SYM("hello   "), NDL_SYM("    last"),
+                      NDL_SYM("a1_Z9 Qz_"), NDL_SYM("Loop    "), NDL_SYM("        ")};
+    ndl_float reals[] = {0.0, -0.0, 1.5, -1000.03, 1e300, -1e-310, INFINITY, -INFINITY};
+
+    uint64_t i;
+    for (i = 0; i < sizeof(nums) / sizeof(nums[0]); i++) {
+        ndl_value value = NDL_VALUE(EVAL_INT, num=nums[i]);
+        if ((NDL_VALUE_TYPE(value) != EVAL_INT) || (NDL_VALUE_NUM(value) != nums[i]) ||
+            (NDL_VALUE_WORD(value) != (uint64_t) nums[i]))
+            return "Int didn't round trip";
+    }
+
+    for (i = 0; i < sizeof(refs) / sizeof(refs[0]); i++) {
+        ndl_value value = NDL_VALUE(EVAL_REF, ref=refs[i]);
+        if ((NDL_VALUE_TYPE(value) != EVAL_REF) || (NDL_VALUE_REF(value) != refs[i]))
+            return "Ref didn't round trip";
+    }
+
+    for (i = 0; i < sizeof(syms) / sizeof(syms[0]); i++) {
+        ndl_value value = NDL_VALUE(EVAL_SYM, sym=syms[i]);
+        if ((NDL_VALUE_TYPE(value) != EVAL_SYM) || (NDL_VALUE_SYM(value) != syms[i]) ||
+            (NDL_VALUE_WORD(value) != syms[i]))
+            return "Sym didn't round trip";
+    }
+
+    for (i = 0; i < sizeof(reals) / sizeof(reals[0]); i++) {
+        ndl_value value = NDL_VALUE(EVAL_FLOAT, real=reals[i]);
+        ndl_float real = NDL_VALUE_REAL(value);
+        if ((NDL_VALUE_TYPE(value) != EVAL_FLOAT) || (memcmp(&real, &reals[i], sizeof(real)) != 0))
+            return "Float didn't round trip";
+    }
+
+    /* Every NaN, including negative ones, stays a float. */
+    ndl_value nan = NDL_VALUE(EVAL_FLOAT, real=-NAN);
+    if ((NDL_VALUE_TYPE(nan) != EVAL_FLOAT) || !isnan(NDL_VALUE_REAL(nan)))
+        return "NaN didn't stay a float";
+
+    ndl_value none = NDL_VALUE(EVAL_NONE, ref=NDL_NULL_REF);
+    if (NDL_VALUE_TYPE(none) != EVAL_NONE)
+        return "None changed type";
+
+#ifdef NDL_VALUE_COMPACT
+    if (sizeof(ndl_value) != 8)
+        return "Compact value isn't 8 bytes";
+
+    ndl_value dotted = NDL_VALUE(EVAL_SYM, sym=NDL_SYM("a1~?{ `|"));
+    if (NDL_VALUE_TYPE(dotted) != EVAL_NONE)
+        return "Out of range sym didn't become EVAL_NONE";
+#endif
+
+    return NULL;
+}
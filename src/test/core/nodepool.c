@@ -1 +1,684 @@
 #include "test.h"
+
+#include "nodepool.h"
+
+char *ndl_test_nodepool_inline(void) {
+
+    ndl_node_pool *pool = ndl_node_pool_init();
+    if (pool == NULL)
+        return "Failed to allocate pool";
+
+    ndl_ref node = ndl_node_pool_alloc(pool);
+    if (node == NDL_NULL_REF) {
+        ndl_node_pool_kill(pool);
+        return "Failed to allocate node";
+    }
+
+    /* Grow past the inline limit, checking every key as it goes. */
+    int64_t i, j;
+    for (i = 0; i < 3 * NDL_NODE_POOL_INLINE; i++) {
+
+        if (ndl_node_pool_put(pool, node, (ndl_sym) i + 1, NDL_VALUE(EVAL_INT, num=i)) != 0) {
+            ndl_node_pool_kill(pool);
+            return "Failed to put key";
+        }
+
+        for (j = 0; j <= i; j++) {
+            ndl_value val = ndl_node_pool_get(pool, node, (ndl_sym) j + 1);
+            if (NDL_VALUE_TYPE(val) != EVAL_INT || NDL_VALUE_NUM(val) != j) {
+                ndl_node_pool_print(pool);
+                ndl_node_pool_kill(pool);
+                return "Got wrong value for key";
+            }
+        }
+
+        if (NDL_VALUE_TYPE(ndl_node_pool_get(pool, node, (ndl_sym) i + 2)) != EVAL_NONE) {
+            ndl_node_pool_kill(pool);
+            return "Got value for missing key";
+        }
+    }
+
+    /* A second, small node: deletion keeps the rest in order. */
+    ndl_ref small = ndl_node_pool_alloc(pool);
+    for (i = 0; i < NDL_NODE_POOL_INLINE; i++)
+        ndl_node_pool_put(pool, small, (ndl_sym) i + 1, NDL_VALUE(EVAL_INT, num=i));
+
+    if ((ndl_node_pool_del(pool, small, 3) != 0) || (ndl_node_pool_del(pool, small, 3) == 0)) {
+        ndl_node_pool_kill(pool);
+        return "Failed to delete key exactly once";
+    }
+
+    ndl_sym last = 0;
+    uint64_t count = 0;
+    void *curr = ndl_node_pool_node_pairs_head(pool, small);
+    while (curr != NULL) {
+
+        ndl_sym key = ndl_node_pool_node_pairs_key(pool, small, curr);
+        ndl_value val = ndl_node_pool_node_pairs_val(pool, small, curr);
+        if ((key <= last) || (key == 3) || (NDL_VALUE_NUM(val) != (int64_t) key - 1)) {
+            ndl_node_pool_kill(pool);
+            return "Iterated wrong pairs after delete";
+        }
+
+        last = key;
+        count++;
+        curr = ndl_node_pool_node_pairs_next(pool, small, curr);
+    }
+
+    if ((count != NDL_NODE_POOL_INLINE - 1) ||
+        (ndl_node_pool_node_size(pool, small) != count) ||
+        (ndl_node_pool_node_size(pool, node) != 3 * NDL_NODE_POOL_INLINE)) {
+        ndl_node_pool_kill(pool);
+        return "Wrong node sizes";
+    }
+
+    /* swap() and take() hand back what they replace, inline and promoted. */
+    ndl_ref nodes[2] = {small, node};
+    for (i = 0; i < 2; i++) {
+
+        ndl_value val = NDL_VALUE(EVAL_INT, num=-1);
+        ndl_value fresh = NDL_VALUE(EVAL_INT, num=-2);
+        ndl_value taken = NDL_VALUE(EVAL_NONE, ref=NDL_NULL_REF);
+
+        if ((ndl_node_pool_swap(pool, nodes[i], 1, &val) != 0) || (NDL_VALUE_NUM(val) != 0) ||
+            (NDL_VALUE_NUM(ndl_node_pool_get(pool, nodes[i], 1)) != -1) ||
+            (ndl_node_pool_swap(pool, nodes[i], 1000, &fresh) != 0) || (NDL_VALUE_TYPE(fresh) != EVAL_NONE) ||
+            (ndl_node_pool_take(pool, nodes[i], 1000, &taken) != 0) || (NDL_VALUE_NUM(taken) != -2) ||
+            (ndl_node_pool_take(pool, nodes[i], 1000, &taken) == 0)) {
+            ndl_node_pool_kill(pool);
+            return "Swap or take returned the wrong old value";
+        }
+    }
+
+    if (!ndl_node_pool_has(pool, small) || ndl_node_pool_has(pool, small + 1) ||
+        ndl_node_pool_has(pool, NDL_NULL_REF) || ndl_node_pool_has(pool, 1 << 20)) {
+        ndl_node_pool_kill(pool);
+        return "Has got node existence wrong";
+    }
+
+    ndl_node_pool_kill(pool);
+
+    return NULL;
+}
+
+char *ndl_test_nodepool_directory(void) {
+
+    ndl_node_pool *pool = ndl_node_pool_init();
+    if (pool == NULL)
+        return "Failed to allocate pool";
+
+    /* Fill three pages' worth, then free every other node. */
+    int64_t count = 3 * NDL_NODE_POOL_PAGE_SIZE;
+    int64_t i;
+    for (i = 1; i <= count; i++) {
+        if (ndl_node_pool_alloc(pool) != i) {
+            ndl_node_pool_kill(pool);
+            return "Sequential allocation skipped an id";
+        }
+    }
+
+    for (i = 1; i <= count; i += 2)
+        ndl_node_pool_free(pool, i);
+
+    if (ndl_node_pool_size(pool) != (uint64_t) count / 2) {
+        ndl_node_pool_kill(pool);
+        return "Wrong size after freeing";
+    }
+
+    /* Freed ids come back before new ones. */
+    for (i = 0; i < count / 2; i++) {
+        ndl_ref node = ndl_node_pool_alloc(pool);
+        if ((node > count) || ((node & 1) == 0)) {
+            ndl_node_pool_kill(pool);
+            return "Didn't reuse a freed id";
+        }
+    }
+
+    if (ndl_node_pool_alloc(pool) != count + 1) {
+        ndl_node_pool_kill(pool);
+        return "Didn't resume from the counter";
+    }
+
+    /* Empty a page entirely, then claim one of its ids directly. */
+    for (i = 0; i < NDL_NODE_POOL_PAGE_SIZE; i++)
+        ndl_node_pool_free(pool, NDL_NODE_POOL_PAGE_SIZE + i);
+
+    if (ndl_node_pool_alloc_pref(pool, NDL_NODE_POOL_PAGE_SIZE + 5) != NDL_NODE_POOL_PAGE_SIZE + 5) {
+        ndl_node_pool_kill(pool);
+        return "Failed to allocate preferred id in released page";
+    }
+
+    if (ndl_node_pool_alloc_pref(pool, NDL_NODE_POOL_PAGE_SIZE + 5) != NDL_NULL_REF) {
+        ndl_node_pool_kill(pool);
+        return "Allocated a taken id";
+    }
+
+    if (ndl_node_pool_alloc_pref(pool, 1000000) != 1000000 ||
+        ndl_node_pool_put(pool, 1000000, 1, NDL_VALUE(EVAL_INT, num=5)) != 0 ||
+        NDL_VALUE_NUM(ndl_node_pool_get(pool, 1000000, 1)) != 5) {
+        ndl_node_pool_kill(pool);
+        return "Failed to use a sparse preferred id";
+    }
+
+    uint64_t seen = 0;
+    ndl_ref last = 0;
+    void *curr = ndl_node_pool_head(pool);
+    while (curr != NULL) {
+        ndl_ref node = ndl_node_pool_node(pool, curr);
+        if (node <= last) {
+            ndl_node_pool_kill(pool);
+            return "Iterated nodes out of order";
+        }
+        last = node;
+        seen++;
+        curr = ndl_node_pool_next(pool, curr);
+    }
+
+    if (seen != ndl_node_pool_size(pool)) {
+        ndl_node_pool_kill(pool);
+        return "Iterated wrong number of nodes";
+    }
+
+    ndl_node_pool_kill(pool);
+
+    return NULL;
+}
+
+char *ndl_test_nodepool_ids(void) {
+
+    ndl_node_pool *pool = ndl_node_pool_init();
+    if (pool == NULL)
+        return "Failed to allocate pool";
+
+    /* A loaded graph: a dense block of preferred ids. */
+    int64_t count = 10 * NDL_NODE_POOL_PAGE_SIZE;
+    int64_t i;
+    for (i = 1; i <= count; i++) {
+        if (ndl_node_pool_alloc_pref(pool, i) != i) {
+            ndl_node_pool_kill(pool);
+            return "Failed to allocate preferred id";
+        }
+    }
+
+    if (ndl_node_pool_alloc(pool) != count + 1) {
+        ndl_node_pool_kill(pool);
+        return "Didn't allocate past a dense block";
+    }
+
+    /* A GC: scattered frees. The lowest holes fill first. */
+    ndl_node_pool_free(pool, 700);
+    ndl_node_pool_free(pool, 3);
+    ndl_node_pool_free(pool, 2000);
+
+    ndl_ref a = ndl_node_pool_alloc(pool);
+    ndl_ref b = ndl_node_pool_alloc(pool);
+    ndl_ref c = ndl_node_pool_alloc(pool);
+    ndl_ref d = ndl_node_pool_alloc(pool);
+    if ((a != 3) || (b != 700) || (c != 2000) || (d != count + 2)) {
+        ndl_node_pool_kill(pool);
+        return "Didn't allocate lowest free ids first";
+    }
+
+    /* Counter sets a floor for new ids. */
+    ndl_node_pool_free(pool, 5);
+    ndl_node_pool_set_counter(pool, 100 * NDL_NODE_POOL_PAGE_SIZE + 1);
+    if ((ndl_node_pool_get_counter(pool) != 100 * NDL_NODE_POOL_PAGE_SIZE + 1) ||
+        (ndl_node_pool_alloc(pool) != 100 * NDL_NODE_POOL_PAGE_SIZE + 1)) {
+        ndl_node_pool_kill(pool);
+        return "Didn't respect the counter";
+    }
+
+    ndl_node_pool_set_counter(pool, 1);
+    if (ndl_node_pool_alloc(pool) != 5) {
+        ndl_node_pool_kill(pool);
+        return "Didn't return to low ids after lowering the counter";
+    }
+
+    ndl_node_pool_kill(pool);
+
+    return NULL;
+}
+
+char *ndl_test_nodepool_order(void) {
+
+    ndl_node_pool *pool = ndl_node_pool_init();
+    if (pool == NULL)
+        return "Failed to allocate pool";
+
+    ndl_ref node = ndl_node_pool_alloc(pool);
+    if (node == NDL_NULL_REF) {
+        ndl_node_pool_kill(pool);
+        return "Failed to allocate node";
+    }
+
+    /* Grow well past promotion, across several table resizes. */
+    uint64_t count = 1000;
+    uint64_t i;
+    for (i = 0; i < count; i++) {
+        if (ndl_node_pool_put(pool, node, (ndl_sym) (i + 1), NDL_VALUE(EVAL_INT, num=(ndl_int) i)) != 0) {
+            ndl_node_pool_kill(pool);
+            return "Failed to put key";
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        if (ndl_node_pool_node_index(pool, node, i) != (ndl_sym) (i + 1)) {
+            ndl_node_pool_kill(pool);
+            return "Index out of insertion order";
+        }
+    }
+
+    if (ndl_node_pool_node_index(pool, node, count) != NDL_NULL_SYM) {
+        ndl_node_pool_kill(pool);
+        return "Index past the end gave a key";
+    }
+
+    /* Drop every third key, then append more. Order must hold. */
+    for (i = 0; i < count; i += 3) {
+        if (ndl_node_pool_del(pool, node, (ndl_sym) (i + 1)) != 0) {
+            ndl_node_pool_kill(pool);
+            return "Failed to delete key";
+        }
+    }
+
+    for (i = count; i < count + 10; i++)
+        ndl_node_pool_put(pool, node, (ndl_sym) (i + 1), NDL_VALUE(EVAL_INT, num=(ndl_int) i));
+
+    uint64_t size = ndl_node_pool_node_size(pool, node);
+    if (size != count - (count + 2) / 3 + 10) {
+        ndl_node_pool_kill(pool);
+        return "Wrong size after deletes";
+    }
+
+    void *curr = ndl_node_pool_node_pairs_head(pool, node);
+    for (i = 0; i < count + 10; i++) {
+
+        if ((i < count) && (i % 3 == 0))
+            continue;
+
+        ndl_sym key = ndl_node_pool_node_pairs_key(pool, node, curr);
+        ndl_value val = ndl_node_pool_node_pairs_val(pool, node, curr);
+        if ((key != (ndl_sym) (i + 1)) || (NDL_VALUE_NUM(val) != (ndl_int) i)) {
+            ndl_node_pool_kill(pool);
+            return "Iteration out of insertion order";
+        }
+
+        curr = ndl_node_pool_node_pairs_next(pool, node, curr);
+    }
+
+    if (curr != NULL) {
+        ndl_node_pool_kill(pool);
+        return "Iteration went past the last pair";
+    }
+
+    uint64_t index = 0;
+    for (i = 0; i < count + 10; i++) {
+
+        if ((i < count) && (i % 3 == 0))
+            continue;
+
+        if ((ndl_node_pool_node_index(pool, node, index++) != (ndl_sym) (i + 1)) ||
+            (NDL_VALUE_NUM(ndl_node_pool_get(pool, node, (ndl_sym) (i + 1))) != (ndl_int) i)) {
+            ndl_node_pool_kill(pool);
+            return "Index or value wrong after deletes";
+        }
+    }
+
+    ndl_node_pool_kill(pool);
+
+    return NULL;
+}
+
+char *ndl_test_nodepool_live(void) {
+
+    ndl_node_pool *pool = ndl_node_pool_init();
+    if (pool == NULL)
+        return "Failed to allocate nodepool";
+
+    /* Two pages' worth, every third node live. */
+    uint64_t i, count = 2 * NDL_NODE_POOL_PAGE_SIZE;
+    for (i = 0; i < count; i++) {
+        if (ndl_node_pool_alloc(pool) == NDL_NULL_REF) {
+            ndl_node_pool_kill(pool);
+            return "Failed to allocate nodes";
+        }
+    }
+
+    ndl_node_pool_live_reset(pool);
+
+    for (i = 1; i <= count; i += 3) {
+        if (ndl_node_pool_live_set(pool, (ndl_ref) i) || !ndl_node_pool_live_set(pool, (ndl_ref) i)) {
+            ndl_node_pool_kill(pool);
+            return "live_set() returned the wrong old bit";
+        }
+    }
+
+    /* Nodes allocated mid-sweep, even past it, aren't swept. */
+    ndl_ref late = ndl_node_pool_alloc(pool);
+    ndl_ref far = ndl_node_pool_alloc_pref(pool, (ndl_ref) (8 * NDL_NODE_POOL_PAGE_SIZE + 3));
+    if ((late == NDL_NULL_REF) || (far == NDL_NULL_REF) ||
+        !ndl_node_pool_live(pool, late) || !ndl_node_pool_live(pool, far)) {
+        ndl_node_pool_kill(pool);
+        return "Nodes allocated mid-sweep weren't live";
+    }
+
+    /* The dead come back in order; freeing them doesn't upset the sweep. */
+    ndl_ref prev = 0, node;
+    uint64_t dead = 0;
+    while ((node = ndl_node_pool_sweep_next(pool)) != NDL_NULL_REF) {
+
+        if ((node <= prev) || ((node - 1) % 3 == 0) || (node > (ndl_ref) count)) {
+            ndl_node_pool_kill(pool);
+            return "Swept a live node, or out of order";
+        }
+
+        ndl_node_pool_free(pool, node);
+        prev = node;
+        dead++;
+    }
+
+    if ((dead != count - (count + 2) / 3) || ndl_node_pool_sweeping(pool) ||
+        (ndl_node_pool_size(pool) != count + 2 - dead)) {
+        ndl_node_pool_kill(pool);
+        return "Sweep missed dead nodes";
+    }
+
+    ndl_node_pool_kill(pool);
+
+    return NULL;
+}
+
+char *ndl_test_nodepool_snapshot(void) {
+
+    ndl_node_pool *pool = ndl_node_pool_init();
+    if (pool == NULL)
+        return "Failed to allocate nodepool";
+
+    /* Three pages, each node holding its id. Node 5 is promoted with a
+     * hole, and 6 has backrefs.
+     */
+    uint64_t i, count = 3 * NDL_NODE_POOL_PAGE_SIZE;
+    for (i = 0; i < count; i++) {
+        ndl_ref node = ndl_node_pool_alloc(pool);
+        if ((node == NDL_NULL_REF) ||
+            ndl_node_pool_put(pool, node, 1, NDL_VALUE(EVAL_INT, num=node))) {
+            ndl_node_pool_kill(pool);
+            return "Failed to allocate nodes";
+        }
+    }
+
+    for (i = 2; i < 2 * NDL_NODE_POOL_INLINE; i++)
+        ndl_node_pool_put(pool, 5, (ndl_sym) i, NDL_VALUE(EVAL_INT, num=(int64_t) i));
+    ndl_node_pool_del(pool, 5, 2);
+
+    ndl_backrefs_add(&ndl_node_pool_node_header(pool, 6)->backrefs, ndl_node_pool_arena(pool), 7);
+
+    void *region = malloc(2 * ndl_node_pool_msize());
+    ndl_node_pool *snap = ndl_node_pool_snapshot(region, pool);
+    if ((snap == NULL) || !ndl_node_pool_readonly(snap) || ndl_node_pool_readonly(pool) ||
+        (snap->dir != pool->dir) || (ndl_node_pool_size(snap) != count)) {
+        ndl_node_pool_kill(pool);
+        return "Snapshot didn't share the directory";
+    }
+
+    /* Writes to page 0 copy it, and the directory, and nothing else. */
+    ndl_node_pool_put(pool, 1, 1, NDL_VALUE(EVAL_INT, num=-1));
+    ndl_node_pool_del(pool, 5, 3);
+    ndl_backrefs_add(&ndl_node_pool_node_header(pool, 6)->backrefs, ndl_node_pool_arena(pool), 8);
+    ndl_node_pool_free(pool, 4);
+
+    if ((snap->dir == pool->dir) || (snap->dir->pages[0] == pool->dir->pages[0]) ||
+        (snap->dir->pages[1] != pool->dir->pages[1])) {
+        ndl_node_pool_mkill(snap);
+        ndl_node_pool_kill(pool);
+        return "Writes copied the wrong pages";
+    }
+
+    if ((NDL_VALUE_NUM(ndl_node_pool_get(pool, 1, 1)) != -1) || (NDL_VALUE_NUM(ndl_node_pool_get(snap, 1, 1)) != 1) ||
+        (NDL_VALUE_NUM(ndl_node_pool_get(snap, 5, 3)) != 3) || (NDL_VALUE_TYPE(ndl_node_pool_get(pool, 5, 3)) != EVAL_NONE) ||
+        (ndl_node_pool_node_size(snap, 5) != 2 * NDL_NODE_POOL_INLINE - 2) ||
+        (ndl_node_pool_node_index(snap, 5, 1) != 3) || (ndl_node_pool_node_index(pool, 5, 1) != 4) ||
+        (NDL_VALUE_NUM(ndl_node_pool_get(snap, 4, 1)) != 4) || (NDL_VALUE_TYPE(ndl_node_pool_get(pool, 4, 1)) != EVAL_NONE) ||
+        (ndl_backrefs_size(&ndl_node_pool_node_peek(snap, 6)->backrefs) != 1) ||
+        (ndl_backrefs_size(&ndl_node_pool_node_peek(pool, 6)->backrefs) != 2)) {
+        ndl_node_pool_mkill(snap);
+        ndl_node_pool_kill(pool);
+        return "Snapshot saw writes made after it";
+    }
+
+    /* Snapshots can't be written, and keep their pages past the pool. */
+    ndl_node_pool *again = ndl_node_pool_snapshot((uint8_t *) region + ndl_node_pool_msize(), pool);
+    ndl_node_pool_free(pool, 2 * NDL_NODE_POOL_PAGE_SIZE);
+    ndl_node_pool_kill(pool);
+
+    if ((ndl_node_pool_alloc(snap) != NDL_NULL_REF) || (ndl_node_pool_free(snap, 1) == 0) ||
+        (ndl_node_pool_put(snap, 1, 1, NDL_VALUE(EVAL_INT, num=0)) == 0) ||
+        (ndl_node_pool_node_header(snap, 1) != NULL) ||
+        (NDL_VALUE_NUM(ndl_node_pool_get(again, 2 * NDL_NODE_POOL_PAGE_SIZE, 1)) != 2 * NDL_NODE_POOL_PAGE_SIZE) ||
+        (NDL_VALUE_NUM(ndl_node_pool_get(again, 1, 1)) != -1) || (ndl_node_pool_size(again) != count - 1)) {
+        ndl_node_pool_mkill(snap);
+        ndl_node_pool_mkill(again);
+        free(region);
+        return "Snapshot was written, or lost its nodes";
+    }
+
+    ndl_node_pool_mkill(snap);
+    ndl_node_pool_mkill(again);
+    free(region);
+
+    return NULL;
+}
+
+char *ndl_test_nodepool_shapes(void) {
+
+    ndl_node_pool *pool = ndl_node_pool_init();
+    if (pool == NULL)
+        return "Failed to allocate pool";
+
+    ndl_sym keys[] = {NDL_SYM("opcode  "), NDL_SYM("syma    "), NDL_SYM("symb    "),
+                      NDL_SYM("symc    "), NDL_SYM("next    ")};
+    uint64_t count = sizeof(keys) / sizeof(keys[0]);
+
+    /* Nodes with the same keys share their shapes. */
+    ndl_ref nodes[64];
+    uint64_t i, j;
+    for (i = 0; i < 64; i++) {
+        nodes[i] = ndl_node_pool_alloc(pool);
+        for (j = 0; j < count; j++)
+            ndl_node_pool_put(pool, nodes[i], keys[j], NDL_VALUE(EVAL_INT, num=(ndl_int) (i * count + j)));
+    }
+
+    if (ndl_node_pool_shape_count(pool) != count) {
+        ndl_node_pool_kill(pool);
+        return "Nodes with the same keys didn't share shapes";
+    }
+
+    /* Deleting keeps order and the other values, through a new shape. */
+    ndl_value taken;
+    if ((ndl_node_pool_take(pool, nodes[1], keys[1], &taken) != 0) ||
+        (NDL_VALUE_NUM(taken) != (ndl_int) count + 1) ||
+        (ndl_node_pool_node_size(pool, nodes[1]) != count - 1) ||
+        (ndl_node_pool_node_index(pool, nodes[1], 1) != keys[2]) ||
+        (NDL_VALUE_NUM(ndl_node_pool_get(pool, nodes[1], keys[4])) != (ndl_int) count + 4) ||
+        (NDL_VALUE_TYPE(ndl_node_pool_get(pool, nodes[1], keys[1])) != EVAL_NONE) ||
+        (ndl_node_pool_node_index(pool, nodes[2], 1) != keys[1])) {
+        ndl_node_pool_kill(pool);
+        return "Deleting a key lost the node's other pairs";
+    }
+
+    /* The same deletion elsewhere reuses those shapes. */
+    uint64_t shapes = ndl_node_pool_shape_count(pool);
+    ndl_node_pool_del(pool, nodes[2], keys[1]);
+    if (ndl_node_pool_shape_count(pool) != shapes) {
+        ndl_node_pool_kill(pool);
+        return "Deleting the same key made new shapes";
+    }
+
+    /* A snapshot keeps its shapes past writes and the pool. */
+    ndl_node_pool *snap = ndl_node_pool_snapshot(malloc(ndl_node_pool_msize()), pool);
+    if (snap == NULL) {
+        ndl_node_pool_kill(pool);
+        return "Failed to snapshot pool";
+    }
+
+    ndl_node_pool_put(pool, nodes[0], NDL_SYM("extra   "), NDL_VALUE(EVAL_INT, num=-1));
+    ndl_node_pool_del(pool, nodes[0], keys[0]);
+    ndl_node_pool_kill(pool);
+
+    if ((ndl_node_pool_node_size(snap, nodes[0]) != count) ||
+        (ndl_node_pool_node_index(snap, nodes[0], 0) != keys[0]) ||
+        (NDL_VALUE_NUM(ndl_node_pool_get(snap, nodes[0], keys[4])) != 4) ||
+        (NDL_VALUE_TYPE(ndl_node_pool_get(snap, nodes[0], NDL_SYM("extra   "))) != EVAL_NONE)) {
+        ndl_node_pool_mkill(snap);
+        free(snap);
+        return "Snapshot saw its pool's shapes change";
+    }
+
+    ndl_node_pool_mkill(snap);
+    free(snap);
+
+    /* Past the limit, nodes needing new shapes get private ones, and still work. */
+    pool = ndl_node_pool_init();
+    for (i = 0; i <= NDL_NODE_POOL_SHAPES_MAX; i++)
+        ndl_node_pool_put(pool, ndl_node_pool_alloc(pool), (ndl_sym) i + 1, NDL_VALUE(EVAL_INT, num=(ndl_int) i));
+
+    ndl_ref last = ndl_node_pool_alloc(pool);
+    ndl_node_pool_put(pool, last, 1, NDL_VALUE(EVAL_INT, num=1));
+    ndl_node_pool_put(pool, last, 0, NDL_VALUE(EVAL_INT, num=0));
+    ndl_node_pool_put(pool, last, 2, NDL_VALUE(EVAL_INT, num=2));
+
+    if ((ndl_node_pool_shape_count(pool) != NDL_NODE_POOL_SHAPES_MAX) ||
+        (NDL_VALUE_NUM(ndl_node_pool_get(pool, NDL_NODE_POOL_SHAPES_MAX + 1, NDL_NODE_POOL_SHAPES_MAX + 1)) !=
+         NDL_NODE_POOL_SHAPES_MAX) ||
+        (ndl_node_pool_node_size(pool, last) != 3) || (ndl_node_pool_node_index(pool, last, 2) != 2) ||
+        (ndl_node_pool_del(pool, last, 0) != 0) || (NDL_VALUE_NUM(ndl_node_pool_get(pool, last, 2)) != 2)) {
+        ndl_node_pool_kill(pool);
+        return "Nodes past the shape limit lost pairs";
+    }
+
+    ndl_node_pool_kill(pool);
+
+    return NULL;
+}
+
+char *ndl_test_nodepool_fill(void) {
+
+    ndl_node_pool *pool = ndl_node_pool_init();
+    if (pool == NULL)
+        return "Failed to allocate pool";
+
+    /* Small enough to stay inline, and large enough to be promoted. */
+    ndl_node_pool_pair pairs[3 * NDL_NODE_POOL_INLINE];
+    uint64_t counts[2] = {3, 3 * NDL_NODE_POOL_INLINE};
+    ndl_ref nodes[2];
+
+    uint64_t i, j;
+    for (i = 0; i < 3 * NDL_NODE_POOL_INLINE; i++) {
+        pairs[i].key = (ndl_sym) i + 1;
+        pairs[i].val = NDL_VALUE(EVAL_INT, num=(ndl_int) i);
+    }
+
+    for (i = 0; i < 2; i++) {
+
+        nodes[i] = ndl_node_pool_alloc(pool);
+        if (ndl_node_pool_fill(pool, nodes[i], counts[i], pairs) != 0) {
+            ndl_node_pool_kill(pool);
+            return "Failed to fill node";
+        }
+
+        if (ndl_node_pool_node_size(pool, nodes[i]) != counts[i]) {
+            ndl_node_pool_kill(pool);
+            return "Filled node has the wrong size";
+        }
+
+        for (j = 0; j < counts[i]; j++) {
+            if ((ndl_node_pool_node_index(pool, nodes[i], j) != pairs[j].key) ||
+                (NDL_VALUE_NUM(ndl_node_pool_get(pool, nodes[i], pairs[j].key)) != (ndl_int) j)) {
+                ndl_node_pool_kill(pool);
+                return "Filled node lost a pair";
+            }
+        }
+    }
+
+    if (ndl_node_pool_pair_count(pool) != counts[0] + counts[1]) {
+        ndl_node_pool_kill(pool);
+        return "Pair count doesn't match fill()s";
+    }
+
+    /* Nonempty nodes and repeated keys are refused. */
+    ndl_ref dup = ndl_node_pool_alloc(pool);
+    pairs[2].key = pairs[0].key;
+    if ((ndl_node_pool_fill(pool, nodes[0], 1, pairs) == 0) ||
+        (ndl_node_pool_fill(pool, dup, 3, pairs) == 0) ||
+        (ndl_node_pool_node_size(pool, dup) != 0)) {
+        ndl_node_pool_kill(pool);
+        return "Filled a nonempty node, or repeated a key";
+    }
+
+    /* The count follows puts, deletes and frees. */
+    ndl_node_pool_put(pool, dup, 1, NDL_VALUE(EVAL_INT, num=1));
+    ndl_node_pool_del(pool, nodes[0], pairs[0].key);
+    ndl_node_pool_free(pool, nodes[1]);
+
+    if (ndl_node_pool_pair_count(pool) != counts[0]) {
+        ndl_node_pool_kill(pool);
+        return "Pair count drifted";
+    }
+
+    ndl_node_pool_kill(pool);
+
+    return NULL;
+}
+
+char *ndl_test_nodepool_arena(void) {
+
+    ndl_node_pool *pool = ndl_node_pool_init();
+    if (pool == NULL)
+        return "Failed to allocate nodepool";
+
+    /* Node 1 is promoted, and 2 is a hub, with a hashed backref set. */
+    ndl_ref node = ndl_node_pool_alloc(pool);
+    ndl_ref hub = ndl_node_pool_alloc(pool);
+
+    uint64_t i;
+    for (i = 0; i < 4 * NDL_NODE_POOL_INLINE; i++)
+        ndl_node_pool_put(pool, node, (ndl_sym) i + 1, NDL_VALUE(EVAL_INT, num=(int64_t) i));
+    for (i = 0; i < 2 * NDL_BACKREFS_LIST_MAX; i++)
+        ndl_backrefs_add(&ndl_node_pool_node_header(pool, hub)->backrefs, ndl_node_pool_arena(pool), (ndl_ref) i + 10);
+
+    ndl_arena *arena = ndl_node_pool_arena(pool);
+    ndl_node_pool_entry *entry = &pool->dir->pages[0]->entries[node];
+    ndl_backrefs *backrefs = &ndl_node_pool_node_peek(pool, hub)->backrefs;
+
+    if ((entry->count != NDL_NODE_POOL_PROMOTED) || (backrefs->cap != NDL_BACKREFS_HASHED)) {
+        ndl_node_pool_kill(pool);
+        return "Node wasn't promoted, or backrefs weren't hashed";
+    }
+
+    if ((entry->table.arena != arena) || (entry->pairs.arena != arena) || (backrefs->table->arena != arena)) {
+        ndl_node_pool_kill(pool);
+        return "Promoted storage or backref table outside the arena";
+    }
+
+    /* Copies made for snapshots stay in it. */
+    void *region = malloc(ndl_node_pool_msize());
+    ndl_node_pool *snap = ndl_node_pool_snapshot(region, pool);
+
+    ndl_node_pool_put(pool, node, 1, NDL_VALUE(EVAL_INT, num=-1));
+    entry = &pool->dir->pages[0]->entries[node];
+    backrefs = &ndl_node_pool_node_peek(pool, hub)->backrefs;
+
+    int kept = (snap != NULL) && (snap->dir->pages[0] != pool->dir->pages[0]) &&
+               (entry->table.arena == arena) && (entry->pairs.arena == arena) &&
+               (backrefs->table->arena == arena) &&
+               (NDL_VALUE_NUM(ndl_node_pool_get(snap, node, 1)) == 0);
+
+    ndl_node_pool_mkill(snap);
+    free(region);
+    ndl_node_pool_kill(pool);
+
+    if (!kept)
+        return "Snapshot copies left the arena";
+
+    return NULL;
+}
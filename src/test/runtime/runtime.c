@@ -1 +1,102 @@
 #include "test.h"
+
+#include "asm.h"
+#include "nodepool.h"
+#include "runtime.h"
+
+/* A process forks a worker whose frame nothing in the graph references,
+ * then drops it. The worker churns through garbage, so the runtime has
+ * to collect, and only its roots keep the worker's frame alive.
+ */
+char *ndl_test_runtime_gc(void) {
+
+    char *src =
+        "new child\n"
+        "save :worker, instpntr -> child\n"
+        "fork child\n"
+        "copy 0 -> child\n"
+        "exit\n"
+        "\n"
+        "worker:\n"
+        "copy 10000 -> count\n"
+        "loop:\n"
+        "new temp\n"
+        "sub count, 1 -> count\n"
+        "branch count, 0 | gt=:loop\n"
+        "exit\n";
+
+    ndl_asm_result res = ndl_asm_parse(src, NULL);
+    if (res.msg != NULL) {
+        ndl_asm_print_err(res);
+        return "Failed to assemble program";
+    }
+
+    ndl_graph *graph = res.graph;
+
+    ndl_ref local = ndl_graph_alloc(graph);
+    ndl_graph_set(graph, local, NDL_SYM("instpntr"), NDL_VALUE(EVAL_REF, ref=res.inst_head));
+
+    ndl_runtime *runtime = ndl_runtime_init(graph);
+    if (runtime == NULL) {
+        ndl_graph_kill(graph);
+        return "Failed to allocate runtime";
+    }
+
+    ndl_proc *proc = ndl_runtime_proc_init(runtime, local, NDL_TIME_ZERO);
+    if ((proc == NULL) || (ndl_proc_resume(proc) != 0)) {
+        ndl_runtime_kill(runtime);
+        ndl_graph_kill(graph);
+        return "Failed to start process";
+    }
+
+    ndl_graph_unmark(graph, local);
+
+    /* Run both by hand, collecting as the runtime would between events. */
+    uint64_t peak = 0;
+    int running = 1;
+    while (running) {
+
+        running = 0;
+
+        ndl_pid pid;
+        for (pid = 1; pid <= 2; pid++) {
+            proc = ndl_runtime_proc(runtime, pid);
+            if ((proc != NULL) && (ndl_proc_status(proc) != ESTATE_DEAD)) {
+                ndl_proc_run(proc, 64);
+                running = 1;
+            }
+        }
+
+        if (ndl_runtime_run_gc(runtime) < 0) {
+            ndl_runtime_kill(runtime);
+            ndl_graph_kill(graph);
+            return "Collection failed";
+        }
+
+        uint64_t size = ndl_node_pool_size((ndl_node_pool *) graph->pool);
+        peak = (size > peak)? size : peak;
+    }
+
+    ndl_runtime_gc_stats stats = ndl_runtime_gc_report(runtime);
+
+    ndl_proc *main = ndl_runtime_proc(runtime, 1);
+    ndl_proc *worker = ndl_runtime_proc(runtime, 2);
+
+    int exited = (main != NULL) && (worker != NULL) &&
+        (ndl_proc_cause(main) == ECAUSE_EXIT) && (ndl_proc_cause(worker) == ECAUSE_EXIT);
+
+    ndl_runtime_kill(runtime);
+    ndl_graph_kill(graph);
+
+    if (!exited)
+        return "Collected a process' frame";
+
+    if ((stats.major + stats.minor == 0) || (stats.pauses == 0) ||
+        (stats.pause_max < stats.pause_last) || (stats.pause_total < stats.pause_max))
+        return "Runtime never collected, or misreported its pauses";
+
+    if (peak > 2 * NDL_RUNTIME_GC_MIN)
+        return "Runtime let garbage pile up";
+
+    return NULL;
+}
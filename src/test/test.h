@@ -33,11 +33,18 @@ char *ndl_test_slab_it(void);
 char *ndl_test_hashtable_alloc(void);
 char *ndl_test_hashtable_minit(void);
 char *ndl_test_hashtable_it(void);
+char *ndl_test_hashtable_churn(void);
 
 char *ndl_test_rehashtable_alloc(void);
 char *ndl_test_rehashtable_minit(void);
 char *ndl_test_rehashtable_it(void);
 char *ndl_test_rehashtable_volume(void);
+char *ndl_test_rehashtable_incremental(void);
+char *ndl_test_rehashtable_latency(void);
+
+char *ndl_test_arena_alloc(void);
+char *ndl_test_arena_trim(void);
+char *ndl_test_arena_remote(void);
 
 char *ndl_test_vector_msize(void);
 char *ndl_test_vector_init(void);
@@ -54,8 +61,24 @@ char *ndl_test_heap_meta(void);
 
 /* Core */
 char *ndl_test_node_value_print(void);
+char *ndl_test_node_value_pack(void);
 
 char *ndl_test_asm_syntax(void);
+char *ndl_test_asm_symbols(void);
+
+char *ndl_test_nodepool_inline(void);
+char *ndl_test_nodepool_directory(void);
+char *ndl_test_nodepool_ids(void);
+char *ndl_test_nodepool_order(void);
+char *ndl_test_nodepool_live(void);
+char *ndl_test_nodepool_snapshot(void);
+char *ndl_test_nodepool_shapes(void);
+char *ndl_test_nodepool_fill(void);
+char *ndl_test_nodepool_arena(void);
+
+char *ndl_test_backrefs_alloc(void);
+char *ndl_test_backrefs_small(void);
+char *ndl_test_backrefs_hub(void);
 
 char *ndl_test_graph_alloc(void);
 char *ndl_test_graph_minit(void);
@@ -63,10 +86,46 @@ char *ndl_test_graph_salloc(void);
 char *ndl_test_graph_gc(void);
 char *ndl_test_graph_kv_it(void);
 char *ndl_test_graph_backref(void);
+char *ndl_test_graph_metadata(void);
+char *ndl_test_graph_deep(void);
+char *ndl_test_graph_parallel(void);
+char *ndl_test_graph_incremental(void);
+char *ndl_test_graph_minor(void);
+char *ndl_test_graph_refcount(void);
+char *ndl_test_graph_lazy(void);
+char *ndl_test_graph_roots(void);
+char *ndl_test_graph_snapshot(void);
+char *ndl_test_graph_copy(void);
+char *ndl_test_graph_batch(void);
+char *ndl_test_graph_format(void);
+char *ndl_test_graph_mmap(void);
 
 /* Runtime */
 char *ndl_test_time_conv(void);
 char *ndl_test_time_add(void);
 char *ndl_test_time_get(void);
 
+char *ndl_test_runtime_gc(void);
+
+/* Benchmarks. Registered under 'bench', not run with the 'ndl' tests. */
+char *ndl_bench_hashtable_probe_pool(void);
+char *ndl_bench_hashtable_probe_node(void);
+char *ndl_bench_hashtable_get(void);
+
+char *ndl_bench_nodepool_get(void);
+char *ndl_bench_nodepool_index(void);
+
+char *ndl_bench_graph_chain(void);
+char *ndl_bench_graph_fan(void);
+char *ndl_bench_graph_random(void);
+char *ndl_bench_graph_parallel(void);
+char *ndl_bench_graph_incremental(void);
+char *ndl_bench_graph_minor(void);
+char *ndl_bench_graph_refcount(void);
+char *ndl_bench_graph_lazy(void);
+char *ndl_bench_graph_snapshot(void);
+char *ndl_bench_graph_copy(void);
+char *ndl_bench_graph_batch(void);
+char *ndl_bench_graph_image(void);
+
 #endif /* NODEL_TEST_H */